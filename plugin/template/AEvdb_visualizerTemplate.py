@@ -187,7 +187,7 @@ class AEvdb_visualizerTemplate(pm.uitypes.AETemplate, channelController):
         menu = pm.optionMenuGrp("VDBVisualizerVolumeCacheVoxelType",
                                label="Volume Cache Precision",
                                changeCommand=change_command).menu()
-        menu.addItems(["half", "float"])
+        menu.addItems(["half", "float", "unorm16", "unorm8"])
         menu.setWidth(70)
         self.update_voxel_type_menu(param_name)
 
@@ -330,6 +330,11 @@ class AEvdb_visualizerTemplate(pm.uitypes.AETemplate, channelController):
 
         self.addSeparator()
         self.addControl("sliceCount", label="Slice Count")
+        self.addControl("sliceTextureExtents", label="Texture Extents")
+        self.addControl("sliceVectorReduction", label="Vector Reduction")
+        self.addControl("sliceRoi", label="Region of Interest")
+        self.addControl("sliceRoiMin", label="Region Min")
+        self.addControl("sliceRoiMax", label="Region Max")
         self.addControl("shadowGain", label="Shadow Gain")
         self.addControl("shadowSampleCount", label="Shadow Sample Count")
 
@@ -14,11 +14,16 @@
 #include "vdb_sliced_display.h"
 #include "vdb_maya_utils.hpp"
 #include "volume_sampling.hpp"
+#include "volume_compression.hpp"
 #include "blackbody.h"
 #include "progress_bar.h"
 
 #include <openvdb/openvdb.h>
 
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
 #include <maya/MArgDatabase.h>
 #include <maya/MArgParser.h>
 #include <maya/MBoundingBox.h>
@@ -34,10 +39,31 @@
 #include <maya/MString.h>
 #include <maya/MSyntax.h>
 
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <cassert>
+#include <ctime>
 
 
 // === Unique pointers to VP2.0 objects ========================================
@@ -95,11 +121,26 @@ struct VDBVolumeSpec {
     std::string vdb_file_name;
     std::string vdb_file_uuid;
     std::string vdb_grid_name;
+    // The texture extents in CUBE mode. In the other modes only the voxel count
+    // of texture_size is used, the actual extents depend on the grid bbox.
     openvdb::Coord texture_size;
-
-    VDBVolumeSpec() {}
-    VDBVolumeSpec(const std::string& vdb_file_name_, const std::string& vdb_file_uuid_, const std::string& vdb_grid_name_, openvdb::Coord texture_size_)
-        : vdb_file_name(vdb_file_name_), vdb_file_uuid(vdb_file_uuid_), vdb_grid_name(vdb_grid_name_), texture_size(texture_size_) {}
+    VDBTextureExtentsMode texture_extents_mode;
+    // How the values of vector grids are turned into scalars.
+    VDBVectorReduction vector_reduction;
+    // If use_roi is set, the texture only covers the part of the grid inside
+    // the world space box roi, see volume_sampling::sampleGrid.
+    bool use_roi;
+    openvdb::BBoxd roi;
+
+    VDBVolumeSpec() : texture_extents_mode(VDBTextureExtentsMode::CUBE), vector_reduction(VDBVectorReduction::LENGTH), use_roi(false) {}
+    VDBVolumeSpec(const std::string& vdb_file_name_, const std::string& vdb_file_uuid_, const std::string& vdb_grid_name_, openvdb::Coord texture_size_,
+                  VDBTextureExtentsMode texture_extents_mode_ = VDBTextureExtentsMode::CUBE,
+                  VDBVectorReduction vector_reduction_ = VDBVectorReduction::LENGTH,
+                  bool use_roi_ = false, const openvdb::BBoxd& roi_ = openvdb::BBoxd())
+        : vdb_file_name(vdb_file_name_), vdb_file_uuid(vdb_file_uuid_), vdb_grid_name(vdb_grid_name_), texture_size(texture_size_),
+          texture_extents_mode(texture_extents_mode_), vector_reduction(vector_reduction_), use_roi(use_roi_), roi(roi_) {}
+
+    const openvdb::BBoxd* getROI() const { return use_roi ? &roi : nullptr; }
 };
 
 namespace {
@@ -121,6 +162,15 @@ namespace std {
             hash_combine(res, spec.texture_size.x());
             hash_combine(res, spec.texture_size.y());
             hash_combine(res, spec.texture_size.z());
+            hash_combine(res, int(spec.texture_extents_mode));
+            hash_combine(res, int(spec.vector_reduction));
+            hash_combine(res, spec.use_roi);
+            if (spec.use_roi) {
+                for (int i = 0; i < 3; ++i) {
+                    hash_combine(res, spec.roi.min()[i]);
+                    hash_combine(res, spec.roi.max()[i]);
+                }
+            }
             return res;
         }
     };
@@ -129,7 +179,11 @@ namespace std {
     {
         return lhs.vdb_file_name == rhs.vdb_file_name &&
                lhs.vdb_grid_name == rhs.vdb_grid_name &&
-               lhs.texture_size == rhs.texture_size;
+               lhs.texture_size == rhs.texture_size &&
+               lhs.texture_extents_mode == rhs.texture_extents_mode &&
+               lhs.vector_reduction == rhs.vector_reduction &&
+               lhs.use_roi == rhs.use_roi &&
+               (!lhs.use_roi || lhs.roi == rhs.roi);
     }
 }
 
@@ -154,16 +208,180 @@ namespace {
     }
 } // unnamed namespace
 
+// === BufferPool ==========================================================
+
+// Hands out byte buffers for the data which is only needed during a call, e.g.
+// the samples of a volume while it's baked, or the voxels converted for the
+// upload, so that concurrent calls don't share them and repeated calls don't
+// reallocate them. A buffer returns to the pool when its handle is destroyed.
+// The pool keeps the smallest buffers up to MAX_POOLED_BYTES.
+class BufferPool {
+public:
+    typedef std::vector<uint8_t> Storage;
+    struct Releaser {
+        BufferPool* pool;
+        void operator()(Storage* storage) const { pool->release(storage); }
+    };
+    typedef std::unique_ptr<Storage, Releaser> Buffer;
+
+    static BufferPool& instance();
+
+    // The contents of the buffer are undefined.
+    Buffer acquire(size_t size_bytes);
+
+private:
+    std::mutex m_mutex;
+    // The pooled buffers in increasing order of capacity.
+    std::vector<std::unique_ptr<Storage>> m_storages;
+
+    void release(Storage* storage);
+
+    static const size_t MAX_POOLED_BYTES;
+};
+
+BufferPool& BufferPool::instance()
+{
+    static BufferPool buffer_pool;
+    return buffer_pool;
+}
+
+BufferPool::Buffer BufferPool::acquire(size_t size_bytes)
+{
+    std::unique_ptr<Storage> storage;
+    {
+        // Take the smallest buffer large enough, or the largest one otherwise.
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_storages.empty()) {
+            auto it = std::lower_bound(m_storages.begin(), m_storages.end(), size_bytes,
+                [](const std::unique_ptr<Storage>& storage, size_t size) { return storage->capacity() < size; });
+            if (it == m_storages.end())
+                --it;
+            storage = std::move(*it);
+            m_storages.erase(it);
+        }
+    }
+    if (!storage)
+        storage.reset(new Storage());
+    storage->resize(size_bytes);
+    return Buffer(storage.release(), Releaser{ this });
+}
+
+void BufferPool::release(Storage* storage)
+{
+    std::unique_ptr<Storage> released(storage);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto it = std::upper_bound(m_storages.begin(), m_storages.end(), released->capacity(),
+        [](size_t capacity, const std::unique_ptr<Storage>& storage) { return capacity < storage->capacity(); });
+    m_storages.insert(it, std::move(released));
+    size_t pooled_bytes = 0;
+    for (size_t i = 0; i < m_storages.size(); ++i) {
+        pooled_bytes += m_storages[i]->capacity();
+        if (pooled_bytes > MAX_POOLED_BYTES) {
+            m_storages.resize(i);
+            break;
+        }
+    }
+}
+
+// === BackgroundThread ====================================================
+
+// Runs tasks one after the other on a thread of its own, which is started with
+// the first task. Unlike tasks of a tbb::task_group, which a thread waiting
+// for its own parallel work may pick up and run within its stack, the tasks
+// never run on the thread that queues them, so they can't stall an interactive
+// bake, and they can block on locks or condition variables held lower on the
+// stack of that thread. Their parallel work runs in the implicit arena of the
+// background thread, and is never stolen by other threads either.
+class BackgroundThread {
+public:
+    BackgroundThread() : m_busy(false), m_stopping(false) {}
+    // Drops the queued tasks and waits for the running one.
+    ~BackgroundThread();
+
+    void run(std::function<void()> task);
+    // Waits until the tasks queued so far have finished. Must not be called
+    // from a task.
+    void wait();
+
+private:
+    std::mutex m_mutex;
+    // Notified when a task is queued or finishes, and when the thread stops.
+    std::condition_variable m_changed;
+    std::deque<std::function<void()>> m_tasks;
+    bool m_busy;
+    bool m_stopping;
+    std::thread m_thread;
+
+    void work();
+};
+
+BackgroundThread::~BackgroundThread()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.clear();
+        m_stopping = true;
+    }
+    m_changed.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void BackgroundThread::run(std::function<void()> task)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tasks.push_back(std::move(task));
+    if (!m_thread.joinable())
+        m_thread = std::thread([this]() { work(); });
+    m_changed.notify_all();
+}
+
+void BackgroundThread::wait()
+{
+    assert(!m_thread.joinable() || m_thread.get_id() != std::this_thread::get_id());
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this]() { return m_tasks.empty() && !m_busy; });
+}
+
+void BackgroundThread::work()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_changed.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+        if (m_stopping)
+            return;
+        auto task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        m_busy = true;
+        lock.unlock();
+        task();
+        lock.lock();
+        m_busy = false;
+        m_changed.notify_all();
+    }
+}
+
 // === VolumeTexture =======================================================
 
+struct VolumeRefinementTicket;
+
 struct VolumeTexture {
     TexturePtr texture_ptr;
     MFloatVector value_range;
     MFloatVector volume_size;
     MFloatVector volume_origin;
     openvdb::Coord extents;
-
-    VolumeTexture() : texture_ptr(nullptr) {}
+    MHWRender::MRasterFormat format;
+    // Set while the texture holds a coarse volume which is being refined in the
+    // background, see VolumeCache. refinement_index is the index of the volume
+    // among the ones baked by the refinement.
+    std::shared_ptr<VolumeRefinementTicket> refinement_ticket;
+    size_t refinement_index;
+    // The spec of the volume last requested for the texture, see
+    // VolumeCache::setDeltaRebake.
+    VDBVolumeSpec spec;
+
+    VolumeTexture() : texture_ptr(nullptr), format(MHWRender::kR32_FLOAT), refinement_index(0) {}
     VolumeTexture(const VolumeTexture&) = delete;
     VolumeTexture& operator=(const VolumeTexture&) = delete;
     VolumeTexture(VolumeTexture&&) = default;
@@ -172,9 +390,9 @@ struct VolumeTexture {
     template <typename RealType>
     void acquireBuffer(
         const openvdb::Coord& texture_extents,
-        const volume_sampling::SampleBufferHeader<RealType>& buffer_header,
+        const volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType>& buffer_header,
         const RealType* buffer_data);
-    void clear() { texture_ptr.reset(); }
+    void clear() { texture_ptr.reset(); refinement_ticket.reset(); }
     bool isValid() const { return texture_ptr.get() != nullptr; }
 
     void assign(MHWRender::MShaderInstance* shader_instance, const MString& param)
@@ -185,9 +403,7 @@ struct VolumeTexture {
 
 private:
     MHWRender::MTextureAssignment m_texture_assignment;
-    static std::vector<float> s_staging;
 };
-std::vector<float> VolumeTexture::s_staging;
 
 namespace {
 
@@ -218,12 +434,30 @@ namespace {
         return extents.x() * extents.y() * extents.z();
     }
 
+    double seconds_since(const std::chrono::steady_clock::time_point& start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Raster format of the textures created from voxels of the given type.
+    // Half voxels are converted to float before uploading.
+    template <typename RealType>
+    MHWRender::MRasterFormat getRasterFormat();
+    template <>
+    inline MHWRender::MRasterFormat getRasterFormat<float>() { return MHWRender::kR32_FLOAT; }
+    template <>
+    inline MHWRender::MRasterFormat getRasterFormat<half>() { return MHWRender::kR32_FLOAT; }
+    template <>
+    inline MHWRender::MRasterFormat getRasterFormat<uint8_t>() { return MHWRender::kR8_UNORM; }
+    template <>
+    inline MHWRender::MRasterFormat getRasterFormat<uint16_t>() { return MHWRender::kR16_UNORM; }
+
 } // unnamed namespace
 
 template <typename RealType>
 void VolumeTexture::acquireBuffer(
     const openvdb::Coord& texture_extents,
-    const volume_sampling::SampleBufferHeader<RealType>& buffer_header,
+    const volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType>& buffer_header,
     const RealType* buffer_data)
 {
     const auto renderer = MHWRender::MRenderer::theRenderer();
@@ -243,29 +477,36 @@ void VolumeTexture::acquireBuffer(
     volume_size = mayavecFromArray3(buffer_header.size);
     volume_origin = mayavecFromArray3(buffer_header.origin);
 
+    // Float and UNORM voxels are uploaded as they are; the shader maps UNORM
+    // texels back to the value range the same way as float ones.
     const void* buffer = nullptr;
-    if (std::is_same<RealType, float>::value) {
+    size_t bytes_per_voxel = sizeof(RealType);
+    BufferPool::Buffer staging;
+    if (!std::is_same<RealType, half>::value) {
         buffer = buffer_data;
     } else {
         // Convert voxels to float.
         // Note: uploading 'half' voxel data (i.e. using raster type kR16_FLOAT) is
         // SLOWER by a factor of ~2 compared to uploading floats. I have no idea why.
         // If you know the answer, please explain it to me (zoltan.gilian@gmail.com).
-        s_staging.resize(voxel_count(texture_extents));
+        const size_t num_voxels = voxel_count(texture_extents);
+        staging = BufferPool::instance().acquire(num_voxels * sizeof(float));
         typedef tbb::blocked_range<size_t> tbb_range;
         const RealType* input = reinterpret_cast<const RealType*>(buffer_data);
-        float* output = s_staging.data();
-        tbb::parallel_for(tbb_range(0, s_staging.size()),
+        float* output = reinterpret_cast<float*>(staging->data());
+        tbb::parallel_for(tbb_range(0, num_voxels),
             [input, output] (const tbb_range& range){
                 for (size_t i = range.begin(); i < range.end(); ++i)
                     output[i] = static_cast<float>(input[i]);
             });
-        buffer = s_staging.data();
+        buffer = staging->data();
+        bytes_per_voxel = sizeof(float);
     }
 
-    // If texture size didn't change, texture data can be updated in place,
+    // If texture size and format didn't change, texture data can be updated in place,
     // providing there is an actual texture owned by this instance.
-    if (extents == texture_extents && texture_ptr.get() != nullptr) {
+    const auto texture_format = getRasterFormat<RealType>();
+    if (extents == texture_extents && format == texture_format && texture_ptr.get() != nullptr) {
         texture_ptr->update(buffer, true);
         return;
     }
@@ -275,33 +516,328 @@ void VolumeTexture::acquireBuffer(
     texture_desc.fWidth = texture_extents.x();
     texture_desc.fHeight = texture_extents.y();
     texture_desc.fDepth = texture_extents.z();
-    texture_desc.fBytesPerRow = sizeof(float) * texture_desc.fWidth;
+    texture_desc.fBytesPerRow = unsigned(bytes_per_voxel) * texture_desc.fWidth;
     texture_desc.fBytesPerSlice = texture_desc.fBytesPerRow * texture_desc.fHeight;
     texture_desc.fMipmaps = 0;
     texture_desc.fArraySlices = 1;
-    texture_desc.fFormat = MHWRender::kR32_FLOAT;
+    texture_desc.fFormat = texture_format;
     texture_desc.fTextureType = MHWRender::kVolumeTexture;
     texture_desc.fEnvMapType = MHWRender::kEnvNone;
     texture_ptr.reset(texture_manager->acquireTexture("", texture_desc, buffer, true));
 
     extents = texture_extents;
+    format = texture_format;
 }
 
+// === MultiResCache ======================================================
+
+// Keeps the MultiResGrid pyramids built for MULTIRES sampling, so that baking
+// the same grid again (e.g. with another slice count, or for another node)
+// reuses the already built levels. Pyramids are keyed by the unique tag of the
+// file and the grid name. When the memory used by the pyramid trees exceeds
+// the limit, the least recently used pyramids are evicted.
+// The cache is thread-safe, since background refinements (see VolumeCache)
+// use it as well. Pyramids are built without holding the lock of the cache, so
+// that other grids can be looked up meanwhile; a call requesting a pyramid
+// which is being built waits for it instead of building it again.
+class MultiResCache {
+public:
+    typedef volume_sampling::FloatMultiResGrid FloatMultiResGrid;
+
+    MultiResCache();
+
+    // Returns the cached pyramid of the grid if it has at least num_levels levels,
+    // otherwise builds (and caches) a new one.
+    FloatMultiResGrid::ConstPtr get(const VDBVolumeSpec& spec, const openvdb::FloatGrid& grid, size_t num_levels);
+
+    void setMemoryLimitBytes(size_t mem_limit_bytes);
+    size_t getMemoryLimitBytes() const { return m_mem_limit_bytes; }
+    size_t getAllocatedBytes() const;
+    void clear();
+
+private:
+    // (file unique tag, grid name)
+    typedef std::pair<std::string, std::string> Key;
+    struct Entry {
+        Key key;
+        FloatMultiResGrid::ConstPtr multires;
+        size_t size_bytes;
+    };
+    typedef std::list<Entry> EntryList;
+
+    mutable std::mutex m_mutex;
+    // The pyramids being built, and notified when one of them is done.
+    std::set<Key> m_building_keys;
+    std::condition_variable m_build_finished;
+    size_t m_mem_limit_bytes;
+    size_t m_allocated_bytes;
+    // Entries in most recently used first order.
+    EntryList m_entries;
+    std::map<Key, EntryList::iterator> m_entry_map;
+
+    void erase(EntryList::iterator entry_it);
+    void evict(size_t mem_limit_bytes);
+
+    static const size_t DEFAULT_LIMIT_BYTES;
+};
+
+// === DiskCache ===========================================================
+
+// Keeps baked volumes on disk across sessions, so that revisiting a volume costs
+// reading it instead of baking it, see VolumeCache::getDiskCache. Every volume
+// is stored in a file of its own, named after the hash of its key; the key
+// identifies the VDB file by its unique tag and modification time, and holds the
+// rest of the volume spec and the voxel type. A page of metadata with the key
+// and the texture extents is followed by the header and the samples of the
+// volume laid out as in the cache buffer, so that the file can be mapped and
+// copied into the cache as is. Files are written under a temporary name and
+// renamed, so that other threads and sessions never read partial files.
+// Reading a file updates its modification time, and the least recently used
+// files are removed when the files take more space than the limit.
+// The cache is thread-safe.
+class DiskCache {
+public:
+    // A volume read from the cache, mapped from its file.
+    class Entry {
+    public:
+        Entry() : m_item_size(0) {}
+        const openvdb::Coord& getExtents() const { return m_extents; }
+        // The header and the samples of the volume, or only the header of an
+        // empty volume.
+        const uint8_t* getItem() const { return static_cast<const uint8_t*>(m_region.get_address()) + DATA_OFFSET; }
+        size_t getItemSize() const { return m_item_size; }
+
+    private:
+        friend class DiskCache;
+        boost::interprocess::mapped_region m_region;
+        openvdb::Coord m_extents;
+        size_t m_item_size;
+    };
+
+    DiskCache();
+
+    // An empty directory turns the cache off, which is the default. Returns
+    // false if the directory can't be created.
+    bool setDirectory(const std::string& directory);
+    std::string getDirectory() const;
+    bool isEnabled() const;
+    void setLimitBytes(size_t limit_bytes);
+    size_t getLimitBytes() const;
+    // The space taken by the files when the directory was last scanned, plus
+    // the files written since.
+    size_t getUsedBytes() const;
+
+    bool read(const std::string& key, Entry& out_entry);
+    void write(const std::string& key, const openvdb::Coord& extents, const uint8_t* item, size_t item_size_bytes);
+
+private:
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t key_size;
+        int32_t extents[3];
+        uint32_t reserved;
+        uint64_t item_size;
+    };
+
+    mutable std::mutex m_mutex;
+    boost::filesystem::path m_directory;
+    size_t m_limit_bytes;
+    size_t m_used_bytes;
+
+    boost::filesystem::path getPath(const std::string& key) const;
+    void evict();
+
+    static const size_t DEFAULT_LIMIT_BYTES;
+    // The offset of the volume in the files, which is page aligned.
+    static const size_t DATA_OFFSET;
+    static const char MAGIC[8];
+    // Files written by other versions are ignored.
+    static const uint32_t VERSION;
+    static const char* EXTENSION;
+};
+
 // === VolumeCache =========================================================
 
+struct VolumeRefinement;
+struct VolumePrefetch;
+struct VolumePrefetchTicket;
+
 class VolumeCache {
 public:
     static VolumeCache& instance();
 
+    // Volumes may be requested from several threads at once. A volume requested
+    // while another call is baking it waits for that bake instead of baking it
+    // again, and different volumes are baked in parallel. Volumes are baked into
+    // pooled buffers without holding the lock of the cache, and copied into the
+    // cache buffer once they're done.
     void getVolume(const VDBVolumeSpec& spec, VolumeTexture& output);
-
-    enum class VoxelType { FLOAT, HALF };
+    // Gets several volumes (e.g. the channels of a node) at once. The volumes which
+    // aren't in the cache yet are sampled in a single pass if they are sampled on
+    // the same lattice (see getBatches), and stored next to each other in the cache.
+    void getVolumes(const std::vector<VDBVolumeSpec>& specs, const std::vector<VolumeTexture*>& outputs);
+
+    // In progressive mode large volumes which aren't in the cache are first baked
+    // at a lower resolution, which is returned immediately, and refined to the
+    // requested resolution on a background thread, one refinement after the
+    // other. Once the refinement is finished (see isRefinementFinished),
+    // finishRefinement has to be called on the main thread to upload the refined
+    // volume and move it into the cache. A viewport
+    // refresh is requested when a refinement finishes. A volume requested while
+    // it's being refined gets the coarse volume and waits for the same
+    // refinement, instead of being baked again. Refinements are cancelled when no
+    // texture waits for them anymore, e.g. because the textures have been loaded
+    // with other specs.
+    // Progressive mode is on by default in interactive sessions.
+    void setProgressive(bool progressive) { m_progressive = progressive; }
+    bool isProgressive() const { return m_progressive; }
+    static bool isRefinementFinished(const VolumeTexture& texture);
+    // Returns true if the texture has been updated.
+    bool finishRefinement(VolumeTexture& texture);
+
+    // During playback the volumes of the next frames are prefetched: they are
+    // baked on a background thread and stored in the cache without being
+    // uploaded, see VDBSlicedDisplayImpl::prefetch. A prefetch bakes the passes of volumes
+    // (see VolumeParam::loadVolumes) for each of its files in order, with the
+    // unique tags read from the files. Prefetched volumes which haven't been
+    // requested yet take at most PREFETCH_LIMIT_FRACTION of the memory limit,
+    // so that prefetching doesn't evict the volumes on display, and grids which
+    // would be baked out of core aren't prefetched. If the ticket is the one of
+    // a running prefetch of the same volumes, its files left to bake are
+    // replaced; otherwise a new prefetch is started. A prefetch is cancelled
+    // when its ticket is dropped, which happens here as well if there are no
+    // files or the cache is off.
+    void prefetch(
+        std::unique_ptr<VolumePrefetchTicket>& ticket,
+        const std::vector<std::vector<VDBVolumeSpec>>& passes,
+        const std::vector<std::string>& file_names);
+    // The number of frames prefetched ahead of the playhead; zero turns
+    // prefetching off. Prefetching is on by default in interactive sessions.
+    void setPrefetchFrameCount(int frame_count) { m_prefetch_frame_count = frame_count; }
+    int getPrefetchFrameCount() const { return m_prefetch_frame_count; }
+
+    // Volumes which haven't been used for the given number of seconds are
+    // compressed in place by a pass on a background thread, started whenever
+    // volumes are requested or prefetched, so that the rest of their ranges can
+    // hold new volumes; see volume_compression for the format. A compressed
+    // volume is decompressed in parallel when it's requested again, and moved
+    // back into the cache uncompressed. Volumes which don't shrink below
+    // MAX_COMPRESSED_FRACTION of their size are left as they are. Zero turns
+    // compression off, which is on by default in interactive sessions.
+    void setCompressionAgeSeconds(int seconds) { m_compression_age_seconds = seconds; }
+    int getCompressionAgeSeconds() const { return m_compression_age_seconds; }
+
+    // UNORM8 and UNORM16 store the normalized samples as 8 and 16 bit unsigned integers.
+    enum class VoxelType { FLOAT, HALF, UNORM8, UNORM16 };
     VoxelType getVoxelType() const { return m_voxel_type; }
     void setVoxelType(VoxelType voxel_type);
 
+    // Shrinking the limit frees whole blocks of the buffer, which are picked
+    // by the eviction policy, see findBlockToRelease.
     void setMemoryLimitBytes(size_t mem_limit_bytes);
     size_t getMemoryLimitBytes() const { return m_mem_limit_bytes; }
-    size_t getAllocatedBytes() const { return m_buffer.size(); }
+    size_t getAllocatedBytes() const;
+
+    // In adaptive mode the memory limit follows the memory available to the
+    // process, read from /proc/meminfo and from the memory limit of its cgroup:
+    // it's set to the allocated bytes plus ADAPTIVE_AVAILABLE_FRACTION of the
+    // available memory, clamped to the floor and the ceiling, whenever that
+    // differs from the current limit by more than ADAPTIVE_HYSTERESIS_FRACTION
+    // of it. The memory is checked when volumes are requested, at most every
+    // ADAPTIVE_UPDATE_SECONDS. Adaptive mode is off by default, unless the
+    // ADAPTIVE_LIMIT_ENV environment variable holds the floor and the ceiling
+    // in gigabytes, separated by a comma (e.g. "1,32").
+    void setAdaptiveLimit(bool adaptive_limit);
+    bool isAdaptiveLimit() const { return m_adaptive_limit; }
+    void setAdaptiveLimitRangeBytes(size_t floor_bytes, size_t ceiling_bytes);
+    size_t getAdaptiveLimitFloorBytes() const { return m_adaptive_floor_bytes; }
+    size_t getAdaptiveLimitCeilingBytes() const { return m_adaptive_ceiling_bytes; }
+    static const char* ADAPTIVE_LIMIT_ENV;
+
+    // Decides which volumes are evicted when the buffer is full. FIFO evicts the
+    // volumes in the order they have been allocated. COST_AWARE is a
+    // GreedyDual-Size policy: every volume has a priority, set to the current
+    // inflation value plus its bake time per byte whenever it is baked or found
+    // in the cache, and the inflation value is raised to the priority of the
+    // volumes evicted. Volumes still occupy contiguous ranges, so a new volume
+    // replaces the contiguous range whose most valuable volume has the lowest
+    // priority. COST_AWARE is the default.
+    enum class EvictionPolicy { FIFO, COST_AWARE };
+    EvictionPolicy getEvictionPolicy() const { return m_eviction_policy; }
+    void setEvictionPolicy(EvictionPolicy eviction_policy) { m_eviction_policy = eviction_policy; }
+    // The number of requested volumes found in the cache and not found in it.
+    size_t getHits() const { return m_hits.load<tbb::relaxed>(); }
+    size_t getMisses() const { return m_misses.load<tbb::relaxed>(); }
+
+    // Counters since the cache was created or the last resetStats, which are
+    // relaxed atomics, cheap enough to stay on. Bakes are counted once they
+    // finish, including the coarse bakes and the refinements of progressive
+    // mode. File reads are the grids loaded from the VDB files, not counting
+    // leaf buffers read on demand, and the volumes read from the disk cache.
+    // Prefetched volumes are counted once they are stored in the cache, and
+    // prefetch hits once they are first requested. Compressed volumes are
+    // counted with their sizes before and after compression, and decompressed
+    // ones when they are requested again.
+    struct Stats {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t baked_bytes;
+        double bake_seconds;
+        double file_read_seconds;
+        size_t prefetched;
+        size_t prefetch_hits;
+        size_t compressed;
+        size_t compressed_input_bytes;
+        size_t compressed_output_bytes;
+        double compression_seconds;
+        size_t decompressed;
+        double decompression_seconds;
+    };
+    Stats getStats() const;
+    void resetStats();
+    // The volumes in the cache, in the order they're laid out in the buffer.
+    struct EntryInfo {
+        VDBVolumeSpec spec;
+        openvdb::Coord extents;
+        size_t size_bytes;
+        // The size before compression, or zero if the volume isn't compressed.
+        size_t uncompressed_size_bytes;
+        double seconds_since_last_use;
+    };
+    std::vector<EntryInfo> getEntries() const;
+
+    MultiResCache& getMultiResCache() { return m_multires_cache; }
+    // If the disk cache has a directory, baked volumes are written to it, and
+    // volumes which aren't in the cache are read from it before loading their
+    // grids. Volumes read from disk aren't baked incrementally in delta rebake
+    // mode, since the checksums of their grids aren't kept on disk.
+    DiskCache& getDiskCache() { return m_disk_cache; }
+
+    // Grids whose leaf buffers take more memory than the out-of-core budget are
+    // baked out of core: only their topology is loaded up front, and the leaf
+    // buffers are read in spatial batches fitting into the budget, see
+    // volume_sampling::sampleGridOutOfCore. This only applies if the grid is
+    // filtered the same way out of core; otherwise it is loaded on demand and
+    // baked as usual. Zero turns out-of-core baking off, which is the default.
+    void setOutOfCoreBudgetBytes(size_t budget_bytes) { m_out_of_core_budget_bytes = budget_bytes; }
+    size_t getOutOfCoreBudgetBytes() const { return m_out_of_core_budget_bytes; }
+
+    // In delta rebake mode a volume which isn't in the cache is baked
+    // incrementally from the cached volume its texture held before, if that only
+    // differs in the file (e.g. the previous frame of a simulation): only the
+    // lattice cells reading leaf nodes or tiles whose checksums changed are
+    // sampled again, and the rest are copied, see volume_sampling::sampleGridDelta.
+    // The checksums of the grids are kept along with the cached volumes. Volumes
+    // baked out of core aren't baked incrementally, and the channels of a node
+    // are baked one by one instead of in a single pass. Off by default.
+    void setDeltaRebake(bool delta_rebake) { m_delta_rebake = delta_rebake; }
+    bool isDeltaRebake() const { return m_delta_rebake; }
+    // The number of lattice cells sampled by the incremental bakes so far, and
+    // the number of cells of the volumes they baked.
+    size_t getDeltaSampledCells() const { return m_delta_sampled_cells; }
+    size_t getDeltaTotalCells() const { return m_delta_total_cells; }
 
 private:
     static size_t s_refcount;
@@ -310,27 +846,134 @@ public:
     // Each SubSceneOverride should call registerUsage in its ctor and unregisterUsage in its dtor
     // so that the cache can be cleared if e.g. a new scene is created.
     static void registerUsage() { ++s_refcount; }
-    static void unregisterUsage() { --s_refcount; if (s_refcount == 0) instance().clear(); }
+    static void unregisterUsage()
+    {
+        --s_refcount;
+        if (s_refcount == 0) {
+            instance().cancelRefinements();
+            instance().cancelPrefetches();
+            instance().cancelCompression();
+            {
+                std::lock_guard<std::mutex> lock(instance().m_mutex);
+                instance().clear();
+            }
+            instance().m_multires_cache.clear();
+        }
+    }
 
 private:
-    VoxelType m_voxel_type;
+    // Guards the buffer, the maps and the eviction state below, and the
+    // volumes being baked. The settings are atomic, so that they can be read
+    // without it.
+    mutable std::mutex m_mutex;
+    // Notified when bakes finish, see waitForBakes.
+    std::condition_variable m_bake_finished;
+    // The volumes being baked by getVolume and getVolumes.
+    std::unordered_set<VDBVolumeSpec> m_in_flight_specs;
+
+    tbb::atomic<VoxelType> m_voxel_type;
+    MultiResCache m_multires_cache;
+    DiskCache m_disk_cache;
+
+    tbb::atomic<bool> m_progressive;
+    // Guards the background threads and the lists of refinements and prefetches.
+    std::mutex m_refinement_mutex;
+    BackgroundThread m_refinement_thread;
+    // The refinements started so far; expired ones are pruned when a new one is started.
+    std::vector<std::weak_ptr<VolumeRefinement>> m_refinements;
+    tbb::atomic<int> m_prefetch_frame_count;
+    BackgroundThread m_prefetch_thread;
+    // The prefetches started so far, pruned the same way.
+    std::vector<std::weak_ptr<VolumePrefetch>> m_prefetches;
+    // The prefetched volumes which haven't been requested yet, and the bytes
+    // they take in the buffer; guarded by m_mutex.
+    std::unordered_set<VDBVolumeSpec> m_prefetched_specs;
+    size_t m_prefetched_bytes;
+    tbb::atomic<int> m_compression_age_seconds;
+    BackgroundThread m_compression_thread;
+    // Set while a compression pass runs; only one runs at a time.
+    tbb::atomic<bool> m_compressing;
+    tbb::atomic<bool> m_compression_cancelled;
+    // Set while the compression pass copies the samples of a volume without
+    // holding the lock; nothing may overwrite or free the buffer meanwhile,
+    // see waitForUnpinned. Guarded by m_mutex.
+    bool m_pinned;
+    std::condition_variable_any m_unpinned;
 
     struct BufferRange {
         size_t begin;
         size_t end;
-        BufferRange(size_t begin_, size_t end_) : begin(begin_), end(end_) {}
+        // Extents of the texture stored in the range.
+        openvdb::Coord extents;
+        // The time it took to bake the volume in seconds, and its priority with
+        // the COST_AWARE eviction policy.
+        double cost;
+        double priority;
+        // When the volume was stored or last found in the cache.
+        std::chrono::steady_clock::time_point last_use;
+        // The size of the volume before it has been compressed, or zero if it
+        // isn't compressed, and whether compressing it didn't pay off.
+        size_t uncompressed_size;
+        bool is_incompressible;
+        BufferRange(size_t begin_, size_t end_, const openvdb::Coord& extents_ = openvdb::Coord())
+            : begin(begin_), end(end_), extents(extents_), cost(0.0), priority(0.0), last_use(std::chrono::steady_clock::now()),
+              uncompressed_size(0), is_incompressible(false) {}
     };
 
-    size_t m_mem_limit_bytes;
-
-    // Objects are stored contiguously in a vector.
-    std::vector<uint8_t> m_buffer;
-    // FIFO cache eviction policy is used for its simplicity. The m_buffer_head
-    // wraps around effectively creating a ring buffer, but objects are always
-    // laid out linearly; m_buffer_head will wrap prematurely if the next object
-    // doesn't fit into m_buffer.
+    tbb::atomic<size_t> m_mem_limit_bytes;
+    tbb::atomic<size_t> m_out_of_core_budget_bytes;
+    tbb::atomic<bool> m_adaptive_limit;
+    tbb::atomic<size_t> m_adaptive_floor_bytes;
+    tbb::atomic<size_t> m_adaptive_ceiling_bytes;
+    // Guards the time the memory was last checked in adaptive mode.
+    std::mutex m_adaptive_mutex;
+    std::chrono::steady_clock::time_point m_adaptive_update_time;
+
+    tbb::atomic<EvictionPolicy> m_eviction_policy;
+    // The GreedyDual inflation value, see EvictionPolicy.
+    double m_inflation;
+    // Statistics, see getStats.
+    tbb::atomic<size_t> m_hits;
+    tbb::atomic<size_t> m_misses;
+    tbb::atomic<size_t> m_evictions;
+    tbb::atomic<size_t> m_baked_bytes;
+    tbb::atomic<uint64_t> m_bake_microseconds;
+    tbb::atomic<uint64_t> m_file_read_microseconds;
+    tbb::atomic<size_t> m_prefetched;
+    tbb::atomic<size_t> m_prefetch_hits;
+    tbb::atomic<size_t> m_compressed;
+    tbb::atomic<size_t> m_compressed_input_bytes;
+    tbb::atomic<size_t> m_compressed_output_bytes;
+    tbb::atomic<uint64_t> m_compression_microseconds;
+    tbb::atomic<size_t> m_decompressed;
+    tbb::atomic<uint64_t> m_decompression_microseconds;
+
+    tbb::atomic<bool> m_delta_rebake;
+    // The checksums of the grids of the cached volumes baked in delta rebake mode.
+    std::unordered_map<VDBVolumeSpec, volume_sampling::GridChecksums> m_grid_checksums;
+    tbb::atomic<size_t> m_delta_sampled_cells;
+    tbb::atomic<size_t> m_delta_total_cells;
+
+    // Objects are stored in a chunked arena. The buffer is made of blocks of
+    // whole chunks, which are allocated as the cache grows and never move, so
+    // growing the buffer copies nothing, and shrinking it frees whole blocks.
+    // Buffer offsets address the blocks one after the other, each one starting
+    // at a multiple of the chunk size, and no object straddles two blocks.
+    // Objects larger than a chunk get a block of as many chunks as they need.
+    // The last block may be shorter to stay within the memory limit.
+    struct BufferBlock {
+        size_t begin;
+        size_t size;
+        std::unique_ptr<uint8_t[]> data;
+    };
+    std::vector<BufferBlock> m_blocks;
+    size_t m_allocated_bytes;
+    // With the FIFO eviction policy the m_buffer_head wraps around effectively
+    // creating a ring buffer, but objects are always laid out linearly;
+    // m_buffer_head will skip to the next block or wrap prematurely if the next
+    // object doesn't fit into the current block.
     size_t m_buffer_head;
-    // Associates VDBVolumeSpec values to ranges in m_buffer.
+    // Associates VDBVolumeSpec values to ranges in the buffer.
     // This makes the cache addressable by VDBVolumeSpec.
     typedef std::unordered_map<VDBVolumeSpec, BufferRange> BufferMap;
     BufferMap m_buffer_map;
@@ -339,26 +982,284 @@ private:
     // can be deleted. The map needs to be ordered.
     std::map<size_t, VDBVolumeSpec> m_allocation_map;
 
+    // Marks volumes as being baked until it's released or destroyed, so that
+    // other calls requesting them wait for the bake, see waitForBakes. The lock
+    // has to be held when it's created; it's locked again to release the marks
+    // if needed, and stays locked afterwards.
+    class InFlightBakes {
+    public:
+        InFlightBakes(VolumeCache& cache, std::unique_lock<std::mutex>& lock, const std::vector<VDBVolumeSpec>& specs);
+        InFlightBakes(const InFlightBakes&) = delete;
+        InFlightBakes& operator=(const InFlightBakes&) = delete;
+        ~InFlightBakes() { release(); }
+        void release();
+        // Releases the mark of a single volume.
+        void release(const VDBVolumeSpec& spec);
+
+    private:
+        VolumeCache& m_cache;
+        std::unique_lock<std::mutex>& m_lock;
+        std::vector<VDBVolumeSpec> m_specs;
+    };
+
     VolumeCache();
-    openvdb::FloatGrid::ConstPtr loadGrid(const VDBVolumeSpec& spec);
+    ~VolumeCache();
+    void waitForBakes(std::unique_lock<std::mutex>& lock, const std::vector<VDBVolumeSpec>& specs);
+    template <typename RealType>
+    static VoxelType getVoxelTypeOf();
+    openvdb::GridBase::Ptr loadGrid(const VDBVolumeSpec& spec);
+    bool isOutOfCore(const VDBVolumeSpec& spec, const openvdb::GridBase& grid, const openvdb::Coord& extents) const;
+    static openvdb::Coord getTextureExtents(const VDBVolumeSpec& spec, const openvdb::GridBase& grid);
+    // The volumes sampled in a single pass, see getBatches.
+    struct Batch {
+        std::vector<size_t> channels;
+        openvdb::Coord extents;
+    };
+    static std::vector<Batch> getBatches(
+        const std::vector<VDBVolumeSpec>& specs,
+        const std::vector<const openvdb::GridBase*>& grids,
+        const std::vector<bool>& can_batch);
     void clear();
     void clearRange(const BufferRange& range);
-    void growBuffer(size_t minimum_buffer_size_bytes);
+    void eraseVolume(BufferMap::iterator it);
+    uint8_t* getBufferData(size_t offset) const;
+    size_t findBlockRange(size_t begin, size_t size_bytes) const;
+    bool addBlock(size_t minimum_size_bytes);
+    bool replaceLastBlocks(size_t size_bytes, size_t& out_begin);
+    void releaseLastBlock();
+    void releaseBlock(size_t index);
+    size_t findBlockToRelease();
+    void releaseBlocks();
+    void updateAdaptiveLimit(bool force);
+    bool findAllocationRange(size_t allocation_size_bytes, size_t alignment, size_t& out_begin);
+    double getPriority(const BufferRange& range) const;
+    void setBakeCost(const VDBVolumeSpec& spec, double seconds);
+    void countLookup(const VDBVolumeSpec& spec);
+    void countBake(size_t bytes, double seconds);
+    void countFileRead(double seconds);
 
     template <typename RealType>
     void getVolume(const VDBVolumeSpec& spec, VolumeTexture& output);
     template <typename RealType>
-    void* allocate(const VDBVolumeSpec& spec);
+    void getVolumes(const std::vector<VDBVolumeSpec>& specs, const std::vector<VolumeTexture*>& outputs);
+    template <typename RealType>
+    void bakeVolume(
+        const VDBVolumeSpec& spec,
+        openvdb::GridBase::Ptr grid,
+        double load_seconds,
+        const std::string& disk_cache_key,
+        const VDBVolumeSpec& prev_spec,
+        const std::vector<VolumeTexture*>& outputs,
+        std::unique_lock<std::mutex>& lock,
+        InFlightBakes& in_flight);
+    template <typename RealType>
+    void bakeVolumes(
+        const std::vector<VDBVolumeSpec>& specs,
+        const std::vector<openvdb::GridBase::ConstPtr>& grids,
+        double load_seconds,
+        const std::vector<std::string>& disk_cache_keys,
+        const openvdb::Coord& extents,
+        const std::vector<std::pair<VolumeTexture*, size_t>>& outputs,
+        std::unique_lock<std::mutex>& lock,
+        InFlightBakes& in_flight);
+    template <typename RealType>
+    bool getCachedVolume(const VDBVolumeSpec& spec, VolumeTexture& output);
+    template <typename RealType>
+    static std::string getDiskCacheKey(const VDBVolumeSpec& spec);
+    template <typename RealType>
+    bool getDiskCachedVolume(const VDBVolumeSpec& spec, const std::string& key, const std::vector<VolumeTexture*>& outputs);
+    template <typename RealType>
+    bool getCompressedVolume(const VDBVolumeSpec& spec, const std::vector<VolumeTexture*>& outputs);
+    template <typename RealType>
+    bool getDownsampledVolume(const VDBVolumeSpec& spec, const std::vector<VolumeTexture*>& outputs);
+    template <typename RealType>
+    bool getRefiningVolume(const VDBVolumeSpec& spec, const std::vector<VolumeTexture*>& outputs);
+    template <typename RealType>
+    bool getDeltaSource(
+        const VDBVolumeSpec& prev_spec,
+        const VDBVolumeSpec& spec,
+        const openvdb::Coord& extents,
+        std::vector<uint8_t>& out_item,
+        volume_sampling::GridChecksums& out_checksums) const;
+    template <typename RealType>
+    bool bakeProgressively(
+        const std::vector<VDBVolumeSpec>& specs,
+        const std::vector<openvdb::GridBase::ConstPtr>& grids,
+        const openvdb::Coord& extents,
+        const std::vector<std::pair<VolumeTexture*, size_t>>& outputs);
+    template <typename RealType>
+    void refine(VolumeRefinement& refinement);
+    template <typename RealType>
+    bool finishRefinement(VolumeRefinement& refinement, size_t index, VolumeTexture& texture);
+    void cancelRefinements();
+    void prefetchFiles(VolumePrefetch& prefetch);
+    template <typename RealType>
+    void prefetchFiles(VolumePrefetch& prefetch);
+    template <typename RealType>
+    bool prefetchVolumes(VolumePrefetch& prefetch, const std::vector<VDBVolumeSpec>& specs);
+    template <typename RealType>
+    bool prefetchBatch(
+        VolumePrefetch& prefetch,
+        const std::vector<VDBVolumeSpec>& specs,
+        const std::vector<const openvdb::GridBase*>& grids,
+        double load_seconds,
+        const std::vector<std::string>& disk_cache_keys,
+        const openvdb::Coord& extents,
+        std::unique_lock<std::mutex>& lock,
+        InFlightBakes& in_flight);
+    void markPrefetched(const std::vector<VDBVolumeSpec>& specs);
+    void cancelPrefetches();
+    void startCompression();
+    void waitForUnpinned();
+    void compressColdVolumes();
+    template <typename RealType>
+    void compressColdVolumes();
+    void cancelCompression();
+    template <typename RealType>
+    static size_t getItemSize(const openvdb::Coord& extents);
+    template <typename RealType>
+    void* allocate(const VDBVolumeSpec* specs, size_t num_specs, const openvdb::Coord& extents);
+    template <typename RealType>
+    void storeVolumes(
+        const VDBVolumeSpec* specs,
+        size_t num_specs,
+        const openvdb::Coord& extents,
+        const uint8_t* items,
+        bool is_empty,
+        double bake_seconds);
     template <typename RealType>
     volume_sampling::Result sampleGrid(
         const VDBVolumeSpec& spec,
-        const openvdb::FloatGrid& grid,
-        volume_sampling::SampleBufferHeader<RealType>& out_header,
+        const openvdb::Coord& extents,
+        const openvdb::GridBase& grid,
+        volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType>& out_header,
         RealType* out_data);
+    template <typename RealType>
+    volume_sampling::Result sampleGridDelta(
+        const VDBVolumeSpec& spec,
+        const openvdb::Coord& extents,
+        const openvdb::GridBase& grid,
+        const volume_sampling::GridChecksums& checksums,
+        const volume_sampling::GridChecksums& prev_checksums,
+        const std::vector<uint8_t>& prev_item,
+        volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data);
+    template <typename RealType>
+    volume_sampling::Result sampleGridOutOfCore(
+        const VDBVolumeSpec& spec,
+        const openvdb::Coord& extents,
+        openvdb::GridBase::Ptr& grid,
+        volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data);
+    template <typename RealType>
+    volume_sampling::Result sampleGrids(
+        const std::vector<VDBVolumeSpec>& specs,
+        const openvdb::Coord& extents,
+        const std::vector<const openvdb::GridBase*>& grids,
+        volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType>* out_headers,
+        RealType* out_data,
+        const volume_sampling::ChannelLayout& layout);
 
     static const size_t DEFAULT_LIMIT_BYTES;
     static const size_t DEFAULT_SIZE_BYTES;
-    static const size_t GROW_AMOUNT_BYTES;
+    static const size_t CHUNK_SIZE_BYTES;
+    static const size_t NO_OFFSET;
+    // Volumes with fewer voxels are always baked at once.
+    static const size_t PROGRESSIVE_MIN_VOXELS;
+    // The coarse bake of a progressive bake has this many times fewer cells along each axis.
+    static const int PROGRESSIVE_COARSE_FACTOR;
+    static const int DEFAULT_PREFETCH_FRAME_COUNT;
+    static const double PREFETCH_LIMIT_FRACTION;
+    static const int DEFAULT_COMPRESSION_AGE_SECONDS;
+    static const double MAX_COMPRESSED_FRACTION;
+    static const size_t DEFAULT_ADAPTIVE_FLOOR_BYTES;
+    static const size_t DEFAULT_ADAPTIVE_CEILING_BYTES;
+    static const double ADAPTIVE_AVAILABLE_FRACTION;
+    static const double ADAPTIVE_HYSTERESIS_FRACTION;
+    static const double ADAPTIVE_UPDATE_SECONDS;
+};
+
+// A background bake of volumes at their requested resolution, see
+// VolumeCache::setProgressive. The samples are written to a private buffer,
+// since the cache buffer may change meanwhile.
+struct VolumeRefinement {
+    std::vector<VDBVolumeSpec> specs;
+    std::vector<openvdb::GridBase::ConstPtr> grids;
+    openvdb::Coord extents;
+    VolumeCache::VoxelType voxel_type;
+    // The header and the samples of each coarse volume, coarse_item_size bytes
+    // apart, uploaded to the textures attached to the refinement later on.
+    openvdb::Coord coarse_extents;
+    std::vector<uint8_t> coarse_buffer;
+    size_t coarse_item_size;
+    // The ticket shared by the textures waiting for the refinement; set before
+    // the refinement is registered, and expired once it's cancelled.
+    std::weak_ptr<VolumeRefinementTicket> ticket;
+    // Set if the checksums of the grids have to be computed as well, in delta
+    // rebake mode.
+    bool compute_checksums;
+    std::vector<volume_sampling::GridChecksums> checksums;
+    // The keys of the volumes in the disk cache, if it's on; the volumes are
+    // written to it by the background task.
+    std::vector<std::string> disk_cache_keys;
+    // The header and the samples of each volume, item_size bytes apart.
+    std::vector<uint8_t> buffer;
+    size_t item_size;
+    volume_sampling::Result result;
+    // The time the bake took in seconds.
+    double bake_seconds;
+    // Set by the background task when it's done; the main thread may only read
+    // buffer and result after that.
+    tbb::atomic<bool> finished;
+    tbb::atomic<bool> cancelled;
+    // Set with the cache locked once the result has been moved into the cache.
+    bool stored;
+
+    VolumeRefinement() : voxel_type(VolumeCache::VoxelType::FLOAT), coarse_item_size(0), compute_checksums(false), item_size(0), result(volume_sampling::Result::INTERRUPTED), bake_seconds(0.0), stored(false)
+    {
+        finished = false;
+        cancelled = false;
+    }
+};
+
+// Shared by the textures waiting for a refinement; cancels the refinement when
+// the last of them drops it.
+struct VolumeRefinementTicket {
+    std::shared_ptr<VolumeRefinement> refinement;
+
+    explicit VolumeRefinementTicket(const std::shared_ptr<VolumeRefinement>& refinement_) : refinement(refinement_) {}
+    ~VolumeRefinementTicket() { refinement->cancelled = true; }
+};
+
+// A background bake of the volumes of upcoming frames, see VolumeCache::prefetch.
+struct VolumePrefetch {
+    // The volumes baked for every file, pass by pass, with their file names and
+    // unique tags left empty.
+    std::vector<std::vector<VDBVolumeSpec>> passes;
+    VolumeCache::VoxelType voxel_type;
+    // Guards file_names, file_name and running.
+    std::mutex mutex;
+    // The files left to bake, nearest frame first.
+    std::deque<std::string> file_names;
+    // The file being baked.
+    std::string file_name;
+    // Cleared by the background task when it stops.
+    bool running;
+    tbb::atomic<bool> cancelled;
+
+    VolumePrefetch() : voxel_type(VolumeCache::VoxelType::FLOAT), running(false)
+    {
+        cancelled = false;
+    }
+};
+
+// Held by the display which started the prefetch; cancels the prefetch when
+// it is dropped.
+struct VolumePrefetchTicket {
+    std::shared_ptr<VolumePrefetch> prefetch;
+
+    explicit VolumePrefetchTicket(const std::shared_ptr<VolumePrefetch>& prefetch_) : prefetch(prefetch_) {}
+    ~VolumePrefetchTicket() { prefetch->cancelled = true; }
 };
 
 size_t VolumeCache::s_refcount = 0;
@@ -397,309 +1298,2649 @@ namespace {
 
     class VDBFile {
     public:
-        VDBFile(const std::string& file_name) : m_vdb_file(file_name) { m_vdb_file.open(false); }
+        // With delayed loading only the topology of the grids is read; leaf
+        // buffers are read on demand, even after the file is closed.
+        VDBFile(const std::string& file_name, bool delayed_load = false) : m_vdb_file(file_name) { m_vdb_file.open(delayed_load); }
         ~VDBFile() { m_vdb_file.close(); }
         operator bool() const { return m_vdb_file.isOpen(); }
-        openvdb::FloatGrid::ConstPtr loadFloatGrid(const std::string& grid_name);
+        std::string getUniqueTag() const { return m_vdb_file.getUniqueTag(); }
+        openvdb::GridBase::Ptr loadGrid(const std::string& grid_name);
 
     private:
         openvdb::io::File m_vdb_file;
     };
 
-    openvdb::FloatGrid::ConstPtr VDBFile::loadFloatGrid(const std::string& grid_name)
+    // Only loads grids which can be sampled, see volume_sampling::processTypedGrid.
+    openvdb::GridBase::Ptr VDBFile::loadGrid(const std::string& grid_name)
     {
         if (!m_vdb_file.isOpen())
             return nullptr;
 
-        openvdb::GridBase::ConstPtr grid_base_ptr;
+        openvdb::GridBase::Ptr grid_base_ptr;
         try {
             grid_base_ptr = m_vdb_file.readGrid(grid_name);
         } catch (const openvdb::Exception&) {
             return nullptr;
         }
 
-        auto grid_ptr = openvdb::gridConstPtrCast<openvdb::FloatGrid>(grid_base_ptr);
-        if (!grid_ptr) {
-            MGlobal::displayError(format("[openvdb] Grid '^1s' is not a FloatGrid.", grid_name.c_str()));
+        if (!volume_sampling::isSupportedGridType(*grid_base_ptr)) {
+            MGlobal::displayError(format("[openvdb] Grid '^1s' has unsupported value type '^2s'.",
+                                         grid_name.c_str(), grid_base_ptr->valueType().c_str()));
             return nullptr;
         }
 
-        return grid_ptr;
+        return grid_base_ptr;
+    }
+
+    volume_sampling::ScalarReduction getScalarReduction(VDBVectorReduction vector_reduction)
+    {
+        switch (vector_reduction) {
+        case VDBVectorReduction::AVERAGE:
+            return volume_sampling::ScalarReduction::AVERAGE;
+        case VDBVectorReduction::COMPONENT_X:
+            return volume_sampling::ScalarReduction::COMPONENT_X;
+        case VDBVectorReduction::COMPONENT_Y:
+            return volume_sampling::ScalarReduction::COMPONENT_Y;
+        case VDBVectorReduction::COMPONENT_Z:
+            return volume_sampling::ScalarReduction::COMPONENT_Z;
+        case VDBVectorReduction::LENGTH:
+        default:
+            return volume_sampling::ScalarReduction::LENGTH;
+        }
+    }
+
+    // The memory taken by the voxels of the grid, as recorded in the file.
+    size_t getFileMemBytes(const openvdb::GridBase& grid)
+    {
+        try {
+            return size_t(std::max<openvdb::Int64>(grid.metaValue<openvdb::Int64>(openvdb::GridBase::META_FILE_MEM_BYTES), 0));
+        } catch (const openvdb::Exception&) {
+            return 0;
+        }
     }
 
     constexpr size_t KILOBYTE = 1024;
     constexpr size_t MEGABYTE = 1024 * KILOBYTE;
     constexpr size_t GIGABYTE = 1024 * MEGABYTE;
 
+    // Reads the first number of a file, e.g. of a cgroup interface file. Fails
+    // for "max", which cgroup v2 uses for no limit.
+    bool readNumber(const std::string& path, size_t& out_value)
+    {
+        std::ifstream file(path);
+        std::string value;
+        if (!(file >> value))
+            return false;
+        char* end = nullptr;
+        const auto number = std::strtoull(value.c_str(), &end, 10);
+        if (end == value.c_str() || *end != '\0')
+            return false;
+        out_value = size_t(number);
+        return true;
+    }
+
+    // Returns the memory the kernel estimates to be available for new
+    // allocations without swapping, MemAvailable in /proc/meminfo.
+    bool readMemAvailableBytes(size_t& out_bytes)
+    {
+        std::ifstream meminfo("/proc/meminfo");
+        std::string key;
+        size_t value = 0;
+        std::string unit;
+        while (meminfo >> key >> value) {
+            std::getline(meminfo, unit);
+            if (key == "MemAvailable:") {
+                out_bytes = value * KILOBYTE;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns the memory left below the memory limit of the cgroup of the
+    // process, for cgroup v2 (memory.max) and v1 (memory.limit_in_bytes).
+    // Fails if the cgroup has no limit.
+    bool readCgroupAvailableBytes(size_t& out_bytes)
+    {
+        std::vector<std::string> directories;
+        std::ifstream cgroup("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(cgroup, line)) {
+            if (line.compare(0, 3, "0::") == 0)
+                directories.push_back("/sys/fs/cgroup" + line.substr(3));
+        }
+        // Containers usually see their own cgroup at the root.
+        directories.push_back("/sys/fs/cgroup");
+        for (const auto& directory : directories) {
+            size_t max_bytes = 0;
+            size_t current_bytes = 0;
+            if (readNumber(directory + "/memory.max", max_bytes) && readNumber(directory + "/memory.current", current_bytes)) {
+                out_bytes = max_bytes > current_bytes ? max_bytes - current_bytes : 0;
+                return true;
+            }
+        }
+
+        // cgroup v1 reports a huge limit instead of no limit.
+        size_t limit_bytes = 0;
+        size_t usage_bytes = 0;
+        if (readNumber("/sys/fs/cgroup/memory/memory.limit_in_bytes", limit_bytes) && limit_bytes < (size_t(1) << 60) &&
+            readNumber("/sys/fs/cgroup/memory/memory.usage_in_bytes", usage_bytes)) {
+            out_bytes = limit_bytes > usage_bytes ? limit_bytes - usage_bytes : 0;
+            return true;
+        }
+        return false;
+    }
+
+    // Returns the memory available to the process: the lesser of the available
+    // system memory and the memory left in its cgroup. Fails if neither can be
+    // read, e.g. on other platforms than Linux.
+    bool readAvailableMemoryBytes(size_t& out_bytes)
+    {
+        size_t mem_available_bytes = 0;
+        size_t cgroup_available_bytes = 0;
+        const bool has_mem_available = readMemAvailableBytes(mem_available_bytes);
+        const bool has_cgroup_limit = readCgroupAvailableBytes(cgroup_available_bytes);
+        if (has_mem_available && has_cgroup_limit)
+            out_bytes = std::min(mem_available_bytes, cgroup_available_bytes);
+        else if (has_mem_available)
+            out_bytes = mem_available_bytes;
+        else if (has_cgroup_limit)
+            out_bytes = cgroup_available_bytes;
+        return has_mem_available || has_cgroup_limit;
+    }
+
+    // Parses the floor and the ceiling of the adaptive limit from
+    // "<floor>,<ceiling>" in gigabytes.
+    bool parseAdaptiveLimitRange(const char* value, size_t& out_floor_bytes, size_t& out_ceiling_bytes)
+    {
+        std::stringstream ss(value);
+        long long floor_gigabytes = -1;
+        long long ceiling_gigabytes = -1;
+        char separator = 0;
+        if (!(ss >> floor_gigabytes >> separator >> ceiling_gigabytes) || separator != ',' ||
+            floor_gigabytes < 0 || ceiling_gigabytes < floor_gigabytes)
+            return false;
+        out_floor_bytes = size_t(floor_gigabytes) << 30;
+        out_ceiling_bytes = size_t(ceiling_gigabytes) << 30;
+        return true;
+    }
+
 } // unnamed namespace
 
 const size_t VolumeCache::DEFAULT_LIMIT_BYTES = 2 * GIGABYTE;
 const size_t VolumeCache::DEFAULT_SIZE_BYTES = 256 * MEGABYTE;
-const size_t VolumeCache::GROW_AMOUNT_BYTES = 256 * MEGABYTE;
-
-VolumeCache& VolumeCache::instance()
+const size_t VolumeCache::CHUNK_SIZE_BYTES = 256 * MEGABYTE;
+const size_t VolumeCache::NO_OFFSET = std::numeric_limits<size_t>::max();
+const size_t VolumeCache::PROGRESSIVE_MIN_VOXELS = 64 * 64 * 64;
+const int VolumeCache::PROGRESSIVE_COARSE_FACTOR = 4;
+const int VolumeCache::DEFAULT_PREFETCH_FRAME_COUNT = 4;
+const double VolumeCache::PREFETCH_LIMIT_FRACTION = 0.5;
+const int VolumeCache::DEFAULT_COMPRESSION_AGE_SECONDS = 30;
+const double VolumeCache::MAX_COMPRESSED_FRACTION = 0.75;
+const char* VolumeCache::ADAPTIVE_LIMIT_ENV = "VDB_VISUALIZER_VOLUME_CACHE_ADAPTIVE_LIMIT";
+const size_t VolumeCache::DEFAULT_ADAPTIVE_FLOOR_BYTES = 1 * GIGABYTE;
+const size_t VolumeCache::DEFAULT_ADAPTIVE_CEILING_BYTES = 64 * GIGABYTE;
+const double VolumeCache::ADAPTIVE_AVAILABLE_FRACTION = 0.5;
+const double VolumeCache::ADAPTIVE_HYSTERESIS_FRACTION = 0.1;
+const double VolumeCache::ADAPTIVE_UPDATE_SECONDS = 2.0;
+const size_t MultiResCache::DEFAULT_LIMIT_BYTES = 1 * GIGABYTE;
+const size_t BufferPool::MAX_POOLED_BYTES = 512 * MEGABYTE;
+const size_t DiskCache::DEFAULT_LIMIT_BYTES = 16 * GIGABYTE;
+const size_t DiskCache::DATA_OFFSET = 4 * KILOBYTE;
+const char DiskCache::MAGIC[8] = { 'V', 'D', 'B', 'V', 'O', 'L', 'U', 'M' };
+const uint32_t DiskCache::VERSION = 1;
+const char* DiskCache::EXTENSION = ".vdbvol";
+
+MultiResCache::MultiResCache() : m_mem_limit_bytes(DEFAULT_LIMIT_BYTES), m_allocated_bytes(0)
 {
-    static VolumeCache volume_cache;
-    return volume_cache;
 }
 
-void VolumeCache::setVoxelType(VoxelType voxel_type)
+MultiResCache::FloatMultiResGrid::ConstPtr MultiResCache::get(
+    const VDBVolumeSpec& spec, const openvdb::FloatGrid& grid, size_t num_levels)
 {
-    if (m_voxel_type != voxel_type)
-        clear();
+    const Key key(spec.vdb_file_uuid, spec.vdb_grid_name);
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // Check if in cache, once no other call is building the pyramid. Pyramids
+    // with too few levels are rebuilt.
+    m_build_finished.wait(lock, [this, &key]() { return m_building_keys.find(key) == m_building_keys.end(); });
+    const auto map_it = m_entry_map.find(key);
+    if (map_it != m_entry_map.end()) {
+        const auto entry_it = map_it->second;
+        if (entry_it->multires->numLevels() >= num_levels) {
+            m_entries.splice(m_entries.begin(), m_entries, entry_it);
+            return entry_it->multires;
+        }
+    }
 
-    m_voxel_type = voxel_type;
+    // Build the pyramid without holding the lock.
+    m_building_keys.insert(key);
+    lock.unlock();
+    FloatMultiResGrid::ConstPtr multires;
+    try {
+        multires = volume_sampling::MultiResProviderNew()(grid, num_levels);
+    } catch (...) {
+        lock.lock();
+        m_building_keys.erase(key);
+        m_build_finished.notify_all();
+        throw;
+    }
+
+    // Level 0 is a copy of the grid tree, so it is accounted for as well.
+    size_t size_bytes = 0;
+    for (size_t level = 0; level < multires->numLevels(); ++level)
+        size_bytes += size_t(multires->constTree(level).memUsage());
+
+    lock.lock();
+    m_building_keys.erase(key);
+    m_build_finished.notify_all();
+    const auto old_map_it = m_entry_map.find(key);
+    if (old_map_it != m_entry_map.end())
+        erase(old_map_it->second);
+
+    // Don't cache pyramids which would not fit anyway.
+    if (m_mem_limit_bytes == 0 || size_bytes > m_mem_limit_bytes)
+        return multires;
+
+    evict(m_mem_limit_bytes - size_bytes);
+    m_entries.push_front({ key, multires, size_bytes });
+    m_entry_map[key] = m_entries.begin();
+    m_allocated_bytes += size_bytes;
+    return multires;
 }
 
-VolumeCache::VolumeCache() : m_voxel_type(VoxelType::HALF), m_mem_limit_bytes(DEFAULT_LIMIT_BYTES), m_buffer_head(0)
+void MultiResCache::setMemoryLimitBytes(size_t mem_limit_bytes)
 {
-    // Don't allocate anything in the ctor to avoid unnecessary consumption of memory (e.g. batch mode).
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_mem_limit_bytes = mem_limit_bytes;
+    evict(m_mem_limit_bytes);
 }
 
-openvdb::FloatGrid::ConstPtr VolumeCache::loadGrid(const VDBVolumeSpec& spec)
+size_t MultiResCache::getAllocatedBytes() const
 {
-    // Open VDB file or bail.
-    auto vdb_file = VDBFile(spec.vdb_file_name);
-    if (!vdb_file)
-        return nullptr;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_allocated_bytes;
+}
 
-    return vdb_file.loadFloatGrid(spec.vdb_grid_name);
+void MultiResCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_entry_map.clear();
+    m_allocated_bytes = 0;
 }
 
-template <typename RealType>
-volume_sampling::Result VolumeCache::sampleGrid(
-    const VDBVolumeSpec& spec,
-    const openvdb::FloatGrid& grid,
-    volume_sampling::SampleBufferHeader<RealType>& out_header,
-    RealType* out_data)
+void MultiResCache::erase(EntryList::iterator entry_it)
 {
-    ProgressBar progress_bar(
-        /* message = */ format("vdb_visualizer: sampling grid ^1s", spec.vdb_grid_name),
-        /* max_progress = */ spec.texture_size.x() * spec.texture_size.y() * spec.texture_size.z());
+    m_allocated_bytes -= entry_it->size_bytes;
+    m_entry_map.erase(entry_it->key);
+    m_entries.erase(entry_it);
+}
 
-    return volume_sampling::sampleGrid(
-        grid, spec.texture_size,
-        out_header, out_data,
-        volume_sampling::FilterMode::AUTO,
-        [&progress_bar](uint32_t progress_samples) {
-            progress_bar.addProgress(progress_samples);
-            return !progress_bar.isCancelled();
-        });
+void MultiResCache::evict(size_t mem_limit_bytes)
+{
+    while (m_allocated_bytes > mem_limit_bytes && !m_entries.empty())
+        erase(std::prev(m_entries.end()));
 }
 
-void VolumeCache::getVolume(const VDBVolumeSpec& spec, VolumeTexture& output)
+DiskCache::DiskCache() : m_limit_bytes(DEFAULT_LIMIT_BYTES), m_used_bytes(0)
 {
-    if (m_voxel_type == VoxelType::HALF)
-        getVolume<half>(spec, output);
-    else if (m_voxel_type == VoxelType::FLOAT)
-        getVolume<float>(spec, output);
 }
 
-template <typename RealType>
-void VolumeCache::getVolume(const VDBVolumeSpec& spec, VolumeTexture& output)
+bool DiskCache::setDirectory(const std::string& directory)
 {
-    typedef volume_sampling::SampleBufferHeader<RealType> Header;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_directory.clear();
+    m_used_bytes = 0;
+    if (directory.empty())
+        return true;
+
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(directory, ec);
+    if (ec || !boost::filesystem::is_directory(directory, ec))
+        return false;
+    m_directory = directory;
+    evict();
+    return true;
+}
 
-    // Check if in cache.
-    auto it = m_buffer_map.find(spec);
-    if (it != m_buffer_map.end()) {
-        // Load from cache.
-        const auto& range = it->second;
-        const Header& header = *(Header*)(m_buffer.data() + range.begin);
-        if (range.end - range.begin == sizeof(header)) {
-            // Empty volume; pass a single zero to the volume texture.
-            const RealType zero_value = 0;
-            output.acquireBuffer<RealType>({1, 1, 1}, header, &zero_value);
-        } else {
-            // Pass the buffer to the volume texture.
-            const RealType* buffer = (RealType*)(&header + 1);
-            output.acquireBuffer(spec.texture_size, header, buffer);
-        }
-        return;
-    }
+std::string DiskCache::getDirectory() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_directory.string();
+}
 
-    // Not in cache; try to load the grid.
-    const auto grid = loadGrid(spec);
-    if (!grid) {
-        output.clear();
-        return;
-    }
+bool DiskCache::isEnabled() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return !m_directory.empty();
+}
 
-    // Allocate space, return if not succesful.
-    void* buffer_ptr = allocate<RealType>(spec);
-    if (!buffer_ptr) {
-        output.clear();
-        return;
-    }
+void DiskCache::setLimitBytes(size_t limit_bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_limit_bytes = limit_bytes;
+    if (!m_directory.empty() && m_used_bytes > m_limit_bytes)
+        evict();
+}
 
-    // Sample grid, return if not succesful (i.e. user cancelled the sampling procedure).
-    Header& header = *(Header*)(buffer_ptr);
-    RealType* buffer = (RealType*)(&header + 1);
-    const auto status = sampleGrid<RealType>(spec, *grid, header, buffer);
-
-    if (status == volume_sampling::Result::EMPTY_VOLUME) {
-        const auto buffer_range_it = m_buffer_map.find(spec);
-        // Only keep the header from the allocation.
-        auto& range = buffer_range_it->second;
-        range.end = range.begin + sizeof(header);
-        // Roll back the buffer head.
-        m_buffer_head = range.end;
-        // Upload a 1x1x1 zero texture.
-        const RealType zero_value = 0;
-        output.acquireBuffer<RealType>({1, 1, 1}, header, &zero_value);
+size_t DiskCache::getLimitBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_limit_bytes;
+}
+
+size_t DiskCache::getUsedBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_used_bytes;
+}
+
+// The file names are the 64 bit FNV-1a hashes of the keys, which are stable
+// across sessions and platforms. Returns an empty path if the cache is off.
+boost::filesystem::path DiskCache::getPath(const std::string& key) const
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (const char c : key) {
+        hash ^= uint8_t(c);
+        hash *= 1099511628211ull;
+    }
+    std::stringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << hash << EXTENSION;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_directory.empty())
+        return boost::filesystem::path();
+    return m_directory / ss.str();
+}
+
+bool DiskCache::read(const std::string& key, Entry& out_entry)
+{
+    namespace bip = boost::interprocess;
+
+    const auto path = getPath(key);
+    if (path.empty())
+        return false;
+
+    // A missing file throws as well.
+    try {
+        bip::file_mapping file(path.string().c_str(), bip::read_only);
+        bip::mapped_region region(file, bip::read_only);
+        const auto* data = static_cast<const uint8_t*>(region.get_address());
+        if (region.get_size() < DATA_OFFSET)
+            return false;
+        FileHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION ||
+            header.key_size != key.size() || sizeof(header) + key.size() > DATA_OFFSET ||
+            DATA_OFFSET + header.item_size != region.get_size() ||
+            key.compare(0, key.size(), (const char*)(data + sizeof(header)), key.size()) != 0)
+            return false;
+
+        out_entry.m_region.swap(region);
+        out_entry.m_extents = openvdb::Coord(header.extents[0], header.extents[1], header.extents[2]);
+        out_entry.m_item_size = size_t(header.item_size);
+    } catch (const bip::interprocess_exception&) {
+        return false;
+    }
+
+    // Mark the file as recently used.
+    boost::system::error_code ec;
+    boost::filesystem::last_write_time(path, std::time(nullptr), ec);
+    return true;
+}
+
+void DiskCache::write(const std::string& key, const openvdb::Coord& extents, const uint8_t* item, size_t item_size_bytes)
+{
+    const auto path = getPath(key);
+    if (path.empty() || sizeof(FileHeader) + key.size() > DATA_OFFSET)
         return;
 
-    } else if (status != volume_sampling::Result::SUCCESS) {
-        // Sampling wasn't successful; clean up.
-        output.clear();
-        // Delete this allocation.
-        const auto buffer_range_it = m_buffer_map.find(spec);
-        if (buffer_range_it == m_buffer_map.end())
-            // If caching is disabled, the allocation hasn't been recorded, so just return.
+    std::vector<char> metadata(DATA_OFFSET, 0);
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.key_size = uint32_t(key.size());
+    for (int i = 0; i < 3; ++i)
+        header.extents[i] = extents[i];
+    header.item_size = item_size_bytes;
+    std::memcpy(metadata.data(), &header, sizeof(header));
+    std::memcpy(metadata.data() + sizeof(header), key.data(), key.size());
+
+    // Write under a temporary name, and rename the file once it's complete.
+    boost::system::error_code ec;
+    const auto temp_path = path.parent_path() / boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%.tmp", ec);
+    if (ec)
+        return;
+    {
+        std::ofstream stream(temp_path.string().c_str(), std::ios::binary);
+        stream.write(metadata.data(), std::streamsize(metadata.size()));
+        stream.write((const char*)item, std::streamsize(item_size_bytes));
+        if (!stream) {
+            stream.close();
+            boost::filesystem::remove(temp_path, ec);
             return;
-        m_allocation_map.erase(buffer_range_it->second.begin);
-        m_buffer_map.erase(buffer_range_it);
+        }
+    }
+    boost::filesystem::rename(temp_path, path, ec);
+    if (ec) {
+        boost::filesystem::remove(temp_path, ec);
         return;
     }
 
-    // Update texture.
-    output.acquireBuffer<RealType>(spec.texture_size, header, buffer);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_used_bytes += DATA_OFFSET + item_size_bytes;
+    if (m_used_bytes > m_limit_bytes)
+        evict();
+}
+
+// Scans the directory, which may be shared with other sessions, and removes the
+// least recently used files until the rest fit into the limit. The lock has to
+// be held.
+void DiskCache::evict()
+{
+    namespace bfs = boost::filesystem;
+
+    struct File {
+        std::time_t last_use;
+        size_t size;
+        bfs::path path;
+    };
+    std::vector<File> files;
+    size_t used_bytes = 0;
+    boost::system::error_code ec;
+    for (bfs::directory_iterator it(m_directory, ec), end; !ec && it != end; it.increment(ec)) {
+        const auto& path = it->path();
+        boost::system::error_code file_ec;
+        if (path.extension() != EXTENSION || !bfs::is_regular_file(path, file_ec))
+            continue;
+        const auto size = bfs::file_size(path, file_ec);
+        if (file_ec)
+            continue;
+        const auto last_use = bfs::last_write_time(path, file_ec);
+        if (file_ec)
+            continue;
+        files.push_back({ last_use, size_t(size), path });
+        used_bytes += size_t(size);
+    }
 
-    // Clear buffer if caching is disabled.
-    if (m_mem_limit_bytes == 0)
-        m_buffer.clear();
+    std::sort(files.begin(), files.end(), [](const File& a, const File& b) { return a.last_use < b.last_use; });
+    for (const auto& file : files) {
+        if (used_bytes <= m_limit_bytes)
+            break;
+        if (bfs::remove(file.path, ec))
+            used_bytes -= file.size;
+    }
+    m_used_bytes = used_bytes;
 }
 
-void VolumeCache::setMemoryLimitBytes(size_t mem_limit_bytes)
+VolumeCache& VolumeCache::instance()
 {
-    m_mem_limit_bytes = mem_limit_bytes;
+    static VolumeCache volume_cache;
+    return volume_cache;
+}
+
+void VolumeCache::setVoxelType(VoxelType voxel_type)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_voxel_type != voxel_type)
+        clear();
+
+    m_voxel_type = voxel_type;
+}
+
+template <>
+VolumeCache::VoxelType VolumeCache::getVoxelTypeOf<half>() { return VoxelType::HALF; }
+template <>
+VolumeCache::VoxelType VolumeCache::getVoxelTypeOf<float>() { return VoxelType::FLOAT; }
+template <>
+VolumeCache::VoxelType VolumeCache::getVoxelTypeOf<uint8_t>() { return VoxelType::UNORM8; }
+template <>
+VolumeCache::VoxelType VolumeCache::getVoxelTypeOf<uint16_t>() { return VoxelType::UNORM16; }
+
+VolumeCache::VolumeCache()
+    : m_prefetched_bytes(0)
+    , m_inflation(0.0)
+    , m_allocated_bytes(0)
+    , m_buffer_head(0)
+{
+    // Don't allocate anything in the ctor to avoid unnecessary consumption of memory (e.g. batch mode).
+    m_voxel_type = VoxelType::HALF;
+    m_progressive = MGlobal::mayaState() == MGlobal::kInteractive;
+    m_prefetch_frame_count = MGlobal::mayaState() == MGlobal::kInteractive ? DEFAULT_PREFETCH_FRAME_COUNT : 0;
+    m_compression_age_seconds = MGlobal::mayaState() == MGlobal::kInteractive ? DEFAULT_COMPRESSION_AGE_SECONDS : 0;
+    m_compressing = false;
+    m_compression_cancelled = false;
+    m_pinned = false;
+    m_mem_limit_bytes = DEFAULT_LIMIT_BYTES;
+    m_out_of_core_budget_bytes = 0;
+    size_t adaptive_floor_bytes = DEFAULT_ADAPTIVE_FLOOR_BYTES;
+    size_t adaptive_ceiling_bytes = DEFAULT_ADAPTIVE_CEILING_BYTES;
+    const char* adaptive_limit_env = std::getenv(ADAPTIVE_LIMIT_ENV);
+    m_adaptive_limit = adaptive_limit_env != nullptr &&
+        parseAdaptiveLimitRange(adaptive_limit_env, adaptive_floor_bytes, adaptive_ceiling_bytes);
+    m_adaptive_floor_bytes = adaptive_floor_bytes;
+    m_adaptive_ceiling_bytes = adaptive_ceiling_bytes;
+    m_eviction_policy = EvictionPolicy::COST_AWARE;
+    m_hits = 0;
+    m_misses = 0;
+    m_evictions = 0;
+    m_baked_bytes = 0;
+    m_bake_microseconds = 0;
+    m_file_read_microseconds = 0;
+    m_prefetched = 0;
+    m_prefetch_hits = 0;
+    m_compressed = 0;
+    m_compressed_input_bytes = 0;
+    m_compressed_output_bytes = 0;
+    m_compression_microseconds = 0;
+    m_decompressed = 0;
+    m_decompression_microseconds = 0;
+    m_delta_rebake = false;
+    m_delta_sampled_cells = 0;
+    m_delta_total_cells = 0;
+}
+
+VolumeCache::~VolumeCache()
+{
+    cancelRefinements();
+    cancelPrefetches();
+    cancelCompression();
+}
 
-    // Shrink buffer if requested.
-    if (m_mem_limit_bytes < m_buffer.size()) {
-        clearRange(BufferRange(m_mem_limit_bytes, m_buffer.size()));
-        m_buffer.resize(mem_limit_bytes);
-        m_buffer.shrink_to_fit();
+VolumeCache::InFlightBakes::InFlightBakes(
+    VolumeCache& cache, std::unique_lock<std::mutex>& lock, const std::vector<VDBVolumeSpec>& specs)
+    : m_cache(cache), m_lock(lock), m_specs(specs)
+{
+    assert(m_lock.owns_lock());
+    m_cache.m_in_flight_specs.insert(m_specs.begin(), m_specs.end());
+}
+
+void VolumeCache::InFlightBakes::release()
+{
+    if (m_specs.empty())
+        return;
+    if (!m_lock.owns_lock())
+        m_lock.lock();
+    for (const auto& spec : m_specs)
+        m_cache.m_in_flight_specs.erase(spec);
+    m_specs.clear();
+    m_cache.m_bake_finished.notify_all();
+}
+
+void VolumeCache::InFlightBakes::release(const VDBVolumeSpec& spec)
+{
+    const auto it = std::find(m_specs.begin(), m_specs.end(), spec);
+    if (it == m_specs.end())
+        return;
+    if (!m_lock.owns_lock())
+        m_lock.lock();
+    m_cache.m_in_flight_specs.erase(spec);
+    m_specs.erase(it);
+    m_cache.m_bake_finished.notify_all();
+}
+
+// Waits until none of the volumes is being baked by another call.
+void VolumeCache::waitForBakes(std::unique_lock<std::mutex>& lock, const std::vector<VDBVolumeSpec>& specs)
+{
+    m_bake_finished.wait(lock, [this, &specs]() {
+        return std::none_of(specs.begin(), specs.end(), [this](const VDBVolumeSpec& spec) {
+            return m_in_flight_specs.find(spec) != m_in_flight_specs.end();
+        });
+    });
+}
+
+openvdb::GridBase::Ptr VolumeCache::loadGrid(const VDBVolumeSpec& spec)
+{
+    // Open VDB file or bail. Grids are delay-loaded if they may be baked out of
+    // core, see isOutOfCore.
+    const auto read_start = std::chrono::steady_clock::now();
+    openvdb::GridBase::Ptr grid;
+    {
+        auto vdb_file = VDBFile(spec.vdb_file_name, /* delayed_load = */ m_out_of_core_budget_bytes > 0);
+        if (!vdb_file)
+            return nullptr;
+
+        grid = vdb_file.loadGrid(spec.vdb_grid_name);
     }
+    countFileRead(seconds_since(read_start));
+    return grid;
+}
 
-    // Reset head if current positions will become invalid.
-    if (m_buffer_head >= m_mem_limit_bytes)
-        m_buffer_head = 0;
+bool VolumeCache::isOutOfCore(const VDBVolumeSpec& spec, const openvdb::GridBase& grid, const openvdb::Coord& extents) const
+{
+    return m_out_of_core_budget_bytes > 0 &&
+        getFileMemBytes(grid) > m_out_of_core_budget_bytes &&
+        volume_sampling::canSampleOutOfCore(grid, extents, spec.getROI());
 }
 
-namespace {
+openvdb::Coord VolumeCache::getTextureExtents(const VDBVolumeSpec& spec, const openvdb::GridBase& grid)
+{
+    if (spec.texture_extents_mode == VDBTextureExtentsMode::CUBE)
+        return spec.texture_size;
 
+    return volume_sampling::computeSamplingExtents(
+        grid, voxel_count(spec.texture_size),
+        /* cap_to_grid_resolution = */ spec.texture_extents_mode == VDBTextureExtentsMode::FIT_ASPECT_CAPPED,
+        volume_sampling::MAX_SAMPLING_EXTENT, spec.getROI());
+}
 
-#ifndef NDEBUG
-    // This is only used in an assert, and will warn / error if not guarded
-    size_t GetLSB(size_t val)
+// Splits the volumes into batches sampled in a single pass. A batch spans the
+// union of the bounding boxes of its grids, so only the volumes whose own
+// lattices have the same extents and bounds, and which share the vector
+// reduction and the region of interest, are batched. This way a volume comes
+// out on the same lattice whichever volumes it's baked with, and can be cached
+// under its own spec. The volumes which can't be batched get batches of their
+// own.
+std::vector<VolumeCache::Batch> VolumeCache::getBatches(
+    const std::vector<VDBVolumeSpec>& specs,
+    const std::vector<const openvdb::GridBase*>& grids,
+    const std::vector<bool>& can_batch)
+{
+    std::vector<Batch> batches;
+    std::vector<openvdb::BBoxd> bounds;
+    for (size_t channel = 0; channel < specs.size(); ++channel) {
+        const auto& spec = specs[channel];
+        const auto extents = getTextureExtents(spec, *grids[channel]);
+        bounds.push_back(volume_sampling::computeSamplingBounds(*grids[channel], spec.getROI()));
+        auto batch_it = batches.end();
+        if (can_batch[channel]) {
+            batch_it = std::find_if(batches.begin(), batches.end(), [&](const Batch& batch) {
+                const auto front = batch.channels.front();
+                const auto& front_spec = specs[front];
+                return can_batch[front] && batch.extents == extents && bounds[front] == bounds[channel] &&
+                    front_spec.vector_reduction == spec.vector_reduction &&
+                    front_spec.use_roi == spec.use_roi && (!spec.use_roi || front_spec.roi == spec.roi);
+            });
+        }
+        if (batch_it != batches.end())
+            batch_it->channels.push_back(channel);
+        else
+            batches.push_back({ { channel }, extents });
+    }
+    return batches;
+}
+
+template <typename RealType>
+volume_sampling::Result VolumeCache::sampleGrid(
+    const VDBVolumeSpec& spec,
+    const openvdb::Coord& extents,
+    const openvdb::GridBase& grid,
+    volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType>& out_header,
+    RealType* out_data)
+{
+    ProgressBar progress_bar(
+        /* message = */ format("vdb_visualizer: sampling grid ^1s", spec.vdb_grid_name),
+        /* max_progress = */ uint32_t(voxel_count(extents)));
+
+    return volume_sampling::sampleGrid(
+        grid, extents,
+        out_header, out_data,
+        volume_sampling::FilterMode::AUTO,
+        [&progress_bar](uint32_t progress_samples) {
+            progress_bar.addProgress(progress_samples);
+            return !progress_bar.isCancelled();
+        },
+        [this, &spec](const openvdb::FloatGrid& grid, size_t num_levels) {
+            return m_multires_cache.get(spec, grid, num_levels);
+        },
+        getScalarReduction(spec.vector_reduction),
+        spec.getROI());
+}
+
+// prev_item holds the header and the samples of the volume to start from, see
+// getDeltaSource.
+template <typename RealType>
+volume_sampling::Result VolumeCache::sampleGridDelta(
+    const VDBVolumeSpec& spec,
+    const openvdb::Coord& extents,
+    const openvdb::GridBase& grid,
+    const volume_sampling::GridChecksums& checksums,
+    const volume_sampling::GridChecksums& prev_checksums,
+    const std::vector<uint8_t>& prev_item,
+    volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType>& out_header,
+    RealType* out_data)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    ProgressBar progress_bar(
+        /* message = */ format("vdb_visualizer: sampling changes of grid ^1s", spec.vdb_grid_name),
+        /* max_progress = */ uint32_t(voxel_count(extents)));
+
+    size_t num_sampled_cells = 0;
+    const auto status = volume_sampling::sampleGridDelta(
+        grid, checksums, prev_checksums,
+        *(const Header*)prev_item.data(), (const RealType*)(prev_item.data() + sizeof(Header)),
+        extents,
+        out_header, out_data,
+        volume_sampling::FilterMode::AUTO,
+        [&progress_bar](uint32_t progress_samples) {
+            progress_bar.addProgress(progress_samples);
+            return !progress_bar.isCancelled();
+        },
+        [this, &spec](const openvdb::FloatGrid& grid, size_t num_levels) {
+            return m_multires_cache.get(spec, grid, num_levels);
+        },
+        getScalarReduction(spec.vector_reduction),
+        spec.getROI(),
+        &num_sampled_cells);
+    if (status == volume_sampling::Result::SUCCESS) {
+        m_delta_sampled_cells.fetch_and_add<tbb::relaxed>(num_sampled_cells);
+        m_delta_total_cells.fetch_and_add<tbb::relaxed>(voxel_count(extents));
+    }
+    return status;
+}
+
+// The grid is handed over to the sampling, which releases its leaf buffers as
+// it goes.
+template <typename RealType>
+volume_sampling::Result VolumeCache::sampleGridOutOfCore(
+    const VDBVolumeSpec& spec,
+    const openvdb::Coord& extents,
+    openvdb::GridBase::Ptr& grid,
+    volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType>& out_header,
+    RealType* out_data)
+{
+    ProgressBar progress_bar(
+        /* message = */ format("vdb_visualizer: sampling grid ^1s out of core", spec.vdb_grid_name),
+        /* max_progress = */ uint32_t(voxel_count(extents)));
+
+    return volume_sampling::sampleGridOutOfCore(
+        [this, &spec, &grid]() -> openvdb::GridBase::Ptr {
+            if (!grid)
+                return loadGrid(spec);
+            openvdb::GridBase::Ptr loaded_grid;
+            loaded_grid.swap(grid);
+            return loaded_grid;
+        },
+        extents,
+        out_header, out_data,
+        m_out_of_core_budget_bytes,
+        [&progress_bar](uint32_t progress_samples) {
+            progress_bar.addProgress(progress_samples);
+            return !progress_bar.isCancelled();
+        },
+        getScalarReduction(spec.vector_reduction),
+        spec.getROI());
+}
+
+template <typename RealType>
+volume_sampling::Result VolumeCache::sampleGrids(
+    const std::vector<VDBVolumeSpec>& specs,
+    const openvdb::Coord& extents,
+    const std::vector<const openvdb::GridBase*>& grids,
+    volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType>* out_headers,
+    RealType* out_data,
+    const volume_sampling::ChannelLayout& layout)
+{
+    MString grid_names;
+    for (const auto& spec : specs)
+        grid_names += format(grid_names.length() == 0 ? "^1s" : ", ^1s", spec.vdb_grid_name);
+    ProgressBar progress_bar(
+        /* message = */ format("vdb_visualizer: sampling grids ^1s", grid_names),
+        /* max_progress = */ uint32_t(voxel_count(extents) * grids.size()));
+
+    return volume_sampling::sampleGrids(
+        grids, extents,
+        out_headers, out_data, layout,
+        volume_sampling::FilterMode::AUTO,
+        [&progress_bar](uint32_t progress_samples) {
+            progress_bar.addProgress(progress_samples);
+            return !progress_bar.isCancelled();
+        },
+        [this, &specs, &grids](const openvdb::FloatGrid& grid, size_t num_levels)
+            -> volume_sampling::FloatMultiResGrid::ConstPtr {
+            const auto channel = size_t(std::find(grids.begin(), grids.end(), &grid) - grids.begin());
+            assert(channel < specs.size());
+            return m_multires_cache.get(specs[channel], grid, num_levels);
+        },
+        getScalarReduction(specs.front().vector_reduction),
+        specs.front().getROI());
+}
+
+void VolumeCache::getVolume(const VDBVolumeSpec& spec, VolumeTexture& output)
+{
+    // Cancel the refinement of the previous volume of the texture, if any.
+    output.refinement_ticket.reset();
+    updateAdaptiveLimit(/* force = */ false);
+
+    const VoxelType voxel_type = m_voxel_type;
+    if (voxel_type == VoxelType::HALF)
+        getVolume<half>(spec, output);
+    else if (voxel_type == VoxelType::FLOAT)
+        getVolume<float>(spec, output);
+    else if (voxel_type == VoxelType::UNORM8)
+        getVolume<uint8_t>(spec, output);
+    else if (voxel_type == VoxelType::UNORM16)
+        getVolume<uint16_t>(spec, output);
+    output.spec = spec;
+    startCompression();
+}
+
+void VolumeCache::getVolumes(const std::vector<VDBVolumeSpec>& specs, const std::vector<VolumeTexture*>& outputs)
+{
+    // Cancel the refinements of the previous volumes of the textures, if any.
+    for (auto output : outputs)
+        output->refinement_ticket.reset();
+    updateAdaptiveLimit(/* force = */ false);
+
+    const VoxelType voxel_type = m_voxel_type;
+    if (voxel_type == VoxelType::HALF)
+        getVolumes<half>(specs, outputs);
+    else if (voxel_type == VoxelType::FLOAT)
+        getVolumes<float>(specs, outputs);
+    else if (voxel_type == VoxelType::UNORM8)
+        getVolumes<uint8_t>(specs, outputs);
+    else if (voxel_type == VoxelType::UNORM16)
+        getVolumes<uint16_t>(specs, outputs);
+    for (size_t i = 0; i < specs.size(); ++i)
+        outputs[i]->spec = specs[i];
+    startCompression();
+}
+
+// The lock has to be held, since the texture is uploaded from the cache buffer.
+template <typename RealType>
+bool VolumeCache::getCachedVolume(const VDBVolumeSpec& spec, VolumeTexture& output)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    // Compressed volumes are decompressed without holding the lock, see
+    // getCompressedVolume.
+    auto it = m_buffer_map.find(spec);
+    if (it == m_buffer_map.end() || it->second.uncompressed_size > 0)
+        return false;
+
+    // Load from cache.
+    auto& range = it->second;
+    range.priority = getPriority(range);
+    range.last_use = std::chrono::steady_clock::now();
+    if (m_prefetched_specs.erase(spec) > 0) {
+        m_prefetched_bytes -= range.end - range.begin;
+        m_prefetch_hits.fetch_and_increment<tbb::relaxed>();
+    }
+    const Header& header = *(Header*)getBufferData(range.begin);
+    if (range.end - range.begin == sizeof(header)) {
+        // Empty volume; pass a single zero to the volume texture.
+        const RealType zero_value = 0;
+        output.acquireBuffer<RealType>({1, 1, 1}, header, &zero_value);
+    } else {
+        // Pass the buffer to the volume texture.
+        const RealType* buffer = (RealType*)(&header + 1);
+        output.acquireBuffer(range.extents, header, buffer);
+    }
+    return true;
+}
+
+// Decompresses a compressed volume in parallel, moves it back into the cache
+// uncompressed, and uploads it to the textures. The volume keeps its bake cost.
+// A volume which can't be decompressed is dropped. The lock must not be held.
+template <typename RealType>
+bool VolumeCache::getCompressedVolume(const VDBVolumeSpec& spec, const std::vector<VolumeTexture*>& outputs)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    // Copy the compressed volume, since it may be evicted once the lock is released.
+    const auto decompress_start = std::chrono::steady_clock::now();
+    std::vector<uint8_t> compressed_item;
+    openvdb::Coord extents;
+    size_t item_size_bytes = 0;
     {
-        return val & -val;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto it = m_buffer_map.find(spec);
+        if (it == m_buffer_map.end() || it->second.uncompressed_size == 0)
+            return false;
+        const auto& range = it->second;
+        const uint8_t* item_ptr = getBufferData(range.begin);
+        compressed_item.assign(item_ptr, item_ptr + (range.end - range.begin));
+        extents = range.extents;
+        item_size_bytes = range.uncompressed_size;
     }
-#endif // NDEBUG
 
-    size_t RoundUpToAlign(size_t val, size_t alignment)
+    auto item = BufferPool::instance().acquire(item_size_bytes);
+    std::memcpy(item->data(), compressed_item.data(), sizeof(Header));
+    const bool success = volume_compression::decompress(
+        compressed_item.data() + sizeof(Header), compressed_item.size() - sizeof(Header),
+        item->data() + sizeof(Header), item_size_bytes - sizeof(Header));
+    const auto decompress_seconds = seconds_since(decompress_start);
+
     {
-        // Require power of 2 alignment.
-        assert(alignment == GetLSB(alignment));
-        return (val + alignment - 1) & ~(alignment - 1);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        double cost = decompress_seconds;
+        const auto it = m_buffer_map.find(spec);
+        if (it != m_buffer_map.end()) {
+            cost = it->second.cost;
+            if (m_prefetched_specs.find(spec) != m_prefetched_specs.end())
+                m_prefetch_hits.fetch_and_increment<tbb::relaxed>();
+            eraseVolume(it);
+        }
+        if (success)
+            storeVolumes<RealType>(&spec, 1, extents, item->data(), false, cost);
     }
-} // unnamed namespace
+    if (!success)
+        return false;
+    m_decompressed.fetch_and_increment<tbb::relaxed>();
+    m_decompression_microseconds.fetch_and_add<tbb::relaxed>(uint64_t(decompress_seconds * 1e6));
+
+    const Header& header = *(const Header*)item->data();
+    for (auto output : outputs)
+        output->acquireBuffer<RealType>(extents, header, (const RealType*)(item->data() + sizeof(Header)));
+    return true;
+}
 
+// Returns the key of the volume in the disk cache, or an empty string if the
+// modification time of the VDB file can't be read.
 template <typename RealType>
-void* VolumeCache::allocate(const VDBVolumeSpec& spec)
-{
-    const size_t item_size_bytes =
-        sizeof(volume_sampling::SampleBufferHeader<RealType>) +
-        voxel_count(spec.texture_size) * sizeof(RealType);
-
-    if (m_mem_limit_bytes == 0) {
-        // Caching is disabled. Use buffer for this request, but perform no accounting.
-        m_buffer.resize(item_size_bytes);
-        m_buffer.shrink_to_fit();
-        return m_buffer.data();
-    } else if (item_size_bytes > m_mem_limit_bytes) {
-        return nullptr;
+std::string VolumeCache::getDiskCacheKey(const VDBVolumeSpec& spec)
+{
+    boost::system::error_code ec;
+    const auto mtime = boost::filesystem::last_write_time(spec.vdb_file_name, ec);
+    if (ec)
+        return std::string();
+
+    std::stringstream ss;
+    ss << std::setprecision(17);
+    ss << "file " << spec.vdb_file_name << "\n"
+       << "tag " << spec.vdb_file_uuid << "\n"
+       << "mtime " << mtime << "\n"
+       << "grid " << spec.vdb_grid_name << "\n"
+       << "size " << spec.texture_size.x() << " " << spec.texture_size.y() << " " << spec.texture_size.z() << "\n"
+       << "extents mode " << int(spec.texture_extents_mode) << "\n"
+       << "reduction " << int(spec.vector_reduction) << "\n"
+       << "voxel type " << int(getVoxelTypeOf<RealType>()) << "\n";
+    if (spec.use_roi) {
+        const auto& min = spec.roi.min();
+        const auto& max = spec.roi.max();
+        ss << "roi " << min.x() << " " << min.y() << " " << min.z() << " "
+           << max.x() << " " << max.y() << " " << max.z() << "\n";
     }
+    return ss.str();
+}
+
+// Reads the volume from the disk cache, copies it into the cache and uploads it
+// to the textures. Reading counts as the cost of the volume. The lock must not
+// be held.
+template <typename RealType>
+bool VolumeCache::getDiskCachedVolume(const VDBVolumeSpec& spec, const std::string& key, const std::vector<VolumeTexture*>& outputs)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    const auto read_start = std::chrono::steady_clock::now();
+    DiskCache::Entry entry;
+    if (!m_disk_cache.read(key, entry))
+        return false;
+    const auto& extents = entry.getExtents();
+    const bool is_empty = entry.getItemSize() == sizeof(Header);
+    if (!is_empty && entry.getItemSize() != getItemSize<RealType>(extents))
+        return false;
 
-    // If this allocation would exceed the memory limit, reset the head index.
-    // Otherwise grow the buffer if needed.
     {
-        const auto allocation_end = m_buffer_head + item_size_bytes;
-        if (m_buffer.size() < allocation_end)
-            growBuffer(allocation_end);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        storeVolumes<RealType>(&spec, 1, extents, entry.getItem(), is_empty, seconds_since(read_start));
+    }
+    countFileRead(seconds_since(read_start));
+
+    // Upload the volume from the mapped file; empty volumes are uploaded as a
+    // 1x1x1 zero texture.
+    const Header& header = *(const Header*)entry.getItem();
+    const RealType zero_value = 0;
+    for (auto output : outputs) {
+        if (is_empty)
+            output->acquireBuffer<RealType>({1, 1, 1}, header, &zero_value);
+        else
+            output->acquireBuffer<RealType>(extents, header, (const RealType*)(entry.getItem() + sizeof(Header)));
     }
+    return true;
+}
 
-    // Allocate buffer range.
-    const size_t buffer_begin = RoundUpToAlign(m_buffer_head, alignof(RealType));
-    const size_t buffer_end = buffer_begin + item_size_bytes;
-    const auto buffer_range = BufferRange(buffer_begin, buffer_end);
-    m_buffer_head = buffer_end;
+// Produces the volume by downsampling the nearest uncompressed cached volume
+// which only differs in a larger texture size, copies it into the cache and uploads it to
+// the textures, so that lowering the slice count doesn't load the grid again.
+// The extents are computed the same way as for a bake, from the size in the
+// header of the cached volume, which is capped to its extents; CUBE volumes
+// have to fit into the extents of the cached one. Empty volumes stay empty.
+// Downsampled volumes aren't written to the disk cache, since they differ
+// slightly from a bake. The lock must not be held.
+template <typename RealType>
+bool VolumeCache::getDownsampledVolume(const VDBVolumeSpec& spec, const std::vector<VolumeTexture*>& outputs)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
 
-    // Throw away old allocations which overlap [buffer_begin, buffer_end).
-    clearRange(buffer_range);
+    // Copy the source volume, since it may be evicted once the lock is released.
+    const auto bake_start = std::chrono::steady_clock::now();
+    openvdb::Coord source_extents;
+    openvdb::Coord extents;
+    std::vector<uint8_t> source_item;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const size_t voxel_budget = voxel_count(spec.texture_size);
+        const BufferRange* source_range = nullptr;
+        for (const auto& it : m_buffer_map) {
+            const auto& range = it.second;
+            if (it.first.vdb_file_uuid != spec.vdb_file_uuid || voxel_count(it.first.texture_size) <= voxel_budget ||
+                range.uncompressed_size > 0)
+                continue;
+            VDBVolumeSpec same_size_spec = it.first;
+            same_size_spec.texture_size = spec.texture_size;
+            if (!(same_size_spec == spec))
+                continue;
+            if (source_range && voxel_count(range.extents) >= voxel_count(source_range->extents))
+                continue;
+
+            const Header& header = *(const Header*)getBufferData(range.begin);
+            const auto candidate_extents = spec.texture_extents_mode == VDBTextureExtentsMode::CUBE ? spec.texture_size :
+                volume_sampling::computeSamplingExtents(
+                    openvdb::Vec3d(double(header.size[0]), double(header.size[1]), double(header.size[2])),
+                    &range.extents, voxel_budget, volume_sampling::MAX_SAMPLING_EXTENT);
+            if (range.end - range.begin == getItemSize<RealType>(range.extents) &&
+                (candidate_extents.x() > range.extents.x() || candidate_extents.y() > range.extents.y() ||
+                 candidate_extents.z() > range.extents.z()))
+                continue;
+            source_range = &range;
+            extents = candidate_extents;
+        }
+        if (!source_range)
+            return false;
+
+        source_extents = source_range->extents;
+        const uint8_t* item_ptr = getBufferData(source_range->begin);
+        source_item.assign(item_ptr, item_ptr + (source_range->end - source_range->begin));
+    }
+
+    // Empty volumes only keep their headers.
+    const bool is_empty = source_item.size() == sizeof(Header);
+    const Header& header = *(const Header*)source_item.data();
+    auto item = BufferPool::instance().acquire(is_empty ? sizeof(Header) : getItemSize<RealType>(extents));
+    *(Header*)item->data() = header;
+    RealType* buffer = (RealType*)(item->data() + sizeof(Header));
+    if (!is_empty) {
+        volume_sampling::downsampleSamples<RealType>(
+            source_extents, (const RealType*)(source_item.data() + sizeof(Header)), extents, buffer);
+    }
+    countBake(is_empty ? sizeof(Header) : item->size(), seconds_since(bake_start));
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        storeVolumes<RealType>(&spec, 1, extents, item->data(), is_empty, seconds_since(bake_start));
+    }
+
+    // Update textures; empty volumes are uploaded as a 1x1x1 zero texture.
+    const RealType zero_value = 0;
+    for (auto output : outputs) {
+        if (is_empty)
+            output->acquireBuffer<RealType>({1, 1, 1}, header, &zero_value);
+        else
+            output->acquireBuffer<RealType>(extents, header, buffer);
+    }
+    return true;
+}
+
+// Attaches the textures to the running refinement of the volume, if any, and
+// uploads its coarse volume to them, so that a volume requested again before
+// its refinement is finished isn't baked again; see bakeProgressively.
+// Refinements which have been cancelled or have failed are skipped. The lock
+// must not be held.
+template <typename RealType>
+bool VolumeCache::getRefiningVolume(const VDBVolumeSpec& spec, const std::vector<VolumeTexture*>& outputs)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    std::shared_ptr<VolumeRefinementTicket> ticket;
+    size_t index = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_refinement_mutex);
+        for (const auto& weak_refinement : m_refinements) {
+            const auto refinement = weak_refinement.lock();
+            if (!refinement || refinement->voxel_type != getVoxelTypeOf<RealType>())
+                continue;
+            const auto spec_it = std::find(refinement->specs.begin(), refinement->specs.end(), spec);
+            if (spec_it == refinement->specs.end())
+                continue;
+            ticket = refinement->ticket.lock();
+            if (!ticket || refinement->cancelled ||
+                (refinement->finished && refinement->result != volume_sampling::Result::SUCCESS)) {
+                ticket.reset();
+                continue;
+            }
+            index = size_t(spec_it - refinement->specs.begin());
+            break;
+        }
+    }
+    if (!ticket)
+        return false;
+
+    const auto& refinement = *ticket->refinement;
+    const auto* item_ptr = refinement.coarse_buffer.data() + index * refinement.coarse_item_size;
+    for (auto output : outputs) {
+        output->acquireBuffer<RealType>(
+            refinement.coarse_extents, *(const Header*)item_ptr, (const RealType*)(item_ptr + sizeof(Header)));
+        output->refinement_ticket = ticket;
+        output->refinement_index = index;
+    }
+    return true;
+}
+
+// Copies the cached volume of prev_spec and the checksums of its grid if the
+// volume of spec can be baked incrementally from it; see setDeltaRebake. They
+// are copied, since the volume may be evicted while the new one is baked. The
+// lock has to be held.
+template <typename RealType>
+bool VolumeCache::getDeltaSource(
+    const VDBVolumeSpec& prev_spec,
+    const VDBVolumeSpec& spec,
+    const openvdb::Coord& extents,
+    std::vector<uint8_t>& out_item,
+    volume_sampling::GridChecksums& out_checksums) const
+{
+    if (prev_spec.vdb_file_name == spec.vdb_file_name && prev_spec.vdb_file_uuid == spec.vdb_file_uuid)
+        return false;
+    VDBVolumeSpec same_file_spec = prev_spec;
+    same_file_spec.vdb_file_name = spec.vdb_file_name;
+    same_file_spec.vdb_file_uuid = spec.vdb_file_uuid;
+    if (!(same_file_spec == spec))
+        return false;
 
-    // Update maps.
-    m_buffer_map.insert({spec, buffer_range}).first;
-    m_allocation_map.insert(std::make_pair(buffer_begin, spec));
-    return m_buffer.data() + buffer_begin;
+    const auto range_it = m_buffer_map.find(prev_spec);
+    const auto checksums_it = m_grid_checksums.find(prev_spec);
+    if (range_it == m_buffer_map.end() || checksums_it == m_grid_checksums.end())
+        return false;
+    // Empty volumes only keep their headers.
+    const auto& range = range_it->second;
+    if (range.extents != extents || range.end - range.begin != getItemSize<RealType>(extents))
+        return false;
+
+    const uint8_t* item_ptr = getBufferData(range.begin);
+    out_item.assign(item_ptr, item_ptr + (range.end - range.begin));
+    out_checksums = checksums_it->second;
+    return true;
+}
+
+template <typename RealType>
+void VolumeCache::getVolume(const VDBVolumeSpec& spec, VolumeTexture& output)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    // Check if in cache, once no other call is baking the volume.
+    std::unique_lock<std::mutex> lock(m_mutex);
+    waitForBakes(lock, { spec });
+    countLookup(spec);
+    if (getCachedVolume<RealType>(spec, output))
+        return;
+
+    // Not in cache or compressed; wait for its refinement, decompress it,
+    // downsample it from a larger cached volume, read it from the disk cache, or
+    // bake it, without holding the lock. Loading the grid counts towards the bake
+    // cost.
+    InFlightBakes in_flight(*this, lock, { spec });
+    lock.unlock();
+    if (getRefiningVolume<RealType>(spec, { &output }) || getCompressedVolume<RealType>(spec, { &output }) ||
+        getDownsampledVolume<RealType>(spec, { &output }))
+        return;
+    const auto disk_cache_key = m_disk_cache.isEnabled() ? getDiskCacheKey<RealType>(spec) : std::string();
+    if (!disk_cache_key.empty() && getDiskCachedVolume<RealType>(spec, disk_cache_key, { &output }))
+        return;
+
+    const auto load_start = std::chrono::steady_clock::now();
+    auto grid = loadGrid(spec);
+    if (!grid) {
+        output.clear();
+        return;
+    }
+    bakeVolume<RealType>(spec, std::move(grid), seconds_since(load_start), disk_cache_key, output.spec, { &output }, lock, in_flight);
+}
+
+// Bakes the volume from its loaded grid, copies it into the cache and uploads
+// it to the textures, whose previous volume is the one of prev_spec. Loading
+// the grid counts towards the bake cost. The volume has to be marked by
+// in_flight, and the lock must not be held; it isn't held on return either.
+template <typename RealType>
+void VolumeCache::bakeVolume(
+    const VDBVolumeSpec& spec,
+    openvdb::GridBase::Ptr grid,
+    double load_seconds,
+    const std::string& disk_cache_key,
+    const VDBVolumeSpec& prev_spec,
+    const std::vector<VolumeTexture*>& outputs,
+    std::unique_lock<std::mutex>& lock,
+    InFlightBakes& in_flight)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    const auto bake_start = std::chrono::steady_clock::now();
+    const auto extents = getTextureExtents(spec, *grid);
+    const bool out_of_core = isOutOfCore(spec, *grid, extents);
+
+    // In delta rebake mode the checksums of the grid are kept along with the
+    // volume, and the volume is baked incrementally from the previous volume of
+    // the textures if possible.
+    volume_sampling::GridChecksums checksums;
+    volume_sampling::GridChecksums prev_checksums;
+    std::vector<uint8_t> prev_item;
+    const bool keep_checksums = m_delta_rebake && !out_of_core && m_mem_limit_bytes > 0 &&
+        volume_sampling::computeGridChecksums(*grid, checksums);
+    bool is_delta = false;
+    if (keep_checksums) {
+        lock.lock();
+        is_delta = getDeltaSource<RealType>(prev_spec, spec, extents, prev_item, prev_checksums);
+        lock.unlock();
+    }
+
+    // Large volumes are refined in the background in progressive mode, unless
+    // they are baked out of core or incrementally.
+    std::vector<std::pair<VolumeTexture*, size_t>> progressive_outputs;
+    for (auto output : outputs)
+        progressive_outputs.emplace_back(output, 0);
+    if (!out_of_core && !is_delta && bakeProgressively<RealType>({ spec }, { grid }, extents, progressive_outputs))
+        return;
+
+    // Sample grid into a pooled buffer, return if not succesful (i.e. user
+    // cancelled the sampling procedure).
+    auto item = BufferPool::instance().acquire(getItemSize<RealType>(extents));
+    Header& header = *(Header*)item->data();
+    RealType* buffer = (RealType*)(&header + 1);
+    const auto sample_start = std::chrono::steady_clock::now();
+    const auto status = out_of_core ? sampleGridOutOfCore<RealType>(spec, extents, grid, header, buffer) :
+        is_delta ? sampleGridDelta<RealType>(spec, extents, *grid, checksums, prev_checksums, prev_item, header, buffer) :
+        sampleGrid<RealType>(spec, extents, *grid, header, buffer);
+    if (status != volume_sampling::Result::SUCCESS && status != volume_sampling::Result::EMPTY_VOLUME) {
+        for (auto output : outputs)
+            output->clear();
+        return;
+    }
+
+    // Copy the volume into the cache, and let the calls waiting for it go on.
+    const bool is_empty = status == volume_sampling::Result::EMPTY_VOLUME;
+    countBake(is_empty ? sizeof(Header) : item->size(), seconds_since(sample_start));
+    lock.lock();
+    storeVolumes<RealType>(&spec, 1, extents, item->data(), is_empty, load_seconds + seconds_since(bake_start));
+    if (keep_checksums && !is_empty && m_buffer_map.find(spec) != m_buffer_map.end())
+        m_grid_checksums[spec] = std::move(checksums);
+    in_flight.release(spec);
+    lock.unlock();
+
+    // Update textures; empty volumes are uploaded as a 1x1x1 zero texture.
+    const RealType zero_value = 0;
+    for (auto output : outputs) {
+        if (is_empty)
+            output->acquireBuffer<RealType>({1, 1, 1}, header, &zero_value);
+        else
+            output->acquireBuffer<RealType>(extents, header, buffer);
+    }
+
+    if (!disk_cache_key.empty())
+        m_disk_cache.write(disk_cache_key, extents, item->data(), is_empty ? sizeof(Header) : item->size());
+}
+
+template <typename RealType>
+void VolumeCache::getVolumes(const std::vector<VDBVolumeSpec>& specs, const std::vector<VolumeTexture*>& outputs)
+{
+    assert(specs.size() == outputs.size());
+
+    // Serve the volumes in the cache, once no other call is baking any of them,
+    // and mark the rest as being baked. Volumes requested more than once are
+    // only sampled once.
+    std::unique_lock<std::mutex> lock(m_mutex);
+    waitForBakes(lock, specs);
+    std::vector<VDBVolumeSpec> sample_specs;
+    std::vector<size_t> pending_outputs;
+    for (size_t i = 0; i < specs.size(); ++i) {
+        countLookup(specs[i]);
+        if (getCachedVolume<RealType>(specs[i], *outputs[i]))
+            continue;
+        if (std::find(sample_specs.begin(), sample_specs.end(), specs[i]) == sample_specs.end())
+            sample_specs.push_back(specs[i]);
+        pending_outputs.push_back(i);
+    }
+    if (sample_specs.empty())
+        return;
+    InFlightBakes in_flight(*this, lock, sample_specs);
+    lock.unlock();
+
+    // Wait for the refinements of the rest, decompress them, downsample them from
+    // larger cached volumes, read them from the disk cache, or load their grids.
+    // The volumes which have been produced from the cache or read from disk and
+    // the ones whose grid can't be loaded are dropped.
+    const bool use_disk_cache = m_disk_cache.isEnabled();
+    std::vector<openvdb::GridBase::Ptr> sample_grids;
+    std::vector<double> load_seconds;
+    std::vector<std::string> disk_cache_keys;
+    for (size_t channel = 0; channel < sample_specs.size();) {
+        const auto& spec = sample_specs[channel];
+        std::vector<VolumeTexture*> channel_outputs;
+        for (const auto i : pending_outputs) {
+            if (specs[i] == spec)
+                channel_outputs.push_back(outputs[i]);
+        }
+
+        const bool is_cached = getRefiningVolume<RealType>(spec, channel_outputs) ||
+            getCompressedVolume<RealType>(spec, channel_outputs) || getDownsampledVolume<RealType>(spec, channel_outputs);
+        const auto disk_cache_key = use_disk_cache && !is_cached ? getDiskCacheKey<RealType>(spec) : std::string();
+        const bool is_disk_cached = !disk_cache_key.empty() && getDiskCachedVolume<RealType>(spec, disk_cache_key, channel_outputs);
+        const auto load_start = std::chrono::steady_clock::now();
+        openvdb::GridBase::Ptr grid;
+        if (!is_cached && !is_disk_cached)
+            grid = loadGrid(spec);
+        if (grid) {
+            sample_grids.push_back(grid);
+            load_seconds.push_back(seconds_since(load_start));
+            disk_cache_keys.push_back(disk_cache_key);
+            ++channel;
+            continue;
+        }
+        if (!is_cached && !is_disk_cached) {
+            for (auto output : channel_outputs)
+                output->clear();
+        }
+        pending_outputs.erase(
+            std::remove_if(pending_outputs.begin(), pending_outputs.end(), [&specs, &spec](size_t i) { return specs[i] == spec; }),
+            pending_outputs.end());
+        sample_specs.erase(sample_specs.begin() + channel);
+    }
+    if (sample_specs.empty())
+        return;
+
+    // Grids which are baked out of core or may be baked incrementally are baked
+    // on their own, see getBatches.
+    const size_t out_of_core_budget_bytes = m_out_of_core_budget_bytes;
+    std::vector<const openvdb::GridBase*> grids;
+    std::vector<bool> can_batch;
+    for (const auto& grid : sample_grids) {
+        grids.push_back(grid.get());
+        can_batch.push_back(!m_delta_rebake &&
+            (out_of_core_budget_bytes == 0 || getFileMemBytes(*grid) <= out_of_core_budget_bytes));
+    }
+    for (const auto& batch : getBatches(sample_specs, grids, can_batch)) {
+        std::vector<std::pair<VolumeTexture*, size_t>> batch_outputs;
+        for (const auto i : pending_outputs) {
+            const auto channel_it = std::find_if(batch.channels.begin(), batch.channels.end(),
+                [&](size_t channel) { return sample_specs[channel] == specs[i]; });
+            if (channel_it != batch.channels.end())
+                batch_outputs.emplace_back(outputs[i], size_t(channel_it - batch.channels.begin()));
+        }
+
+        // A single volume doesn't benefit from multi-grid sampling. The
+        // previous volume of its first texture is the one it may be baked
+        // incrementally from.
+        if (batch.channels.size() == 1) {
+            const auto channel = batch.channels.front();
+            std::vector<VolumeTexture*> channel_outputs;
+            for (const auto& output : batch_outputs)
+                channel_outputs.push_back(output.first);
+            bakeVolume<RealType>(sample_specs[channel], std::move(sample_grids[channel]), load_seconds[channel],
+                                 disk_cache_keys[channel], channel_outputs.front()->spec, channel_outputs, lock, in_flight);
+            continue;
+        }
+
+        std::vector<VDBVolumeSpec> batch_specs;
+        std::vector<openvdb::GridBase::ConstPtr> batch_grids;
+        std::vector<std::string> batch_disk_cache_keys;
+        double batch_load_seconds = 0.0;
+        for (const auto channel : batch.channels) {
+            batch_specs.push_back(sample_specs[channel]);
+            batch_grids.push_back(sample_grids[channel]);
+            batch_disk_cache_keys.push_back(disk_cache_keys[channel]);
+            batch_load_seconds += load_seconds[channel];
+        }
+        bakeVolumes<RealType>(batch_specs, batch_grids, batch_load_seconds, batch_disk_cache_keys, batch.extents,
+                              batch_outputs, lock, in_flight);
+    }
+}
+
+// Bakes the volumes from their loaded grids in a single pass, see getBatches,
+// copies them into the cache and uploads them to the textures, each of which
+// is paired with the index of its volume. Otherwise the same as bakeVolume.
+template <typename RealType>
+void VolumeCache::bakeVolumes(
+    const std::vector<VDBVolumeSpec>& specs,
+    const std::vector<openvdb::GridBase::ConstPtr>& grids,
+    double load_seconds,
+    const std::vector<std::string>& disk_cache_keys,
+    const openvdb::Coord& extents,
+    const std::vector<std::pair<VolumeTexture*, size_t>>& outputs,
+    std::unique_lock<std::mutex>& lock,
+    InFlightBakes& in_flight)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    // Large volumes are refined in the background in progressive mode.
+    const auto bake_start = std::chrono::steady_clock::now();
+    if (bakeProgressively<RealType>(specs, grids, extents, outputs))
+        return;
+
+    std::vector<const openvdb::GridBase*> grid_ptrs;
+    for (const auto& grid : grids)
+        grid_ptrs.push_back(grid.get());
+
+    // Sample the grids into the planes following the headers of the items, in a
+    // pooled buffer laid out the same way as in the cache.
+    const size_t item_size_bytes = getItemSize<RealType>(extents);
+    auto batch = BufferPool::instance().acquire(item_size_bytes * specs.size());
+    uint8_t* batch_ptr = batch->data();
+    std::vector<Header> headers(specs.size());
+    const auto sample_start = std::chrono::steady_clock::now();
+    const auto status = sampleGrids<RealType>(
+        specs, extents, grid_ptrs, headers.data(),
+        (RealType*)(batch_ptr + sizeof(Header)),
+        volume_sampling::ChannelLayout::planar(item_size_bytes / sizeof(RealType)));
+    for (size_t channel = 0; channel < specs.size(); ++channel)
+        *(Header*)(batch_ptr + channel * item_size_bytes) = headers[channel];
+
+    if (status != volume_sampling::Result::SUCCESS && status != volume_sampling::Result::EMPTY_VOLUME) {
+        // Sampling wasn't successful.
+        for (const auto& output : outputs)
+            output.first->clear();
+        return;
+    }
+
+    // Copy the volumes into the cache, and let the calls waiting for them go on.
+    const bool is_empty = status == volume_sampling::Result::EMPTY_VOLUME;
+    countBake((is_empty ? sizeof(Header) : item_size_bytes) * specs.size(), seconds_since(sample_start));
+    lock.lock();
+    storeVolumes<RealType>(specs.data(), specs.size(), extents, batch_ptr, is_empty,
+                           load_seconds + seconds_since(bake_start));
+    for (const auto& spec : specs)
+        in_flight.release(spec);
+    lock.unlock();
+
+    if (is_empty) {
+        // Upload 1x1x1 zero textures.
+        const RealType zero_value = 0;
+        for (const auto& output : outputs)
+            output.first->acquireBuffer<RealType>({1, 1, 1}, headers[output.second], &zero_value);
+    } else {
+        // Update textures; each one consumes its own plane.
+        for (const auto& output : outputs) {
+            const auto* item_ptr = batch_ptr + output.second * item_size_bytes;
+            const Header& header = *(const Header*)item_ptr;
+            output.first->acquireBuffer(extents, header, (const RealType*)(item_ptr + sizeof(Header)));
+        }
+    }
+
+    for (size_t channel = 0; channel < specs.size(); ++channel) {
+        if (!disk_cache_keys[channel].empty()) {
+            m_disk_cache.write(disk_cache_keys[channel], extents, batch_ptr + channel * item_size_bytes,
+                               is_empty ? sizeof(Header) : item_size_bytes);
+        }
+    }
+}
+
+void VolumeCache::setMemoryLimitBytes(size_t mem_limit_bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_mem_limit_bytes = mem_limit_bytes;
+
+    // Shrink buffer if requested; the blocks are freed right away.
+    if (m_allocated_bytes > m_mem_limit_bytes)
+        waitForUnpinned();
+    while (!m_blocks.empty() && m_allocated_bytes > m_mem_limit_bytes)
+        releaseBlock(findBlockToRelease());
+
+    // Reset head if current positions will become invalid.
+    if (m_blocks.empty() || m_buffer_head >= m_blocks.back().begin + m_blocks.back().size)
+        m_buffer_head = 0;
+}
+
+size_t VolumeCache::getAllocatedBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_allocated_bytes;
+}
+
+void VolumeCache::setAdaptiveLimit(bool adaptive_limit)
+{
+    m_adaptive_limit = adaptive_limit;
+    updateAdaptiveLimit(/* force = */ true);
+}
+
+void VolumeCache::setAdaptiveLimitRangeBytes(size_t floor_bytes, size_t ceiling_bytes)
+{
+    m_adaptive_floor_bytes = floor_bytes;
+    m_adaptive_ceiling_bytes = std::max(floor_bytes, ceiling_bytes);
+    updateAdaptiveLimit(/* force = */ true);
+}
+
+// Adapts the memory limit to the available memory in adaptive mode, see
+// setAdaptiveLimit. Unless forced, the memory is only checked if it hasn't
+// been for ADAPTIVE_UPDATE_SECONDS, and the limit is only changed if it's
+// outside of the hysteresis band around the new limit, or outside of the
+// floor and the ceiling. The lock must not be held.
+void VolumeCache::updateAdaptiveLimit(bool force)
+{
+    if (!m_adaptive_limit)
+        return;
+
+    std::lock_guard<std::mutex> adaptive_lock(m_adaptive_mutex);
+    const auto now = std::chrono::steady_clock::now();
+    if (!force && std::chrono::duration<double>(now - m_adaptive_update_time).count() < ADAPTIVE_UPDATE_SECONDS)
+        return;
+    m_adaptive_update_time = now;
+
+    size_t available_bytes = 0;
+    if (!readAvailableMemoryBytes(available_bytes))
+        return;
+    const size_t floor_bytes = m_adaptive_floor_bytes;
+    const size_t ceiling_bytes = m_adaptive_ceiling_bytes;
+    const size_t limit_bytes = m_mem_limit_bytes;
+    const size_t target_bytes = std::min(std::max(
+        getAllocatedBytes() + size_t(double(available_bytes) * ADAPTIVE_AVAILABLE_FRACTION), floor_bytes), ceiling_bytes);
+    const bool in_range = floor_bytes <= limit_bytes && limit_bytes <= ceiling_bytes;
+    const double band_bytes = ADAPTIVE_HYSTERESIS_FRACTION * double(limit_bytes);
+    if (!force && in_range && std::abs(double(target_bytes) - double(limit_bytes)) <= band_bytes)
+        return;
+    if (target_bytes != limit_bytes)
+        setMemoryLimitBytes(target_bytes);
+}
+
+namespace {
+
+
+#ifndef NDEBUG
+    // This is only used in an assert, and will warn / error if not guarded
+    size_t GetLSB(size_t val)
+    {
+        return val & -val;
+    }
+#endif // NDEBUG
+
+    size_t RoundUpToAlign(size_t val, size_t alignment)
+    {
+        // Require power of 2 alignment.
+        assert(alignment == GetLSB(alignment));
+        return (val + alignment - 1) & ~(alignment - 1);
+    }
+} // unnamed namespace
+
+template <typename RealType>
+size_t VolumeCache::getItemSize(const openvdb::Coord& extents)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+    // Items are padded so that all the items of a batch are aligned.
+    const size_t alignment = std::max(alignof(Header), alignof(RealType));
+    return RoundUpToAlign(sizeof(Header) + voxel_count(extents) * sizeof(RealType), alignment);
+}
+
+template <typename RealType>
+void* VolumeCache::allocate(const VDBVolumeSpec* specs, size_t num_specs, const openvdb::Coord& extents)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+    const size_t alignment = std::max(alignof(Header), alignof(RealType));
+    const size_t item_size_bytes = getItemSize<RealType>(extents);
+    const size_t allocation_size_bytes = item_size_bytes * num_specs;
+
+    // Caching is disabled, or the volumes would not fit anyway.
+    if (allocation_size_bytes > m_mem_limit_bytes)
+        return nullptr;
+    waitForUnpinned();
+
+    // The items of a batch are allocated in one piece, so that the head can't
+    // wrap around and evict the first items of the batch.
+    size_t buffer_begin = 0;
+    if (m_eviction_policy == EvictionPolicy::COST_AWARE) {
+        if (!findAllocationRange(allocation_size_bytes, alignment, buffer_begin))
+            return nullptr;
+    } else {
+        // Allocate at the head, or in the next block it fits into. Add a block
+        // if it doesn't fit into any of the remaining blocks, or wrap around if
+        // this would exceed the memory limit.
+        buffer_begin = findBlockRange(RoundUpToAlign(m_buffer_head, alignment), allocation_size_bytes);
+        if (buffer_begin == NO_OFFSET && addBlock(allocation_size_bytes))
+            buffer_begin = m_blocks.back().begin;
+        if (buffer_begin == NO_OFFSET)
+            buffer_begin = findBlockRange(0, allocation_size_bytes);
+        if (buffer_begin == NO_OFFSET && !replaceLastBlocks(allocation_size_bytes, buffer_begin))
+            return nullptr;
+    }
+
+    // Allocate buffer range.
+    const size_t buffer_end = buffer_begin + allocation_size_bytes;
+    m_buffer_head = buffer_end;
+
+    // Throw away old allocations which overlap [buffer_begin, buffer_end).
+    clearRange(BufferRange(buffer_begin, buffer_end));
+
+    // Update maps. The priorities are updated once the bake cost is known, see
+    // setBakeCost.
+    for (size_t i = 0; i < num_specs; ++i) {
+        const auto item_begin = buffer_begin + i * item_size_bytes;
+        BufferRange range(item_begin, item_begin + item_size_bytes, extents);
+        range.priority = getPriority(range);
+        m_buffer_map.insert({specs[i], range});
+        m_allocation_map.insert(std::make_pair(item_begin, specs[i]));
+    }
+    return getBufferData(buffer_begin);
+}
+
+// Copies baked volumes into the cache. items holds the header and the samples of
+// each volume, getItemSize apart, of which only the headers are kept for empty
+// volumes. The volumes are stored next to each other if possible, and one by one
+// otherwise. Nothing is stored if caching is disabled, or if the voxel type has
+// been changed while they were baked. The lock has to be held.
+template <typename RealType>
+void VolumeCache::storeVolumes(
+    const VDBVolumeSpec* specs,
+    size_t num_specs,
+    const openvdb::Coord& extents,
+    const uint8_t* items,
+    bool is_empty,
+    double bake_seconds)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    if (m_mem_limit_bytes == 0 || getVoxelTypeOf<RealType>() != m_voxel_type)
+        return;
+
+    // The volumes share the cost of the bake.
+    const size_t item_size_bytes = getItemSize<RealType>(extents);
+    const auto store = [&](size_t first, size_t count) -> bool {
+        auto* buffer_ptr = (uint8_t*)allocate<RealType>(specs + first, count, extents);
+        if (!buffer_ptr)
+            return false;
+        for (size_t i = first; i < first + count; ++i) {
+            const auto* item_ptr = items + i * item_size_bytes;
+            auto& range = m_buffer_map.find(specs[i])->second;
+            if (is_empty) {
+                // Only keep the header from the allocation, and roll back the buffer head.
+                std::memcpy(buffer_ptr + (i - first) * item_size_bytes, item_ptr, sizeof(Header));
+                range.end = range.begin + sizeof(Header);
+                m_buffer_head = range.end;
+            } else {
+                std::memcpy(buffer_ptr + (i - first) * item_size_bytes, item_ptr, item_size_bytes);
+            }
+            setBakeCost(specs[i], bake_seconds / double(num_specs));
+        }
+        return true;
+    };
+    if (store(0, num_specs) || num_specs == 1)
+        return;
+    for (size_t i = 0; i < num_specs; ++i)
+        store(i, 1);
+}
+
+// Finds the range to allocate with the COST_AWARE eviction policy: the free space
+// after the last volume if the buffer has or can grow enough room there,
+// otherwise the range whose eviction is the cheapest, i.e. whose most valuable
+// volume has the lowest priority, and which evicts the fewest bytes among those.
+// The candidate ranges start at the beginning of a block, or at the beginning or
+// the end of a volume, and have to fit into a block.
+bool VolumeCache::findAllocationRange(size_t allocation_size_bytes, size_t alignment, size_t& out_begin)
+{
+    const auto get_range = [this](const std::pair<const size_t, VDBVolumeSpec>& allocation) -> const BufferRange& {
+        const auto range_it = m_buffer_map.find(allocation.second);
+        assert(range_it != m_buffer_map.end());
+        return range_it->second;
+    };
+
+    const size_t used_end = m_allocation_map.empty() ? 0 :
+        RoundUpToAlign(get_range(*m_allocation_map.rbegin()).end, alignment);
+    out_begin = findBlockRange(used_end, allocation_size_bytes);
+    if (out_begin == NO_OFFSET && addBlock(allocation_size_bytes))
+        out_begin = m_blocks.back().begin;
+    if (out_begin != NO_OFFSET)
+        return true;
+
+    std::vector<size_t> candidates;
+    for (const auto& block : m_blocks)
+        candidates.push_back(block.begin);
+    for (const auto& allocation : m_allocation_map) {
+        const auto& range = get_range(allocation);
+        candidates.push_back(RoundUpToAlign(range.begin, alignment));
+        candidates.push_back(RoundUpToAlign(range.end, alignment));
+    }
+
+    bool found = false;
+    double best_priority = 0.0;
+    size_t best_evicted_bytes = 0;
+    for (const auto candidate : candidates) {
+        const auto begin = findBlockRange(candidate, allocation_size_bytes);
+        if (begin != candidate)
+            continue;
+        const auto end = begin + allocation_size_bytes;
+
+        // Visit the volumes overlapping [begin, end).
+        double max_priority = std::numeric_limits<double>::lowest();
+        size_t evicted_bytes = 0;
+        auto it = m_allocation_map.upper_bound(begin);
+        if (it != m_allocation_map.begin())
+            --it;
+        for (; it != m_allocation_map.end() && it->first < end; ++it) {
+            const auto& range = get_range(*it);
+            if (range.end <= begin)
+                continue;
+            max_priority = std::max(max_priority, range.priority);
+            evicted_bytes += range.end - range.begin;
+        }
+
+        if (!found || max_priority < best_priority ||
+            (max_priority == best_priority && evicted_bytes < best_evicted_bytes)) {
+            found = true;
+            out_begin = begin;
+            best_priority = max_priority;
+            best_evicted_bytes = evicted_bytes;
+        }
+    }
+
+    // None of the blocks is large enough.
+    if (!found)
+        return replaceLastBlocks(allocation_size_bytes, out_begin);
+
+    if (best_evicted_bytes > 0)
+        m_inflation = std::max(m_inflation, best_priority);
+    return true;
+}
+
+double VolumeCache::getPriority(const BufferRange& range) const
+{
+    return m_inflation + range.cost / double(std::max(range.end - range.begin, size_t(1)));
+}
+
+void VolumeCache::setBakeCost(const VDBVolumeSpec& spec, double seconds)
+{
+    const auto range_it = m_buffer_map.find(spec);
+    if (range_it == m_buffer_map.end())
+        return;
+    range_it->second.cost = seconds;
+    range_it->second.priority = getPriority(range_it->second);
+}
+
+// Counts a hit if the volume is in the cache, and a miss otherwise. Volumes
+// being baked by other calls have to be waited for first. The lock has to be
+// held.
+void VolumeCache::countLookup(const VDBVolumeSpec& spec)
+{
+    if (m_buffer_map.find(spec) != m_buffer_map.end())
+        m_hits.fetch_and_increment<tbb::relaxed>();
+    else
+        m_misses.fetch_and_increment<tbb::relaxed>();
+}
+
+void VolumeCache::countBake(size_t bytes, double seconds)
+{
+    m_baked_bytes.fetch_and_add<tbb::relaxed>(bytes);
+    m_bake_microseconds.fetch_and_add<tbb::relaxed>(uint64_t(seconds * 1e6));
+}
+
+void VolumeCache::countFileRead(double seconds)
+{
+    m_file_read_microseconds.fetch_and_add<tbb::relaxed>(uint64_t(seconds * 1e6));
+}
+
+VolumeCache::Stats VolumeCache::getStats() const
+{
+    Stats stats;
+    stats.hits = m_hits.load<tbb::relaxed>();
+    stats.misses = m_misses.load<tbb::relaxed>();
+    stats.evictions = m_evictions.load<tbb::relaxed>();
+    stats.baked_bytes = m_baked_bytes.load<tbb::relaxed>();
+    stats.bake_seconds = double(m_bake_microseconds.load<tbb::relaxed>()) * 1e-6;
+    stats.file_read_seconds = double(m_file_read_microseconds.load<tbb::relaxed>()) * 1e-6;
+    stats.prefetched = m_prefetched.load<tbb::relaxed>();
+    stats.prefetch_hits = m_prefetch_hits.load<tbb::relaxed>();
+    stats.compressed = m_compressed.load<tbb::relaxed>();
+    stats.compressed_input_bytes = m_compressed_input_bytes.load<tbb::relaxed>();
+    stats.compressed_output_bytes = m_compressed_output_bytes.load<tbb::relaxed>();
+    stats.compression_seconds = double(m_compression_microseconds.load<tbb::relaxed>()) * 1e-6;
+    stats.decompressed = m_decompressed.load<tbb::relaxed>();
+    stats.decompression_seconds = double(m_decompression_microseconds.load<tbb::relaxed>()) * 1e-6;
+    return stats;
+}
+
+void VolumeCache::resetStats()
+{
+    m_hits.store<tbb::relaxed>(0);
+    m_misses.store<tbb::relaxed>(0);
+    m_evictions.store<tbb::relaxed>(0);
+    m_baked_bytes.store<tbb::relaxed>(0);
+    m_bake_microseconds.store<tbb::relaxed>(0);
+    m_file_read_microseconds.store<tbb::relaxed>(0);
+    m_prefetched.store<tbb::relaxed>(0);
+    m_prefetch_hits.store<tbb::relaxed>(0);
+    m_compressed.store<tbb::relaxed>(0);
+    m_compressed_input_bytes.store<tbb::relaxed>(0);
+    m_compressed_output_bytes.store<tbb::relaxed>(0);
+    m_compression_microseconds.store<tbb::relaxed>(0);
+    m_decompressed.store<tbb::relaxed>(0);
+    m_decompression_microseconds.store<tbb::relaxed>(0);
+}
+
+std::vector<VolumeCache::EntryInfo> VolumeCache::getEntries() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto now = std::chrono::steady_clock::now();
+    std::vector<EntryInfo> entries;
+    for (const auto& allocation : m_allocation_map) {
+        const auto& range = m_buffer_map.find(allocation.second)->second;
+        entries.push_back({ allocation.second, range.extents, range.end - range.begin, range.uncompressed_size,
+                            std::chrono::duration<double>(now - range.last_use).count() });
+    }
+    return entries;
+}
+
+uint8_t* VolumeCache::getBufferData(size_t offset) const
+{
+    for (const auto& block : m_blocks) {
+        if (block.begin <= offset && offset < block.begin + block.size)
+            return block.data.get() + (offset - block.begin);
+    }
+    assert(false && "offset outside of the buffer blocks");
+    return nullptr;
+}
+
+// Returns the first offset at or after begin where size_bytes fit into a block,
+// or NO_OFFSET if they don't fit into any of the blocks from there on.
+size_t VolumeCache::findBlockRange(size_t begin, size_t size_bytes) const
+{
+    for (const auto& block : m_blocks) {
+        const auto block_end = block.begin + block.size;
+        if (block_end <= begin)
+            continue;
+        const auto block_begin = std::max(begin, block.begin);
+        if (block_begin + size_bytes <= block_end)
+            return block_begin;
+    }
+    return NO_OFFSET;
+}
+
+// Appends a block of whole chunks holding at least minimum_size_bytes, or of the
+// memory left below the limit if that is enough. Nothing is copied or zeroed.
+bool VolumeCache::addBlock(size_t minimum_size_bytes)
+{
+    const size_t available_bytes = m_mem_limit_bytes > m_allocated_bytes ? m_mem_limit_bytes - m_allocated_bytes : 0;
+    const size_t size_bytes = std::min(RoundUpToAlign(minimum_size_bytes, CHUNK_SIZE_BYTES), available_bytes);
+    if (size_bytes == 0 || size_bytes < minimum_size_bytes)
+        return false;
+
+    BufferBlock block;
+    block.begin = m_blocks.empty() ? 0 :
+        RoundUpToAlign(m_blocks.back().begin + m_blocks.back().size, CHUNK_SIZE_BYTES);
+    block.size = size_bytes;
+    try {
+        block.data.reset(new uint8_t[size_bytes]);
+    } catch (const std::bad_alloc&) {
+        return false;
+    }
+    m_allocated_bytes += size_bytes;
+    m_blocks.push_back(std::move(block));
+    return true;
+}
+
+// Makes room for size_bytes when none of the blocks is large enough, and the
+// limit doesn't allow adding a block: frees the last blocks, with the volumes in
+// them, until a large enough block can be added.
+bool VolumeCache::replaceLastBlocks(size_t size_bytes, size_t& out_begin)
+{
+    while (!addBlock(size_bytes)) {
+        if (m_blocks.empty())
+            return false;
+        releaseLastBlock();
+    }
+    out_begin = m_blocks.back().begin;
+    return true;
+}
+
+// Frees the last block, and evicts the volumes in it.
+void VolumeCache::releaseLastBlock()
+{
+    releaseBlock(m_blocks.size() - 1);
+}
+
+// Frees a block, and evicts the volumes in it. The offsets of the other blocks
+// stay the same, so the buffer may have holes afterwards.
+void VolumeCache::releaseBlock(size_t index)
+{
+    const auto& block = m_blocks[index];
+    const bool has_head = block.begin <= m_buffer_head && m_buffer_head < block.begin + block.size;
+    clearRange(BufferRange(block.begin, block.begin + block.size));
+    m_allocated_bytes -= block.size;
+    m_blocks.erase(m_blocks.begin() + ptrdiff_t(index));
+    // Move the head out of the hole.
+    if (has_head)
+        m_buffer_head = index < m_blocks.size() ? m_blocks[index].begin : 0;
+}
+
+// Picks the block to free when the buffer shrinks, the way volumes are evicted
+// by the eviction policy. Blocks without volumes go first. With COST_AWARE it
+// is the block whose most valuable volume has the lowest priority, and which
+// holds the fewest bytes among those, and the inflation value is raised to
+// that priority. With FIFO it is the block after the one holding the head,
+// i.e. the one holding the oldest volumes.
+size_t VolumeCache::findBlockToRelease()
+{
+    assert(!m_blocks.empty());
+    size_t head_block = 0;
+    size_t best_block = 0;
+    double best_priority = 0.0;
+    size_t best_used_bytes = 0;
+    for (size_t i = 0; i < m_blocks.size(); ++i) {
+        const auto& block = m_blocks[i];
+        const auto block_end = block.begin + block.size;
+        if (block.begin <= m_buffer_head && m_buffer_head < block_end)
+            head_block = i;
+
+        double max_priority = std::numeric_limits<double>::lowest();
+        size_t used_bytes = 0;
+        for (auto it = m_allocation_map.lower_bound(block.begin); it != m_allocation_map.end() && it->first < block_end; ++it) {
+            const auto& range = m_buffer_map.find(it->second)->second;
+            max_priority = std::max(max_priority, range.priority);
+            used_bytes += range.end - range.begin;
+        }
+        if (used_bytes == 0)
+            return i;
+        if (i == 0 || max_priority < best_priority || (max_priority == best_priority && used_bytes < best_used_bytes)) {
+            best_block = i;
+            best_priority = max_priority;
+            best_used_bytes = used_bytes;
+        }
+    }
+
+    if (m_eviction_policy == EvictionPolicy::FIFO)
+        return (head_block + 1) % m_blocks.size();
+    m_inflation = std::max(m_inflation, best_priority);
+    return best_block;
+}
+
+void VolumeCache::releaseBlocks()
+{
+    m_blocks.clear();
+    m_blocks.shrink_to_fit();
+    m_allocated_bytes = 0;
+}
+
+// The lock has to be held.
+void VolumeCache::clear()
+{
+    waitForUnpinned();
+    m_buffer_head = 0;
+    m_inflation = 0.0;
+    releaseBlocks();
+    m_buffer_map.clear();
+    m_allocation_map.clear();
+    m_grid_checksums.clear();
+    m_prefetched_specs.clear();
+    m_prefetched_bytes = 0;
+}
+
+void VolumeCache::clearRange(const BufferRange& range_to_clear)
+{
+    // Find first range which begins strictly after the given range.begin.
+    auto erase_it = m_allocation_map.upper_bound(range_to_clear.begin);
+    // Start erasing at the previous range if it contains range_to_clear.begin.
+    if (erase_it != m_allocation_map.begin()) {
+        auto prev_it = erase_it;
+        --prev_it;
+        const auto prev_range_it = m_buffer_map.find(prev_it->second);
+        assert(prev_range_it != m_buffer_map.end());
+        const auto& prev_range = prev_range_it->second;
+        if (prev_range.begin <= range_to_clear.begin && range_to_clear.begin < prev_range.end)
+            erase_it = prev_it;
+    }
+    // The first range to keep is the first one which begins on or after range.end.
+    auto erase_end = m_allocation_map.lower_bound(range_to_clear.end);
+
+    while (erase_it != erase_end) {
+        m_evictions.fetch_and_increment<tbb::relaxed>();
+        if (m_prefetched_specs.erase(erase_it->second) > 0) {
+            const auto& range = m_buffer_map.find(erase_it->second)->second;
+            m_prefetched_bytes -= range.end - range.begin;
+        }
+        m_grid_checksums.erase(erase_it->second);
+        m_buffer_map.erase(erase_it->second);
+        erase_it = m_allocation_map.erase(erase_it);
+    }
+}
+
+// Drops a volume from the cache without counting it as an eviction. The lock
+// has to be held.
+void VolumeCache::eraseVolume(BufferMap::iterator it)
+{
+    if (m_prefetched_specs.erase(it->first) > 0)
+        m_prefetched_bytes -= it->second.end - it->second.begin;
+    m_grid_checksums.erase(it->first);
+    m_allocation_map.erase(it->second.begin);
+    m_buffer_map.erase(it);
+}
+
+template <typename RealType>
+bool VolumeCache::bakeProgressively(
+    const std::vector<VDBVolumeSpec>& specs,
+    const std::vector<openvdb::GridBase::ConstPtr>& grids,
+    const openvdb::Coord& extents,
+    const std::vector<std::pair<VolumeTexture*, size_t>>& outputs)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    if (!m_progressive || voxel_count(extents) < PROGRESSIVE_MIN_VOXELS)
+        return false;
+
+    // Bake the coarse volumes. The cells are large compared to the voxels, so
+    // sparse box filtering is cheap and good enough until the refinement is done.
+    const auto coarse_extents = openvdb::Coord(
+        std::max(extents.x() / PROGRESSIVE_COARSE_FACTOR, 1),
+        std::max(extents.y() / PROGRESSIVE_COARSE_FACTOR, 1),
+        std::max(extents.z() / PROGRESSIVE_COARSE_FACTOR, 1));
+    const size_t coarse_item_size = getItemSize<RealType>(coarse_extents);
+    std::vector<const openvdb::GridBase*> grid_ptrs;
+    for (const auto& grid : grids)
+        grid_ptrs.push_back(grid.get());
+    std::vector<Header> coarse_headers(specs.size());
+    std::vector<uint8_t> coarse_buffer(coarse_item_size * specs.size());
+    const auto coarse_start = std::chrono::steady_clock::now();
+    const auto status = volume_sampling::sampleGrids(
+        grid_ptrs, coarse_extents,
+        coarse_headers.data(), (RealType*)(coarse_buffer.data() + sizeof(Header)),
+        volume_sampling::ChannelLayout::planar(coarse_item_size / sizeof(RealType)),
+        volume_sampling::FilterMode::SPARSE_BOX,
+        volume_sampling::ProgressCallbackNoOp(),
+        volume_sampling::MultiResProviderNew(),
+        getScalarReduction(specs.front().vector_reduction),
+        specs.front().getROI());
+
+    // Empty volumes and failures are left to the regular code path.
+    if (status != volume_sampling::Result::SUCCESS)
+        return false;
+    for (size_t channel = 0; channel < specs.size(); ++channel)
+        *(Header*)(coarse_buffer.data() + channel * coarse_item_size) = coarse_headers[channel];
+    countBake(coarse_buffer.size(), seconds_since(coarse_start));
+
+    // Start the refinement, and upload the coarse volumes meanwhile.
+    auto refinement = std::make_shared<VolumeRefinement>();
+    refinement->specs = specs;
+    refinement->grids = grids;
+    refinement->extents = extents;
+    refinement->voxel_type = getVoxelTypeOf<RealType>();
+    refinement->coarse_extents = coarse_extents;
+    refinement->coarse_buffer = std::move(coarse_buffer);
+    refinement->coarse_item_size = coarse_item_size;
+    refinement->compute_checksums = m_delta_rebake;
+    if (m_disk_cache.isEnabled()) {
+        for (const auto& spec : specs)
+            refinement->disk_cache_keys.push_back(getDiskCacheKey<RealType>(spec));
+    }
+    const auto ticket = std::make_shared<VolumeRefinementTicket>(refinement);
+    refinement->ticket = ticket;
+    for (const auto& output : outputs) {
+        const auto* item_ptr = refinement->coarse_buffer.data() + output.second * coarse_item_size;
+        output.first->acquireBuffer<RealType>(coarse_extents, *(const Header*)item_ptr, (const RealType*)(item_ptr + sizeof(Header)));
+        output.first->refinement_ticket = ticket;
+        output.first->refinement_index = output.second;
+    }
+
+    std::lock_guard<std::mutex> lock(m_refinement_mutex);
+    m_refinements.erase(
+        std::remove_if(m_refinements.begin(), m_refinements.end(),
+            [](const std::weak_ptr<VolumeRefinement>& r) { return r.expired(); }),
+        m_refinements.end());
+    m_refinements.push_back(refinement);
+    m_refinement_thread.run([this, refinement]() { refine<RealType>(*refinement); });
+    return true;
+}
+
+template <typename RealType>
+void VolumeCache::refine(VolumeRefinement& refinement)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    // Skip the refinements cancelled while they were queued.
+    if (refinement.cancelled) {
+        refinement.finished = true;
+        return;
+    }
+
+    // The volumes are laid out the same way as in the cache, so that they can be
+    // moved into it with a single copy.
+    const auto num_volumes = refinement.specs.size();
+    refinement.item_size = getItemSize<RealType>(refinement.extents);
+    refinement.buffer.resize(refinement.item_size * num_volumes);
+
+    // The sampling is interrupted through the progress callback once the
+    // refinement is cancelled.
+    const auto progress_callback = [&refinement](uint32_t) -> bool { return !refinement.cancelled; };
+    const auto multires_provider = [this, &refinement](const openvdb::FloatGrid& grid, size_t num_levels)
+        -> volume_sampling::FloatMultiResGrid::ConstPtr {
+        const auto channel = size_t(std::find_if(refinement.grids.begin(), refinement.grids.end(),
+            [&grid](const openvdb::GridBase::ConstPtr& g) { return g.get() == &grid; }) - refinement.grids.begin());
+        assert(channel < refinement.specs.size());
+        return m_multires_cache.get(refinement.specs[channel], grid, num_levels);
+    };
+    const auto reduction = getScalarReduction(refinement.specs.front().vector_reduction);
+    const auto region = refinement.specs.front().getROI();
+
+    const auto bake_start = std::chrono::steady_clock::now();
+    std::vector<Header> headers(num_volumes);
+    if (num_volumes == 1) {
+        refinement.result = volume_sampling::sampleGrid(
+            *refinement.grids.front(), refinement.extents,
+            headers.front(), (RealType*)(refinement.buffer.data() + sizeof(Header)),
+            volume_sampling::FilterMode::AUTO, progress_callback, multires_provider, reduction, region);
+    } else {
+        std::vector<const openvdb::GridBase*> grid_ptrs;
+        for (const auto& grid : refinement.grids)
+            grid_ptrs.push_back(grid.get());
+        refinement.result = volume_sampling::sampleGrids(
+            grid_ptrs, refinement.extents,
+            headers.data(), (RealType*)(refinement.buffer.data() + sizeof(Header)),
+            volume_sampling::ChannelLayout::planar(refinement.item_size / sizeof(RealType)),
+            volume_sampling::FilterMode::AUTO, progress_callback, multires_provider, reduction, region);
+    }
+    for (size_t i = 0; i < num_volumes; ++i)
+        *(Header*)(refinement.buffer.data() + i * refinement.item_size) = headers[i];
+    refinement.bake_seconds = seconds_since(bake_start);
+    if (refinement.result == volume_sampling::Result::SUCCESS)
+        countBake(refinement.buffer.size(), refinement.bake_seconds);
+
+    if (refinement.compute_checksums && refinement.result == volume_sampling::Result::SUCCESS) {
+        refinement.checksums.resize(num_volumes);
+        for (size_t i = 0; i < num_volumes; ++i)
+            volume_sampling::computeGridChecksums(*refinement.grids[i], refinement.checksums[i]);
+    }
+
+    refinement.finished = true;
+    if (!refinement.cancelled)
+        MGlobal::executeCommandOnIdle("refresh");
+
+    // Write the volumes to the disk cache once they can be shown; the buffer is
+    // only read from here on.
+    if (refinement.result == volume_sampling::Result::SUCCESS) {
+        for (size_t i = 0; i < refinement.disk_cache_keys.size(); ++i) {
+            if (!refinement.disk_cache_keys[i].empty()) {
+                m_disk_cache.write(refinement.disk_cache_keys[i], refinement.extents,
+                                   refinement.buffer.data() + i * refinement.item_size, refinement.item_size);
+            }
+        }
+    }
+}
+
+bool VolumeCache::isRefinementFinished(const VolumeTexture& texture)
+{
+    return texture.refinement_ticket && texture.refinement_ticket->refinement->finished;
+}
+
+bool VolumeCache::finishRefinement(VolumeTexture& texture)
+{
+    if (!isRefinementFinished(texture))
+        return false;
+
+    // Keep the refinement alive until the texture is updated, even if this is
+    // the last texture waiting for it.
+    const auto ticket = texture.refinement_ticket;
+    texture.refinement_ticket.reset();
+    auto& refinement = *ticket->refinement;
+    const auto index = texture.refinement_index;
+    if (refinement.voxel_type == VoxelType::HALF)
+        return finishRefinement<half>(refinement, index, texture);
+    else if (refinement.voxel_type == VoxelType::FLOAT)
+        return finishRefinement<float>(refinement, index, texture);
+    else if (refinement.voxel_type == VoxelType::UNORM8)
+        return finishRefinement<uint8_t>(refinement, index, texture);
+    else if (refinement.voxel_type == VoxelType::UNORM16)
+        return finishRefinement<uint16_t>(refinement, index, texture);
+    return false;
+}
+
+template <typename RealType>
+bool VolumeCache::finishRefinement(VolumeRefinement& refinement, size_t index, VolumeTexture& texture)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    // Keep the coarse volume if the refinement didn't succeed.
+    if (refinement.result != volume_sampling::Result::SUCCESS)
+        return false;
+
+    // Move the volumes into the cache, unless some of them have been baked
+    // meanwhile, see storeVolumes.
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const bool is_cached = std::any_of(refinement.specs.begin(), refinement.specs.end(),
+            [this](const VDBVolumeSpec& spec) { return m_buffer_map.find(spec) != m_buffer_map.end(); });
+        if (!refinement.stored && !is_cached) {
+            assert(refinement.item_size == getItemSize<RealType>(refinement.extents));
+            storeVolumes<RealType>(
+                refinement.specs.data(), refinement.specs.size(), refinement.extents,
+                refinement.buffer.data(), /* is_empty = */ false, refinement.bake_seconds);
+            for (size_t i = 0; i < refinement.checksums.size(); ++i) {
+                if (m_buffer_map.find(refinement.specs[i]) != m_buffer_map.end())
+                    m_grid_checksums[refinement.specs[i]] = std::move(refinement.checksums[i]);
+            }
+        }
+        refinement.stored = true;
+    }
+
+    const auto* item_ptr = refinement.buffer.data() + index * refinement.item_size;
+    texture.acquireBuffer(refinement.extents, *(const Header*)item_ptr, (const RealType*)(item_ptr + sizeof(Header)));
+    return true;
+}
+
+void VolumeCache::cancelRefinements()
+{
+    std::lock_guard<std::mutex> lock(m_refinement_mutex);
+    for (const auto& refinement : m_refinements) {
+        if (auto refinement_ptr = refinement.lock())
+            refinement_ptr->cancelled = true;
+    }
+    m_refinement_thread.wait();
+    m_refinements.clear();
+}
+
+void VolumeCache::prefetch(
+    std::unique_ptr<VolumePrefetchTicket>& ticket,
+    const std::vector<std::vector<VDBVolumeSpec>>& passes,
+    const std::vector<std::string>& file_names)
+{
+    // Nothing is prefetched with the cache off; dropping the ticket cancels the
+    // running prefetch.
+    if (file_names.empty() || m_mem_limit_bytes == 0) {
+        ticket.reset();
+        return;
+    }
+
+    // The volumes are the same for every file.
+    std::vector<std::vector<VDBVolumeSpec>> file_passes = passes;
+    for (auto& pass : file_passes) {
+        for (auto& spec : pass) {
+            spec.vdb_file_name.clear();
+            spec.vdb_file_uuid.clear();
+        }
+    }
+    const VoxelType voxel_type = m_voxel_type;
+
+    // Hand the files to the running prefetch if it bakes the same volumes,
+    // except the one it's baking.
+    if (ticket) {
+        auto& running_prefetch = *ticket->prefetch;
+        std::lock_guard<std::mutex> lock(running_prefetch.mutex);
+        if (running_prefetch.running && running_prefetch.voxel_type == voxel_type && running_prefetch.passes == file_passes) {
+            running_prefetch.file_names.clear();
+            for (const auto& file_name : file_names) {
+                if (file_name != running_prefetch.file_name)
+                    running_prefetch.file_names.push_back(file_name);
+            }
+            return;
+        }
+    }
+
+    ticket.reset();
+    auto prefetch = std::make_shared<VolumePrefetch>();
+    prefetch->passes = std::move(file_passes);
+    prefetch->voxel_type = voxel_type;
+    prefetch->file_names.assign(file_names.begin(), file_names.end());
+    prefetch->running = true;
+    ticket.reset(new VolumePrefetchTicket(prefetch));
+
+    std::lock_guard<std::mutex> lock(m_refinement_mutex);
+    m_prefetches.erase(
+        std::remove_if(m_prefetches.begin(), m_prefetches.end(),
+            [](const std::weak_ptr<VolumePrefetch>& p) { return p.expired(); }),
+        m_prefetches.end());
+    m_prefetches.push_back(prefetch);
+    m_prefetch_thread.run([this, prefetch]() { prefetchFiles(*prefetch); });
+}
+
+void VolumeCache::prefetchFiles(VolumePrefetch& prefetch)
+{
+    if (prefetch.voxel_type == VoxelType::HALF)
+        prefetchFiles<half>(prefetch);
+    else if (prefetch.voxel_type == VoxelType::FLOAT)
+        prefetchFiles<float>(prefetch);
+    else if (prefetch.voxel_type == VoxelType::UNORM8)
+        prefetchFiles<uint8_t>(prefetch);
+    else if (prefetch.voxel_type == VoxelType::UNORM16)
+        prefetchFiles<uint16_t>(prefetch);
+}
+
+template <typename RealType>
+void VolumeCache::prefetchFiles(VolumePrefetch& prefetch)
+{
+    bool keep_going = true;
+    for (;;) {
+        std::string file_name;
+        {
+            std::lock_guard<std::mutex> lock(prefetch.mutex);
+            if (!keep_going || prefetch.cancelled || prefetch.file_names.empty()) {
+                prefetch.file_name.clear();
+                prefetch.running = false;
+                return;
+            }
+            file_name = prefetch.file_names.front();
+            prefetch.file_names.pop_front();
+            prefetch.file_name = file_name;
+        }
+
+        // The volumes are cached under the unique tag of the file, which is read
+        // from its header. Missing files are skipped.
+        std::string file_uuid;
+        try {
+            auto vdb_file = VDBFile(file_name);
+            if (!vdb_file)
+                continue;
+            file_uuid = vdb_file.getUniqueTag();
+        } catch (const openvdb::Exception&) {
+            continue;
+        }
+
+        for (const auto& pass : prefetch.passes) {
+            auto specs = pass;
+            for (auto& spec : specs) {
+                spec.vdb_file_name = file_name;
+                spec.vdb_file_uuid = file_uuid;
+            }
+            keep_going = prefetchVolumes<RealType>(prefetch, specs);
+            if (!keep_going)
+                break;
+        }
+        startCompression();
+    }
+}
+
+// Bakes the volumes which aren't in the cache yet, or reads them from the disk
+// cache, and stores them in the cache. The volumes sampled on the same lattice
+// are baked in a single pass, see getBatches. Returns false if the prefetch
+// has to stop, because it has been cancelled or the prefetched volumes take up
+// their share of the cache.
+template <typename RealType>
+bool VolumeCache::prefetchVolumes(VolumePrefetch& prefetch, const std::vector<VDBVolumeSpec>& specs)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    waitForBakes(lock, specs);
+    if (prefetch.cancelled || m_prefetched_bytes >= size_t(double(m_mem_limit_bytes) * PREFETCH_LIMIT_FRACTION))
+        return false;
+    std::vector<VDBVolumeSpec> sample_specs;
+    for (const auto& spec : specs) {
+        if (m_buffer_map.find(spec) == m_buffer_map.end() &&
+            std::find(sample_specs.begin(), sample_specs.end(), spec) == sample_specs.end())
+            sample_specs.push_back(spec);
+    }
+    if (sample_specs.empty())
+        return true;
+    InFlightBakes in_flight(*this, lock, sample_specs);
+    lock.unlock();
+
+    // Read the volumes from the disk cache, or load their grids. The volumes
+    // read from disk, the ones whose grid can't be loaded and the ones which
+    // would be baked out of core are dropped.
+    const bool use_disk_cache = m_disk_cache.isEnabled();
+    const size_t out_of_core_budget_bytes = m_out_of_core_budget_bytes;
+    std::vector<openvdb::GridBase::ConstPtr> sample_grids;
+    std::vector<double> load_seconds;
+    std::vector<std::string> disk_cache_keys;
+    for (size_t channel = 0; channel < sample_specs.size();) {
+        if (prefetch.cancelled)
+            return false;
+        const auto& spec = sample_specs[channel];
+        const auto disk_cache_key = use_disk_cache ? getDiskCacheKey<RealType>(spec) : std::string();
+        const auto load_start = std::chrono::steady_clock::now();
+        openvdb::GridBase::Ptr grid;
+        if (!disk_cache_key.empty() && getDiskCachedVolume<RealType>(spec, disk_cache_key, {})) {
+            lock.lock();
+            markPrefetched({ spec });
+            lock.unlock();
+        } else {
+            grid = loadGrid(spec);
+        }
+        if (grid && (out_of_core_budget_bytes == 0 || getFileMemBytes(*grid) <= out_of_core_budget_bytes)) {
+            sample_grids.push_back(grid);
+            load_seconds.push_back(seconds_since(load_start));
+            disk_cache_keys.push_back(disk_cache_key);
+            ++channel;
+            continue;
+        }
+        sample_specs.erase(sample_specs.begin() + channel);
+    }
+    if (sample_specs.empty())
+        return !prefetch.cancelled;
+
+    std::vector<const openvdb::GridBase*> grids;
+    for (const auto& grid : sample_grids)
+        grids.push_back(grid.get());
+    for (const auto& batch : getBatches(sample_specs, grids, std::vector<bool>(grids.size(), true))) {
+        std::vector<VDBVolumeSpec> batch_specs;
+        std::vector<const openvdb::GridBase*> batch_grids;
+        std::vector<std::string> batch_disk_cache_keys;
+        double batch_load_seconds = 0.0;
+        for (const auto channel : batch.channels) {
+            batch_specs.push_back(sample_specs[channel]);
+            batch_grids.push_back(grids[channel]);
+            batch_disk_cache_keys.push_back(disk_cache_keys[channel]);
+            batch_load_seconds += load_seconds[channel];
+        }
+        if (!prefetchBatch<RealType>(prefetch, batch_specs, batch_grids, batch_load_seconds, batch_disk_cache_keys,
+                                     batch.extents, lock, in_flight))
+            return false;
+    }
+    return !prefetch.cancelled;
+}
+
+// Bakes a batch of prefetched volumes from their loaded grids, see getBatches,
+// and stores them in the cache. Loading the grids counts towards the bake
+// cost. Returns false if the prefetch has been cancelled. The volumes have to
+// be marked by in_flight, and the lock must not be held.
+template <typename RealType>
+bool VolumeCache::prefetchBatch(
+    VolumePrefetch& prefetch,
+    const std::vector<VDBVolumeSpec>& specs,
+    const std::vector<const openvdb::GridBase*>& grids,
+    double load_seconds,
+    const std::vector<std::string>& disk_cache_keys,
+    const openvdb::Coord& extents,
+    std::unique_lock<std::mutex>& lock,
+    InFlightBakes& in_flight)
+{
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    // Sample the grids into a pooled buffer laid out the same way as in the
+    // cache. The sampling is interrupted through the progress callback once the
+    // prefetch is cancelled.
+    const auto bake_start = std::chrono::steady_clock::now();
+    const auto num_volumes = specs.size();
+    const size_t item_size_bytes = getItemSize<RealType>(extents);
+    auto batch = BufferPool::instance().acquire(item_size_bytes * num_volumes);
+    uint8_t* batch_ptr = batch->data();
+    const auto progress_callback = [&prefetch](uint32_t) -> bool { return !prefetch.cancelled; };
+    const auto multires_provider = [this, &specs, &grids](const openvdb::FloatGrid& grid, size_t num_levels)
+        -> volume_sampling::FloatMultiResGrid::ConstPtr {
+        const auto channel = size_t(std::find(grids.begin(), grids.end(), &grid) - grids.begin());
+        assert(channel < specs.size());
+        return m_multires_cache.get(specs[channel], grid, num_levels);
+    };
+    const auto reduction = getScalarReduction(specs.front().vector_reduction);
+    const auto region = specs.front().getROI();
+    const auto sample_start = std::chrono::steady_clock::now();
+    std::vector<Header> headers(num_volumes);
+    volume_sampling::Result status;
+    if (num_volumes == 1) {
+        status = volume_sampling::sampleGrid(
+            *grids.front(), extents, headers.front(), (RealType*)(batch_ptr + sizeof(Header)),
+            volume_sampling::FilterMode::AUTO, progress_callback, multires_provider, reduction, region);
+    } else {
+        status = volume_sampling::sampleGrids(
+            grids, extents, headers.data(), (RealType*)(batch_ptr + sizeof(Header)),
+            volume_sampling::ChannelLayout::planar(item_size_bytes / sizeof(RealType)),
+            volume_sampling::FilterMode::AUTO, progress_callback, multires_provider, reduction, region);
+    }
+    for (size_t channel = 0; channel < num_volumes; ++channel)
+        *(Header*)(batch_ptr + channel * item_size_bytes) = headers[channel];
+    if (status != volume_sampling::Result::SUCCESS && status != volume_sampling::Result::EMPTY_VOLUME)
+        return !prefetch.cancelled;
+
+    // In delta rebake mode the checksums of the grids are kept along with the
+    // volumes, so that the frames after them can be baked incrementally.
+    const bool is_empty = status == volume_sampling::Result::EMPTY_VOLUME;
+    std::vector<volume_sampling::GridChecksums> checksums;
+    if (m_delta_rebake && !is_empty) {
+        checksums.resize(num_volumes);
+        for (size_t channel = 0; channel < num_volumes; ++channel)
+            volume_sampling::computeGridChecksums(*grids[channel], checksums[channel]);
+    }
+
+    // Copy the volumes into the cache, and let the calls waiting for them go on.
+    countBake((is_empty ? sizeof(Header) : item_size_bytes) * num_volumes, seconds_since(sample_start));
+    lock.lock();
+    storeVolumes<RealType>(specs.data(), num_volumes, extents, batch_ptr, is_empty,
+                           load_seconds + seconds_since(bake_start));
+    markPrefetched(specs);
+    for (size_t channel = 0; channel < checksums.size(); ++channel) {
+        if (m_buffer_map.find(specs[channel]) != m_buffer_map.end())
+            m_grid_checksums[specs[channel]] = std::move(checksums[channel]);
+    }
+    for (const auto& spec : specs)
+        in_flight.release(spec);
+    lock.unlock();
+
+    for (size_t channel = 0; channel < num_volumes; ++channel) {
+        if (!disk_cache_keys[channel].empty()) {
+            m_disk_cache.write(disk_cache_keys[channel], extents, batch_ptr + channel * item_size_bytes,
+                               is_empty ? sizeof(Header) : item_size_bytes);
+        }
+    }
+    return !prefetch.cancelled;
+}
+
+// Counts the volumes as prefetched if they are in the cache. The lock has to
+// be held.
+void VolumeCache::markPrefetched(const std::vector<VDBVolumeSpec>& specs)
+{
+    for (const auto& spec : specs) {
+        const auto it = m_buffer_map.find(spec);
+        if (it == m_buffer_map.end() || !m_prefetched_specs.insert(spec).second)
+            continue;
+        m_prefetched_bytes += it->second.end - it->second.begin;
+        m_prefetched.fetch_and_increment<tbb::relaxed>();
+    }
 }
 
-void VolumeCache::growBuffer(size_t minimum_buffer_size_bytes)
+void VolumeCache::cancelPrefetches()
 {
-    // Reset head if requested size exceeds the limit.
-    if (minimum_buffer_size_bytes > m_mem_limit_bytes) {
-        m_buffer_head = 0;
-        return;
+    std::lock_guard<std::mutex> lock(m_refinement_mutex);
+    for (const auto& prefetch : m_prefetches) {
+        if (auto prefetch_ptr = prefetch.lock())
+            prefetch_ptr->cancelled = true;
     }
+    m_prefetch_thread.wait();
+    m_prefetches.clear();
+}
 
-    size_t new_size_bytes = m_buffer.size() + GROW_AMOUNT_BYTES;
-    new_size_bytes = std::max(minimum_buffer_size_bytes, new_size_bytes);
-    new_size_bytes = std::min(m_mem_limit_bytes, new_size_bytes);
-
-    // Bail if buffer size is large enough already.
-    if (new_size_bytes <= m_buffer.size())
+// Starts a compression pass on the background thread, unless one is running
+// already or compression is off. The lock must not be held.
+void VolumeCache::startCompression()
+{
+    if (m_compression_age_seconds <= 0 || m_compressing.compare_and_swap(true, false))
         return;
+    m_compression_thread.run([this]() {
+        compressColdVolumes();
+        m_compressing = false;
+    });
+}
 
-    // Try to resize or reset head if failed.
-    try {
-        m_buffer.resize(new_size_bytes);
-    } catch (const std::bad_alloc&) {
-        m_buffer_head = 0;
-    }
+// Waits until the compression pass has copied the volume it pinned, before the
+// buffer is overwritten or freed. The lock has to be held; it's released while
+// waiting.
+void VolumeCache::waitForUnpinned()
+{
+    m_unpinned.wait(m_mutex, [this]() { return !m_pinned; });
 }
 
-void VolumeCache::clear()
+void VolumeCache::compressColdVolumes()
 {
-    m_buffer_head = 0;
-    m_buffer.clear();
-    m_buffer.shrink_to_fit();
-    m_buffer_map.clear();
-    m_allocation_map.clear();
+    const VoxelType voxel_type = m_voxel_type;
+    if (voxel_type == VoxelType::HALF)
+        compressColdVolumes<half>();
+    else if (voxel_type == VoxelType::FLOAT)
+        compressColdVolumes<float>();
+    else if (voxel_type == VoxelType::UNORM8)
+        compressColdVolumes<uint8_t>();
+    else if (voxel_type == VoxelType::UNORM16)
+        compressColdVolumes<uint16_t>();
 }
 
-void VolumeCache::clearRange(const BufferRange& range_to_clear)
+// Compresses the least recently used of the volumes which are cold enough, one
+// by one, until none is left or the pass is cancelled. The volume is pinned
+// while its samples are copied, so that the copy and the compression don't
+// hold the lock, and the samples are only replaced by the compressed ones if
+// the volume is still in the same place. Headers and empty volumes are left as
+// they are.
+template <typename RealType>
+void VolumeCache::compressColdVolumes()
 {
-    // Find first range which begins strictly after the given range.begin.
-    auto erase_it = m_allocation_map.upper_bound(range_to_clear.begin);
-    // Start erasing at the previous range if it contains range_to_clear.begin.
-    if (erase_it != m_allocation_map.begin()) {
-        auto prev_it = erase_it;
-        --prev_it;
-        const auto prev_range_it = m_buffer_map.find(prev_it->second);
-        assert(prev_range_it != m_buffer_map.end());
-        const auto& prev_range = prev_range_it->second;
-        if (prev_range.begin <= range_to_clear.begin && range_to_clear.begin < prev_range.end)
-            erase_it = prev_it;
-    }
-    // The first range to keep is the first one which begins on or after range.end.
-    auto erase_end = m_allocation_map.lower_bound(range_to_clear.end);
+    typedef volume_sampling::SampleBufferHeader<typename volume_sampling::SampleTraits<RealType>::HeaderType> Header;
+
+    std::vector<uint8_t> samples;
+    std::vector<uint8_t> compressed;
+    while (!m_compression_cancelled) {
+        VDBVolumeSpec spec;
+        size_t begin = 0;
+        const uint8_t* samples_ptr = nullptr;
+        size_t samples_size = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const int age_seconds = m_compression_age_seconds;
+            if (age_seconds <= 0 || getVoxelTypeOf<RealType>() != m_voxel_type)
+                return;
+            const auto max_last_use = std::chrono::steady_clock::now() - std::chrono::seconds(age_seconds);
+            auto coldest = m_buffer_map.end();
+            for (auto it = m_buffer_map.begin(); it != m_buffer_map.end(); ++it) {
+                const auto& range = it->second;
+                if (range.uncompressed_size > 0 || range.is_incompressible ||
+                    range.end - range.begin <= sizeof(Header) || range.last_use > max_last_use)
+                    continue;
+                if (coldest == m_buffer_map.end() || range.last_use < coldest->second.last_use)
+                    coldest = it;
+            }
+            if (coldest == m_buffer_map.end())
+                return;
+
+            spec = coldest->first;
+            begin = coldest->second.begin;
+            samples_ptr = getBufferData(begin) + sizeof(Header);
+            samples_size = coldest->second.end - begin - sizeof(Header);
+            m_pinned = true;
+        }
 
-    while (erase_it != erase_end) {
-        m_buffer_map.erase(erase_it->second);
-        erase_it = m_allocation_map.erase(erase_it);
+        // The blocks never move, so the pinned samples stay where they are.
+        samples.assign(samples_ptr, samples_ptr + samples_size);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pinned = false;
+        }
+        m_unpinned.notify_all();
+
+        const auto compression_start = std::chrono::steady_clock::now();
+        volume_compression::compress(samples.data(), samples.size(), compressed);
+        const auto compression_seconds = seconds_since(compression_start);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto it = m_buffer_map.find(spec);
+        if (it == m_buffer_map.end() || it->second.begin != begin || it->second.uncompressed_size > 0 ||
+            it->second.end - it->second.begin != sizeof(Header) + samples.size())
+            continue;
+        auto& range = it->second;
+        if (double(compressed.size()) > MAX_COMPRESSED_FRACTION * double(samples.size())) {
+            range.is_incompressible = true;
+            continue;
+        }
+
+        // Shrink the range to the compressed samples; the volume keeps its
+        // priority apart from the change of its size, see getPriority.
+        const size_t size_bytes = range.end - range.begin;
+        const size_t compressed_size_bytes = sizeof(Header) + compressed.size();
+        std::memcpy(getBufferData(begin) + sizeof(Header), compressed.data(), compressed.size());
+        range.priority += range.cost / double(compressed_size_bytes) - range.cost / double(size_bytes);
+        range.uncompressed_size = size_bytes;
+        range.end = range.begin + compressed_size_bytes;
+        if (m_prefetched_specs.find(spec) != m_prefetched_specs.end())
+            m_prefetched_bytes -= size_bytes - compressed_size_bytes;
+
+        m_compressed.fetch_and_increment<tbb::relaxed>();
+        m_compressed_input_bytes.fetch_and_add<tbb::relaxed>(size_bytes);
+        m_compressed_output_bytes.fetch_and_add<tbb::relaxed>(compressed_size_bytes);
+        m_compression_microseconds.fetch_and_add<tbb::relaxed>(uint64_t(compression_seconds * 1e6));
     }
 }
 
+void VolumeCache::cancelCompression()
+{
+    m_compression_cancelled = true;
+    m_compression_thread.wait();
+    m_compression_cancelled = false;
+}
+
 // === VolumeParam =========================================================
 
 class VolumeParam {
@@ -708,6 +3949,21 @@ public:
     void setParamPrefix(const char *param_prefix);
     void setShaderInstance(MHWRender::MShaderInstance *shader_instance) { m_shader_instance = shader_instance; }
     void loadVolume(const VDBVolumeSpec& volume_spec);
+    // Loads the volumes of several params at once; the volumes are sampled in a
+    // single pass, and each param consumes its own plane of the result.
+    static void loadVolumes(const std::vector<VolumeParam*>& params, const std::vector<VDBVolumeSpec>& volume_specs);
+    // See VolumeCache::setProgressive.
+    bool isRefinementFinished() const
+    {
+        return VolumeCache::isRefinementFinished(m_volume_texture) || VolumeCache::isRefinementFinished(m_context_texture);
+    }
+    void finishRefinement();
+
+    // Volumes with a region of interest are shown with a context volume around
+    // the region, which covers the whole grid with this many times fewer
+    // cells along each axis.
+    static const int CONTEXT_COARSE_FACTOR;
+    static VDBVolumeSpec getContextSpec(const VDBVolumeSpec& volume_spec);
 
 private:
     MString use_texture_param;
@@ -715,12 +3971,21 @@ private:
     MString value_range_param;
     MString volume_size_param;
     MString volume_origin_param;
+    MString use_context_texture_param;
+    MString context_texture_param;
+    MString context_value_range_param;
+    MString context_volume_size_param;
+    MString context_volume_origin_param;
     MHWRender::MShaderInstance *m_shader_instance;
     VolumeTexture m_volume_texture;
+    // Only valid if the volume has a region of interest.
+    VolumeTexture m_context_texture;
 
     void assign();
 };
 
+const int VolumeParam::CONTEXT_COARSE_FACTOR = 4;
+
 VolumeParam::VolumeParam(const char *shader_param_prefix, MHWRender::MShaderInstance *shader_instance)
 {
     setParamPrefix(shader_param_prefix);
@@ -736,14 +4001,72 @@ void VolumeParam::setParamPrefix(const char *param_prefix)
     value_range_param = format("^1s_value_range", param_prefix);
     volume_size_param = format("^1s_volume_size", param_prefix);
     volume_origin_param = format("^1s_volume_origin", param_prefix);
+    use_context_texture_param = format("use_^1s_context_texture", param_prefix);
+    context_texture_param = format("^1s_context_texture", param_prefix);
+    context_value_range_param = format("^1s_context_value_range", param_prefix);
+    context_volume_size_param = format("^1s_context_volume_size", param_prefix);
+    context_volume_origin_param = format("^1s_context_volume_origin", param_prefix);
+}
+
+// The context volume is cached under its own spec, so it is shared by all the
+// regions of interest of the grid.
+VDBVolumeSpec VolumeParam::getContextSpec(const VDBVolumeSpec& volume_spec)
+{
+    VDBVolumeSpec context_spec = volume_spec;
+    context_spec.use_roi = false;
+    context_spec.roi = openvdb::BBoxd();
+    context_spec.texture_size = openvdb::Coord(
+        std::max(volume_spec.texture_size.x() / CONTEXT_COARSE_FACTOR, 1),
+        std::max(volume_spec.texture_size.y() / CONTEXT_COARSE_FACTOR, 1),
+        std::max(volume_spec.texture_size.z() / CONTEXT_COARSE_FACTOR, 1));
+    return context_spec;
 }
 
 void VolumeParam::loadVolume(const VDBVolumeSpec& volume_spec)
 {
     VolumeCache::instance().getVolume(volume_spec, m_volume_texture);
+    if (volume_spec.use_roi)
+        VolumeCache::instance().getVolume(getContextSpec(volume_spec), m_context_texture);
+    else
+        m_context_texture.clear();
     assign();
 }
 
+void VolumeParam::loadVolumes(const std::vector<VolumeParam*>& params, const std::vector<VDBVolumeSpec>& volume_specs)
+{
+    std::vector<VolumeTexture*> textures;
+    textures.reserve(params.size());
+    for (auto param : params)
+        textures.push_back(&param->m_volume_texture);
+
+    if (!volume_specs.empty())
+        VolumeCache::instance().getVolumes(volume_specs, textures);
+
+    // The context volumes are sampled in a second pass.
+    std::vector<VolumeTexture*> context_textures;
+    std::vector<VDBVolumeSpec> context_specs;
+    for (size_t i = 0; i < params.size(); ++i) {
+        if (volume_specs[i].use_roi) {
+            context_textures.push_back(&params[i]->m_context_texture);
+            context_specs.push_back(getContextSpec(volume_specs[i]));
+        } else
+            params[i]->m_context_texture.clear();
+    }
+    if (!context_specs.empty())
+        VolumeCache::instance().getVolumes(context_specs, context_textures);
+
+    for (auto param : params)
+        param->assign();
+}
+
+void VolumeParam::finishRefinement()
+{
+    const bool volume_refined = VolumeCache::instance().finishRefinement(m_volume_texture);
+    const bool context_refined = VolumeCache::instance().finishRefinement(m_context_texture);
+    if (volume_refined || context_refined)
+        assign();
+}
+
 void VolumeParam::assign()
 {
     const bool use_texture = m_volume_texture.isValid();
@@ -755,6 +4078,16 @@ void VolumeParam::assign()
     CHECK_MSTATUS(m_shader_instance->setParameter(value_range_param, m_volume_texture.value_range));
     CHECK_MSTATUS(m_shader_instance->setParameter(volume_size_param, m_volume_texture.volume_size));
     CHECK_MSTATUS(m_shader_instance->setParameter(volume_origin_param, m_volume_texture.volume_origin));
+
+    const bool use_context_texture = m_context_texture.isValid();
+    CHECK_MSTATUS(m_shader_instance->setParameter(use_context_texture_param, use_context_texture));
+    if (!use_context_texture)
+        return;
+
+    m_context_texture.assign(m_shader_instance, context_texture_param);
+    CHECK_MSTATUS(m_shader_instance->setParameter(context_value_range_param, m_context_texture.value_range));
+    CHECK_MSTATUS(m_shader_instance->setParameter(context_volume_size_param, m_context_texture.volume_size));
+    CHECK_MSTATUS(m_shader_instance->setParameter(context_volume_origin_param, m_context_texture.volume_origin));
 }
 
 // === RampTextureBase =====================================================
@@ -1024,6 +4357,14 @@ uniform texture3D density_texture;
 uniform sampler3D density_sampler = sampler_state {
     Texture = <density_texture>;
 };
+uniform bool      use_density_context_texture = false;
+uniform vec2      density_context_value_range;
+uniform vec3      density_context_volume_size;
+uniform vec3      density_context_volume_origin;
+uniform texture3D density_context_texture;
+uniform sampler3D density_context_sampler = sampler_state {
+    Texture = <density_context_texture>;
+};
 
 #define COLOR_SOURCE_COLOR 0
 #define COLOR_SOURCE_RAMP  1
@@ -1040,6 +4381,14 @@ uniform texture3D scattering_texture;
 uniform sampler3D scattering_sampler = sampler_state {
     Texture = <scattering_texture>;
 };
+uniform bool      use_scattering_context_texture = false;
+uniform vec2      scattering_context_value_range;
+uniform vec3      scattering_context_volume_size;
+uniform vec3      scattering_context_volume_origin;
+uniform texture3D scattering_context_texture;
+uniform sampler3D scattering_context_sampler = sampler_state {
+    Texture = <scattering_context_texture>;
+};
 
 uniform vec3      transparency;
 uniform bool      use_transparency_texture = false;
@@ -1050,6 +4399,14 @@ uniform texture3D transparency_texture;
 uniform sampler3D transparency_sampler = sampler_state {
     Texture = <transparency_texture>;
 };
+uniform bool      use_transparency_context_texture = false;
+uniform vec2      transparency_context_value_range;
+uniform vec3      transparency_context_volume_size;
+uniform vec3      transparency_context_volume_origin;
+uniform texture3D transparency_context_texture;
+uniform sampler3D transparency_context_sampler = sampler_state {
+    Texture = <transparency_context_texture>;
+};
 
 #define EMISSION_MODE_NONE                  0
 #define EMISSION_MODE_CHANNEL               1
@@ -1067,6 +4424,14 @@ uniform texture3D emission_texture;
 uniform sampler3D emission_sampler = sampler_state {
     Texture = <emission_texture>;
 };
+uniform bool      use_emission_context_texture = false;
+uniform vec2      emission_context_value_range;
+uniform vec3      emission_context_volume_size;
+uniform vec3      emission_context_volume_origin;
+uniform texture3D emission_context_texture;
+uniform sampler3D emission_context_sampler = sampler_state {
+    Texture = <emission_context_texture>;
+};
 
 uniform float     temperature = 5000.0f;
 uniform bool      use_temperature_texture = false;
@@ -1077,6 +4442,14 @@ uniform texture3D temperature_texture;
 uniform sampler3D temperature_sampler = sampler_state {
     Texture = <temperature_texture>;
 };
+uniform bool      use_temperature_context_texture = false;
+uniform vec2      temperature_context_value_range;
+uniform vec3      temperature_context_volume_size;
+uniform vec3      temperature_context_volume_origin;
+uniform texture3D temperature_context_texture;
+uniform sampler3D temperature_context_sampler = sampler_state {
+    Texture = <temperature_context_texture>;
+};
 
 uniform float     blackbody_intensity = 1.0f;
 uniform texture1D blackbody_lut_texture;
@@ -1237,14 +4610,34 @@ float CalcLOD(float distance_model, vec3 size_model)
     return clamp(log(max_component) / log(2.f), 0.f, 16.f);
 }
 
+// Returns the channel value at pos_model. Outside the volume (which only covers
+// the region of interest if there is one), the context volume is sampled if it's
+// used.
+float SampleChannel(
+    sampler3D volume_sampler, vec2 value_range, vec3 volume_size, vec3 volume_origin,
+    bool use_context, sampler3D context_sampler, vec2 context_value_range, vec3 context_volume_size, vec3 context_volume_origin,
+    vec3 pos_model, float lod_scale_model)
+{
+    vec3 tex_coords = (pos_model - volume_origin) / volume_size;
+    if (use_context && (any(lessThan(tex_coords, vec3(0, 0, 0))) || any(greaterThan(tex_coords, vec3(1, 1, 1)))))
+    {
+        tex_coords = (pos_model - context_volume_origin) / context_volume_size;
+        float lod = CalcLOD(lod_scale_model, context_volume_size);
+        return lerp(context_value_range.x, context_value_range.y, SampleTexture3D(context_sampler, tex_coords, lod).r);
+    }
+
+    float lod = CalcLOD(lod_scale_model, volume_size);
+    return lerp(value_range.x, value_range.y, SampleTexture3D(volume_sampler, tex_coords, lod).r);
+}
+
 float SampleDensityTexture(vec3 pos_model, float lod_scale_model)
 {
     if (use_density_texture)
     {
-        vec3 tex_coords = (pos_model - density_volume_origin) / density_volume_size;
-        float lod = CalcLOD(lod_scale_model, density_volume_size);
-        float tex_sample = SampleTexture3D(density_sampler, tex_coords, lod).r;
-        float channel_value = lerp(density_value_range.x, density_value_range.y, tex_sample);
+        float channel_value = SampleChannel(
+            density_sampler, density_value_range, density_volume_size, density_volume_origin,
+            use_density_context_texture, density_context_sampler, density_context_value_range,
+            density_context_volume_size, density_context_volume_origin, pos_model, lod_scale_model);
         if (density_source == DENSITY_SOURCE_RAMP)
             channel_value *= SampleFloatRamp(density_ramp_sampler, unlerp(density_ramp_domain.x, density_ramp_domain.y, channel_value));
         return density * channel_value;
@@ -1258,10 +4651,10 @@ vec3 SampleScatteringTexture(vec3 pos_model, float lod_scale_model)
     float channel_value = 0;
     if (use_scattering_texture)
     {
-        vec3 tex_coords = (pos_model - scattering_volume_origin) / scattering_volume_size;
-        float lod = CalcLOD(lod_scale_model, scattering_volume_size);
-        float voxel_value = SampleTexture3D(scattering_sampler, tex_coords, lod).r;
-        channel_value = lerp(scattering_value_range.x, scattering_value_range.y, voxel_value);
+        channel_value = SampleChannel(
+            scattering_sampler, scattering_value_range, scattering_volume_size, scattering_volume_origin,
+            use_scattering_context_texture, scattering_context_sampler, scattering_context_value_range,
+            scattering_context_volume_size, scattering_context_volume_origin, pos_model, lod_scale_model);
     }
 
     vec3 res = scattering_color;
@@ -1280,10 +4673,10 @@ vec3 SampleTransparencyTexture(vec3 pos_model, float lod_scale_model)
     vec3 res = transparency;
     if (use_transparency_texture)
     {
-        vec3 tex_coords = (pos_model - transparency_volume_origin) / transparency_volume_size;
-        float lod = CalcLOD(lod_scale_model, transparency_volume_size);
-        float voxel_value = SampleTexture3D(transparency_sampler, tex_coords, lod).r;
-        res *= lerp(transparency_value_range.x, transparency_value_range.y, voxel_value);
+        res *= SampleChannel(
+            transparency_sampler, transparency_value_range, transparency_volume_size, transparency_volume_origin,
+            use_transparency_context_texture, transparency_context_sampler, transparency_context_value_range,
+            transparency_context_volume_size, transparency_context_volume_origin, pos_model, lod_scale_model);
     }
 
     return clamp(res, vec3(EPS, EPS, EPS), vec3(1, 1, 1));
@@ -1294,10 +4687,10 @@ float SampleTemperatureTexture(vec3 pos_model, float lod_scale_model)
     float res = temperature;
     if (use_temperature_texture)
     {
-        vec3 tex_coords = (pos_model - temperature_volume_origin) / temperature_volume_size;
-        float lod = CalcLOD(lod_scale_model, temperature_volume_size);
-        float voxel_value = SampleTexture3D(temperature_sampler, tex_coords, lod).r;
-        res *= lerp(temperature_value_range.x, temperature_value_range.y, voxel_value);
+        res *= SampleChannel(
+            temperature_sampler, temperature_value_range, temperature_volume_size, temperature_volume_origin,
+            use_temperature_context_texture, temperature_context_sampler, temperature_context_value_range,
+            temperature_context_volume_size, temperature_context_volume_origin, pos_model, lod_scale_model);
     }
 
     return res;
@@ -1311,10 +4704,10 @@ vec3 SampleEmissionTexture(vec3 pos_model, float lod_scale_model)
     float channel_value = 0;
     if (use_emission_texture)
     {
-        vec3 tex_coords = (pos_model - emission_volume_origin) / emission_volume_size;
-        float lod = CalcLOD(lod_scale_model, emission_volume_size);
-        float voxel_value = SampleTexture3D(emission_sampler, tex_coords, lod).r;
-        channel_value = lerp(emission_value_range.x, emission_value_range.y, voxel_value);
+        channel_value = SampleChannel(
+            emission_sampler, emission_value_range, emission_volume_size, emission_volume_origin,
+            use_emission_context_texture, emission_context_sampler, emission_context_value_range,
+            emission_context_volume_size, emission_context_volume_origin, pos_model, lod_scale_model);
     }
 
     vec3 res = emission_color;
@@ -1854,11 +5247,14 @@ public:
         VDBSlicedDisplayChangeSet& changes);
     void setWorldMatrices(const MMatrixArray& world_matrices);
     void enable(bool enable);
+    bool hasFinishedRefinements() const;
+    void finishRefinements();
 
 private:
     bool initRenderItems(MHWRender::MSubSceneContainer& container);
 
     void updateSliceGeo(const MBoundingBox& bbox, int slice_count);
+    void prefetch(const VDBSlicedDisplayData& data, const std::vector<VDBVolumeSpec>& volume_specs);
 
     MHWRender::MPxSubSceneOverride& m_parent;
 
@@ -1883,8 +5279,18 @@ private:
 
     bool m_enabled;
     bool m_selected;
+
+    // The cache time of the last frame loaded, and the step from the one
+    // before, which is zero if the playhead jumped.
+    double m_cache_time;
+    double m_playback_step;
+    std::unique_ptr<VolumePrefetchTicket> m_prefetch_ticket;
+    // Larger steps of the cache time are jumps of the playhead.
+    static const double MAX_PLAYBACK_STEP;
 };
 
+const double VDBSlicedDisplayImpl::MAX_PLAYBACK_STEP = 4.0;
+
 
 // === Sliced display mode implementation ===================================
 
@@ -1894,6 +5300,7 @@ VDBSlicedDisplayImpl::VDBSlicedDisplayImpl(MHWRender::MPxSubSceneOverride& paren
     , m_density_ramp(RAMP_RESOLUTION), m_scattering_ramp(RAMP_RESOLUTION), m_emission_ramp(RAMP_RESOLUTION)
     , m_volume_sampler_state(createSamplerState(MHWRender::MSamplerState::kMinMagMipLinear, MHWRender::MSamplerState::kTexBorder))
     , m_enabled(false), m_selected(false)
+    , m_cache_time(0.0), m_playback_step(0.0)
 {
     if (!m_volume_shader)
         return;
@@ -1907,7 +5314,9 @@ VDBSlicedDisplayImpl::VDBSlicedDisplayImpl(MHWRender::MPxSubSceneOverride& paren
     m_temperature_channel.setShaderInstance(m_volume_shader.get());
 
     // Create sampler state for textures.
-    for (MString param : { "density_sampler", "scattering_sampler", "transparency_sampler", "emission_sampler", "temperature_sampler" })
+    for (MString param : { "density_sampler", "scattering_sampler", "transparency_sampler", "emission_sampler", "temperature_sampler",
+                           "density_context_sampler", "scattering_context_sampler", "transparency_context_sampler",
+                           "emission_context_sampler", "temperature_context_sampler" })
         CHECK_MSTATUS(m_volume_shader->setParameter(param, *m_volume_sampler_state));
 
     // Assign ramp sampler states.
@@ -1932,6 +5341,24 @@ void VDBSlicedDisplayImpl::enable(bool enable)
         m_slices_renderable.render_item->enable(m_enabled);
 }
 
+bool VDBSlicedDisplayImpl::hasFinishedRefinements() const
+{
+    for (const VolumeParam* channel : { &m_density_channel, &m_scattering_channel, &m_emission_channel, &m_transparency_channel, &m_temperature_channel }) {
+        if (channel->isRefinementFinished())
+            return true;
+    }
+    return false;
+}
+
+void VDBSlicedDisplayImpl::finishRefinements()
+{
+    if (!m_volume_shader)
+        return;
+
+    for (VolumeParam* channel : { &m_density_channel, &m_scattering_channel, &m_emission_channel, &m_transparency_channel, &m_temperature_channel })
+        channel->finishRefinement();
+}
+
 namespace {
 
     constexpr auto SLICES_RENDER_ITEM_NAME = "vdb_volume_slices";
@@ -2072,17 +5499,38 @@ bool VDBSlicedDisplayImpl::update(
     }
 
     // Update volumes.
+    const bool frame_changed =
+        (changes & VDBSlicedDisplayChangeSet::ALL_CHANNELS) == VDBSlicedDisplayChangeSet::ALL_CHANNELS;
+    // The texel budget is slice_count^3; the cache lays it out according to texture_extents_mode.
     const auto extents = openvdb::Coord(data.slice_count, data.slice_count, data.slice_count);
+    const auto extents_mode = data.texture_extents_mode;
+    const auto vector_reduction = data.vector_reduction;
+    // With a region of interest the budget goes to the region, and the rest of
+    // the grid is shown with a coarse context volume, see VolumeParam. The
+    // slices still cover the whole grid.
+    const auto use_roi = data.use_roi && !data.roi.empty();
+    std::vector<VolumeParam*> volume_params;
+    std::vector<VDBVolumeSpec> volume_specs;
+    const auto add_volume = [&](VolumeParam& volume_param, const std::string& channel) {
+        volume_params.push_back(&volume_param);
+        volume_specs.emplace_back(vdb_file->filename(), vdb_file->getUniqueTag(), channel, extents, extents_mode, vector_reduction,
+                                  use_roi, data.roi);
+    };
     if (hasChange(changes, VDBSlicedDisplayChangeSet::DENSITY_CHANNEL))
-        m_density_channel.loadVolume({ vdb_file->filename(), vdb_file->getUniqueTag(), data.density_channel, extents });
+        add_volume(m_density_channel, data.density_channel);
     if (hasChange(changes, VDBSlicedDisplayChangeSet::SCATTER_COLOR_CHANNEL))
-        m_scattering_channel.loadVolume({ vdb_file->filename(), vdb_file->getUniqueTag(), data.scatter_color_channel, extents });
+        add_volume(m_scattering_channel, data.scatter_color_channel);
     if (hasChange(changes, VDBSlicedDisplayChangeSet::TRANSPARENT_CHANNEL))
-        m_transparency_channel.loadVolume({ vdb_file->filename(), vdb_file->getUniqueTag(), data.transparent_channel, extents });
+        add_volume(m_transparency_channel, data.transparent_channel);
     if (hasChange(changes, VDBSlicedDisplayChangeSet::EMISSION_CHANNEL))
-        m_emission_channel.loadVolume({ vdb_file->filename(), vdb_file->getUniqueTag(), data.emission_channel, extents });
+        add_volume(m_emission_channel, data.emission_channel);
     if (hasChange(changes, VDBSlicedDisplayChangeSet::TEMPERATURE_CHANNEL))
-        m_temperature_channel.loadVolume({ vdb_file->filename(), vdb_file->getUniqueTag(), data.temperature_channel, extents });
+        add_volume(m_temperature_channel, data.temperature_channel);
+    // The changed channels are sampled together.
+    if (!volume_params.empty())
+        VolumeParam::loadVolumes(volume_params, volume_specs);
+    if (frame_changed)
+        prefetch(data, volume_specs);
 
     changes = VDBSlicedDisplayChangeSet::NO_CHANGES;
 
@@ -2090,6 +5538,46 @@ bool VDBSlicedDisplayImpl::update(
     return true;
 }
 
+// During playback the next frames of the sequence are baked in the background,
+// see VolumeCache::prefetch. The direction and the speed of playback are taken
+// from the last step of the cache time; the prefetch is cancelled when the
+// playhead jumps or reverses.
+void VDBSlicedDisplayImpl::prefetch(const VDBSlicedDisplayData& data, const std::vector<VDBVolumeSpec>& volume_specs)
+{
+    const double step = data.cache_time - m_cache_time;
+    const bool is_playback = step != 0.0 && std::abs(step) <= MAX_PLAYBACK_STEP;
+    const bool reversed = step * m_playback_step < 0.0;
+    m_cache_time = data.cache_time;
+    m_playback_step = is_playback ? step : 0.0;
+    const int frame_count = VolumeCache::instance().getPrefetchFrameCount();
+    const bool can_prefetch = is_playback && frame_count > 0 && data.cache_sequence.isSequence();
+    if (!can_prefetch || reversed)
+        m_prefetch_ticket.reset();
+    if (!can_prefetch)
+        return;
+
+    // Frames held or repeated by the out of range modes are only baked once.
+    const auto file_name = data.cache_sequence.getFilePath(data.cache_time);
+    std::vector<std::string> file_names;
+    for (int i = 1; i <= frame_count; ++i) {
+        const auto next_file_name = data.cache_sequence.getFilePath(data.cache_time + step * i);
+        if (!next_file_name.empty() && next_file_name != file_name &&
+            std::find(file_names.begin(), file_names.end(), next_file_name) == file_names.end())
+            file_names.push_back(next_file_name);
+    }
+
+    // The context volumes are baked in a second pass, as in VolumeParam::loadVolumes.
+    std::vector<std::vector<VDBVolumeSpec>> passes(1, volume_specs);
+    std::vector<VDBVolumeSpec> context_specs;
+    for (const auto& spec : volume_specs) {
+        if (spec.use_roi)
+            context_specs.push_back(VolumeParam::getContextSpec(spec));
+    }
+    if (!context_specs.empty())
+        passes.push_back(context_specs);
+    VolumeCache::instance().prefetch(m_prefetch_ticket, passes, file_names);
+}
+
 void VDBSlicedDisplayImpl::setWorldMatrices(const MMatrixArray& world_matrices)
 {
     if (!m_enabled)
@@ -2113,8 +5601,34 @@ MSyntax VDBVolumeCacheCmd::create_syntax()
     syntax.addFlag("h", "help", MSyntax::kNoArg);
     syntax.addFlag("l", "limit", MSyntax::kLong);
     syntax.makeFlagQueryWithFullArgs("limit", true);
+    syntax.addFlag("al", "adaptiveLimit", MSyntax::kBoolean);
+    syntax.makeFlagQueryWithFullArgs("adaptiveLimit", true);
+    syntax.addFlag("alf", "adaptiveLimitFloor", MSyntax::kLong);
+    syntax.makeFlagQueryWithFullArgs("adaptiveLimitFloor", true);
+    syntax.addFlag("alc", "adaptiveLimitCeiling", MSyntax::kLong);
+    syntax.makeFlagQueryWithFullArgs("adaptiveLimitCeiling", true);
     syntax.addFlag("vt", "voxelType", MSyntax::kString);
     syntax.makeFlagQueryWithFullArgs("voxelType", true);
+    syntax.addFlag("pl", "pyramidLimit", MSyntax::kLong);
+    syntax.makeFlagQueryWithFullArgs("pyramidLimit", true);
+    syntax.addFlag("pg", "progressive", MSyntax::kBoolean);
+    syntax.makeFlagQueryWithFullArgs("progressive", true);
+    syntax.addFlag("ob", "outOfCoreBudget", MSyntax::kLong);
+    syntax.makeFlagQueryWithFullArgs("outOfCoreBudget", true);
+    syntax.addFlag("dr", "deltaRebake", MSyntax::kBoolean);
+    syntax.makeFlagQueryWithFullArgs("deltaRebake", true);
+    syntax.addFlag("pf", "prefetch", MSyntax::kLong);
+    syntax.makeFlagQueryWithFullArgs("prefetch", true);
+    syntax.addFlag("ca", "compressAfter", MSyntax::kLong);
+    syntax.makeFlagQueryWithFullArgs("compressAfter", true);
+    syntax.addFlag("ep", "evictionPolicy", MSyntax::kString);
+    syntax.makeFlagQueryWithFullArgs("evictionPolicy", true);
+    syntax.addFlag("dcd", "diskCacheDirectory", MSyntax::kString);
+    syntax.makeFlagQueryWithFullArgs("diskCacheDirectory", true);
+    syntax.addFlag("dcl", "diskCacheLimit", MSyntax::kLong);
+    syntax.makeFlagQueryWithFullArgs("diskCacheLimit", true);
+    syntax.addFlag("st", "stats", MSyntax::kNoArg);
+    syntax.addFlag("rs", "reset", MSyntax::kNoArg);
     return syntax;
 }
 
@@ -2127,10 +5641,22 @@ namespace
             return "half";
         else if (voxel_type == VolumeCache::VoxelType::FLOAT)
             return "float";
+        else if (voxel_type == VolumeCache::VoxelType::UNORM8)
+            return "unorm8";
+        else if (voxel_type == VolumeCache::VoxelType::UNORM16)
+            return "unorm16";
         else
             return "unknown";
     }
 
+    MString getEvictionPolicyString()
+    {
+        if (VolumeCache::instance().getEvictionPolicy() == VolumeCache::EvictionPolicy::FIFO)
+            return "fifo";
+        else
+            return "costAware";
+    }
+
 } // unnamed namespace
 
 
@@ -2154,13 +5680,164 @@ MStatus VDBVolumeCacheCmd::doIt(const MArgList& args)
                 return MS::kFailure;
             }
 
+            // A fixed limit turns the adaptive limit off.
+            VolumeCache::instance().setAdaptiveLimit(false);
             VolumeCache::instance().setMemoryLimitBytes(size_t(new_limit_gigabytes) << 30);
         }
 
+        if (parser.isFlagSet("adaptiveLimitFloor") || parser.isFlagSet("adaptiveLimitCeiling")) {
+            // Set the range of the adaptive limit to the given values in gigabytes.
+            auto& cache = VolumeCache::instance();
+            size_t floor_bytes = cache.getAdaptiveLimitFloorBytes();
+            size_t ceiling_bytes = cache.getAdaptiveLimitCeilingBytes();
+            if (parser.isFlagSet("adaptiveLimitFloor")) {
+                const int floor_gigabytes = parser.flagArgumentInt("adaptiveLimitFloor", 0, &status);
+                if (status != MStatus::kSuccess || floor_gigabytes < 0) {
+                    display_error("In edit mode argument to 'adaptiveLimitFloor' has to be a non-negative integer representing gigabytes.");
+                    return MS::kFailure;
+                }
+                floor_bytes = size_t(floor_gigabytes) << 30;
+            }
+            if (parser.isFlagSet("adaptiveLimitCeiling")) {
+                const int ceiling_gigabytes = parser.flagArgumentInt("adaptiveLimitCeiling", 0, &status);
+                if (status != MStatus::kSuccess || ceiling_gigabytes < 0) {
+                    display_error("In edit mode argument to 'adaptiveLimitCeiling' has to be a non-negative integer representing gigabytes.");
+                    return MS::kFailure;
+                }
+                ceiling_bytes = size_t(ceiling_gigabytes) << 30;
+            }
+
+            cache.setAdaptiveLimitRangeBytes(floor_bytes, ceiling_bytes);
+        }
+
+        if (parser.isFlagSet("adaptiveLimit")) {
+            // Turn the adaptive limit on or off.
+            const bool adaptive_limit = parser.flagArgumentBool("adaptiveLimit", 0, &status);
+            if (status != MStatus::kSuccess) {
+                display_error("In edit mode the 'adaptiveLimit' flag requires a boolean argument.");
+                return MS::kFailure;
+            }
+
+            VolumeCache::instance().setAdaptiveLimit(adaptive_limit);
+        }
+
+        if (parser.isFlagSet("pyramidLimit")) {
+            // Set MultiResGrid pyramid cache limit to the given value in gigabytes.
+            const int new_limit_gigabytes = parser.flagArgumentInt("pyramidLimit", 0, &status);
+            if (status != MStatus::kSuccess || new_limit_gigabytes < 0) {
+                display_error("In edit mode argument to 'pyramidLimit' has to be a non-negative integer representing gigabytes.");
+                return MS::kFailure;
+            }
+
+            VolumeCache::instance().getMultiResCache().setMemoryLimitBytes(size_t(new_limit_gigabytes) << 30);
+        }
+
+        if (parser.isFlagSet("progressive")) {
+            // Turn progressive baking on or off.
+            const bool progressive = parser.flagArgumentBool("progressive", 0, &status);
+            if (status != MStatus::kSuccess) {
+                display_error("In edit mode the 'progressive' flag requires a boolean argument.");
+                return MS::kFailure;
+            }
+
+            VolumeCache::instance().setProgressive(progressive);
+        }
+
+        if (parser.isFlagSet("deltaRebake")) {
+            // Turn delta rebaking on or off.
+            const bool delta_rebake = parser.flagArgumentBool("deltaRebake", 0, &status);
+            if (status != MStatus::kSuccess) {
+                display_error("In edit mode the 'deltaRebake' flag requires a boolean argument.");
+                return MS::kFailure;
+            }
+
+            VolumeCache::instance().setDeltaRebake(delta_rebake);
+        }
+
+        if (parser.isFlagSet("prefetch")) {
+            // Set the number of frames prefetched during playback.
+            const int frame_count = parser.flagArgumentInt("prefetch", 0, &status);
+            if (status != MStatus::kSuccess || frame_count < 0) {
+                display_error("In edit mode argument to 'prefetch' has to be a non-negative integer representing frames.");
+                return MS::kFailure;
+            }
+
+            VolumeCache::instance().setPrefetchFrameCount(frame_count);
+        }
+
+        if (parser.isFlagSet("compressAfter")) {
+            // Set the number of seconds after which unused volumes are compressed.
+            const int age_seconds = parser.flagArgumentInt("compressAfter", 0, &status);
+            if (status != MStatus::kSuccess || age_seconds < 0) {
+                display_error("In edit mode argument to 'compressAfter' has to be a non-negative integer representing seconds.");
+                return MS::kFailure;
+            }
+
+            VolumeCache::instance().setCompressionAgeSeconds(age_seconds);
+        }
+
+        if (parser.isFlagSet("evictionPolicy")) {
+            const auto policy_str = parser.flagArgumentString("evictionPolicy", 0, &status);
+            if (status != MStatus::kSuccess) {
+                display_error("In edit mode the 'evictionPolicy' flag requires a string argument, either 'fifo' or 'costAware'.");
+                return MS::kFailure;
+            }
+
+            if (policy_str == "fifo")
+                VolumeCache::instance().setEvictionPolicy(VolumeCache::EvictionPolicy::FIFO);
+            else if (policy_str == "costAware")
+                VolumeCache::instance().setEvictionPolicy(VolumeCache::EvictionPolicy::COST_AWARE);
+            else {
+                display_error("In edit mode argument to 'evictionPolicy' has to be either 'fifo' or 'costAware'.");
+                return MS::kFailure;
+            }
+        }
+
+        if (parser.isFlagSet("reset")) {
+            // Reset the statistics of the cache.
+            VolumeCache::instance().resetStats();
+        }
+
+        if (parser.isFlagSet("diskCacheDirectory")) {
+            // Set the directory of the disk cache; an empty string turns it off.
+            const auto directory = parser.flagArgumentString("diskCacheDirectory", 0, &status);
+            if (status != MStatus::kSuccess) {
+                display_error("In edit mode the 'diskCacheDirectory' flag requires a string argument.");
+                return MS::kFailure;
+            }
+
+            if (!VolumeCache::instance().getDiskCache().setDirectory(directory.asChar())) {
+                display_error(format("Can't create the disk cache directory '^1s'.", directory));
+                return MS::kFailure;
+            }
+        }
+
+        if (parser.isFlagSet("diskCacheLimit")) {
+            // Set the disk cache limit to the given value in gigabytes.
+            const int new_limit_gigabytes = parser.flagArgumentInt("diskCacheLimit", 0, &status);
+            if (status != MStatus::kSuccess || new_limit_gigabytes < 0) {
+                display_error("In edit mode argument to 'diskCacheLimit' has to be a non-negative integer representing gigabytes.");
+                return MS::kFailure;
+            }
+
+            VolumeCache::instance().getDiskCache().setLimitBytes(size_t(new_limit_gigabytes) << 30);
+        }
+
+        if (parser.isFlagSet("outOfCoreBudget")) {
+            // Set the out-of-core baking budget to the given value in megabytes.
+            const int new_budget_megabytes = parser.flagArgumentInt("outOfCoreBudget", 0, &status);
+            if (status != MStatus::kSuccess || new_budget_megabytes < 0) {
+                display_error("In edit mode argument to 'outOfCoreBudget' has to be a non-negative integer representing megabytes.");
+                return MS::kFailure;
+            }
+
+            VolumeCache::instance().setOutOfCoreBudgetBytes(size_t(new_budget_megabytes) << 20);
+        }
+
         if (parser.isFlagSet("voxelType")) {
             const auto voxel_type_str = parser.flagArgumentString("voxelType", 0, &status);
             if (status != MStatus::kSuccess) {
-                display_error("In edit mode the 'voxelType' flag requires a string argument, either 'half' or 'float'.");
+                display_error("In edit mode the 'voxelType' flag requires a string argument, one of 'half', 'float', 'unorm8' or 'unorm16'.");
                 return MS::kFailure;
             }
 
@@ -2168,8 +5845,12 @@ MStatus VDBVolumeCacheCmd::doIt(const MArgList& args)
                 VolumeCache::instance().setVoxelType(VolumeCache::VoxelType::HALF);
             else if (voxel_type_str == "float")
                 VolumeCache::instance().setVoxelType(VolumeCache::VoxelType::FLOAT);
+            else if (voxel_type_str == "unorm8")
+                VolumeCache::instance().setVoxelType(VolumeCache::VoxelType::UNORM8);
+            else if (voxel_type_str == "unorm16")
+                VolumeCache::instance().setVoxelType(VolumeCache::VoxelType::UNORM16);
             else {
-                display_error("In edit mode argument to 'voxelType' has to be either 'half' or 'float'.");
+                display_error("In edit mode argument to 'voxelType' has to be one of 'half', 'float', 'unorm8' or 'unorm16'.");
                 return MS::kFailure;
             }
         }
@@ -2181,43 +5862,279 @@ MStatus VDBVolumeCacheCmd::doIt(const MArgList& args)
             const size_t limit_bytes = VolumeCache::instance().getMemoryLimitBytes();
             MPxCommand::setResult(unsigned(limit_bytes / (1 << 30)));
             return MS::kSuccess;
+        } else if (parser.isFlagSet("adaptiveLimit")) {
+            // Return whether the limit adapts to the available memory.
+            MPxCommand::setResult(VolumeCache::instance().isAdaptiveLimit());
+            return MS::kSuccess;
+        } else if (parser.isFlagSet("adaptiveLimitFloor")) {
+            // Return the floor of the adaptive limit in gigabytes.
+            MPxCommand::setResult(unsigned(VolumeCache::instance().getAdaptiveLimitFloorBytes() >> 30));
+            return MS::kSuccess;
+        } else if (parser.isFlagSet("adaptiveLimitCeiling")) {
+            // Return the ceiling of the adaptive limit in gigabytes.
+            MPxCommand::setResult(unsigned(VolumeCache::instance().getAdaptiveLimitCeilingBytes() >> 30));
+            return MS::kSuccess;
         } else if (parser.isFlagSet("voxelType")) {
             // Return the voxel type as string.
             MPxCommand::setResult(getVoxelTypeString());
             return MS::kSuccess;
+        } else if (parser.isFlagSet("pyramidLimit")) {
+            // Return MultiResGrid pyramid cache limit in gigabytes.
+            const size_t limit_bytes = VolumeCache::instance().getMultiResCache().getMemoryLimitBytes();
+            MPxCommand::setResult(unsigned(limit_bytes / (1 << 30)));
+            return MS::kSuccess;
+        } else if (parser.isFlagSet("progressive")) {
+            // Return whether progressive baking is on.
+            MPxCommand::setResult(VolumeCache::instance().isProgressive());
+            return MS::kSuccess;
+        } else if (parser.isFlagSet("outOfCoreBudget")) {
+            // Return the out-of-core baking budget in megabytes.
+            const size_t budget_bytes = VolumeCache::instance().getOutOfCoreBudgetBytes();
+            MPxCommand::setResult(unsigned(budget_bytes >> 20));
+            return MS::kSuccess;
+        } else if (parser.isFlagSet("deltaRebake")) {
+            // Return whether delta rebaking is on.
+            MPxCommand::setResult(VolumeCache::instance().isDeltaRebake());
+            return MS::kSuccess;
+        } else if (parser.isFlagSet("prefetch")) {
+            // Return the number of frames prefetched during playback.
+            MPxCommand::setResult(VolumeCache::instance().getPrefetchFrameCount());
+            return MS::kSuccess;
+        } else if (parser.isFlagSet("compressAfter")) {
+            // Return the number of seconds after which unused volumes are compressed.
+            MPxCommand::setResult(VolumeCache::instance().getCompressionAgeSeconds());
+            return MS::kSuccess;
+        } else if (parser.isFlagSet("evictionPolicy")) {
+            // Return the eviction policy as string.
+            MPxCommand::setResult(getEvictionPolicyString());
+            return MS::kSuccess;
+        } else if (parser.isFlagSet("diskCacheDirectory")) {
+            // Return the disk cache directory, empty if the disk cache is off.
+            MPxCommand::setResult(toMString(VolumeCache::instance().getDiskCache().getDirectory()));
+            return MS::kSuccess;
+        } else if (parser.isFlagSet("diskCacheLimit")) {
+            // Return the disk cache limit in gigabytes.
+            const size_t limit_bytes = VolumeCache::instance().getDiskCache().getLimitBytes();
+            MPxCommand::setResult(unsigned(limit_bytes / (1 << 30)));
+            return MS::kSuccess;
         }
 
-        display_error("In query mode either 'limit' or 'voxelType' flag has to be specified.");
+        display_error("In query mode either 'limit', 'adaptiveLimit', 'adaptiveLimitFloor', 'adaptiveLimitCeiling', 'voxelType', 'pyramidLimit', 'progressive', 'outOfCoreBudget', 'deltaRebake', 'prefetch', 'compressAfter', 'evictionPolicy', 'diskCacheDirectory' or 'diskCacheLimit' flag has to be specified.");
         return MS::kFailure;
     }
 
     // Neither edit nor query mode: display info.
 
-    if (parser.isFlagSet("voxelType")) {
-        // Display voxel type.
-        MGlobal::displayInfo(format("[openvdb] volume cache voxel type is '^1s'.", getVoxelTypeString()));
-        return MS::kSuccess;
-    } else if (parser.isFlagSet("limit")) {
-        // Display allocated bytes and cache limit.
-        const auto pretty_string_size = [](size_t size) -> std::string {
-            static const std::array<char, 3> prefixes = { { 'G', 'M', 'K' } };
+    const auto pretty_string_size = [](size_t size) -> std::string {
+        static const std::array<char, 3> prefixes = { { 'G', 'M', 'K' } };
 
-            std::stringstream ss;
-            ss << std::setprecision(2) << std::setiosflags(std::ios_base::fixed);
+        std::stringstream ss;
+        ss << std::setprecision(2) << std::setiosflags(std::ios_base::fixed);
 
-            for (size_t i = 0; i < prefixes.size(); ++i) {
-                size_t prefix_size = 1LL << (10 * (prefixes.size() - i));
-                if (size < prefix_size)
-                    continue;
+        for (size_t i = 0; i < prefixes.size(); ++i) {
+            size_t prefix_size = 1LL << (10 * (prefixes.size() - i));
+            if (size < prefix_size)
+                continue;
+
+            ss << double(size) / double(prefix_size) << prefixes[i] << "B";
+            return ss.str();
+        }
+
+        ss << double(size) << "B";
+        return ss.str();
+    };
 
-                ss << double(size) / double(prefix_size) << prefixes[i] << "B";
-                return ss.str();
+    if (parser.isFlagSet("stats") || parser.isFlagSet("reset")) {
+        if (parser.isFlagSet("stats")) {
+            // Display the statistics of the cache, and the volumes in it.
+            const auto& cache = VolumeCache::instance();
+            const auto stats = cache.getStats();
+            const size_t lookups = stats.hits + stats.misses;
+            std::stringstream ss;
+            ss << std::setprecision(1) << std::setiosflags(std::ios_base::fixed);
+            ss << "hits: " << stats.hits << ", misses: " << stats.misses << ", hit rate: ";
+            if (lookups > 0)
+                ss << 100.0 * double(stats.hits) / double(lookups) << "%";
+            else
+                ss << "-";
+            ss << ", evictions: " << stats.evictions << ", prefetched: " << stats.prefetched << ", prefetch hits: "
+               << stats.prefetch_hits;
+            if (stats.prefetched > 0)
+                ss << " (" << 100.0 * double(stats.prefetch_hits) / double(stats.prefetched) << "%)";
+            MGlobal::displayInfo(format("[openvdb] Volume cache ^1s.", ss.str()));
+
+            ss.str("");
+            ss << std::setprecision(3) << "baked " << pretty_string_size(stats.baked_bytes) << " in "
+               << stats.bake_seconds << "s, file reads took " << stats.file_read_seconds << "s";
+            MGlobal::displayInfo(format("[openvdb] Volume cache ^1s.", ss.str()));
+
+            ss.str("");
+            ss << "compressed " << stats.compressed << " volume(s) from " << pretty_string_size(stats.compressed_input_bytes)
+               << " to " << pretty_string_size(stats.compressed_output_bytes);
+            if (stats.compressed_output_bytes > 0)
+                ss << " (" << double(stats.compressed_input_bytes) / double(stats.compressed_output_bytes) << ":1)";
+            ss << " in " << stats.compression_seconds << "s, decompressed " << stats.decompressed << " in "
+               << stats.decompression_seconds << "s";
+            MGlobal::displayInfo(format("[openvdb] Volume cache ^1s.", ss.str()));
+
+            const auto entries = cache.getEntries();
+            ss.str("");
+            ss << entries.size() << " volume(s), allocated/total: " << pretty_string_size(cache.getAllocatedBytes())
+               << "/" << pretty_string_size(cache.getMemoryLimitBytes());
+            MGlobal::displayInfo(format("[openvdb] Volume cache holds ^1s.", ss.str()));
+            for (const auto& entry : entries) {
+                ss.str("");
+                ss << std::setprecision(1) << entry.spec.vdb_file_name << " '" << entry.spec.vdb_grid_name << "' "
+                   << entry.extents.x() << "x" << entry.extents.y() << "x" << entry.extents.z() << ", "
+                   << pretty_string_size(entry.size_bytes);
+                if (entry.uncompressed_size_bytes > 0)
+                    ss << " (compressed from " << pretty_string_size(entry.uncompressed_size_bytes) << ")";
+                ss << ", last used " << entry.seconds_since_last_use << "s ago";
+                MGlobal::displayInfo(format("[openvdb]   ^1s", ss.str()));
             }
+        }
 
-            ss << double(size) << "B";
-            return ss.str();
-        };
+        if (parser.isFlagSet("reset")) {
+            // Reset the statistics of the cache.
+            VolumeCache::instance().resetStats();
+            MGlobal::displayInfo("[openvdb] Volume cache statistics have been reset.");
+        }
+        return MS::kSuccess;
+    } else if (parser.isFlagSet("diskCacheDirectory") || parser.isFlagSet("diskCacheLimit")) {
+        // Display the disk cache directory, and the space used by its files and the limit.
+        const auto& disk_cache = VolumeCache::instance().getDiskCache();
+        const auto directory = disk_cache.getDirectory();
+        if (directory.empty()) {
+            MGlobal::displayInfo("[openvdb] Disk caching is off.");
+            return MS::kSuccess;
+        }
+
+        MGlobal::displayInfo(format("[openvdb] Disk cache '^1s' used/total: ^2s/^3s.",
+            directory,
+            pretty_string_size(disk_cache.getUsedBytes()),
+            pretty_string_size(disk_cache.getLimitBytes())));
+        return MS::kSuccess;
+    } else if (parser.isFlagSet("outOfCoreBudget")) {
+        // Display the out-of-core baking budget.
+        const size_t budget = VolumeCache::instance().getOutOfCoreBudgetBytes();
+        if (budget == 0) {
+            MGlobal::displayInfo("[openvdb] Out-of-core baking is off.");
+            return MS::kSuccess;
+        }
+
+        MGlobal::displayInfo(format("[openvdb] Out-of-core baking budget: ^1s.", pretty_string_size(budget)));
+        return MS::kSuccess;
+    } else if (parser.isFlagSet("evictionPolicy")) {
+        // Display the eviction policy and the hit rate of the cache so far.
+        const auto& cache = VolumeCache::instance();
+        const size_t lookups = cache.getHits() + cache.getMisses();
+        std::stringstream ss;
+        ss << std::setprecision(1) << std::setiosflags(std::ios_base::fixed);
+        if (lookups > 0)
+            ss << 100.0 * double(cache.getHits()) / double(lookups) << "% of " << lookups << " requests";
+        else
+            ss << "-";
+        MGlobal::displayInfo(format("[openvdb] Volume cache eviction policy is '^1s', hit rate: ^2s.",
+            getEvictionPolicyString(), ss.str()));
+        return MS::kSuccess;
+    } else if (parser.isFlagSet("deltaRebake")) {
+        // Display whether delta rebaking is on, and the fraction of the cells
+        // the incremental bakes had to sample again.
+        const auto& cache = VolumeCache::instance();
+        const size_t total_cells = cache.getDeltaTotalCells();
+        std::stringstream ss;
+        ss << std::setprecision(1) << std::setiosflags(std::ios_base::fixed);
+        if (total_cells > 0)
+            ss << 100.0 * double(cache.getDeltaSampledCells()) / double(total_cells) << "%";
+        else
+            ss << "-";
+        MGlobal::displayInfo(format("[openvdb] Delta rebaking is ^1s, resampled cells: ^2s.",
+            cache.isDeltaRebake() ? "on" : "off", ss.str()));
+        return MS::kSuccess;
+    } else if (parser.isFlagSet("prefetch")) {
+        // Display the number of frames prefetched, and the share of the
+        // prefetched volumes requested so far.
+        const auto& cache = VolumeCache::instance();
+        const int frame_count = cache.getPrefetchFrameCount();
+        if (frame_count == 0) {
+            MGlobal::displayInfo("[openvdb] Prefetching is off.");
+            return MS::kSuccess;
+        }
 
+        const auto stats = cache.getStats();
+        std::stringstream ss;
+        ss << std::setprecision(1) << std::setiosflags(std::ios_base::fixed);
+        if (stats.prefetched > 0)
+            ss << 100.0 * double(stats.prefetch_hits) / double(stats.prefetched) << "% of " << stats.prefetched << " volumes";
+        else
+            ss << "-";
+        MGlobal::displayInfo(format("[openvdb] Prefetching ^1s frame(s) during playback, prefetch hit rate: ^2s.",
+            std::to_string(frame_count), ss.str()));
+        return MS::kSuccess;
+    } else if (parser.isFlagSet("compressAfter")) {
+        // Display after how long unused volumes are compressed, the compression
+        // ratio so far and the average time it took to decompress a volume.
+        const auto& cache = VolumeCache::instance();
+        const int age_seconds = cache.getCompressionAgeSeconds();
+        if (age_seconds == 0) {
+            MGlobal::displayInfo("[openvdb] Volume compression is off.");
+            return MS::kSuccess;
+        }
+
+        const auto stats = cache.getStats();
+        std::stringstream ss;
+        ss << std::setprecision(2) << std::setiosflags(std::ios_base::fixed);
+        if (stats.compressed_output_bytes > 0)
+            ss << double(stats.compressed_input_bytes) / double(stats.compressed_output_bytes) << ":1 over " << stats.compressed << " volume(s)";
+        else
+            ss << "-";
+        ss << ", average decompression time: ";
+        if (stats.decompressed > 0)
+            ss << 1e3 * stats.decompression_seconds / double(stats.decompressed) << "ms";
+        else
+            ss << "-";
+        MGlobal::displayInfo(format("[openvdb] Compressing volumes unused for ^1ss, compression ratio: ^2s.",
+            std::to_string(age_seconds), ss.str()));
+        return MS::kSuccess;
+    } else if (parser.isFlagSet("adaptiveLimit") || parser.isFlagSet("adaptiveLimitFloor") || parser.isFlagSet("adaptiveLimitCeiling")) {
+        // Display whether the limit adapts to the available memory, its range
+        // and the current limit.
+        const auto& cache = VolumeCache::instance();
+        if (!cache.isAdaptiveLimit()) {
+            MGlobal::displayInfo(format("[openvdb] Adaptive volume cache limit is off, range: ^1s-^2s.",
+                pretty_string_size(cache.getAdaptiveLimitFloorBytes()),
+                pretty_string_size(cache.getAdaptiveLimitCeilingBytes())));
+            return MS::kSuccess;
+        }
+
+        MGlobal::displayInfo(format("[openvdb] Adaptive volume cache limit is on, range: ^1s-^2s, current limit: ^3s.",
+            pretty_string_size(cache.getAdaptiveLimitFloorBytes()),
+            pretty_string_size(cache.getAdaptiveLimitCeilingBytes()),
+            pretty_string_size(cache.getMemoryLimitBytes())));
+        return MS::kSuccess;
+    } else if (parser.isFlagSet("progressive")) {
+        // Display whether progressive baking is on.
+        MGlobal::displayInfo(format("[openvdb] Progressive baking is ^1s.", VolumeCache::instance().isProgressive() ? "on" : "off"));
+        return MS::kSuccess;
+    } else if (parser.isFlagSet("voxelType")) {
+        // Display voxel type.
+        MGlobal::displayInfo(format("[openvdb] volume cache voxel type is '^1s'.", getVoxelTypeString()));
+        return MS::kSuccess;
+    } else if (parser.isFlagSet("pyramidLimit")) {
+        // Display allocated bytes and limit of the MultiResGrid pyramid cache.
+        const auto& multires_cache = VolumeCache::instance().getMultiResCache();
+        const size_t limit = multires_cache.getMemoryLimitBytes();
+        if (limit == 0) {
+            MGlobal::displayInfo("[openvdb] Pyramid caching is off.");
+            return MS::kSuccess;
+        }
+
+        MGlobal::displayInfo(format("[openvdb] Pyramid cache allocated/total: ^1s/^2s.",
+            pretty_string_size(multires_cache.getAllocatedBytes()),
+            pretty_string_size(limit)));
+        return MS::kSuccess;
+    } else if (parser.isFlagSet("limit")) {
+        // Display allocated bytes and cache limit.
         const size_t limit = VolumeCache::instance().getMemoryLimitBytes();
         if (limit == 0) {
             MGlobal::displayInfo("[openvdb] Volume caching is off.");
@@ -2232,7 +6149,7 @@ MStatus VDBVolumeCacheCmd::doIt(const MArgList& args)
     }
 
     // Default: display help.
-    MGlobal::displayInfo(format("[openvdb] Usage: ^1s [-h|-help] [-q|-query|-e|-edit] [-vt|-voxelType [\"half\"|\"float\"]] [-l|-limit [<limit_in_gigabytes>]]", COMMAND_STRING));
+    MGlobal::displayInfo(format("[openvdb] Usage: ^1s [-h|-help] [-q|-query|-e|-edit] [-vt|-voxelType [\"half\"|\"float\"|\"unorm8\"|\"unorm16\"]] [-l|-limit [<limit_in_gigabytes>]] [-al|-adaptiveLimit [on|off]] [-alf|-adaptiveLimitFloor [<floor_in_gigabytes>]] [-alc|-adaptiveLimitCeiling [<ceiling_in_gigabytes>]] [-pl|-pyramidLimit [<limit_in_gigabytes>]] [-pg|-progressive [on|off]] [-ob|-outOfCoreBudget [<budget_in_megabytes>]] [-dr|-deltaRebake [on|off]] [-pf|-prefetch [<frames>]] [-ca|-compressAfter [<seconds>]] [-ep|-evictionPolicy [\"fifo\"|\"costAware\"]] [-dcd|-diskCacheDirectory [<directory>]] [-dcl|-diskCacheLimit [<limit_in_gigabytes>]] [-st|-stats] [-rs|-reset]", COMMAND_STRING));
     return MS::kSuccess;
 }
 
@@ -2266,3 +6183,13 @@ void VDBSlicedDisplay::enable(bool enable)
 {
     m_impl->enable(enable);
 }
+
+bool VDBSlicedDisplay::hasFinishedRefinements() const
+{
+    return m_impl->hasFinishedRefinements();
+}
+
+void VDBSlicedDisplay::finishRefinements()
+{
+    m_impl->finishRefinements();
+}
@@ -84,6 +84,10 @@ public:
         VDBSlicedDisplayChangeSet& changes);
     void setWorldMatrices(const MMatrixArray& world_matrices);
     void enable(bool enable);
+    // Volumes are refined in the background after a coarse version has been
+    // displayed. Refined volumes are swapped in by finishRefinements.
+    bool hasFinishedRefinements() const;
+    void finishRefinements();
 private:
     std::unique_ptr<VDBSlicedDisplayImpl> m_impl;
 };
@@ -338,6 +338,17 @@ namespace MHWRender {
                 sliced_display_changes |= VDBSlicedDisplayChangeSet::ALL_CHANNELS;
             }
 
+            if (setup_parameter(sliced_display_data.texture_extents_mode, data->sliced_display_data.texture_extents_mode))
+                sliced_display_changes |= VDBSlicedDisplayChangeSet::ALL_CHANNELS;
+
+            if (setup_parameter(sliced_display_data.vector_reduction, data->sliced_display_data.vector_reduction))
+                sliced_display_changes |= VDBSlicedDisplayChangeSet::ALL_CHANNELS;
+
+            const bool use_roi_changed = setup_parameter(sliced_display_data.use_roi, data->sliced_display_data.use_roi);
+            const bool roi_changed = setup_parameter(sliced_display_data.roi, data->sliced_display_data.roi);
+            if (use_roi_changed || (sliced_display_data.use_roi && roi_changed))
+                sliced_display_changes |= VDBSlicedDisplayChangeSet::ALL_CHANNELS;
+
             if (bbox_changed)
                 sliced_display_changes |= VDBSlicedDisplayChangeSet::BOUNDING_BOX;
 
@@ -359,6 +370,10 @@ namespace MHWRender {
             if (setup_parameter(sliced_display_data.temperature_channel, data->sliced_display_data.temperature_channel))
                 sliced_display_changes |= VDBSlicedDisplayChangeSet::TEMPERATURE_CHANNEL;
 
+            // Only used to prefetch the next frames, which doesn't change the display.
+            sliced_display_data.cache_sequence = data->sliced_display_data.cache_sequence;
+            sliced_display_data.cache_time = data->sliced_display_data.cache_time;
+
             if (file_has_changed) {
                 sliced_display_changes |= VDBSlicedDisplayChangeSet::ALL_CHANNELS;
             }
@@ -845,6 +860,10 @@ namespace MHWRender {
             setup_matrices();
         }
 
+        // Swap in the volumes refined in the background.
+        if (data->display_mode == DISPLAY_SLICED)
+            m_sliced_display.finishRefinements();
+
         // Setting up shader parameters
         if (data->shader_has_changed && p_point_cloud_shader) {
             p_point_cloud_shader->setParameter("point_size", data->point_size);
@@ -882,7 +901,8 @@ namespace MHWRender {
         MFnDagNode dgNode(m_object);
         MDagPath dg;
         dgNode.getPath(dg);
-        return p_data->update(p_vdb_visualizer->get_update(), m_object, frameContext);
+        const bool data_changed = p_data->update(p_vdb_visualizer->get_update(), m_object, frameContext);
+        return data_changed || m_sliced_display.hasFinishedRefinements();
     }
 
     void VDBSubSceneOverride::setup_point_cloud(MRenderItem* point_cloud, const MFloatPoint& camera_pos)
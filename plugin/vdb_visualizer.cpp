@@ -104,6 +104,19 @@ namespace {
         CACHE_OUT_OF_RANGE_MODE_REPEAT
     };
 
+    VDBCacheSequence getCacheSequence(MDataBlock& data_block)
+    {
+        VDBCacheSequence cache_sequence;
+        cache_sequence.vdb_path = data_block.inputValue(VDBVisualizerShape::s_vdb_path).asString().asChar();
+        cache_sequence.playback_offset =
+            data_block.inputValue(VDBVisualizerShape::s_cache_playback_offset).asTime().as(MTime::uiUnit());
+        cache_sequence.playback_start = data_block.inputValue(VDBVisualizerShape::s_cache_playback_start).asInt();
+        cache_sequence.playback_end = data_block.inputValue(VDBVisualizerShape::s_cache_playback_end).asInt();
+        cache_sequence.before_mode = data_block.inputValue(VDBVisualizerShape::s_cache_before_mode).asShort();
+        cache_sequence.after_mode = data_block.inputValue(VDBVisualizerShape::s_cache_after_mode).asShort();
+        return cache_sequence;
+    }
+
     // we have to do lots of line, rectangle intersection, so using the Cohen-Sutherland algorithm
     // https://en.wikipedia.org/wiki/Cohen%E2%80%93Sutherland_algorithm
     class SelectionRectangle {
@@ -196,6 +209,61 @@ namespace {
     };
 }
 
+VDBCacheSequence::VDBCacheSequence()
+    : playback_offset(0.0)
+    , playback_start(0)
+    , playback_end(0)
+    , before_mode(CACHE_OUT_OF_RANGE_MODE_NONE)
+    , after_mode(CACHE_OUT_OF_RANGE_MODE_NONE)
+{
+}
+
+bool VDBCacheSequence::isSequence() const
+{
+    return boost::regex_match(vdb_path, VDBVisualizerShape::s_frame_expr);
+}
+
+std::string VDBCacheSequence::getFilePath(double cache_time) const
+{
+    if (!isSequence())
+        return vdb_path;
+
+    int cache_frame = static_cast<int>(cache_time - playback_offset);
+    const int cache_playback_end = std::max(playback_start, playback_end);
+    if (cache_frame < playback_start) {
+        if (before_mode == CACHE_OUT_OF_RANGE_MODE_NONE) {
+            return "";
+        } else if (before_mode == CACHE_OUT_OF_RANGE_MODE_HOLD) {
+            cache_frame = playback_start;
+        } else if (before_mode == CACHE_OUT_OF_RANGE_MODE_REPEAT) {
+            const int cache_playback_range = cache_playback_end - playback_start;
+            cache_frame = cache_playback_end - (playback_start - cache_frame - 1) % (cache_playback_range + 1);
+        }
+    } else if (cache_frame > cache_playback_end) {
+        if (after_mode == CACHE_OUT_OF_RANGE_MODE_NONE) {
+            return "";
+        } else if (after_mode == CACHE_OUT_OF_RANGE_MODE_HOLD) {
+            cache_frame = cache_playback_end;
+        } else if (after_mode == CACHE_OUT_OF_RANGE_MODE_REPEAT) {
+            const int cache_playback_range = cache_playback_end - playback_start;
+            cache_frame = playback_start + (cache_frame - cache_playback_end - 1) % (cache_playback_range + 1);
+        }
+    }
+    cache_frame = std::max(0, cache_frame);
+
+    size_t hash_count = 0;
+    for (auto c : vdb_path) {
+        if (c == '#') {
+            ++hash_count;
+        }
+    }
+    std::stringstream ss;
+    ss.fill('0');
+    ss.width(hash_count);
+    ss << cache_frame;
+    return boost::regex_replace(vdb_path, VDBVisualizerShape::s_hash_expr, ss.str());
+}
+
 VDBSlicedDisplayData::VDBSlicedDisplayData()
     : density(-1)
     , density_source(VDBChannelSource::VALUE)
@@ -212,8 +280,12 @@ VDBSlicedDisplayData::VDBSlicedDisplayData()
     , blackbody_kelvin(-1)
     , blackbody_intensity(-1)
     , slice_count(-1)
+    , texture_extents_mode(VDBTextureExtentsMode::CUBE)
+    , vector_reduction(VDBVectorReduction::LENGTH)
+    , use_roi(false)
     , shadow_sample_count(-1)
     , shadow_gain(-1)
+    , cache_time(0.0)
 {
 }
 
@@ -260,58 +332,11 @@ MStatus VDBVisualizerShape::compute(const MPlug& plug, MDataBlock& dataBlock)
     MStatus status = MS::kSuccess;
 
     if (plug == s_out_vdb_path) {
-        std::string vdb_path = dataBlock.inputValue(s_vdb_path).asString().asChar();
-
-        if (boost::regex_match(vdb_path, s_frame_expr)) {
-            const double cache_time = dataBlock.inputValue(s_cache_time).asTime().as(MTime::uiUnit());
-            const double cache_playback_offset = dataBlock.inputValue(s_cache_playback_offset).asTime().as(
-                MTime::uiUnit());
-            int cache_frame = static_cast<int>(cache_time - cache_playback_offset);
-            const int cache_playback_start = dataBlock.inputValue(s_cache_playback_start).asInt();
-            const int cache_playback_end = std::max(cache_playback_start,
-                                                    dataBlock.inputValue(s_cache_playback_end).asInt());
-            bool frame_in_range = true;
-            if (cache_frame < cache_playback_start) {
-                const short cache_before_mode = dataBlock.inputValue(s_cache_before_mode).asShort();
-                if (cache_before_mode == CACHE_OUT_OF_RANGE_MODE_NONE) {
-                    frame_in_range = false;
-                } else if (cache_before_mode == CACHE_OUT_OF_RANGE_MODE_HOLD) {
-                    cache_frame = cache_playback_start;
-                } else if (cache_before_mode == CACHE_OUT_OF_RANGE_MODE_REPEAT) {
-                    const int cache_playback_range = cache_playback_end - cache_playback_start;
-                    cache_frame =
-                        cache_playback_end - (cache_playback_start - cache_frame - 1) % (cache_playback_range + 1);
-                }
-            } else if (cache_frame > cache_playback_end) {
-                const short cache_after_mode = dataBlock.inputValue(s_cache_after_mode).asShort();
-                if (cache_after_mode == CACHE_OUT_OF_RANGE_MODE_NONE) {
-                    frame_in_range = false;
-                } else if (cache_after_mode == CACHE_OUT_OF_RANGE_MODE_HOLD) {
-                    cache_frame = cache_playback_end;
-                } else if (cache_after_mode == CACHE_OUT_OF_RANGE_MODE_REPEAT) {
-                    const int cache_playback_range = cache_playback_end - cache_playback_start;
-                    cache_frame =
-                        cache_playback_start + (cache_frame - cache_playback_end - 1) % (cache_playback_range + 1);
-                }
-            }
-            cache_frame = std::max(0, cache_frame);
-
-            if (frame_in_range) {
-                size_t hash_count = 0;
-                for (auto c : vdb_path) {
-                    if (c == '#') {
-                        ++hash_count;
-                    }
-                }
-                std::stringstream ss;
-                ss.fill('0');
-                ss.width(hash_count);
-                ss << cache_frame;
-                vdb_path = boost::regex_replace(vdb_path, s_hash_expr, ss.str());
-            } else {
-                vdb_path = "";
-            }
-        }
+        const VDBCacheSequence cache_sequence = getCacheSequence(dataBlock);
+        const double cache_time = dataBlock.inputValue(s_cache_time).asTime().as(MTime::uiUnit());
+        const std::string vdb_path = cache_sequence.getFilePath(cache_time);
+        m_vdb_data.sliced_display_data.cache_sequence = cache_sequence;
+        m_vdb_data.sliced_display_data.cache_time = cache_time;
 
         if (vdb_path != m_vdb_data.vdb_path) {
 
@@ -754,6 +779,39 @@ MStatus VDBVisualizerShape::initialize()
     CHECK_MSTATUS(MPxNode::addAttribute(s_sliced_display_params.slice_count));
     CHECK_MSTATUS(attributeAffects(s_sliced_display_params.slice_count, s_update_trigger));
 
+    s_sliced_display_params.texture_extents_mode = eAttr.create("sliceTextureExtents", "slice_texture_extents");
+    eAttr.addField("Cube", int(VDBTextureExtentsMode::CUBE));
+    eAttr.addField("Fit Bounding Box", int(VDBTextureExtentsMode::FIT_ASPECT));
+    eAttr.addField("Fit Bounding Box, Cap to Grid Resolution", int(VDBTextureExtentsMode::FIT_ASPECT_CAPPED));
+    eAttr.setDefault(int(VDBTextureExtentsMode::CUBE));
+    CHECK_MSTATUS(MPxNode::addAttribute(s_sliced_display_params.texture_extents_mode));
+    CHECK_MSTATUS(attributeAffects(s_sliced_display_params.texture_extents_mode, s_update_trigger));
+
+    s_sliced_display_params.vector_reduction = eAttr.create("sliceVectorReduction", "slice_vector_reduction");
+    eAttr.addField("Length", int(VDBVectorReduction::LENGTH));
+    eAttr.addField("Average", int(VDBVectorReduction::AVERAGE));
+    eAttr.addField("X", int(VDBVectorReduction::COMPONENT_X));
+    eAttr.addField("Y", int(VDBVectorReduction::COMPONENT_Y));
+    eAttr.addField("Z", int(VDBVectorReduction::COMPONENT_Z));
+    eAttr.setDefault(int(VDBVectorReduction::LENGTH));
+    CHECK_MSTATUS(MPxNode::addAttribute(s_sliced_display_params.vector_reduction));
+    CHECK_MSTATUS(attributeAffects(s_sliced_display_params.vector_reduction, s_update_trigger));
+
+    s_sliced_display_params.use_roi = nAttr.create("sliceRoi", "slice_roi", MFnNumericData::kBoolean);
+    nAttr.setDefault(false);
+    CHECK_MSTATUS(MPxNode::addAttribute(s_sliced_display_params.use_roi));
+    CHECK_MSTATUS(attributeAffects(s_sliced_display_params.use_roi, s_update_trigger));
+
+    s_sliced_display_params.roi_min = nAttr.createPoint("sliceRoiMin", "slice_roi_min");
+    nAttr.setDefault(-1.0, -1.0, -1.0);
+    CHECK_MSTATUS(MPxNode::addAttribute(s_sliced_display_params.roi_min));
+    CHECK_MSTATUS(attributeAffects(s_sliced_display_params.roi_min, s_update_trigger));
+
+    s_sliced_display_params.roi_max = nAttr.createPoint("sliceRoiMax", "slice_roi_max");
+    nAttr.setDefault(1.0, 1.0, 1.0);
+    CHECK_MSTATUS(MPxNode::addAttribute(s_sliced_display_params.roi_max));
+    CHECK_MSTATUS(attributeAffects(s_sliced_display_params.roi_max, s_update_trigger));
+
     s_sliced_display_params.shadow_gain = nAttr.create("shadowGain", "shadow_gain", MFnNumericData::kFloat);
     nAttr.setDefault(0.2);
     nAttr.setMin(0.0);
@@ -926,6 +984,13 @@ VDBVisualizerData* VDBVisualizerShape::get_update()
             data.blackbody_kelvin = MPlug(tmo, params.blackbody_kelvin).asFloat();
             data.blackbody_intensity = MPlug(tmo, params.blackbody_intensity).asFloat();
             m_vdb_data.sliced_display_data.slice_count = MPlug(thisMObject(), s_sliced_display_params.slice_count).asInt();
+            data.texture_extents_mode = VDBTextureExtentsMode(MPlug(tmo, params.texture_extents_mode).asInt());
+            data.vector_reduction = VDBVectorReduction(MPlug(tmo, params.vector_reduction).asInt());
+            data.use_roi = MPlug(tmo, params.use_roi).asBool();
+            const auto roi_min = attributeAsFloatVector(tmo, params.roi_min);
+            const auto roi_max = attributeAsFloatVector(tmo, params.roi_max);
+            data.roi = openvdb::BBoxd(
+                openvdb::Vec3d(roi_min.x, roi_min.y, roi_min.z), openvdb::Vec3d(roi_max.x, roi_max.y, roi_max.z));
             data.shadow_sample_count = MPlug(tmo, params.shadow_sample_count).asInt();
             data.shadow_gain = MPlug(tmo, params.shadow_gain).asFloat();
 
@@ -53,6 +53,22 @@ enum class VDBChannelSource {
     RAMP = 1
 };
 
+// How the slice_count^3 texel budget of a channel texture is laid out.
+enum class VDBTextureExtentsMode {
+    CUBE = 0,
+    FIT_ASPECT = 1,        // Follow the aspect ratio of the grid bbox.
+    FIT_ASPECT_CAPPED = 2, // Same as FIT_ASPECT, but don't exceed the grid resolution.
+};
+
+// How vector grid values are turned into the scalars of a channel texture.
+enum class VDBVectorReduction {
+    LENGTH = 0,
+    AVERAGE = 1,
+    COMPONENT_X = 2,
+    COMPONENT_Y = 3,
+    COMPONENT_Z = 4
+};
+
 enum class VDBEmissionMode {
     NONE = 0,
     CHANNEL = 1,
@@ -68,6 +84,25 @@ struct RampData {
     RampData() = default;
 };
 
+// Maps the cache time of a node to a file of its VDB sequence, given by a path
+// with a frame pattern of #'s. Frames outside the playback range are left out,
+// held or repeated depending on the out of range modes. Times are in UI units.
+struct VDBCacheSequence {
+    std::string vdb_path;
+    double playback_offset;
+    int playback_start;
+    int playback_end;
+    short before_mode;
+    short after_mode;
+
+    VDBCacheSequence();
+
+    bool isSequence() const;
+    // Returns the path of the file shown at the cache time, which is vdb_path if
+    // it isn't a sequence, or an empty string if the frame is left out.
+    std::string getFilePath(double cache_time) const;
+};
+
 struct VDBSlicedDisplayData {
 
     // Shader data; the shader approximates aiStandardVolume shader.
@@ -101,9 +136,18 @@ struct VDBSlicedDisplayData {
 
     // Additional visualization data.
     int   slice_count;
+    VDBTextureExtentsMode texture_extents_mode;
+    VDBVectorReduction vector_reduction;
+    // World space region the texel budget is spent on, if use_roi is set.
+    bool  use_roi;
+    openvdb::BBoxd roi;
     int   shadow_sample_count;
     float shadow_gain;
 
+    // The next frames of the sequence are prefetched during playback.
+    VDBCacheSequence cache_sequence;
+    double cache_time;
+
     VDBSlicedDisplayData();
 };
 
@@ -137,6 +181,11 @@ struct VDBSlicedDisplayParams {
     MObject blackbody_kelvin;
     MObject blackbody_intensity;
     MObject slice_count;
+    MObject texture_extents_mode;
+    MObject vector_reduction;
+    MObject use_roi;
+    MObject roi_min;
+    MObject roi_max;
     MObject shadow_sample_count;
     MObject shadow_gain;
 };
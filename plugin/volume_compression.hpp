@@ -0,0 +1,208 @@
+// Copyright 2019 Luma Pictures
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <tbb/atomic.h>
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+namespace volume_compression {
+
+// A block compressor for baked volumes, which are mostly made of large zero
+// regions (the background of sparse grids, normalized over the value range).
+// The data is split into independent blocks of BLOCK_SIZE bytes, which are
+// compressed and decompressed in parallel. Each block is a sequence of runs of
+// 8 byte words: a token with the number of zero words and the number of literal
+// words following them, and the literal words. The bytes after the last whole
+// word of a block are stored as they are.
+//
+// The compressed stream starts with the size of the data and the number of
+// blocks, followed by the end offset of each block relative to the first one.
+
+constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+// Compresses size bytes of data into out_compressed, replacing its contents.
+inline void compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out_compressed);
+
+// Returns the size of the data the stream decompresses to, or zero if the
+// stream is truncated.
+inline size_t getDecompressedSize(const uint8_t* compressed, size_t compressed_size);
+
+// Decompresses the stream into out_data, which has to hold size bytes, the
+// size returned by getDecompressedSize. Returns false if the stream is
+// malformed.
+inline bool decompress(const uint8_t* compressed, size_t compressed_size, uint8_t* out_data, size_t size);
+
+
+// === Implementation ==========================================================
+
+namespace detail {
+
+typedef uint64_t Word;
+constexpr size_t WORD_SIZE = sizeof(Word);
+// The maximum number of zero or literal words of a run.
+constexpr size_t MAX_RUN_WORDS = 0xffff;
+
+struct StreamHeader {
+    uint64_t size;
+    uint64_t num_blocks;
+};
+
+struct RunToken {
+    uint16_t num_zero_words;
+    uint16_t num_literal_words;
+};
+
+inline bool isZeroWord(const uint8_t* ptr)
+{
+    Word word;
+    std::memcpy(&word, ptr, WORD_SIZE);
+    return word == 0;
+}
+
+inline void compressBlock(const uint8_t* data, size_t size, std::vector<uint8_t>& out_block)
+{
+    out_block.clear();
+    const size_t num_words = size / WORD_SIZE;
+    size_t word = 0;
+    while (word < num_words) {
+        RunToken token = { 0, 0 };
+        while (word < num_words && token.num_zero_words < MAX_RUN_WORDS && isZeroWord(data + word * WORD_SIZE)) {
+            ++token.num_zero_words;
+            ++word;
+        }
+        const size_t literal_begin = word;
+        while (word < num_words && token.num_literal_words < MAX_RUN_WORDS && !isZeroWord(data + word * WORD_SIZE)) {
+            ++token.num_literal_words;
+            ++word;
+        }
+
+        const size_t token_offset = out_block.size();
+        const size_t literal_bytes = size_t(token.num_literal_words) * WORD_SIZE;
+        out_block.resize(token_offset + sizeof(RunToken) + literal_bytes);
+        std::memcpy(out_block.data() + token_offset, &token, sizeof(RunToken));
+        std::memcpy(out_block.data() + token_offset + sizeof(RunToken), data + literal_begin * WORD_SIZE, literal_bytes);
+    }
+    out_block.insert(out_block.end(), data + num_words * WORD_SIZE, data + size);
+}
+
+inline bool decompressBlock(const uint8_t* block, size_t block_size, uint8_t* out_data, size_t size)
+{
+    const size_t num_words = size / WORD_SIZE;
+    const uint8_t* block_end = block + block_size;
+    size_t word = 0;
+    while (word < num_words) {
+        if (block_end - block < ptrdiff_t(sizeof(RunToken)))
+            return false;
+        RunToken token;
+        std::memcpy(&token, block, sizeof(RunToken));
+        block += sizeof(RunToken);
+        const size_t literal_bytes = size_t(token.num_literal_words) * WORD_SIZE;
+        if (word + token.num_zero_words + token.num_literal_words > num_words || size_t(block_end - block) < literal_bytes)
+            return false;
+
+        std::memset(out_data + word * WORD_SIZE, 0, size_t(token.num_zero_words) * WORD_SIZE);
+        word += token.num_zero_words;
+        std::memcpy(out_data + word * WORD_SIZE, block, literal_bytes);
+        word += token.num_literal_words;
+        block += literal_bytes;
+    }
+    const size_t tail_bytes = size - num_words * WORD_SIZE;
+    if (size_t(block_end - block) != tail_bytes)
+        return false;
+    std::memcpy(out_data + num_words * WORD_SIZE, block, tail_bytes);
+    return true;
+}
+
+} // namespace detail
+
+inline void compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out_compressed)
+{
+    const size_t num_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<std::vector<uint8_t>> blocks(num_blocks);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, num_blocks), [&](const tbb::blocked_range<size_t>& range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            const size_t begin = i * BLOCK_SIZE;
+            detail::compressBlock(data + begin, std::min(BLOCK_SIZE, size - begin), blocks[i]);
+        }
+    });
+
+    const detail::StreamHeader header = { size, num_blocks };
+    const size_t blocks_offset = sizeof(header) + num_blocks * sizeof(uint64_t);
+    std::vector<uint64_t> block_ends(num_blocks);
+    size_t blocks_size = 0;
+    for (size_t i = 0; i < num_blocks; ++i) {
+        blocks_size += blocks[i].size();
+        block_ends[i] = blocks_size;
+    }
+
+    out_compressed.resize(blocks_offset + blocks_size);
+    std::memcpy(out_compressed.data(), &header, sizeof(header));
+    std::memcpy(out_compressed.data() + sizeof(header), block_ends.data(), num_blocks * sizeof(uint64_t));
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, num_blocks), [&](const tbb::blocked_range<size_t>& range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            if (!blocks[i].empty())
+                std::memcpy(out_compressed.data() + blocks_offset + block_ends[i] - blocks[i].size(), blocks[i].data(), blocks[i].size());
+        }
+    });
+}
+
+inline size_t getDecompressedSize(const uint8_t* compressed, size_t compressed_size)
+{
+    if (compressed_size < sizeof(detail::StreamHeader))
+        return 0;
+    detail::StreamHeader header;
+    std::memcpy(&header, compressed, sizeof(header));
+    return size_t(header.size);
+}
+
+inline bool decompress(const uint8_t* compressed, size_t compressed_size, uint8_t* out_data, size_t size)
+{
+    if (compressed_size < sizeof(detail::StreamHeader))
+        return false;
+    detail::StreamHeader header;
+    std::memcpy(&header, compressed, sizeof(header));
+    const size_t num_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const size_t blocks_offset = sizeof(header) + num_blocks * sizeof(uint64_t);
+    if (header.size != size || header.num_blocks != num_blocks || compressed_size < blocks_offset)
+        return false;
+
+    std::vector<uint64_t> block_ends(num_blocks);
+    std::memcpy(block_ends.data(), compressed + sizeof(header), num_blocks * sizeof(uint64_t));
+    if (num_blocks > 0 && block_ends.back() != compressed_size - blocks_offset)
+        return false;
+
+    tbb::atomic<bool> success;
+    success = true;
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, num_blocks), [&](const tbb::blocked_range<size_t>& range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            const size_t block_begin = i == 0 ? 0 : size_t(block_ends[i - 1]);
+            const size_t begin = i * BLOCK_SIZE;
+            if (block_begin > block_ends[i] ||
+                !detail::decompressBlock(compressed + blocks_offset + block_begin, size_t(block_ends[i]) - block_begin,
+                                         out_data + begin, std::min(BLOCK_SIZE, size - begin))) {
+                success = false;
+            }
+        }
+    });
+    return success;
+}
+
+} // namespace volume_compression
@@ -14,15 +14,24 @@
 #pragma once
 
 #include <openvdb/openvdb.h>
+#include <openvdb/tools/Interpolation.h>
 #include <openvdb/tools/MultiResGrid.h>
 
+#include <tbb/atomic.h>
 #include <tbb/enumerable_thread_specific.h>
 #include <tbb/parallel_for.h>
 
 #include <algorithm>
+#include <functional>
 #include <limits>
+#include <map>
+#include <memory>
+#include <type_traits>
+#include <vector>
 #include <cassert>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
 
 
 namespace volume_sampling {
@@ -35,9 +44,69 @@ struct SampleBufferHeader
     RealType origin[3];
 };
 
+// Describes how samples of a given type are stored in the output buffer.
+// Samples are normalized to [0, 1] over the value range stored in the header,
+// and fromUnit converts them to the sample type as they are written.
+// Floating point samples are stored as they are. Unsigned integer samples are
+// stored as normalized integers (UNORM), i.e. [0, 1] is mapped to [0, max],
+// and come with a float header.
+template <typename SampleType>
+struct SampleTraits {
+    typedef SampleType HeaderType;
+    static constexpr bool is_unorm = false;
+
+    static SampleType fromUnit(float value) { return SampleType(value); }
+    static float toUnit(SampleType value) { return float(value); }
+};
+
+template <typename UIntType>
+struct UNormSampleTraits {
+    typedef float HeaderType;
+    static constexpr bool is_unorm = true;
+
+    static UIntType fromUnit(float value)
+    {
+        // NaNs map to zero.
+        const float clamped = value > 0.0f ? std::min(value, 1.0f) : 0.0f;
+        return UIntType(clamped * float(std::numeric_limits<UIntType>::max()) + 0.5f);
+    }
+
+    static float toUnit(UIntType value) { return float(value) / float(std::numeric_limits<UIntType>::max()); }
+};
+
+template <> struct SampleTraits<uint8_t> : UNormSampleTraits<uint8_t> {};
+template <> struct SampleTraits<uint16_t> : UNormSampleTraits<uint16_t> {};
+
 // The AUTO filter mode uses a box filter if the sampling_extents is finer than
-// the grid resolution. Otherwise it uses MultiResGrid filtering.
-enum class FilterMode { BOX, MULTIRES, AUTO };
+// the grid resolution. Otherwise it uses MultiResGrid filtering, or REDUCE if
+// the lattice is at least REDUCE_MIN_VOXELS_PER_CELL times coarser than the
+// grid along every axis.
+// The SPARSE_BOX filter mode produces exactly the same output as BOX, but it
+// only samples the parts of the lattice which overlap leaf nodes or
+// non-background tiles of the grid; the rest of the lattice is filled with the
+// background value. AUTO uses SPARSE_BOX instead of BOX when the grid has a
+// linear transform.
+// The REDUCE filter mode sets every cell to the average of the grid voxels
+// falling into it, by iterating the leaf nodes and tiles of the grid directly.
+// It requires a transform whose index space axes are aligned with the world
+// space axes, and a lattice not finer than the grid; otherwise BOX filtering
+// is used instead.
+enum class FilterMode { BOX, MULTIRES, AUTO, SPARSE_BOX, REDUCE };
+
+constexpr double REDUCE_MIN_VOXELS_PER_CELL = 4.0;
+
+// Grids of the following value types can be sampled: float, double, int32,
+// int64, Vec3s and Vec3d (see processTypedGrid). Samples are always scalar:
+// integer values are interpolated as floats, and vector values are reduced to
+// scalars according to the ScalarReduction. BOX filtering reduces the
+// interpolated vectors, REDUCE filtering reduces every voxel before averaging.
+// Only float and double grids support MULTIRES filtering; for the other types
+// it falls back to BOX.
+// Float and double grids of class GRID_LEVEL_SET are sampled as fog-like
+// occupancy instead of signed distances, see ScalarReducer; their value range
+// is [0, 1]. SPARSE_BOX fills the lattice blocks inside the interior tiles
+// without sampling them.
+enum class ScalarReduction { LENGTH, AVERAGE, COMPONENT_X, COMPONENT_Y, COMPONENT_Z };
 
 // A callable ProgressCallback parameter can be passed to the sampleGrid function.
 // The progress callback is called by passing a single uint32_t parameter to
@@ -49,19 +118,248 @@ struct ProgressCallbackNoOp {
     bool operator()(uint32_t) { return true; }
 };
 
+typedef openvdb::tools::MultiResGrid<openvdb::FloatTree> FloatMultiResGrid;
+
+// A callable MultiResProvider parameter can be passed to the sampleGrid function.
+// It is only called if a FloatGrid is sampled with MULTIRES filtering, with the
+// grid and the number of levels needed, and it should return a MultiResGrid built
+// from the grid with at least that many levels. This allows reusing pyramids
+// across calls.
+// The default MultiResProvider builds a new MultiResGrid every time, as is
+// always done for double grids.
+struct MultiResProviderNew {
+    FloatMultiResGrid::ConstPtr operator()(const openvdb::FloatGrid& grid, size_t num_levels)
+    {
+        return FloatMultiResGrid::ConstPtr(new FloatMultiResGrid(num_levels, grid));
+    }
+};
+
 // Possible results.
-enum class Result { SUCCESS, EMPTY_VOLUME, INTERRUPTED, UNKNOWN_FILTER_MODE };
+enum class Result { SUCCESS, EMPTY_VOLUME, INTERRUPTED, UNKNOWN_FILTER_MODE, UNSUPPORTED_GRID_TYPE };
+
+// Calls op(grid) with the grid cast to its actual type, if that is one of the
+// grid types supported by the sampling functions. Returns false otherwise.
+template <typename GridOp>
+bool processTypedGrid(const openvdb::GridBase& grid, GridOp& op);
 
-// Sample an openvdb FloatGrid on a regular 3D grid of points.
+inline bool isSupportedGridType(const openvdb::GridBase& grid);
+
+// Sample an openvdb grid on a regular 3D grid of points.
 // Store the sample values in a contiguous buffer out_data.
-template <typename RealType, typename ProgressCallback = ProgressCallbackNoOp>
+// RealType can be float, half, uint8_t or uint16_t; see SampleTraits.
+// The sampling code is instantiated for the type of the grid, so there are no
+// per-sample type dispatches.
+// The points span the bounding box of the grid. If region_world is not null,
+// the bounding box is clipped to the voxels overlapping that world space box
+// first, so that all the points are spent on the region (e.g. to inspect a
+// part of the grid up close). The same region has to be passed to
+// computeSamplingExtents. Grids not overlapping the region are empty.
+template <typename RealType, typename GridType, typename ProgressCallback = ProgressCallbackNoOp, typename MultiResProvider = MultiResProviderNew>
+Result sampleGrid(
+        const GridType& grid,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        FilterMode filter_mode = FilterMode::AUTO,
+        ProgressCallback progress_callback = ProgressCallback(),
+        MultiResProvider multires_provider = MultiResProvider(),
+        ScalarReduction reduction = ScalarReduction::LENGTH,
+        const openvdb::BBoxd* region_world = nullptr);
+
+// Same as above for a grid of any supported type, see processTypedGrid.
+// Returns UNSUPPORTED_GRID_TYPE for other grids.
+template <typename RealType, typename ProgressCallback = ProgressCallbackNoOp, typename MultiResProvider = MultiResProviderNew>
 Result sampleGrid(
-        const openvdb::FloatGrid& grid,
+        const openvdb::GridBase& grid,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        FilterMode filter_mode = FilterMode::AUTO,
+        ProgressCallback progress_callback = ProgressCallback(),
+        MultiResProvider multires_provider = MultiResProvider(),
+        ScalarReduction reduction = ScalarReduction::LENGTH,
+        const openvdb::BBoxd* region_world = nullptr);
+
+// Out-of-core version of sampleGrid with FilterMode::AUTO, for grids which
+// don't fit into memory. load_grid has to return a new instance of the grid
+// (a GridBase::Ptr) read from a file opened with delayed loading, so that only
+// the topology of the grid is resident, and the leaf buffers are read on
+// demand. The lattice is sampled in slabs along z, and the leaf nodes are
+// removed from the grid as soon as no remaining slab reads them, which keeps
+// the loaded leaf buffers within memory_budget_bytes, or within what a single
+// lattice slice (REDUCE) or layer of blocks (SPARSE_BOX) reads, if that is
+// more. Unless the grid is a level set, the value range is computed in a
+// streaming pass over a second instance of the grid first.
+// The output is identical to that of sampleGrid, provided that
+// canSampleOutOfCore returns true for the grid; otherwise UNKNOWN_FILTER_MODE
+// is returned.
+template <typename RealType, typename GridLoader, typename ProgressCallback = ProgressCallbackNoOp>
+Result sampleGridOutOfCore(
+        GridLoader load_grid,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        size_t memory_budget_bytes,
+        ProgressCallback progress_callback = ProgressCallback(),
+        ScalarReduction reduction = ScalarReduction::LENGTH,
+        const openvdb::BBoxd* region_world = nullptr);
+
+// Returns true if FilterMode::AUTO picks a filtering for the grid which can be
+// done out of core: REDUCE, or SPARSE_BOX with an axis aligned transform.
+// MULTIRES pyramids are built from the whole grid, so they can't be.
+inline bool canSampleOutOfCore(
+        const openvdb::GridBase& grid,
+        const openvdb::Coord& sampling_extents,
+        const openvdb::BBoxd* region_world = nullptr);
+
+// Checksums of the topology and the values of a grid, see computeGridChecksums.
+struct GridChecksums {
+    struct Node {
+        openvdb::CoordBBox bbox;
+        uint64_t checksum;
+    };
+
+    // Covers the grid type, class, background and transform.
+    uint64_t grid_checksum;
+    // The leaf nodes and the non-background tiles, ordered by bbox.
+    std::vector<Node> nodes;
+
+    GridChecksums() : grid_checksum(0) {}
+};
+
+// Computes a checksum of the value mask and the values of every leaf node, and
+// of the value and the state of every non-background tile of the grid.
+// Returns false for unsupported grid types, see processTypedGrid.
+inline bool computeGridChecksums(const openvdb::GridBase& grid, GridChecksums& out_checksums);
+
+// Incremental version of sampleGrid for grids which only differ in some of
+// their nodes from a grid sampled before, e.g. adjacent frames of a simulation.
+// prev_header and prev_data hold the samples of the previous grid, taken with
+// the same sampling_extents, filter_mode, reduction and region, and
+// prev_checksums are its checksums (see computeGridChecksums). Only the lattice
+// blocks (slices with REDUCE filtering) which can read nodes whose checksums
+// differ are sampled; the rest of the samples are copied from prev_data, which
+// may be the same buffer as out_data.
+// The samples are encoded over the value range of the previous samples, so
+// that the copied ones stay valid. If that doesn't cover the value range of the
+// grid, or the grids aren't comparable (the transform, background or sampled
+// bounding box differ, or the transform isn't linear), the whole grid is
+// sampled as with sampleGrid. Otherwise the output is the same as that of
+// sampleGrid, except for the value range.
+// If out_num_sampled_cells is not null, it is set to the number of lattice
+// cells which have been sampled.
+template <typename RealType, typename ProgressCallback = ProgressCallbackNoOp, typename MultiResProvider = MultiResProviderNew>
+Result sampleGridDelta(
+        const openvdb::GridBase& grid,
+        const GridChecksums& checksums,
+        const GridChecksums& prev_checksums,
+        const SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& prev_header,
+        const RealType* prev_data,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        FilterMode filter_mode = FilterMode::AUTO,
+        ProgressCallback progress_callback = ProgressCallback(),
+        MultiResProvider multires_provider = MultiResProvider(),
+        ScalarReduction reduction = ScalarReduction::LENGTH,
+        const openvdb::BBoxd* region_world = nullptr,
+        size_t* out_num_sampled_cells = nullptr);
+
+// Describes how the samples of multiple channels are laid out in an output
+// buffer: the sample of channel c in lattice cell i is stored at
+// out_data[i * cell_stride + c * channel_stride]. Cells are ordered with x
+// changing the fastest, then y, then z.
+struct ChannelLayout {
+    size_t cell_stride;
+    size_t channel_stride;
+
+    // The channels are stored one after the other, plane_size samples apart.
+    // plane_size can be larger than the number of cells, e.g. to leave room
+    // for a header between the planes.
+    static ChannelLayout planar(size_t plane_size) { return { 1, plane_size }; }
+    // The samples of the channels are stored next to each other in each cell.
+    static ChannelLayout interleaved(size_t num_channels) { return { num_channels, 1 }; }
+};
+
+// Sample several openvdb grids (e.g. the channels of a volume) on the same
+// regular 3D grid of points, in a single traversal of the points. The points
+// span the union of the bounding boxes of the grids. Channel c holds the
+// samples of grids[c], stored in out_data according to layout, and its header
+// is written to out_headers[c]. Empty grids sample their background value.
+// The grids can be of different supported types; vector grids are reduced with
+// the same ScalarReduction. Returns UNSUPPORTED_GRID_TYPE if any of the grids
+// isn't supported.
+// REDUCE filtering isn't available for multiple grids; AUTO and REDUCE pick
+// MULTIRES or (SPARSE_)BOX filtering for each channel separately.
+template <typename RealType, typename ProgressCallback = ProgressCallbackNoOp, typename MultiResProvider = MultiResProviderNew>
+Result sampleGrids(
+        const std::vector<const openvdb::GridBase*>& grids,
         const openvdb::Coord& sampling_extents,
-        SampleBufferHeader<RealType>& out_header,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>* out_headers,
         RealType* out_data,
+        const ChannelLayout& layout,
         FilterMode filter_mode = FilterMode::AUTO,
-        ProgressCallback progress_callback = ProgressCallback());
+        ProgressCallback progress_callback = ProgressCallback(),
+        MultiResProvider multires_provider = MultiResProvider(),
+        ScalarReduction reduction = ScalarReduction::LENGTH,
+        const openvdb::BBoxd* region_world = nullptr);
+
+// The default maximum number of lattice cells along an axis, the largest 3D
+// texture size commonly supported by GPUs.
+constexpr int MAX_SAMPLING_EXTENT = 2048;
+
+// Distribute a budget of voxel_budget lattice cells over the world space
+// bounding box of the grid, so that the lattice cells are (nearly) cubic.
+// If cap_to_grid_resolution is set, no axis gets more cells than the grid has
+// voxels along it. No axis gets more than max_extent cells. If region_world is
+// not null, the budget is distributed over the part of the bounding box
+// overlapping it, see sampleGrid.
+inline openvdb::Coord computeSamplingExtents(
+        const openvdb::GridBase& grid,
+        uint64_t voxel_budget,
+        bool cap_to_grid_resolution,
+        int max_extent = MAX_SAMPLING_EXTENT,
+        const openvdb::BBoxd* region_world = nullptr);
+
+// Same as above, for the union of the bounding boxes of the grids, as sampled by
+// sampleGrids. With cap_to_grid_resolution no axis gets more cells than the
+// finest grid has voxels along the union.
+template <typename GridType>
+openvdb::Coord computeSamplingExtents(
+        const std::vector<const GridType*>& grids,
+        uint64_t voxel_budget,
+        bool cap_to_grid_resolution,
+        int max_extent = MAX_SAMPLING_EXTENT,
+        const openvdb::BBoxd* region_world = nullptr);
+
+// Same as above, for a lattice spanning a box of the given world space size
+// (e.g. the size in the header of a sampled volume). If max_cells is not null,
+// no axis gets more cells than it has.
+inline openvdb::Coord computeSamplingExtents(
+        const openvdb::Vec3d& size,
+        const openvdb::Coord* max_cells,
+        uint64_t voxel_budget,
+        int max_extent = MAX_SAMPLING_EXTENT);
+
+// Returns the world space box spanned by the lattice of sampleGrid: the
+// bounding box of the grid, clipped to the region if it's not null. Empty if
+// the grid doesn't overlap the region. sampleGrids spans the union of the
+// boxes of its grids.
+inline openvdb::BBoxd computeSamplingBounds(
+        const openvdb::GridBase& grid,
+        const openvdb::BBoxd* region_world = nullptr);
+
+// Resamples the samples of a lattice onto a lattice spanning the same box,
+// which mustn't be finer along any axis, with a box filter: every output cell
+// is the average of the input cells it overlaps, weighted by the overlap.
+// Samples are averaged as normalized values, so the output has the same header
+// as the input. The output slices are filtered in parallel.
+template <typename RealType>
+void downsampleSamples(
+        const openvdb::Coord& extents,
+        const RealType* data,
+        const openvdb::Coord& out_extents,
+        RealType* out_data);
 
 
 // === Implementation ==========================================================
@@ -121,12 +419,29 @@ getIndexSpaceBoundingBox(const openvdb::GridBase& grid)
     }
 }
 
+// Returns the index space bounding box of the grid, clipped to the voxels
+// overlapping the world space region if it's not null; see sampleGrid.
+inline openvdb::CoordBBox
+getSamplingBoundingBox(const openvdb::GridBase& grid, const openvdb::BBoxd* region_world)
+{
+    auto bbox_is = getIndexSpaceBoundingBox(grid);
+    if (!region_world || bbox_is.empty())
+        return bbox_is;
+
+    if (region_world->empty())
+        return {};
+    const auto region_is = grid.transform().worldToIndex(*region_world);
+    bbox_is.intersect(openvdb::CoordBBox(
+        openvdb::Coord::floor(region_is.min()), openvdb::Coord::ceil(region_is.max())));
+    return bbox_is;
+}
+
 template <typename RealType>
 struct ValueRange {
 public:
     ValueRange()
         : m_min(std::numeric_limits<RealType>::max())
-        , m_max(std::numeric_limits<RealType>::min())
+        , m_max(std::numeric_limits<RealType>::lowest())
     {}
     ValueRange(RealType min_, RealType max_)
         : m_min(min_)
@@ -142,6 +457,12 @@ public:
         m_max = std::max(m_max, value);
     }
 
+    void addRange(const ValueRange& range)
+    {
+        addValue(range.getMin());
+        addValue(range.getMax());
+    }
+
 private:
     RealType m_min, m_max;
 };
@@ -166,174 +487,2566 @@ void setHeader(
 }
 
 
-template <typename SamplingFunc, typename SampleType, typename ProgressCallback = ProgressCallbackNoOp>
-Result sampleVolume(
-        const openvdb::Coord& extents,
-        SamplingFunc sampling_func,
-        SampleType* out_samples,
-        FloatRange& out_value_range,
-        ProgressCallback pcb = ProgressCallback())
-{
-    const auto domain = openvdb::CoordBBox(openvdb::Coord(0, 0, 0),
-                                           extents - openvdb::Coord(1, 1, 1));
-    if (domain.empty())
-        return Result::EMPTY_VOLUME;
+// Samples a tree with trilinear interpolation through a ValueAccessor.
+// Accessors cache the nodes visited by the previous lookup, which pays off when
+// consecutive samples are close to each other, but they are not thread-safe:
+// every task has to sample through its own instance.
+// Integer values are interpolated as floats; BoxSampler would interpolate
+// them in the integer type, truncating the results.
+template <typename TreeType>
+class TreeBoxSampler {
+public:
+    typedef std::is_integral<typename TreeType::ValueType> IsIntegral;
+    typedef typename std::conditional<IsIntegral::value, float, typename TreeType::ValueType>::type ValueType;
 
-    const auto num_voxels = domain.volume();
+    explicit TreeBoxSampler(const TreeType& tree) : m_accessor(tree) {}
 
-    // Sample on a lattice.
-    typedef tbb::enumerable_thread_specific<FloatRange> PerThreadRange;
-    PerThreadRange ranges;
-    const openvdb::Vec3i stride = {1, extents.x(), extents.x() * extents.y()};
-    tbb::atomic<bool> cancelled;
-    cancelled = false;
-    tbb::parallel_for(domain,
-        [&sampling_func, &stride, &ranges, out_samples, &pcb, &cancelled]
-        (const openvdb::CoordBBox& bbox)
+    ValueType isSample(const openvdb::Vec3d& pos_is) const
     {
-        const auto local_extents = bbox.extents();
-        const auto progress_step = local_extents.x() * local_extents.y();
+        return sample(IsIntegral(), pos_is);
+    }
 
-        // Loop through local bbox.
-        PerThreadRange::reference this_thread_range = ranges.local();
-        for (auto z = bbox.min().z(); z <= bbox.max().z(); ++z) {
-            for (auto y = bbox.min().y(); y <= bbox.max().y(); ++y) {
-                for (auto x = bbox.min().x(); x <= bbox.max().x(); ++x) {
-                    if (cancelled)
-                        return;
-                    const auto domain_index = openvdb::Vec3i(x, y, z);
-                    const auto linear_index = domain_index.dot(stride);
-                    const auto sample_value = sampling_func(domain_index);
-                    out_samples[linear_index] = sample_value;
-                    this_thread_range.addValue(sample_value);
-                }
-            }
+private:
+    ValueType sample(std::false_type /* is_integral */, const openvdb::Vec3d& pos_is) const
+    {
+        return openvdb::tools::BoxSampler::sample(m_accessor, pos_is);
+    }
 
-            // Invoke progress Callback.
-            if (!pcb(progress_step)) {
-                cancelled = true;
-                return;
-            }
+    ValueType sample(std::true_type /* is_integral */, const openvdb::Vec3d& pos_is) const
+    {
+        const auto ijk = openvdb::Coord::floor(pos_is);
+        const auto uvw = pos_is - ijk.asVec3d();
+        float values[2][2][2];
+        for (int dx = 0; dx < 2; ++dx)
+            for (int dy = 0; dy < 2; ++dy)
+                for (int dz = 0; dz < 2; ++dz)
+                    values[dx][dy][dz] = float(m_accessor.getValue(ijk.offsetBy(dx, dy, dz)));
+
+        const auto lerp = [](float a, float b, double weight) { return a + float((b - a) * weight); };
+        float values_x[2];
+        for (int dx = 0; dx < 2; ++dx) {
+            values_x[dx] = lerp(
+                lerp(values[dx][0][0], values[dx][0][1], uvw.z()),
+                lerp(values[dx][1][0], values[dx][1][1], uvw.z()),
+                uvw.y());
         }
-    });
-    if (cancelled)
-        return Result::INTERRUPTED;
+        return lerp(values_x[0], values_x[1], uvw.x());
+    }
+
+    openvdb::tree::ValueAccessor<const TreeType> m_accessor;
+};
+
+// Converts the values of a grid to the scalars stored in the samples. Scalar
+// values are simply cast, except for the signed distances of level sets, which
+// are converted to a fog-like occupancy: 1 inside and 0 outside, with a
+// smoothstep across the narrow band (0.5 on the surface). The exterior
+// background maps to 0 and the interior tiles to 1, so level sets display like
+// fog volumes, without a separate sdfToFogVolume conversion. Values are taken
+// as floats, so the reducer of an integer grid can be applied to the samples
+// interpolated by TreeBoxSampler. See below for vectors.
+template <typename ValueType>
+class ScalarReducer {
+public:
+    explicit ScalarReducer(ScalarReduction /* reduction */, float level_set_half_width = 0)
+        : m_inv_band_width(level_set_half_width > 0 ? 0.5f / level_set_half_width : 0.0f)
+    {}
 
-    // Merge per-thread value ranges.
-    out_value_range = FloatRange();
-    for (const FloatRange& per_thread_range : ranges) {
-        out_value_range.addValue(per_thread_range.getMin());
-        out_value_range.addValue(per_thread_range.getMax());
+    float operator()(float value) const
+    {
+        if (!isOccupancy())
+            return value;
+        const auto t = clamp(0.5f - value * m_inv_band_width, 0.0f, 1.0f);
+        return t * t * (3.0f - 2.0f * t);
     }
 
-    // Remap sample values to [0, 1].
-    typedef tbb::blocked_range<size_t> tbb_range;
-    tbb::parallel_for(tbb_range(0, num_voxels),
-        [out_samples, &out_value_range](const tbb_range& range) {
-        for (auto i = range.begin(); i < range.end(); ++i) {
-            out_samples[i] = unlerp(
-                out_value_range.getMin(),
-                out_value_range.getMax(),
-                out_samples[i]);
+    // Returns true if the values are converted to occupancy, which is in [0, 1].
+    bool isOccupancy() const { return m_inv_band_width > 0; }
+
+    // Widens a range of reduced voxel values, so that it bounds the reduced
+    // values interpolated between the voxels as well. The occupancy is
+    // monotonic in the distance, so it doesn't need widening either.
+    FloatRange boundInterpolated(const FloatRange& range) const { return range; }
+
+private:
+    float m_inv_band_width;
+};
+
+template <typename T>
+class ScalarReducer<openvdb::math::Vec3<T>> {
+public:
+    explicit ScalarReducer(ScalarReduction reduction, float /* level_set_half_width */ = 0)
+        : m_reduction(reduction)
+    {}
+
+    float operator()(const openvdb::math::Vec3<T>& value) const
+    {
+        switch (m_reduction) {
+        case ScalarReduction::AVERAGE:
+            return float((value.x() + value.y() + value.z()) / T(3));
+        case ScalarReduction::COMPONENT_X:
+            return float(value.x());
+        case ScalarReduction::COMPONENT_Y:
+            return float(value.y());
+        case ScalarReduction::COMPONENT_Z:
+            return float(value.z());
+        case ScalarReduction::LENGTH:
+        default:
+            return float(value.length());
         }
-    });
+    }
 
-    return Result::SUCCESS;
+    bool isOccupancy() const { return false; }
+
+    // The components and their average are linear, but the length of an
+    // interpolated vector can be shorter than any of the voxel vectors.
+    FloatRange boundInterpolated(const FloatRange& range) const
+    {
+        if (m_reduction == ScalarReduction::LENGTH)
+            return FloatRange(std::min(range.getMin(), 0.0f), range.getMax());
+        return range;
+    }
+
+private:
+    ScalarReduction m_reduction;
+};
+
+// Returns the half-width of the narrow band of a floating point level set,
+// which is its background value, or zero if the grid isn't a level set.
+template <typename GridType>
+inline float getLevelSetHalfWidth(std::true_type /* is_floating_point */, const GridType& grid)
+{
+    const auto half_width = float(grid.background());
+    return grid.getGridClass() == openvdb::GRID_LEVEL_SET && half_width > 0 ? half_width : 0.0f;
 }
 
-} // namespace detail
+template <typename GridType>
+inline float getLevelSetHalfWidth(std::false_type /* is_floating_point */, const GridType&)
+{
+    return 0.0f;
+}
 
+// Creates the reducer of the values of a grid; level sets are detected from
+// their grid class and converted to occupancy.
+template <typename GridType>
+inline ScalarReducer<typename GridType::ValueType> makeScalarReducer(const GridType& grid, ScalarReduction reduction)
+{
+    typedef typename GridType::ValueType ValueType;
+    return ScalarReducer<ValueType>(
+        reduction, getLevelSetHalfWidth(std::is_floating_point<ValueType>(), grid));
+}
 
-template <typename RealType, typename ProgressCallback>
-Result sampleGrid(
-        const openvdb::FloatGrid& grid,
-        const openvdb::Coord& sampling_extents,
-        SampleBufferHeader<RealType>& out_header,
-        RealType* out_data,
-        FilterMode filter_mode,
-        ProgressCallback pcb)
+// Wraps an index space sampler (e.g. TreeBoxSampler) to return scalar samples.
+template <typename IndexSampler, typename Reducer>
+class ReducingSampler {
+public:
+    typedef float ValueType;
+
+    ReducingSampler(const IndexSampler& sampler, const Reducer& reducer)
+        : m_sampler(sampler)
+        , m_reducer(reducer)
+    {}
+
+    float isSample(const openvdb::Vec3d& pos_is) const
+    {
+        return m_reducer(m_sampler.isSample(pos_is));
+    }
+
+private:
+    IndexSampler m_sampler;
+    Reducer m_reducer;
+};
+
+template <typename IndexSampler, typename Reducer>
+inline ReducingSampler<IndexSampler, Reducer> makeReducingSampler(const IndexSampler& sampler, const Reducer& reducer)
 {
-    assert(out_data);
+    return ReducingSampler<IndexSampler, Reducer>(sampler, reducer);
+}
 
-    const auto grid_bbox_is = detail::getIndexSpaceBoundingBox(grid);
-    const auto bbox_world = grid.transform().indexToWorld(grid_bbox_is);
+// MULTIRES filtering is only supported for floating point scalar trees.
+template <typename TreeType>
+struct SupportsMultiRes : std::is_floating_point<typename TreeType::ValueType> {};
 
-    // Return if the grid bbox is empty.
-    if (grid_bbox_is.empty()) {
-        detail::setHeader<RealType>({0, 0}, bbox_world, out_header);
-        return Result::EMPTY_VOLUME;
+// Returns a MultiResGrid with num_levels levels built from the grid. Pyramids of
+// FloatGrids come from the MultiResProvider, others are built from scratch.
+template <typename MultiResProvider>
+inline FloatMultiResGrid::ConstPtr getMultiResGrid(
+        MultiResProvider& multires_provider, const openvdb::FloatGrid& grid, size_t num_levels)
+{
+    return multires_provider(grid, num_levels);
+}
+
+template <typename MultiResProvider, typename GridType>
+inline typename openvdb::tools::MultiResGrid<typename GridType::TreeType>::ConstPtr getMultiResGrid(
+        MultiResProvider& /* multires_provider */, const GridType& grid, size_t num_levels)
+{
+    typedef openvdb::tools::MultiResGrid<typename GridType::TreeType> MultiResGridType;
+    return typename MultiResGridType::ConstPtr(new MultiResGridType(num_levels, grid));
+}
+
+// Samples a MultiResGrid at a fractional level. The result is the same as the
+// one of MultiResGrid::sampleValue<1>, but the two levels involved are sampled
+// through cached accessors instead of creating new ones for every sample.
+// Not thread-safe; see TreeBoxSampler.
+template <typename TreeType>
+class MultiResSampler {
+public:
+    typedef typename TreeType::ValueType ValueType;
+
+    // Levels beyond the coarsest level of the pyramid are clamped.
+    MultiResSampler(const openvdb::tools::MultiResGrid<TreeType>& multires, double level)
+        : m_level0(std::min(size_t(std::floor(level)), multires.coarsestLevel()))
+        , m_level1(std::min(size_t(std::ceil(level)), multires.coarsestLevel()))
+        , m_scale0(1.0 / double(size_t(1) << m_level0))
+        , m_scale1(1.0 / double(size_t(1) << m_level1))
+        , m_weight0(ValueType(double(m_level1) - level))
+        , m_accessor0(multires.constTree(m_level0))
+        , m_accessor1(multires.constTree(m_level1))
+    {}
+
+    ValueType isSample(const openvdb::Vec3d& pos_is) const
+    {
+        const ValueType value0 = openvdb::tools::BoxSampler::sample(m_accessor0, pos_is * m_scale0);
+        if (m_level0 == m_level1)
+            return value0;
+        const ValueType value1 = openvdb::tools::BoxSampler::sample(m_accessor1, pos_is * m_scale1);
+        return m_weight0 * value0 + (ValueType(1) - m_weight0) * value1;
     }
 
-    const auto grid_extents = grid_bbox_is.extents().asVec3d();
-    const auto max_lod = detail::getLOD(grid_extents);
-    const auto num_levels = int(openvdb::math::Ceil(max_lod));
+private:
+    size_t m_level0, m_level1;
+    double m_scale0, m_scale1;
+    ValueType m_weight0;
+    openvdb::tree::ValueAccessor<const TreeType> m_accessor0;
+    openvdb::tree::ValueAccessor<const TreeType> m_accessor1;
+};
 
-    if (filter_mode == FilterMode::AUTO) {
-        if (num_levels > 1) {
-            filter_mode = FilterMode::MULTIRES;
+// Maps lattice cells to positions over bbox_world, and samples them with an
+// index space sampler (e.g. TreeBoxSampler).
+// If the grid transform is linear, the lattice maps to a regular grid in index
+// space as well, so the index space position of the first cell and the per-axis
+// steps are precomputed, and rows of cells are sampled by adding up the step
+// along x. Other (e.g. frustum) transforms go through world space and
+// Transform::worldToIndex for every cell.
+template <typename IndexSampler>
+class LatticeSampler {
+public:
+    typedef typename IndexSampler::ValueType ValueType;
+
+    LatticeSampler(
+            const IndexSampler& sampler,
+            const openvdb::math::Transform& transform,
+            const openvdb::BBoxd& bbox_world,
+            const openvdb::Coord& extents)
+        : m_sampler(sampler)
+        , m_transform(&transform)
+        , m_origin(bbox_world.min())
+        , m_size(bbox_world.extents())
+        , m_extents(extents.asVec3d())
+        , m_is_linear(transform.isLinear())
+    {
+        if (!m_is_linear)
+            return;
+
+        // The steps are measured over the whole lattice to minimize rounding errors.
+        const auto cell_size = m_size / m_extents;
+        const auto first_cell_ws = m_origin + 0.5 * cell_size;
+        m_origin_is = transform.worldToIndex(first_cell_ws);
+        m_step_x_is = (transform.worldToIndex(first_cell_ws + openvdb::Vec3d(m_size.x(), 0, 0)) - m_origin_is) / m_extents.x();
+        m_step_y_is = (transform.worldToIndex(first_cell_ws + openvdb::Vec3d(0, m_size.y(), 0)) - m_origin_is) / m_extents.y();
+        m_step_z_is = (transform.worldToIndex(first_cell_ws + openvdb::Vec3d(0, 0, m_size.z())) - m_origin_is) / m_extents.z();
+    }
+
+    // Samples the cells [x_begin, x_end] of the lattice row (y, z), and calls
+    // consume(i, value) with the i-th sample of the row.
+    template <typename Consumer>
+    void sampleRow(int x_begin, int x_end, int y, int z, Consumer& consume) const
+    {
+        if (m_is_linear) {
+            auto pos_is = m_origin_is + double(x_begin) * m_step_x_is +
+                double(y) * m_step_y_is + double(z) * m_step_z_is;
+            for (int x = x_begin; x <= x_end; ++x) {
+                consume(x - x_begin, m_sampler.isSample(pos_is));
+                pos_is += m_step_x_is;
+            }
         } else {
-            filter_mode = FilterMode::BOX;
+            for (int x = x_begin; x <= x_end; ++x) {
+                const auto domain_index = openvdb::Vec3d(x, y, z);
+                const auto pos_ws = m_origin + (domain_index + 0.5) / m_extents * m_size;
+                consume(x - x_begin, m_sampler.isSample(m_transform->worldToIndex(pos_ws)));
+            }
         }
     }
 
-    const auto domain_extents = sampling_extents.asVec3d();
+private:
+    IndexSampler m_sampler;
+    const openvdb::math::Transform* m_transform;
+    openvdb::Vec3d m_origin;
+    openvdb::Vec3d m_size;
+    openvdb::Vec3d m_extents;
+    bool m_is_linear;
+    // Linear transforms only.
+    openvdb::Vec3d m_origin_is;
+    openvdb::Vec3d m_step_x_is;
+    openvdb::Vec3d m_step_y_is;
+    openvdb::Vec3d m_step_z_is;
+};
 
-    if (filter_mode == FilterMode::MULTIRES) {
-        // Create multiresolution grid.
-        openvdb::tools::MultiResGrid<openvdb::FloatTree> multires(size_t(num_levels), grid);
+template <typename IndexSampler>
+inline LatticeSampler<IndexSampler> makeLatticeSampler(
+        const IndexSampler& sampler,
+        const openvdb::math::Transform& transform,
+        const openvdb::BBoxd& bbox_world,
+        const openvdb::Coord& extents)
+{
+    return LatticeSampler<IndexSampler>(sampler, transform, bbox_world, extents);
+}
 
-        // Calculate sampling LoD level.
-        const auto coarse_voxel_size = grid_extents / sampling_extents.asVec3d();
-        const auto lod_level = detail::clamp(detail::getLOD(coarse_voxel_size), 0, num_levels);
+// The sampling lattice is processed in cubic blocks of cells. Blocks are the
+// unit of work of the parallel loop and the granularity of sparse sampling.
+constexpr int LATTICE_BLOCK_DIM = 8;
 
-        // Set up sampling func.
-        auto sampling_func = [&multires, lod_level, &bbox_world, &domain_extents]
-            (const openvdb::Vec3d& domain_index) -> RealType
-        {
-            const auto pos_ws = bbox_world.min() +
-                (domain_index + 0.5) / domain_extents * bbox_world.extents();
-            const auto pos_is = multires.transform().worldToIndex(pos_ws);
-            return multires.sampleValue<1>(pos_is, lod_level);
-        };
+class LatticeBlocks {
+public:
+    explicit LatticeBlocks(const openvdb::Coord& extents)
+        : m_extents(extents)
+        , m_block_counts(
+            (extents.x() + LATTICE_BLOCK_DIM - 1) / LATTICE_BLOCK_DIM,
+            (extents.y() + LATTICE_BLOCK_DIM - 1) / LATTICE_BLOCK_DIM,
+            (extents.z() + LATTICE_BLOCK_DIM - 1) / LATTICE_BLOCK_DIM)
+    {}
 
-        // Sample the MultiResGrid and fill the output variables.
-        detail::FloatRange value_range;
-        const auto res = detail::sampleVolume(
-                sampling_extents,
-                sampling_func,
-                out_data,
-                value_range,
-                pcb);
-        detail::setHeader<RealType>(value_range, bbox_world, out_header);
-        return res;
+    const openvdb::Coord& blockCounts() const { return m_block_counts; }
 
-    } else if (filter_mode == FilterMode::BOX) {
-        // Set up sampling func.
-        openvdb::tools::GridSampler<
-            openvdb::FloatGrid,
-            openvdb::tools::BoxSampler> sampler(grid);
-        auto sampling_func = [&sampler, &bbox_world, &domain_extents]
-            (const openvdb::Vec3d& domain_index) -> RealType
-        {
-            const auto sample_pos_ws = bbox_world.min() +
-                (domain_index + 0.5) / domain_extents * bbox_world.extents();
-            return sampler.wsSample(sample_pos_ws);
-        };
+    size_t count() const
+    {
+        return size_t(m_block_counts.x()) * size_t(m_block_counts.y()) * size_t(m_block_counts.z());
+    }
 
-        // Sample the grid and fill the output variables.
-        detail::FloatRange value_range;
-        const auto res = detail::sampleVolume(
-                sampling_extents,
-                sampling_func,
-                out_data,
-                value_range,
-                pcb);
-        detail::setHeader<RealType>(value_range, bbox_world, out_header);
-        return res;
+    size_t linearIndex(int bx, int by, int bz) const
+    {
+        return size_t(bx) + size_t(m_block_counts.x()) * (size_t(by) + size_t(m_block_counts.y()) * size_t(bz));
+    }
 
-    } else {
-        return Result::UNKNOWN_FILTER_MODE;
+    // Returns the inclusive range of lattice cells covered by the given block.
+    openvdb::CoordBBox cellBBox(size_t block_index) const
+    {
+        const auto bx = int(block_index % size_t(m_block_counts.x()));
+        block_index /= size_t(m_block_counts.x());
+        const auto by = int(block_index % size_t(m_block_counts.y()));
+        const auto bz = int(block_index / size_t(m_block_counts.y()));
+        const auto min = openvdb::Coord(bx, by, bz) * LATTICE_BLOCK_DIM;
+        const auto max = openvdb::Coord::minComponent(
+            min + openvdb::Coord(LATTICE_BLOCK_DIM - 1), m_extents - openvdb::Coord(1));
+        return { min, max };
+    }
+
+private:
+    openvdb::Coord m_extents;
+    openvdb::Coord m_block_counts;
+};
+
+// Returns true if the index space axes of the transform are mapped to the
+// world space axes of the same name, i.e. the transform is a (possibly
+// negative) scale and a translation. out_flip is set for the axes along which
+// the index and world space directions are opposite.
+inline bool getAxisAlignment(const openvdb::math::Transform& transform, bool out_flip[3])
+{
+    if (!transform.isLinear())
+        return false;
+
+    const auto origin_ws = transform.indexToWorld(openvdb::Vec3d(0, 0, 0));
+    for (int axis = 0; axis < 3; ++axis) {
+        openvdb::Vec3d unit_is(0, 0, 0);
+        unit_is[axis] = 1;
+        const auto dir_ws = transform.indexToWorld(unit_is) - origin_ws;
+        const auto scale = std::abs(dir_ws[axis]);
+        if (scale == 0)
+            return false;
+        for (int other_axis = 0; other_axis < 3; ++other_axis) {
+            if (other_axis != axis && std::abs(dir_ws[other_axis]) > 1e-6 * scale)
+                return false;
+        }
+        out_flip[axis] = dir_ws[axis] < 0;
+    }
+    return true;
+}
+
+// Marks the lattice blocks which have to be sampled; the cells of unmarked
+// blocks are known to sample the background value of every channel. The blocks
+// of single channel masks which only read the voxels of a constant tile (e.g.
+// the interior of a level set) are marked as FILLED with the reduced value of
+// the tile instead. The samples of KEPT blocks are already in the output
+// buffer, see sampleGridDelta.
+struct BlockMask {
+    enum : uint8_t { BACKGROUND = 0, SAMPLED = 1, FILLED = 2, KEPT = 3 };
+
+    std::vector<uint8_t> active;
+    std::vector<float> backgrounds;
+    // Fill values of the FILLED blocks, indexed by block.
+    std::vector<float> fills;
+};
+
+// Computes the inclusive range of lattice cells along one axis whose centers
+// fall into the world space interval [lo, hi]. The range is widened by a cell
+// on both sides to stay conservative in the face of rounding errors.
+// Returns false if the range doesn't overlap the lattice.
+inline bool getLatticeCellRange(
+        double lo, double hi,
+        double lattice_origin, double lattice_size, int lattice_extent,
+        int& out_first, int& out_last)
+{
+    if (lattice_size <= 0) {
+        // Degenerate axis: every cell center lies on the same plane.
+        out_first = 0;
+        out_last = lattice_extent - 1;
+        return lo <= lattice_origin && lattice_origin <= hi;
+    }
+
+    const auto scale = double(lattice_extent) / lattice_size;
+    const auto first = std::floor((lo - lattice_origin) * scale - 0.5) - 1;
+    const auto last = std::ceil((hi - lattice_origin) * scale - 0.5) + 1;
+    if (last < 0 || first > lattice_extent - 1)
+        return false;
+
+    out_first = int(std::max(first, 0.0));
+    out_last = int(std::min(last, double(lattice_extent - 1)));
+    return true;
+}
+
+// Inner counterpart of getLatticeCellRange: computes the inclusive range of
+// lattice cells along one axis whose centers are known to fall into the world
+// space interval [lo, hi], narrowed by a cell on both sides.
+// Returns false if the range is empty.
+inline bool getInnerLatticeCellRange(
+        double lo, double hi,
+        double lattice_origin, double lattice_size, int lattice_extent,
+        int& out_first, int& out_last)
+{
+    if (lattice_size <= 0) {
+        out_first = 0;
+        out_last = lattice_extent - 1;
+        return lo <= lattice_origin && lattice_origin <= hi;
+    }
+
+    const auto scale = double(lattice_extent) / lattice_size;
+    const auto first = std::ceil((lo - lattice_origin) * scale - 0.5) + 1;
+    const auto last = std::floor((hi - lattice_origin) * scale - 0.5) - 1;
+    out_first = int(std::max(first, 0.0));
+    out_last = int(std::min(last, double(lattice_extent - 1)));
+    return first <= last && out_first <= out_last;
+}
+
+// Returns the world space bounding box of the union of the non-empty grids,
+// each clipped to the region; see getSamplingBoundingBox.
+template <typename GridType>
+openvdb::BBoxd getWorldBoundingBox(const std::vector<const GridType*>& grids, const openvdb::BBoxd* region_world)
+{
+    openvdb::BBoxd bbox_world;
+    for (const GridType* grid : grids) {
+        const auto grid_bbox_is = getSamplingBoundingBox(*grid, region_world);
+        if (!grid_bbox_is.empty())
+            bbox_world.expand(grid->transform().indexToWorld(grid_bbox_is));
+    }
+    return bbox_world;
+}
+
+// Distributes a budget of voxel_budget lattice cells over a box of the given
+// size, see computeSamplingExtents. If max_cells is not null, the extents are
+// capped to it as well.
+inline openvdb::Coord computeLatticeExtents(
+        const openvdb::Vec3d& size,
+        const openvdb::Coord* max_cells,
+        uint64_t voxel_budget,
+        int max_extent)
+{
+    const auto max_size = maxComponentValue(size);
+
+    // Axes which are flat compared to the largest one get a single cell; the
+    // budget is distributed over the remaining ones.
+    double size_product = 1;
+    int num_axes = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (size[axis] > max_size * 1e-6) {
+            size_product *= size[axis];
+            ++num_axes;
+        }
+    }
+    if (num_axes == 0 || voxel_budget == 0)
+        return { 1, 1, 1 };
+
+    const auto cells_per_unit = std::pow(double(voxel_budget) / size_product, 1.0 / num_axes);
+    openvdb::Coord extents(1, 1, 1);
+    for (int axis = 0; axis < 3; ++axis) {
+        if (size[axis] <= max_size * 1e-6)
+            continue;
+        auto axis_extent = std::llround(size[axis] * cells_per_unit);
+        if (max_cells)
+            axis_extent = std::min<long long>(axis_extent, (*max_cells)[axis]);
+        extents[axis] = int(clamp<long long>(axis_extent, 1, max_extent));
+    }
+    return extents;
+}
+
+// Rasterizes the bounds of the leaf nodes and the non-background tiles of the
+// grid into the blocks of the sampling lattice, and adds the reduced background
+// value of the grid as the background of the next channel of the mask.
+// BoxSampler reads the 2x2x2 voxels around the sample position, so node bounds
+// are dilated by a voxel. Only valid for grids with a linear transform.
+template <typename GridType>
+void rasterizeTopology(
+        const GridType& grid,
+        const openvdb::BBoxd& bbox_world,
+        const openvdb::Coord& extents,
+        const ScalarReducer<typename GridType::ValueType>& reduce,
+        BlockMask& mask)
+{
+    typedef typename GridType::TreeType TreeType;
+
+    const LatticeBlocks blocks(extents);
+    if (mask.active.empty())
+        mask.active.assign(blocks.count(), BlockMask::BACKGROUND);
+    assert(mask.active.size() == blocks.count());
+    mask.backgrounds.push_back(reduce(grid.background()));
+
+    const auto& transform = grid.transform();
+    const auto lattice_origin = bbox_world.min();
+    const auto lattice_size = bbox_world.extents();
+
+    const auto mark_node = [&](const openvdb::CoordBBox& node_bbox_is) {
+        const auto dilated_bbox_is = openvdb::BBoxd(
+            node_bbox_is.min().asVec3d() - openvdb::Vec3d(1),
+            node_bbox_is.max().asVec3d() + openvdb::Vec3d(1));
+        const auto node_bbox_ws = transform.indexToWorld(dilated_bbox_is);
+
+        openvdb::Coord first, last;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!getLatticeCellRange(
+                    node_bbox_ws.min()[axis], node_bbox_ws.max()[axis],
+                    lattice_origin[axis], lattice_size[axis], extents[axis],
+                    first[axis], last[axis]))
+                return;
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            first[axis] /= LATTICE_BLOCK_DIM;
+            last[axis] /= LATTICE_BLOCK_DIM;
+        }
+        for (auto bz = first.z(); bz <= last.z(); ++bz) {
+            for (auto by = first.y(); by <= last.y(); ++by) {
+                const auto row_begin = blocks.linearIndex(first.x(), by, bz);
+                std::fill(
+                    mask.active.begin() + row_begin,
+                    mask.active.begin() + row_begin + (last.x() - first.x() + 1),
+                    uint8_t(BlockMask::SAMPLED));
+            }
+        }
+    };
+
+    // Leaf nodes; inactive voxels are included, since they can hold any value.
+    for (auto leaf_it = grid.tree().cbeginLeaf(); leaf_it; ++leaf_it)
+        mark_node(leaf_it->getNodeBoundingBox());
+
+    // Tiles of the internal and root nodes which differ from the background.
+    typename TreeType::ValueAllCIter tile_it = grid.tree().cbeginValueAll();
+    tile_it.setMaxDepth(TreeType::ValueAllCIter::LEAF_DEPTH - 1);
+    for (; tile_it; ++tile_it) {
+        if (openvdb::math::isExactlyEqual(tile_it.getValue(), grid.background()))
+            continue;
+        openvdb::CoordBBox tile_bbox;
+        tile_it.getBoundingBox(tile_bbox);
+        mark_node(tile_bbox);
     }
+
+    // Fills are only kept for single channel masks, since the other channels
+    // would have to be constant over the same blocks.
+    if (mask.backgrounds.size() > 1) {
+        std::replace(mask.active.begin(), mask.active.end(),
+                     uint8_t(BlockMask::FILLED), uint8_t(BlockMask::SAMPLED));
+        mask.fills.clear();
+        return;
+    }
+
+    // Blocks whose cells only read the voxels of a single tile sample its value
+    // exactly, so they are filled instead, which mostly pays off for the large
+    // interior tiles of level sets. The cells of a tile are found through the
+    // world space bounds of its voxels, which are exact for axis aligned
+    // transforms only. BoxSampler reads up to the voxel after the sample
+    // position, so the bounds are eroded by a voxel at the top.
+    bool flip[3];
+    if (!getAxisAlignment(transform, flip))
+        return;
+    const auto first_block = [](int first_cell) { return (first_cell + LATTICE_BLOCK_DIM - 1) / LATTICE_BLOCK_DIM; };
+    const auto last_block = [](int last_cell, int extent) {
+        return last_cell == extent - 1 ? last_cell / LATTICE_BLOCK_DIM : (last_cell + 1) / LATTICE_BLOCK_DIM - 1;
+    };
+    tile_it = grid.tree().cbeginValueAll();
+    tile_it.setMaxDepth(TreeType::ValueAllCIter::LEAF_DEPTH - 1);
+    for (; tile_it; ++tile_it) {
+        if (openvdb::math::isExactlyEqual(tile_it.getValue(), grid.background()))
+            continue;
+        openvdb::CoordBBox tile_bbox;
+        tile_it.getBoundingBox(tile_bbox);
+        const auto tile_bbox_ws = transform.indexToWorld(openvdb::BBoxd(
+            tile_bbox.min().asVec3d(), tile_bbox.max().asVec3d() - openvdb::Vec3d(1)));
+
+        openvdb::Coord first, last;
+        bool is_empty = false;
+        for (int axis = 0; axis < 3 && !is_empty; ++axis) {
+            is_empty = !getInnerLatticeCellRange(
+                tile_bbox_ws.min()[axis], tile_bbox_ws.max()[axis],
+                lattice_origin[axis], lattice_size[axis], extents[axis],
+                first[axis], last[axis]);
+            if (!is_empty) {
+                first[axis] = first_block(first[axis]);
+                last[axis] = last_block(last[axis], extents[axis]);
+                is_empty = first[axis] > last[axis];
+            }
+        }
+        if (is_empty)
+            continue;
+
+        if (mask.fills.empty())
+            mask.fills.assign(blocks.count(), 0.0f);
+        const auto fill = reduce(tile_it.getValue());
+        for (auto bz = first.z(); bz <= last.z(); ++bz) {
+            for (auto by = first.y(); by <= last.y(); ++by) {
+                for (auto bx = first.x(); bx <= last.x(); ++bx) {
+                    const auto block_index = blocks.linearIndex(bx, by, bz);
+                    mask.active[block_index] = BlockMask::FILLED;
+                    mask.fills[block_index] = fill;
+                }
+            }
+        }
+    }
+}
+
+// Returns the memory needed by a leaf node with its buffer loaded.
+template <typename LeafType>
+inline size_t leafMemoryBytes()
+{
+    return sizeof(LeafType) + sizeof(typename LeafType::ValueType) * LeafType::SIZE;
+}
+
+template <typename TreeType>
+std::vector<const typename TreeType::LeafNodeType*> collectLeaves(const TreeType& tree)
+{
+    std::vector<const typename TreeType::LeafNodeType*> leaves;
+    leaves.reserve(tree.leafCount());
+    for (auto leaf_it = tree.cbeginLeaf(); leaf_it; ++leaf_it)
+        leaves.push_back(&*leaf_it);
+    return leaves;
+}
+
+// Same as above, for the leaves overlapping the index space bbox. Only the
+// topology is visited, so no leaf buffers are loaded.
+template <typename TreeType>
+std::vector<const typename TreeType::LeafNodeType*> collectLeaves(const TreeType& tree, const openvdb::CoordBBox& bbox)
+{
+    std::vector<const typename TreeType::LeafNodeType*> leaves;
+    for (auto leaf_it = tree.cbeginLeaf(); leaf_it; ++leaf_it) {
+        if (bbox.hasOverlap(leaf_it->getNodeBoundingBox()))
+            leaves.push_back(&*leaf_it);
+    }
+    return leaves;
+}
+
+// Returns the range of the reduced values of the grid if it's known without
+// visiting the voxels, which is the case for the occupancy of level sets.
+template <typename GridType>
+bool getKnownValueRange(
+        const GridType& /* grid */,
+        const ScalarReducer<typename GridType::ValueType>& reduce,
+        FloatRange& out_value_range)
+{
+    if (!reduce.isOccupancy())
+        return false;
+    out_value_range = FloatRange(0.0f, 1.0f);
+    return true;
+}
+
+// Returns the range of the background and the non-background tiles of the
+// internal and root nodes.
+template <typename GridType>
+FloatRange computeTileValueRange(const GridType& grid, const ScalarReducer<typename GridType::ValueType>& reduce)
+{
+    typedef typename GridType::TreeType TreeType;
+
+    const auto background = reduce(grid.background());
+    FloatRange value_range(background, background);
+    typename TreeType::ValueAllCIter tile_it = grid.tree().cbeginValueAll();
+    tile_it.setMaxDepth(TreeType::ValueAllCIter::LEAF_DEPTH - 1);
+    for (; tile_it; ++tile_it) {
+        if (!openvdb::math::isExactlyEqual(tile_it.getValue(), grid.background()))
+            value_range.addValue(reduce(tile_it.getValue()));
+    }
+    return value_range;
+}
+
+// Adds the values of the voxels of leaves [begin, end) to the range, in parallel.
+template <typename LeafType, typename Reducer>
+void addLeafValueRange(
+        const std::vector<const LeafType*>& leaves,
+        size_t begin,
+        size_t end,
+        const Reducer& reduce,
+        FloatRange& value_range)
+{
+    typedef tbb::enumerable_thread_specific<FloatRange> PerThreadRange;
+    PerThreadRange ranges;
+    typedef tbb::blocked_range<size_t> tbb_range;
+    tbb::parallel_for(tbb_range(begin, end),
+        [&leaves, &ranges, &reduce](const tbb_range& range) {
+        PerThreadRange::reference this_thread_range = ranges.local();
+        for (auto i = range.begin(); i < range.end(); ++i) {
+            const LeafType& leaf = *leaves[i];
+            for (openvdb::Index offset = 0; offset < LeafType::SIZE; ++offset)
+                this_thread_range.addValue(reduce(leaf.getValue(offset)));
+        }
+    });
+    for (const FloatRange& per_thread_range : ranges)
+        value_range.addRange(per_thread_range);
+}
+
+// Computes a range bounding the scalar values of the voxels the samplers can
+// read: the voxels of the leaves overlapping read_bbox_is (see
+// getReadBoundingBox), including the inactive ones, the non-background tiles
+// and the background. Box filtered and averaged samples are weighted averages
+// of these, so they fall into the range as well; see also
+// ScalarReducer::boundInterpolated. The value range is known up front because
+// OpenVDB doesn't store it in the grid metadata (addStatsMetadata only covers
+// the bbox, the voxel count and the memory usage), so there's no cheaper
+// source that is guaranteed to bound every voxel. Level sets aren't
+// traversed, since their occupancy is in [0, 1], see getKnownValueRange.
+template <typename GridType>
+FloatRange computeValueRange(
+        const GridType& grid,
+        const ScalarReducer<typename GridType::ValueType>& reduce,
+        const openvdb::CoordBBox& read_bbox_is)
+{
+    FloatRange value_range;
+    if (getKnownValueRange(grid, reduce, value_range))
+        return value_range;
+
+    value_range = computeTileValueRange(grid, reduce);
+    const auto leaves = collectLeaves(grid.tree(), read_bbox_is);
+    addLeafValueRange(leaves, 0, leaves.size(), reduce, value_range);
+    return value_range;
+}
+
+// Maps values from a value range to [0, 1], clamping the values outside of it,
+// and converts them to samples; see SampleTraits. The values of a constant
+// range are mapped to zero.
+class SampleEncoder {
+public:
+    explicit SampleEncoder(const FloatRange& value_range)
+        : m_min(value_range.getMin())
+        , m_scale(value_range.getMax() > value_range.getMin() ? 1.0f / (value_range.getMax() - value_range.getMin()) : 0.0f)
+    {}
+
+    template <typename SampleType>
+    SampleType encode(float value) const
+    {
+        return SampleTraits<SampleType>::fromUnit(clamp((value - m_min) * m_scale, 0.0f, 1.0f));
+    }
+
+private:
+    float m_min;
+    float m_scale;
+};
+
+// Adapts a single channel sampling function (see LatticeSampler) to the
+// interface of the multi-channel ones used by sampleChannels.
+template <typename SamplingFunc>
+class SingleChannelSampler {
+public:
+    explicit SingleChannelSampler(const SamplingFunc& sampling_func) : m_sampling_func(sampling_func) {}
+
+    template <typename Consumer>
+    void sampleRow(size_t /* channel */, int x_begin, int x_end, int y, int z, Consumer& consume) const
+    {
+        m_sampling_func.sampleRow(x_begin, x_end, y, z, consume);
+    }
+
+private:
+    SamplingFunc m_sampling_func;
+};
+
+template <typename SamplingFunc>
+inline SingleChannelSampler<SamplingFunc> makeSingleChannelSampler(const SamplingFunc& sampling_func)
+{
+    return SingleChannelSampler<SamplingFunc>(sampling_func);
+}
+
+// Samples every cell of the lattice for every channel of the layout.
+// make_sampling_func is invoked once per task range to create the sampling
+// function used by that range, so that samplers holding ValueAccessors aren't
+// shared between threads; it has to provide
+// sampleRow(channel, x_begin, x_end, y, z, consume).
+// The channels of a row are sampled one after the other, so all of them share
+// the traversal of the lattice.
+// If active_blocks is not null, only the marked blocks are sampled, and the rest
+// are filled with the background values of the channels or the fill values of
+// the blocks, or kept; see BlockMask.
+// The samples of each channel are remapped from its value range (see
+// computeValueRange) to [0, 1] as they are written, so the output is final
+// after a single pass.
+// Only the layers of blocks [block_z_begin, block_z_end) along z are sampled,
+// which allows sampling the lattice in slabs (see sampleSlabs).
+template <typename SamplingFuncFactory, typename SampleType, typename ProgressCallback = ProgressCallbackNoOp>
+Result sampleChannels(
+        const openvdb::Coord& extents,
+        const ChannelLayout& layout,
+        size_t num_channels,
+        SamplingFuncFactory make_sampling_func,
+        SampleType* out_samples,
+        const FloatRange* value_ranges,
+        ProgressCallback pcb = ProgressCallback(),
+        const BlockMask* active_blocks = nullptr,
+        int block_z_begin = 0,
+        int block_z_end = std::numeric_limits<int>::max())
+{
+    const auto domain = openvdb::CoordBBox(openvdb::Coord(0, 0, 0),
+                                           extents - openvdb::Coord(1, 1, 1));
+    if (domain.empty() || num_channels == 0)
+        return Result::EMPTY_VOLUME;
+
+    const LatticeBlocks blocks(extents);
+    assert(!active_blocks || active_blocks->active.size() == blocks.count());
+    assert(!active_blocks || active_blocks->backgrounds.size() == num_channels);
+
+    std::vector<SampleEncoder> encoders;
+    encoders.reserve(num_channels);
+    for (size_t channel = 0; channel < num_channels; ++channel)
+        encoders.emplace_back(value_ranges[channel]);
+
+    // Blocks are ordered along z the slowest, so layers of blocks are contiguous.
+    const auto blocks_per_layer = size_t(blocks.blockCounts().x()) * size_t(blocks.blockCounts().y());
+    block_z_end = std::min(block_z_end, blocks.blockCounts().z());
+    if (block_z_begin >= block_z_end)
+        return Result::SUCCESS;
+
+    // Sample on a lattice, block by block.
+    const openvdb::Vec3i stride = {1, extents.x(), extents.x() * extents.y()};
+    tbb::atomic<bool> cancelled;
+    cancelled = false;
+    typedef tbb::blocked_range<size_t> tbb_range;
+    tbb::parallel_for(tbb_range(size_t(block_z_begin) * blocks_per_layer, size_t(block_z_end) * blocks_per_layer),
+        [&make_sampling_func, &stride, &encoders, &blocks, &layout, num_channels, active_blocks, out_samples, &pcb, &cancelled]
+        (const tbb_range& block_range)
+    {
+        const auto sampling_func = make_sampling_func();
+        const auto cell_stride = layout.cell_stride;
+        for (auto block_index = block_range.begin(); block_index < block_range.end(); ++block_index) {
+            const auto bbox = blocks.cellBBox(block_index);
+
+            const auto block_state = active_blocks ? active_blocks->active[block_index] : uint8_t(BlockMask::SAMPLED);
+            if (block_state == BlockMask::KEPT) {
+                // The samples of the block are left as they are.
+            } else if (block_state != BlockMask::SAMPLED) {
+                // Bulk fill blocks which don't overlap the grid topology, or lie
+                // inside a constant tile.
+                const auto row_length = size_t(bbox.max().x() - bbox.min().x() + 1);
+                for (size_t channel = 0; channel < num_channels; ++channel) {
+                    const auto fill = encoders[channel].encode<SampleType>(
+                        block_state == BlockMask::FILLED ? active_blocks->fills[block_index] : active_blocks->backgrounds[channel]);
+                    for (auto z = bbox.min().z(); z <= bbox.max().z(); ++z) {
+                        for (auto y = bbox.min().y(); y <= bbox.max().y(); ++y) {
+                            SampleType* out_row = out_samples + layout.channel_stride * channel +
+                                cell_stride * size_t(openvdb::Vec3i(bbox.min().x(), y, z).dot(stride));
+                            if (cell_stride == 1) {
+                                std::fill(out_row, out_row + row_length, fill);
+                            } else {
+                                for (size_t i = 0; i < row_length; ++i)
+                                    out_row[i * cell_stride] = fill;
+                            }
+                        }
+                    }
+                }
+            } else {
+                // Loop through the rows of the block.
+                for (auto z = bbox.min().z(); z <= bbox.max().z(); ++z) {
+                    for (auto y = bbox.min().y(); y <= bbox.max().y(); ++y) {
+                        if (cancelled)
+                            return;
+                        const auto row_offset = cell_stride * size_t(openvdb::Vec3i(bbox.min().x(), y, z).dot(stride));
+                        for (size_t channel = 0; channel < num_channels; ++channel) {
+                            SampleType* out_row = out_samples + row_offset + layout.channel_stride * channel;
+                            const SampleEncoder& encoder = encoders[channel];
+                            auto consume = [out_row, cell_stride, &encoder](int i, float value) {
+                                out_row[size_t(i) * cell_stride] = encoder.encode<SampleType>(value);
+                            };
+                            sampling_func.sampleRow(channel, bbox.min().x(), bbox.max().x(), y, z, consume);
+                        }
+                    }
+                }
+            }
+
+            // Invoke progress Callback.
+            if (!pcb(uint32_t(bbox.volume() * num_channels))) {
+                cancelled = true;
+                return;
+            }
+        }
+    });
+    if (cancelled)
+        return Result::INTERRUPTED;
+    return Result::SUCCESS;
+}
+
+// Single channel version of sampleChannels; make_sampling_func has to provide
+// sampleRow(x_begin, x_end, y, z, consume).
+template <typename SamplingFuncFactory, typename SampleType, typename ProgressCallback = ProgressCallbackNoOp>
+Result sampleVolume(
+        const openvdb::Coord& extents,
+        SamplingFuncFactory make_sampling_func,
+        SampleType* out_samples,
+        const FloatRange& value_range,
+        ProgressCallback pcb = ProgressCallback(),
+        const BlockMask* active_blocks = nullptr,
+        int block_z_begin = 0,
+        int block_z_end = std::numeric_limits<int>::max())
+{
+    return sampleChannels(
+        extents,
+        ChannelLayout::planar(size_t(0)),
+        1,
+        [&make_sampling_func]() { return makeSingleChannelSampler(make_sampling_func()); },
+        out_samples,
+        &value_range,
+        pcb,
+        active_blocks,
+        block_z_begin,
+        block_z_end);
+}
+
+// Distributes the voxels of the grid bbox along one axis evenly among the cells
+// of the lattice: the k-th voxel of the bbox goes to cell k * extent / voxel_count,
+// so every cell gets a whole number of voxels, provided that the lattice isn't
+// finer than the grid. If the axis is flipped, the cells are numbered from the
+// other end, so voxel k goes to cell extent - 1 - k * extent / voxel_count.
+class ReductionAxis {
+public:
+    ReductionAxis(int bbox_min, int bbox_max, int extent, bool flip)
+        : m_bbox_min(bbox_min)
+        , m_bbox_max(bbox_max)
+        , m_extent(extent)
+        , m_flip(flip)
+        , m_cells(size_t(bbox_max - bbox_min + 1))
+        , m_first_voxels(size_t(extent) + 1)
+    {
+        const auto voxel_count = int64_t(bbox_max - bbox_min + 1);
+        for (int64_t k = 0; k < voxel_count; ++k) {
+            const auto cell = int(k * extent / voxel_count);
+            m_cells[size_t(k)] = flip ? extent - 1 - cell : cell;
+        }
+        // Voxel k is in unflipped cell c iff ceil(c * voxel_count / extent) <= k < ceil((c + 1) * voxel_count / extent).
+        for (int c = 0; c <= extent; ++c)
+            m_first_voxels[size_t(c)] = bbox_min + int((int64_t(c) * voxel_count + extent - 1) / extent);
+    }
+
+    int bboxMin() const { return m_bbox_min; }
+    int bboxMax() const { return m_bbox_max; }
+
+    // The cell of an index space voxel coordinate within the bbox.
+    int cell(int i) const { return m_cells[size_t(i - m_bbox_min)]; }
+
+    // The index space voxel coordinates [first, last] of a cell. Cells of a
+    // flipped axis cover decreasing coordinates.
+    int firstVoxel(int c) const { return m_first_voxels[size_t(unflippedCell(c))]; }
+    int lastVoxel(int c) const { return m_first_voxels[size_t(unflippedCell(c)) + 1] - 1; }
+    int voxelCount(int c) const { return lastVoxel(c) - firstVoxel(c) + 1; }
+
+    // Returns false if [first, last] doesn't overlap the bbox. Otherwise clips it
+    // to the bbox and returns the inclusive range of cells it overlaps.
+    bool clip(int& first, int& last, int& out_first_cell, int& out_last_cell) const
+    {
+        first = std::max(first, m_bbox_min);
+        last = std::min(last, m_bbox_max);
+        if (first > last)
+            return false;
+        out_first_cell = std::min(cell(first), cell(last));
+        out_last_cell = std::max(cell(first), cell(last));
+        return true;
+    }
+
+private:
+    int unflippedCell(int c) const { return m_flip ? m_extent - 1 - c : c; }
+
+    int m_bbox_min, m_bbox_max;
+    int m_extent;
+    bool m_flip;
+    std::vector<int> m_cells;
+    std::vector<int> m_first_voxels;
+};
+
+// Computes the box filtered average of the voxels of the grid in every cell of
+// the lattice, by accumulating the values of leaf voxels and tiles directly.
+// Voxels not covered by leaves or non-background tiles count as background.
+// Every voxel value is converted to a scalar with reduce before averaging, and
+// the averages are remapped from value_range to [0, 1] as they are written.
+// The lattice maps to the voxels of grid_bbox_is, and the axes of the grid
+// transform have to be aligned with the world axes (see getAxisAlignment).
+// Work is split into lattice z slices; the leaves and tiles are bucketed by the
+// slices they overlap in advance, so that slices can be processed in parallel.
+// Only the slices [slice_begin, slice_end) are computed, and only those marked
+// in slice_mask if it's not null.
+template <typename GridType, typename SampleType, typename ProgressCallback = ProgressCallbackNoOp>
+Result reduceVolume(
+        const GridType& grid,
+        const openvdb::CoordBBox& grid_bbox_is,
+        const bool flip[3],
+        const openvdb::Coord& extents,
+        const ScalarReducer<typename GridType::ValueType>& reduce,
+        const FloatRange& value_range,
+        SampleType* out_samples,
+        ProgressCallback pcb = ProgressCallback(),
+        int slice_begin = 0,
+        int slice_end = std::numeric_limits<int>::max(),
+        const std::vector<uint8_t>* slice_mask = nullptr)
+{
+    typedef typename GridType::TreeType TreeType;
+    typedef typename TreeType::LeafNodeType LeafType;
+
+    const auto domain = openvdb::CoordBBox(openvdb::Coord(0, 0, 0),
+                                           extents - openvdb::Coord(1, 1, 1));
+    if (domain.empty())
+        return Result::EMPTY_VOLUME;
+
+    const ReductionAxis axes[3] = {
+        ReductionAxis(grid_bbox_is.min().x(), grid_bbox_is.max().x(), extents.x(), flip[0]),
+        ReductionAxis(grid_bbox_is.min().y(), grid_bbox_is.max().y(), extents.y(), flip[1]),
+        ReductionAxis(grid_bbox_is.min().z(), grid_bbox_is.max().z(), extents.z(), flip[2]) };
+
+    // Bucket leaves and non-background tiles by the lattice z slices they overlap.
+    struct Tile {
+        openvdb::CoordBBox bbox;
+        double value;
+    };
+    std::vector<std::vector<const LeafType*>> slice_leaves(size_t(extents.z()));
+    std::vector<std::vector<Tile>> slice_tiles(size_t(extents.z()));
+    slice_end = std::min(slice_end, extents.z());
+    if (slice_begin >= slice_end)
+        return Result::SUCCESS;
+    const auto get_slices = [&axes, slice_begin, slice_end](const openvdb::CoordBBox& bbox, int& first_slice, int& last_slice) -> bool {
+        auto first = bbox.min().z();
+        auto last = bbox.max().z();
+        if (!axes[2].clip(first, last, first_slice, last_slice))
+            return false;
+        first_slice = std::max(first_slice, slice_begin);
+        last_slice = std::min(last_slice, slice_end - 1);
+        return first_slice <= last_slice;
+    };
+
+    const auto is_masked = [slice_mask](int slice) { return slice_mask && !(*slice_mask)[size_t(slice)]; };
+
+    int first_slice, last_slice;
+    for (auto leaf_it = grid.tree().cbeginLeaf(); leaf_it; ++leaf_it) {
+        if (!get_slices(leaf_it->getNodeBoundingBox(), first_slice, last_slice))
+            continue;
+        for (auto slice = first_slice; slice <= last_slice; ++slice) {
+            if (!is_masked(slice))
+                slice_leaves[size_t(slice)].push_back(&*leaf_it);
+        }
+    }
+
+    typename TreeType::ValueAllCIter tile_it = grid.tree().cbeginValueAll();
+    tile_it.setMaxDepth(TreeType::ValueAllCIter::LEAF_DEPTH - 1);
+    for (; tile_it; ++tile_it) {
+        if (openvdb::math::isExactlyEqual(tile_it.getValue(), grid.background()))
+            continue;
+        Tile tile;
+        tile_it.getBoundingBox(tile.bbox);
+        tile.value = double(reduce(tile_it.getValue()));
+        if (!get_slices(tile.bbox, first_slice, last_slice))
+            continue;
+        for (auto slice = first_slice; slice <= last_slice; ++slice) {
+            if (!is_masked(slice))
+                slice_tiles[size_t(slice)].push_back(tile);
+        }
+    }
+
+    // Per-cell sums of the covered voxel values, and the number of covered voxels.
+    struct SliceAccumulator {
+        std::vector<double> sums;
+        std::vector<int64_t> counts;
+    };
+    typedef tbb::enumerable_thread_specific<SliceAccumulator> PerThreadAccumulator;
+    PerThreadAccumulator accumulators;
+    const SampleEncoder encoder(value_range);
+
+    const auto slice_size = size_t(extents.x()) * size_t(extents.y());
+    const auto background = double(reduce(grid.background()));
+    tbb::atomic<bool> cancelled;
+    cancelled = false;
+    typedef tbb::blocked_range<int> tbb_range;
+    tbb::parallel_for(tbb_range(slice_begin, slice_end),
+        [&](const tbb_range& slice_range)
+    {
+        PerThreadAccumulator::reference acc = accumulators.local();
+        for (auto slice = slice_range.begin(); slice < slice_range.end(); ++slice) {
+            if (cancelled)
+                return;
+            if (is_masked(slice)) {
+                if (!pcb(uint32_t(slice_size))) {
+                    cancelled = true;
+                    return;
+                }
+                continue;
+            }
+
+            acc.sums.assign(slice_size, 0.0);
+            acc.counts.assign(slice_size, 0);
+            const auto slice_first_z = axes[2].firstVoxel(slice);
+            const auto slice_last_z = axes[2].lastVoxel(slice);
+
+            // Leaf voxels. Voxels are laid out with z being the fastest changing
+            // coordinate in a leaf, and z doesn't change the cell within the slice.
+            for (const LeafType* leaf : slice_leaves[size_t(slice)]) {
+                const auto leaf_bbox = leaf->getNodeBoundingBox();
+                const auto z_begin = std::max(leaf_bbox.min().z(), slice_first_z);
+                const auto z_end = std::min(leaf_bbox.max().z(), slice_last_z);
+                const auto x_begin = std::max(leaf_bbox.min().x(), axes[0].bboxMin());
+                const auto x_end = std::min(leaf_bbox.max().x(), axes[0].bboxMax());
+                const auto y_begin = std::max(leaf_bbox.min().y(), axes[1].bboxMin());
+                const auto y_end = std::min(leaf_bbox.max().y(), axes[1].bboxMax());
+                for (auto x = x_begin; x <= x_end; ++x) {
+                    const auto cell_x = size_t(axes[0].cell(x));
+                    for (auto y = y_begin; y <= y_end; ++y) {
+                        const auto cell_index = cell_x + size_t(extents.x()) * size_t(axes[1].cell(y));
+                        auto offset = LeafType::coordToOffset(openvdb::Coord(x, y, z_begin));
+                        double sum = 0.0;
+                        for (auto z = z_begin; z <= z_end; ++z, ++offset)
+                            sum += double(reduce(leaf->getValue(offset)));
+                        acc.sums[cell_index] += sum;
+                        acc.counts[cell_index] += z_end - z_begin + 1;
+                    }
+                }
+            }
+
+            // Tiles cover whole boxes of voxels, so only the number of voxels
+            // they cover in each cell needs to be computed.
+            for (const Tile& tile : slice_tiles[size_t(slice)]) {
+                int first[3] = { tile.bbox.min().x(), tile.bbox.min().y(), tile.bbox.min().z() };
+                int last[3] = { tile.bbox.max().x(), tile.bbox.max().y(), tile.bbox.max().z() };
+                int first_cell[3], last_cell[3];
+                if (!axes[0].clip(first[0], last[0], first_cell[0], last_cell[0]) ||
+                    !axes[1].clip(first[1], last[1], first_cell[1], last_cell[1]))
+                    continue;
+                const auto count_z = int64_t(
+                    std::min(last[2], slice_last_z) - std::max(first[2], slice_first_z) + 1);
+                if (count_z <= 0)
+                    continue;
+                for (auto cell_y = first_cell[1]; cell_y <= last_cell[1]; ++cell_y) {
+                    const auto count_yz = count_z * int64_t(
+                        std::min(last[1], axes[1].lastVoxel(cell_y)) - std::max(first[1], axes[1].firstVoxel(cell_y)) + 1);
+                    for (auto cell_x = first_cell[0]; cell_x <= last_cell[0]; ++cell_x) {
+                        const auto count = count_yz * int64_t(
+                            std::min(last[0], axes[0].lastVoxel(cell_x)) - std::max(first[0], axes[0].firstVoxel(cell_x)) + 1);
+                        const auto cell_index = size_t(cell_x) + size_t(extents.x()) * size_t(cell_y);
+                        acc.sums[cell_index] += tile.value * double(count);
+                        acc.counts[cell_index] += count;
+                    }
+                }
+            }
+
+            // Average, counting the uncovered voxels as background.
+            const auto count_z = int64_t(axes[2].voxelCount(slice));
+            SampleType* out_slice = out_samples + slice_size * size_t(slice);
+            for (int cell_y = 0; cell_y < extents.y(); ++cell_y) {
+                const auto count_yz = count_z * int64_t(axes[1].voxelCount(cell_y));
+                for (int cell_x = 0; cell_x < extents.x(); ++cell_x) {
+                    const auto cell_index = size_t(cell_x) + size_t(extents.x()) * size_t(cell_y);
+                    const auto count = count_yz * int64_t(axes[0].voxelCount(cell_x));
+                    const auto sum = acc.sums[cell_index] + background * double(count - acc.counts[cell_index]);
+                    out_slice[cell_index] = encoder.encode<SampleType>(float(sum / double(count)));
+                }
+            }
+
+            // Invoke progress Callback.
+            if (!pcb(uint32_t(slice_size))) {
+                cancelled = true;
+                return;
+            }
+        }
+    });
+    if (cancelled)
+        return Result::INTERRUPTED;
+    return Result::SUCCESS;
+}
+
+} // namespace detail
+
+inline openvdb::Coord computeSamplingExtents(
+        const openvdb::GridBase& grid,
+        uint64_t voxel_budget,
+        bool cap_to_grid_resolution,
+        int max_extent,
+        const openvdb::BBoxd* region_world)
+{
+    const auto grid_bbox_is = detail::getSamplingBoundingBox(grid, region_world);
+    if (grid_bbox_is.empty())
+        return { 1, 1, 1 };
+
+    const auto size = grid.transform().indexToWorld(grid_bbox_is).extents();
+    const auto grid_extents = grid_bbox_is.extents();
+    return detail::computeLatticeExtents(
+        size, cap_to_grid_resolution ? &grid_extents : nullptr, voxel_budget, max_extent);
+}
+
+template <typename GridType>
+openvdb::Coord computeSamplingExtents(
+        const std::vector<const GridType*>& grids,
+        uint64_t voxel_budget,
+        bool cap_to_grid_resolution,
+        int max_extent,
+        const openvdb::BBoxd* region_world)
+{
+    const auto bbox_world = detail::getWorldBoundingBox(grids, region_world);
+    if (bbox_world.empty())
+        return { 1, 1, 1 };
+
+    const auto size = bbox_world.extents();
+    openvdb::Coord max_cells(1, 1, 1);
+    for (const GridType* grid : grids) {
+        const auto voxel_size = grid->voxelSize();
+        for (int axis = 0; axis < 3; ++axis) {
+            if (voxel_size[axis] > 0)
+                max_cells[axis] = std::max(max_cells[axis], int(std::min(
+                    std::ceil(size[axis] / voxel_size[axis]) + 1, double(max_extent))));
+        }
+    }
+    return detail::computeLatticeExtents(
+        size, cap_to_grid_resolution ? &max_cells : nullptr, voxel_budget, max_extent);
+}
+
+inline openvdb::Coord computeSamplingExtents(
+        const openvdb::Vec3d& size,
+        const openvdb::Coord* max_cells,
+        uint64_t voxel_budget,
+        int max_extent)
+{
+    return detail::computeLatticeExtents(size, max_cells, voxel_budget, max_extent);
+}
+
+inline openvdb::BBoxd computeSamplingBounds(
+        const openvdb::GridBase& grid,
+        const openvdb::BBoxd* region_world)
+{
+    return detail::getWorldBoundingBox(std::vector<const openvdb::GridBase*>(1, &grid), region_world);
+}
+
+namespace detail {
+
+// The input cells overlapping each output cell along an axis of a downsample,
+// and their weights, which add up to one. The taps of output cell i are
+// [offsets[i], offsets[i + 1]).
+struct DownsampleTaps {
+    std::vector<size_t> offsets;
+    std::vector<int> cells;
+    std::vector<float> weights;
+};
+
+inline DownsampleTaps computeDownsampleTaps(int extent, int out_extent)
+{
+    assert(out_extent > 0 && out_extent <= extent);
+    DownsampleTaps taps;
+    const double scale = double(extent) / double(out_extent);
+    for (int i = 0; i < out_extent; ++i) {
+        taps.offsets.push_back(taps.cells.size());
+        const double begin = i * scale;
+        const double end = std::min((i + 1) * scale, double(extent));
+        for (int cell = int(begin); cell < extent && cell < end; ++cell) {
+            const double overlap = std::min(end, cell + 1.0) - std::max(begin, double(cell));
+            if (overlap <= 0.0)
+                continue;
+            taps.cells.push_back(cell);
+            taps.weights.push_back(float(overlap / (end - begin)));
+        }
+    }
+    taps.offsets.push_back(taps.cells.size());
+    return taps;
+}
+
+} // namespace detail
+
+template <typename RealType>
+void downsampleSamples(
+        const openvdb::Coord& extents,
+        const RealType* data,
+        const openvdb::Coord& out_extents,
+        RealType* out_data)
+{
+    typedef SampleTraits<RealType> Traits;
+
+    const detail::DownsampleTaps taps[3] = {
+        detail::computeDownsampleTaps(extents.x(), out_extents.x()),
+        detail::computeDownsampleTaps(extents.y(), out_extents.y()),
+        detail::computeDownsampleTaps(extents.z(), out_extents.z()) };
+    const size_t row_size = size_t(extents.x());
+    const size_t slice_size = row_size * size_t(extents.y());
+    const size_t out_slice_size = size_t(out_extents.x()) * size_t(out_extents.y());
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, out_extents.z()), [&](const tbb::blocked_range<int>& range) {
+        for (int z = range.begin(); z < range.end(); ++z) {
+            RealType* out_ptr = out_data + size_t(z) * out_slice_size;
+            for (int y = 0; y < out_extents.y(); ++y) {
+                for (int x = 0; x < out_extents.x(); ++x) {
+                    float sum = 0.0f;
+                    for (size_t tz = taps[2].offsets[z]; tz < taps[2].offsets[z + 1]; ++tz) {
+                        for (size_t ty = taps[1].offsets[y]; ty < taps[1].offsets[y + 1]; ++ty) {
+                            const RealType* row = data + size_t(taps[2].cells[tz]) * slice_size + size_t(taps[1].cells[ty]) * row_size;
+                            const float row_weight = taps[2].weights[tz] * taps[1].weights[ty];
+                            for (size_t tx = taps[0].offsets[x]; tx < taps[0].offsets[x + 1]; ++tx)
+                                sum += row_weight * taps[0].weights[tx] * Traits::toUnit(row[taps[0].cells[tx]]);
+                        }
+                    }
+                    *out_ptr++ = Traits::fromUnit(sum);
+                }
+            }
+        }
+    });
+}
+
+
+template <typename GridOp>
+bool processTypedGrid(const openvdb::GridBase& grid, GridOp& op)
+{
+    if (grid.isType<openvdb::FloatGrid>())
+        op(static_cast<const openvdb::FloatGrid&>(grid));
+    else if (grid.isType<openvdb::DoubleGrid>())
+        op(static_cast<const openvdb::DoubleGrid&>(grid));
+    else if (grid.isType<openvdb::Int32Grid>())
+        op(static_cast<const openvdb::Int32Grid&>(grid));
+    else if (grid.isType<openvdb::Int64Grid>())
+        op(static_cast<const openvdb::Int64Grid&>(grid));
+    else if (grid.isType<openvdb::Vec3SGrid>())
+        op(static_cast<const openvdb::Vec3SGrid&>(grid));
+    else if (grid.isType<openvdb::Vec3DGrid>())
+        op(static_cast<const openvdb::Vec3DGrid&>(grid));
+    else
+        return false;
+    return true;
+}
+
+namespace detail {
+
+struct NoOpGridOp {
+    template <typename GridType>
+    void operator()(const GridType&) {}
+};
+
+} // namespace detail
+
+inline bool isSupportedGridType(const openvdb::GridBase& grid)
+{
+    detail::NoOpGridOp op;
+    return processTypedGrid(grid, op);
+}
+
+
+namespace detail {
+
+// The filtering picked for a grid by sampleGridImpl, see FilterMode.
+struct FilterSetup {
+    FilterMode filter_mode;
+    openvdb::CoordBBox grid_bbox_is;
+    openvdb::BBoxd bbox_world;
+    // MULTIRES only.
+    size_t num_levels;
+    double lod_level;
+    // Whether the index space axes are aligned with the world space axes, and
+    // the axes along which their directions are opposite; see getAxisAlignment.
+    bool is_axis_aligned;
+    bool flip[3];
+};
+
+inline FilterSetup setupFilter(
+        const openvdb::GridBase& grid,
+        const openvdb::Coord& sampling_extents,
+        FilterMode filter_mode,
+        bool supports_multires,
+        const openvdb::BBoxd* region_world)
+{
+    FilterSetup setup;
+    setup.filter_mode = filter_mode;
+    setup.grid_bbox_is = getSamplingBoundingBox(grid, region_world);
+    setup.bbox_world = grid.transform().indexToWorld(setup.grid_bbox_is);
+    setup.num_levels = 0;
+    setup.lod_level = 0;
+    setup.flip[0] = setup.flip[1] = setup.flip[2] = false;
+    setup.is_axis_aligned = getAxisAlignment(grid.transform(), setup.flip);
+    if (setup.grid_bbox_is.empty())
+        return setup;
+
+    const auto& grid_bbox_is = setup.grid_bbox_is;
+    const auto grid_extents = grid_bbox_is.extents().asVec3d();
+    const auto max_lod = getLOD(grid_extents);
+    const auto num_levels = int(openvdb::math::Ceil(max_lod));
+
+    // Calculate sampling LoD level.
+    const auto coarse_voxel_size = grid_extents / sampling_extents.asVec3d();
+    const auto lod_level = clamp(getLOD(coarse_voxel_size), 0, num_levels);
+    setup.num_levels = size_t(num_levels);
+    setup.lod_level = lod_level;
+
+    // REDUCE needs an axis aligned transform, and at least one voxel per cell.
+    const bool can_reduce = setup.is_axis_aligned &&
+        sampling_extents.x() <= grid_bbox_is.dim().x() &&
+        sampling_extents.y() <= grid_bbox_is.dim().y() &&
+        sampling_extents.z() <= grid_bbox_is.dim().z();
+
+    if (filter_mode == FilterMode::AUTO) {
+        if (can_reduce && coarse_voxel_size.x() >= REDUCE_MIN_VOXELS_PER_CELL &&
+                coarse_voxel_size.y() >= REDUCE_MIN_VOXELS_PER_CELL &&
+                coarse_voxel_size.z() >= REDUCE_MIN_VOXELS_PER_CELL) {
+            setup.filter_mode = FilterMode::REDUCE;
+        } else if (supports_multires && num_levels > 1 && lod_level > 0) {
+            setup.filter_mode = FilterMode::MULTIRES;
+        } else if (grid.transform().isLinear()) {
+            setup.filter_mode = FilterMode::SPARSE_BOX;
+        } else {
+            setup.filter_mode = FilterMode::BOX;
+        }
+    } else if ((filter_mode == FilterMode::REDUCE && !can_reduce) ||
+               (filter_mode == FilterMode::MULTIRES && !supports_multires)) {
+        setup.filter_mode = FilterMode::BOX;
+    }
+    return setup;
+}
+
+// Returns how far, in voxels of the grid, the samples of the filtering can read
+// from their position. BoxSampler reads the voxels next to the sample position,
+// and REDUCE cells are found conservatively by getLatticeCellRange, so a voxel
+// is enough for them. The voxels of MultiResGrid levels are restricted from
+// 3x3x3 voxels of the next finer level, so the footprint of a level grows with
+// twice its voxel size.
+inline double getFilterDilation(FilterMode filter_mode, double lod_level)
+{
+    return filter_mode == FilterMode::MULTIRES ? double(4 << int(std::ceil(lod_level))) + 1 : 1.0;
+}
+
+// Returns the index space bounding box of the voxels the samples over
+// bbox_world can read; see getFilterDilation.
+inline openvdb::CoordBBox getReadBoundingBox(
+        const openvdb::math::Transform& transform,
+        const openvdb::BBoxd& bbox_world,
+        FilterMode filter_mode,
+        double lod_level)
+{
+    const auto bbox_is = transform.worldToIndex(bbox_world);
+    const openvdb::Vec3d dilation(getFilterDilation(filter_mode, lod_level));
+    return openvdb::CoordBBox(
+        openvdb::Coord::floor(bbox_is.min() - dilation), openvdb::Coord::ceil(bbox_is.max() + dilation));
+}
+
+inline openvdb::CoordBBox getReadBoundingBox(const openvdb::GridBase& grid, const FilterSetup& setup)
+{
+    return getReadBoundingBox(grid.transform(), setup.bbox_world, setup.filter_mode, setup.lod_level);
+}
+
+// Restricts sampleGridImpl to the parts of the lattice which may have changed
+// since the samples in the output buffer were taken, see sampleGridDelta.
+struct DeltaMask {
+    // The value range the kept samples are encoded over.
+    FloatRange value_range;
+    // Nonzero for the lattice blocks (see LatticeBlocks) to sample.
+    std::vector<uint8_t> blocks;
+    // Nonzero for the lattice z slices to sample with REDUCE filtering.
+    std::vector<uint8_t> slices;
+};
+
+// Marks the blocks of the mask which don't have to be sampled as KEPT. An empty
+// mask is set up for a single channel first.
+template <typename ValueType>
+void applyDeltaMask(
+        const DeltaMask& delta,
+        const ValueType& background,
+        const ScalarReducer<ValueType>& reduce,
+        BlockMask& mask)
+{
+    if (mask.active.empty()) {
+        mask.active.assign(delta.blocks.size(), BlockMask::SAMPLED);
+        mask.backgrounds.assign(1, reduce(background));
+    }
+    assert(mask.active.size() == delta.blocks.size());
+    for (size_t block_index = 0; block_index < delta.blocks.size(); ++block_index) {
+        if (!delta.blocks[block_index])
+            mask.active[block_index] = BlockMask::KEPT;
+    }
+}
+
+// MULTIRES filtering of sampleGridImpl.
+template <typename RealType, typename GridType, typename ProgressCallback, typename MultiResProvider>
+Result sampleMultiRes(
+        std::true_type /* supports_multires */,
+        const GridType& grid,
+        size_t num_levels,
+        double lod_level,
+        const ScalarReducer<typename GridType::ValueType>& reduce,
+        const FloatRange& value_range,
+        const openvdb::BBoxd& bbox_world,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        ProgressCallback pcb,
+        MultiResProvider& multires_provider,
+        const BlockMask* active_blocks)
+{
+    typedef typename GridType::TreeType TreeType;
+
+    // Get multiresolution grid.
+    const auto multires_ptr = getMultiResGrid(multires_provider, grid, num_levels);
+    assert(multires_ptr);
+    const auto& multires = *multires_ptr;
+
+    // Set up sampling func.
+    const auto make_sampling_func = [&multires, lod_level, &reduce, &bbox_world, &sampling_extents]()
+    {
+        return makeLatticeSampler(
+            makeReducingSampler(MultiResSampler<TreeType>(multires, lod_level), reduce),
+            multires.transform(), bbox_world, sampling_extents);
+    };
+
+    // Sample the MultiResGrid and fill the output variables.
+    setHeader(value_range, bbox_world, out_header);
+    return sampleVolume(
+            sampling_extents,
+            make_sampling_func,
+            out_data,
+            value_range,
+            pcb,
+            active_blocks);
+}
+
+template <typename RealType, typename GridType, typename ProgressCallback, typename MultiResProvider>
+Result sampleMultiRes(
+        std::false_type /* supports_multires */,
+        const GridType&,
+        size_t,
+        double,
+        const ScalarReducer<typename GridType::ValueType>&,
+        const FloatRange&,
+        const openvdb::BBoxd&,
+        const openvdb::Coord&,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>&,
+        RealType*,
+        ProgressCallback,
+        MultiResProvider&,
+        const BlockMask*)
+{
+    assert(false && "MULTIRES filtering is not supported for this grid type");
+    return Result::UNKNOWN_FILTER_MODE;
+}
+
+// Samples the grid; see sampleGrid. If delta is not null, only the parts of the
+// lattice it marks are sampled, see DeltaMask.
+template <typename RealType, typename GridType, typename ProgressCallback, typename MultiResProvider>
+Result sampleGridImpl(
+        const GridType& grid,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        FilterMode filter_mode,
+        ProgressCallback pcb,
+        MultiResProvider& multires_provider,
+        ScalarReduction reduction,
+        const openvdb::BBoxd* region_world,
+        const DeltaMask* delta = nullptr)
+{
+    typedef typename GridType::TreeType TreeType;
+    typedef SupportsMultiRes<TreeType> SupportsMultiResType;
+
+    assert(out_data);
+
+    const auto setup = setupFilter(grid, sampling_extents, filter_mode, SupportsMultiResType::value, region_world);
+    const auto& grid_bbox_is = setup.grid_bbox_is;
+    const auto& bbox_world = setup.bbox_world;
+    const auto num_levels = setup.num_levels;
+    const auto lod_level = setup.lod_level;
+    const bool* flip = setup.flip;
+    filter_mode = setup.filter_mode;
+
+    // Return if the grid bbox is empty.
+    if (grid_bbox_is.empty()) {
+        detail::setHeader({0, 0}, bbox_world, out_header);
+        return Result::EMPTY_VOLUME;
+    }
+
+    // Compute the value range of the samples up front, unless it is given.
+    // Only the leaves the samples can read are visited, which saves work for
+    // bakes clipped to a region; a lattice spanning the grid reads every leaf.
+    const auto reduce = makeScalarReducer(grid, reduction);
+    const auto voxel_value_range = delta ?
+        delta->value_range : computeValueRange(grid, reduce, getReadBoundingBox(grid, setup));
+
+    if (filter_mode == FilterMode::REDUCE) {
+        // Average the voxels of the grid falling into each cell.
+        detail::setHeader(voxel_value_range, bbox_world, out_header);
+        return detail::reduceVolume(
+                grid,
+                grid_bbox_is,
+                flip,
+                sampling_extents,
+                reduce,
+                voxel_value_range,
+                out_data,
+                pcb,
+                0,
+                std::numeric_limits<int>::max(),
+                delta ? &delta->slices : nullptr);
+
+    } else if (filter_mode == FilterMode::MULTIRES) {
+        detail::BlockMask kept_blocks;
+        if (delta)
+            detail::applyDeltaMask(*delta, grid.background(), reduce, kept_blocks);
+        return sampleMultiRes<RealType>(
+                SupportsMultiResType(),
+                grid,
+                num_levels,
+                lod_level,
+                reduce,
+                voxel_value_range,
+                bbox_world,
+                sampling_extents,
+                out_header,
+                out_data,
+                pcb,
+                multires_provider,
+                delta ? &kept_blocks : nullptr);
+
+    } else if (filter_mode == FilterMode::BOX || filter_mode == FilterMode::SPARSE_BOX) {
+        // Set up sampling func.
+        const auto make_sampling_func = [&grid, &reduce, &bbox_world, &sampling_extents]()
+        {
+            return detail::makeLatticeSampler(
+                detail::makeReducingSampler(detail::TreeBoxSampler<TreeType>(grid.tree()), reduce),
+                grid.transform(), bbox_world, sampling_extents);
+        };
+
+        // Find the parts of the lattice which overlap the grid topology.
+        // The topology can only be rasterized conservatively for linear transforms.
+        detail::BlockMask active_blocks;
+        const bool is_sparse = filter_mode == FilterMode::SPARSE_BOX && grid.transform().isLinear();
+        if (is_sparse)
+            detail::rasterizeTopology(grid, bbox_world, sampling_extents, reduce, active_blocks);
+        if (delta)
+            detail::applyDeltaMask(*delta, grid.background(), reduce, active_blocks);
+
+        // Sample the grid and fill the output variables.
+        const auto value_range = delta ? delta->value_range : reduce.boundInterpolated(voxel_value_range);
+        detail::setHeader(value_range, bbox_world, out_header);
+        return detail::sampleVolume(
+                sampling_extents,
+                make_sampling_func,
+                out_data,
+                value_range,
+                pcb,
+                is_sparse || delta ? &active_blocks : nullptr);
+
+    } else {
+        return Result::UNKNOWN_FILTER_MODE;
+    }
+}
+
+// Grid operation for processTypedGrid, forwarding to sampleGrid.
+template <typename RealType, typename ProgressCallback, typename MultiResProvider>
+struct SampleGridOp {
+    const openvdb::Coord& sampling_extents;
+    SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header;
+    RealType* out_data;
+    FilterMode filter_mode;
+    ProgressCallback& pcb;
+    MultiResProvider& multires_provider;
+    ScalarReduction reduction;
+    const openvdb::BBoxd* region_world;
+    Result result;
+
+    template <typename GridType>
+    void operator()(const GridType& grid)
+    {
+        result = volume_sampling::sampleGrid<RealType>(
+            grid, sampling_extents, out_header, out_data, filter_mode, pcb, multires_provider, reduction, region_world);
+    }
+};
+
+} // namespace detail
+
+template <typename RealType, typename GridType, typename ProgressCallback, typename MultiResProvider>
+Result sampleGrid(
+        const GridType& grid,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        FilterMode filter_mode,
+        ProgressCallback pcb,
+        MultiResProvider multires_provider,
+        ScalarReduction reduction,
+        const openvdb::BBoxd* region_world)
+{
+    return detail::sampleGridImpl(
+        grid, sampling_extents, out_header, out_data, filter_mode, pcb, multires_provider, reduction, region_world);
+}
+
+template <typename RealType, typename ProgressCallback, typename MultiResProvider>
+Result sampleGrid(
+        const openvdb::GridBase& grid,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        FilterMode filter_mode,
+        ProgressCallback pcb,
+        MultiResProvider multires_provider,
+        ScalarReduction reduction,
+        const openvdb::BBoxd* region_world)
+{
+    detail::SampleGridOp<RealType, ProgressCallback, MultiResProvider> op = {
+        sampling_extents, out_header, out_data, filter_mode, pcb, multires_provider, reduction, region_world,
+        Result::UNSUPPORTED_GRID_TYPE };
+    processTypedGrid(grid, op);
+    return op.result;
+}
+
+namespace detail {
+
+// 64 bit FNV-1a style hashing, mixing in a word at a time; the checksums only
+// have to tell changed nodes apart.
+constexpr uint64_t CHECKSUM_OFFSET_BASIS = 14695981039346656037ull;
+constexpr uint64_t CHECKSUM_PRIME = 1099511628211ull;
+
+inline uint64_t mixChecksum(uint64_t checksum, uint64_t word)
+{
+    return (checksum ^ word) * CHECKSUM_PRIME;
+}
+
+inline uint64_t mixChecksumBytes(uint64_t checksum, const void* data, size_t size)
+{
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        checksum = mixChecksum(checksum, word);
+    }
+    for (; i < size; ++i)
+        checksum = mixChecksum(checksum, bytes[i]);
+    return checksum;
+}
+
+template <typename T>
+inline uint64_t mixChecksumValue(uint64_t checksum, const T& value)
+{
+    return mixChecksumBytes(checksum, &value, sizeof(value));
+}
+
+// Orders nodes by their bbox.
+inline bool isNodeBefore(const GridChecksums::Node& lhs, const GridChecksums::Node& rhs)
+{
+    if (lhs.bbox.min() != rhs.bbox.min())
+        return lhs.bbox.min() < rhs.bbox.min();
+    return lhs.bbox.max() < rhs.bbox.max();
+}
+
+// Grid operation for processTypedGrid, computing the checksums of the grid.
+struct GridChecksumsOp {
+    GridChecksums& checksums;
+
+    template <typename GridType>
+    void operator()(const GridType& grid)
+    {
+        typedef typename GridType::TreeType TreeType;
+        typedef typename TreeType::LeafNodeType LeafType;
+        typedef typename LeafType::NodeMaskType MaskType;
+
+        // The sampling only depends on the transform through the images of
+        // the index space origin and axes, as long as it's linear.
+        auto grid_checksum = mixChecksumBytes(CHECKSUM_OFFSET_BASIS, grid.type().data(), grid.type().size());
+        grid_checksum = mixChecksumValue(grid_checksum, int(grid.getGridClass()));
+        grid_checksum = mixChecksumValue(grid_checksum, grid.background());
+        const auto& transform = grid.transform();
+        grid_checksum = mixChecksumBytes(grid_checksum, transform.mapType().data(), transform.mapType().size());
+        for (const auto& pos_is : { openvdb::Vec3d(0, 0, 0), openvdb::Vec3d(1, 0, 0), openvdb::Vec3d(0, 1, 0), openvdb::Vec3d(0, 0, 1) })
+            grid_checksum = mixChecksumValue(grid_checksum, transform.indexToWorld(pos_is));
+        checksums.grid_checksum = grid_checksum;
+
+        // Leaf nodes, in parallel.
+        const auto leaves = collectLeaves(grid.tree());
+        checksums.nodes.resize(leaves.size());
+        typedef tbb::blocked_range<size_t> tbb_range;
+        tbb::parallel_for(tbb_range(0, leaves.size()), [this, &leaves](const tbb_range& range) {
+            for (auto i = range.begin(); i < range.end(); ++i) {
+                const LeafType& leaf = *leaves[i];
+                const MaskType& mask = leaf.getValueMask();
+                auto checksum = CHECKSUM_OFFSET_BASIS;
+                for (openvdb::Index word = 0; word < MaskType::WORD_COUNT; ++word)
+                    checksum = mixChecksum(checksum, mask.template getWord<uint64_t>(word));
+                checksum = mixChecksumBytes(checksum, leaf.buffer().data(), sizeof(typename LeafType::ValueType) * LeafType::SIZE);
+                checksums.nodes[i] = { leaf.getNodeBoundingBox(), checksum };
+            }
+        });
+
+        // Tiles of the internal and root nodes which differ from the background.
+        typename TreeType::ValueAllCIter tile_it = grid.tree().cbeginValueAll();
+        tile_it.setMaxDepth(TreeType::ValueAllCIter::LEAF_DEPTH - 1);
+        for (; tile_it; ++tile_it) {
+            if (openvdb::math::isExactlyEqual(tile_it.getValue(), grid.background()))
+                continue;
+            GridChecksums::Node node;
+            tile_it.getBoundingBox(node.bbox);
+            node.checksum = mixChecksumValue(
+                mixChecksumValue(CHECKSUM_OFFSET_BASIS, tile_it.getValue()), uint64_t(tile_it.isValueOn()));
+            checksums.nodes.push_back(node);
+        }
+
+        std::sort(checksums.nodes.begin(), checksums.nodes.end(), isNodeBefore);
+    }
+};
+
+// Calls mark(bbox) with the bboxes of the nodes which differ between the two
+// sets of checksums: those whose checksums differ, and those which are only
+// present in one of them.
+template <typename MarkNode>
+void forEachChangedNode(const GridChecksums& lhs, const GridChecksums& rhs, MarkNode mark)
+{
+    auto lhs_it = lhs.nodes.begin();
+    auto rhs_it = rhs.nodes.begin();
+    while (lhs_it != lhs.nodes.end() || rhs_it != rhs.nodes.end()) {
+        if (rhs_it == rhs.nodes.end() || (lhs_it != lhs.nodes.end() && isNodeBefore(*lhs_it, *rhs_it))) {
+            mark(lhs_it->bbox);
+            ++lhs_it;
+        } else if (lhs_it == lhs.nodes.end() || isNodeBefore(*rhs_it, *lhs_it)) {
+            mark(rhs_it->bbox);
+            ++rhs_it;
+        } else {
+            if (lhs_it->checksum != rhs_it->checksum)
+                mark(lhs_it->bbox);
+            ++lhs_it;
+            ++rhs_it;
+        }
+    }
+}
+
+// Samples the grid incrementally; see sampleGridDelta.
+template <typename RealType, typename GridType, typename ProgressCallback, typename MultiResProvider>
+Result sampleGridDeltaImpl(
+        const GridType& grid,
+        const GridChecksums& checksums,
+        const GridChecksums& prev_checksums,
+        const SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& prev_header,
+        const RealType* prev_data,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        FilterMode filter_mode,
+        ProgressCallback pcb,
+        MultiResProvider& multires_provider,
+        ScalarReduction reduction,
+        const openvdb::BBoxd* region_world,
+        size_t* out_num_sampled_cells)
+{
+    typedef typename GridType::TreeType TreeType;
+    typedef typename SampleTraits<RealType>::HeaderType HeaderType;
+
+    assert(out_data && prev_data);
+
+    const auto num_cells = size_t(sampling_extents.x()) * size_t(sampling_extents.y()) * size_t(sampling_extents.z());
+    const auto sample_all = [&]() -> Result {
+        if (out_num_sampled_cells)
+            *out_num_sampled_cells = num_cells;
+        return sampleGridImpl(
+            grid, sampling_extents, out_header, out_data, filter_mode, pcb, multires_provider, reduction, region_world);
+    };
+
+    // The previous samples can only be reused if the grids and the lattices
+    // match, and the lattice cells affected by a node can be found.
+    const auto setup = setupFilter(grid, sampling_extents, filter_mode, SupportsMultiRes<TreeType>::value, region_world);
+    if (setup.grid_bbox_is.empty() || !grid.transform().isLinear() ||
+            checksums.grid_checksum != prev_checksums.grid_checksum)
+        return sample_all();
+
+    SampleBufferHeader<HeaderType> header;
+    setHeader(FloatRange(0, 0), setup.bbox_world, header);
+    for (int axis = 0; axis < 3; ++axis) {
+        if (header.size[axis] != prev_header.size[axis] || header.origin[axis] != prev_header.origin[axis])
+            return sample_all();
+    }
+
+    // The samples are encoded over the previous value range, which has to
+    // cover the one sampleGrid would use.
+    const auto reduce = makeScalarReducer(grid, reduction);
+    auto value_range = computeValueRange(grid, reduce, getReadBoundingBox(grid, setup));
+    if (setup.filter_mode == FilterMode::BOX || setup.filter_mode == FilterMode::SPARSE_BOX)
+        value_range = reduce.boundInterpolated(value_range);
+    const auto prev_value_range = FloatRange(float(prev_header.value_range[0]), float(prev_header.value_range[1]));
+    if (value_range.getMin() < prev_value_range.getMin() || value_range.getMax() > prev_value_range.getMax())
+        return sample_all();
+
+    // Mark the lattice cells which can read the changed nodes, see
+    // getFilterDilation.
+    DeltaMask delta;
+    delta.value_range = prev_value_range;
+    const LatticeBlocks blocks(sampling_extents);
+    delta.blocks.assign(blocks.count(), 0);
+    delta.slices.assign(size_t(sampling_extents.z()), 0);
+    const auto dilation = getFilterDilation(setup.filter_mode, setup.lod_level);
+    const auto& transform = grid.transform();
+    const auto lattice_origin = setup.bbox_world.min();
+    const auto lattice_size = setup.bbox_world.extents();
+    forEachChangedNode(checksums, prev_checksums, [&](const openvdb::CoordBBox& node_bbox_is) {
+        const auto node_bbox_ws = transform.indexToWorld(openvdb::BBoxd(
+            node_bbox_is.min().asVec3d() - openvdb::Vec3d(dilation),
+            node_bbox_is.max().asVec3d() + openvdb::Vec3d(dilation)));
+        openvdb::Coord first, last;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!getLatticeCellRange(
+                    node_bbox_ws.min()[axis], node_bbox_ws.max()[axis],
+                    lattice_origin[axis], lattice_size[axis], sampling_extents[axis],
+                    first[axis], last[axis]))
+                return;
+        }
+        std::fill(delta.slices.begin() + first.z(), delta.slices.begin() + last.z() + 1, uint8_t(1));
+        for (auto bz = first.z() / LATTICE_BLOCK_DIM; bz <= last.z() / LATTICE_BLOCK_DIM; ++bz) {
+            for (auto by = first.y() / LATTICE_BLOCK_DIM; by <= last.y() / LATTICE_BLOCK_DIM; ++by) {
+                const auto row_begin = blocks.linearIndex(first.x() / LATTICE_BLOCK_DIM, by, bz);
+                const auto row_end = blocks.linearIndex(last.x() / LATTICE_BLOCK_DIM, by, bz) + 1;
+                std::fill(delta.blocks.begin() + row_begin, delta.blocks.begin() + row_end, uint8_t(1));
+            }
+        }
+    });
+
+    if (out_num_sampled_cells) {
+        size_t num_sampled_cells = 0;
+        if (setup.filter_mode == FilterMode::REDUCE) {
+            const auto slice_size = size_t(sampling_extents.x()) * size_t(sampling_extents.y());
+            num_sampled_cells = slice_size * size_t(std::count(delta.slices.begin(), delta.slices.end(), uint8_t(1)));
+        } else {
+            for (size_t block_index = 0; block_index < blocks.count(); ++block_index) {
+                if (delta.blocks[block_index])
+                    num_sampled_cells += size_t(blocks.cellBBox(block_index).volume());
+            }
+        }
+        *out_num_sampled_cells = num_sampled_cells;
+    }
+
+    // Start from the previous samples, and overwrite the ones which may have changed.
+    if (out_data != prev_data)
+        std::copy(prev_data, prev_data + num_cells, out_data);
+    return sampleGridImpl(
+        grid, sampling_extents, out_header, out_data, filter_mode, pcb, multires_provider, reduction, region_world,
+        &delta);
+}
+
+// Grid operation for processTypedGrid, forwarding to sampleGridDeltaImpl.
+template <typename RealType, typename ProgressCallback, typename MultiResProvider>
+struct SampleGridDeltaOp {
+    const GridChecksums& checksums;
+    const GridChecksums& prev_checksums;
+    const SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& prev_header;
+    const RealType* prev_data;
+    const openvdb::Coord& sampling_extents;
+    SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header;
+    RealType* out_data;
+    FilterMode filter_mode;
+    ProgressCallback& pcb;
+    MultiResProvider& multires_provider;
+    ScalarReduction reduction;
+    const openvdb::BBoxd* region_world;
+    size_t* out_num_sampled_cells;
+    Result result;
+
+    template <typename GridType>
+    void operator()(const GridType& grid)
+    {
+        result = sampleGridDeltaImpl(
+            grid, checksums, prev_checksums, prev_header, prev_data, sampling_extents, out_header, out_data,
+            filter_mode, pcb, multires_provider, reduction, region_world, out_num_sampled_cells);
+    }
+};
+
+} // namespace detail
+
+inline bool computeGridChecksums(const openvdb::GridBase& grid, GridChecksums& out_checksums)
+{
+    out_checksums = GridChecksums();
+    detail::GridChecksumsOp op = { out_checksums };
+    return processTypedGrid(grid, op);
+}
+
+template <typename RealType, typename ProgressCallback, typename MultiResProvider>
+Result sampleGridDelta(
+        const openvdb::GridBase& grid,
+        const GridChecksums& checksums,
+        const GridChecksums& prev_checksums,
+        const SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& prev_header,
+        const RealType* prev_data,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        FilterMode filter_mode,
+        ProgressCallback pcb,
+        MultiResProvider multires_provider,
+        ScalarReduction reduction,
+        const openvdb::BBoxd* region_world,
+        size_t* out_num_sampled_cells)
+{
+    detail::SampleGridDeltaOp<RealType, ProgressCallback, MultiResProvider> op = {
+        checksums, prev_checksums, prev_header, prev_data, sampling_extents, out_header, out_data,
+        filter_mode, pcb, multires_provider, reduction, region_world, out_num_sampled_cells,
+        Result::UNSUPPORTED_GRID_TYPE };
+    processTypedGrid(grid, op);
+    return op.result;
+}
+
+namespace detail {
+
+// Removes a leaf node from the tree, releasing its buffer. Its voxels become
+// part of an inactive background tile.
+template <typename TreeType>
+inline void releaseLeaf(TreeType& tree, const openvdb::Coord& leaf_origin)
+{
+    tree.addTile(/* level = */ 1, leaf_origin, tree.background(), false);
+}
+
+// Out-of-core version of computeValueRange: the leaves are visited in batches
+// fitting into the memory budget, and released after each batch. The leaves
+// outside read_bbox_is are never loaded.
+// Returns false if the progress callback interrupted the computation.
+template <typename GridType, typename ProgressCallback>
+bool computeValueRangeOutOfCore(
+        GridType& grid,
+        const ScalarReducer<typename GridType::ValueType>& reduce,
+        const openvdb::CoordBBox& read_bbox_is,
+        size_t memory_budget_bytes,
+        ProgressCallback& pcb,
+        FloatRange& out_value_range)
+{
+    typedef typename GridType::TreeType::LeafNodeType LeafType;
+
+    if (getKnownValueRange(grid, reduce, out_value_range))
+        return true;
+
+    out_value_range = computeTileValueRange(grid, reduce);
+    const auto leaves = collectLeaves(grid.tree(), read_bbox_is);
+    const auto batch_size = std::max<size_t>(memory_budget_bytes / leafMemoryBytes<LeafType>(), 1);
+    for (size_t begin = 0; begin < leaves.size(); begin += batch_size) {
+        const auto end = std::min(begin + batch_size, leaves.size());
+        addLeafValueRange(leaves, begin, end, reduce, out_value_range);
+        for (auto i = begin; i < end; ++i)
+            releaseLeaf(grid.tree(), leaves[i]->origin());
+        if (!pcb(0))
+            return false;
+    }
+    return true;
+}
+
+// Samples the lattice out of core, in slabs of units (lattice slices or layers
+// of blocks) along z. index_z_range(unit, lo, hi) has to set the inclusive range
+// of index space z coordinates of the voxels read by a unit; the ranges have to
+// move monotonically with the units, which they do for axis aligned transforms.
+// Units are added to a slab as long as the leaves overlapping its range fit
+// into the memory budget, then sample_slab(unit_begin, unit_end) samples the
+// slab, and the leaves which no remaining unit reads are released.
+template <typename GridType, typename IndexRangeFunc, typename SampleSlabFunc>
+Result sampleSlabs(
+        GridType& grid,
+        int num_units,
+        size_t memory_budget_bytes,
+        IndexRangeFunc index_z_range,
+        SampleSlabFunc sample_slab)
+{
+    typedef typename GridType::TreeType::LeafNodeType LeafType;
+
+    // Count the leaves of each layer of leaves along z. The topology is resident,
+    // so this doesn't load any leaf buffers.
+    std::map<int, size_t> layer_leaf_counts;
+    for (auto leaf_it = grid.tree().cbeginLeaf(); leaf_it; ++leaf_it)
+        ++layer_leaf_counts[leaf_it->origin().z()];
+    const auto count_leaves = [&layer_leaf_counts](int lo, int hi) -> size_t {
+        size_t count = 0;
+        for (auto it = layer_leaf_counts.lower_bound(lo - int(LeafType::DIM) + 1);
+             it != layer_leaf_counts.end() && it->first <= hi; ++it)
+            count += it->second;
+        return count;
+    };
+    const auto max_leaves = std::max<size_t>(memory_budget_bytes / leafMemoryBytes<LeafType>(), 1);
+
+    int unit_begin = 0;
+    while (unit_begin < num_units) {
+        // Grow the slab while the leaves it reads fit into the budget.
+        int lo, hi;
+        index_z_range(unit_begin, lo, hi);
+        auto unit_end = unit_begin + 1;
+        for (; unit_end < num_units; ++unit_end) {
+            int unit_lo, unit_hi;
+            index_z_range(unit_end, unit_lo, unit_hi);
+            unit_lo = std::min(lo, unit_lo);
+            unit_hi = std::max(hi, unit_hi);
+            if (count_leaves(unit_lo, unit_hi) > max_leaves)
+                break;
+            lo = unit_lo;
+            hi = unit_hi;
+        }
+
+        const auto res = sample_slab(unit_begin, unit_end);
+        if (res != Result::SUCCESS)
+            return res;
+        unit_begin = unit_end;
+        if (unit_begin == num_units)
+            break;
+
+        // Release the leaves outside the range of the remaining units.
+        int first_lo, first_hi, last_lo, last_hi;
+        index_z_range(unit_begin, first_lo, first_hi);
+        index_z_range(num_units - 1, last_lo, last_hi);
+        const auto remaining_lo = std::min(first_lo, last_lo);
+        const auto remaining_hi = std::max(first_hi, last_hi);
+        std::vector<openvdb::Coord> released_origins;
+        for (auto leaf_it = grid.tree().cbeginLeaf(); leaf_it; ++leaf_it) {
+            const auto origin_z = leaf_it->origin().z();
+            if (origin_z + int(LeafType::DIM) - 1 < remaining_lo || origin_z > remaining_hi)
+                released_origins.push_back(leaf_it->origin());
+        }
+        for (const auto& origin : released_origins) {
+            releaseLeaf(grid.tree(), origin);
+            --layer_leaf_counts[origin.z()];
+        }
+    }
+    return Result::SUCCESS;
+}
+
+inline bool isOutOfCoreFilterSetup(const FilterSetup& setup)
+{
+    return setup.is_axis_aligned &&
+        (setup.filter_mode == FilterMode::REDUCE || setup.filter_mode == FilterMode::SPARSE_BOX);
+}
+
+template <typename RealType, typename GridType, typename GridLoader, typename ProgressCallback>
+Result sampleGridOutOfCoreImpl(
+        GridType& grid,
+        GridLoader& load_grid,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        size_t memory_budget_bytes,
+        ProgressCallback pcb,
+        ScalarReduction reduction,
+        const openvdb::BBoxd* region_world)
+{
+    typedef typename GridType::TreeType TreeType;
+
+    assert(out_data);
+
+    const auto setup = setupFilter(
+        grid, sampling_extents, FilterMode::AUTO, SupportsMultiRes<TreeType>::value, region_world);
+    const auto& grid_bbox_is = setup.grid_bbox_is;
+    const auto& bbox_world = setup.bbox_world;
+
+    // Return if the grid bbox is empty.
+    if (grid_bbox_is.empty()) {
+        setHeader({0, 0}, bbox_world, out_header);
+        return Result::EMPTY_VOLUME;
+    }
+
+    if (!isOutOfCoreFilterSetup(setup))
+        return Result::UNKNOWN_FILTER_MODE;
+
+    // Compute the value range of the samples up front, from a separate instance
+    // of the grid, since the leaves are released as they are visited. Like in
+    // sampleGridImpl, only the leaves the samples can read are loaded, which
+    // saves a second read of the whole grid for bakes clipped to a region.
+    const auto reduce = makeScalarReducer(grid, reduction);
+    FloatRange voxel_value_range;
+    if (!getKnownValueRange(grid, reduce, voxel_value_range)) {
+        const auto range_grid = openvdb::gridPtrCast<GridType>(load_grid());
+        if (!range_grid)
+            return Result::UNSUPPORTED_GRID_TYPE;
+        if (!computeValueRangeOutOfCore(
+                *range_grid, reduce, getReadBoundingBox(grid, setup), memory_budget_bytes, pcb, voxel_value_range))
+            return Result::INTERRUPTED;
+    }
+
+    if (setup.filter_mode == FilterMode::REDUCE) {
+        // Slabs of lattice slices; each slice averages the voxels of its own range.
+        setHeader(voxel_value_range, bbox_world, out_header);
+        const ReductionAxis axis_z(grid_bbox_is.min().z(), grid_bbox_is.max().z(), sampling_extents.z(), setup.flip[2]);
+        return sampleSlabs(grid, sampling_extents.z(), memory_budget_bytes,
+            [&axis_z](int slice, int& lo, int& hi) {
+                lo = axis_z.firstVoxel(slice);
+                hi = axis_z.lastVoxel(slice);
+            },
+            [&](int slice_begin, int slice_end) {
+                return reduceVolume(
+                    grid, grid_bbox_is, setup.flip, sampling_extents, reduce, voxel_value_range,
+                    out_data, pcb, slice_begin, slice_end);
+            });
+    }
+
+    // Slabs of layers of lattice blocks. Box filtering reads the two voxels
+    // around the index space position of each cell center along z; the range
+    // is widened by a voxel to stay conservative in the face of rounding errors.
+    const auto make_sampling_func = [&grid, &reduce, &bbox_world, &sampling_extents]()
+    {
+        return makeLatticeSampler(
+            makeReducingSampler(TreeBoxSampler<TreeType>(grid.tree()), reduce),
+            grid.transform(), bbox_world, sampling_extents);
+    };
+    BlockMask active_blocks;
+    rasterizeTopology(grid, bbox_world, sampling_extents, reduce, active_blocks);
+
+    const auto value_range = reduce.boundInterpolated(voxel_value_range);
+    setHeader(value_range, bbox_world, out_header);
+    const LatticeBlocks blocks(sampling_extents);
+    const auto cell_size_z = bbox_world.extents().z() / double(sampling_extents.z());
+    const auto& transform = grid.transform();
+    const auto index_z = [&bbox_world, &transform, cell_size_z](int cell_z) -> double {
+        const auto cell_center_ws = openvdb::Vec3d(
+            bbox_world.min().x(), bbox_world.min().y(), bbox_world.min().z() + (double(cell_z) + 0.5) * cell_size_z);
+        return transform.worldToIndex(cell_center_ws).z();
+    };
+    return sampleSlabs(grid, blocks.blockCounts().z(), memory_budget_bytes,
+        [&index_z, &sampling_extents](int block_z, int& lo, int& hi) {
+            const auto z0 = index_z(block_z * LATTICE_BLOCK_DIM);
+            const auto z1 = index_z(std::min(block_z * LATTICE_BLOCK_DIM + LATTICE_BLOCK_DIM - 1, sampling_extents.z() - 1));
+            lo = int(std::floor(std::min(z0, z1))) - 1;
+            hi = int(std::floor(std::max(z0, z1))) + 2;
+        },
+        [&](int block_z_begin, int block_z_end) {
+            return sampleVolume(
+                sampling_extents, make_sampling_func, out_data, value_range, pcb,
+                &active_blocks, block_z_begin, block_z_end);
+        });
+}
+
+// Grid operation for processTypedGrid, forwarding to sampleGridOutOfCoreImpl
+// with the grid cast to its actual type.
+template <typename RealType, typename GridLoader, typename ProgressCallback>
+struct SampleGridOutOfCoreOp {
+    openvdb::GridBase::Ptr grid;
+    GridLoader& load_grid;
+    const openvdb::Coord& sampling_extents;
+    SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header;
+    RealType* out_data;
+    size_t memory_budget_bytes;
+    ProgressCallback& pcb;
+    ScalarReduction reduction;
+    const openvdb::BBoxd* region_world;
+    Result result;
+
+    template <typename GridType>
+    void operator()(const GridType&)
+    {
+        const auto typed_grid = openvdb::gridPtrCast<GridType>(grid);
+        result = sampleGridOutOfCoreImpl<RealType>(
+            *typed_grid, load_grid, sampling_extents, out_header, out_data, memory_budget_bytes, pcb, reduction,
+            region_world);
+    }
+};
+
+struct CanSampleOutOfCoreOp {
+    const openvdb::Coord& sampling_extents;
+    const openvdb::BBoxd* region_world;
+    bool result;
+
+    template <typename GridType>
+    void operator()(const GridType& grid)
+    {
+        const auto setup = setupFilter(
+            grid, sampling_extents, FilterMode::AUTO, SupportsMultiRes<typename GridType::TreeType>::value,
+            region_world);
+        result = setup.grid_bbox_is.empty() || isOutOfCoreFilterSetup(setup);
+    }
+};
+
+} // namespace detail
+
+template <typename RealType, typename GridLoader, typename ProgressCallback>
+Result sampleGridOutOfCore(
+        GridLoader load_grid,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>& out_header,
+        RealType* out_data,
+        size_t memory_budget_bytes,
+        ProgressCallback pcb,
+        ScalarReduction reduction,
+        const openvdb::BBoxd* region_world)
+{
+    const openvdb::GridBase::Ptr grid = load_grid();
+    if (!grid)
+        return Result::UNSUPPORTED_GRID_TYPE;
+
+    detail::SampleGridOutOfCoreOp<RealType, GridLoader, ProgressCallback> op = {
+        grid, load_grid, sampling_extents, out_header, out_data, memory_budget_bytes, pcb, reduction, region_world,
+        Result::UNSUPPORTED_GRID_TYPE };
+    processTypedGrid(*grid, op);
+    return op.result;
+}
+
+inline bool canSampleOutOfCore(
+        const openvdb::GridBase& grid,
+        const openvdb::Coord& sampling_extents,
+        const openvdb::BBoxd* region_world)
+{
+    detail::CanSampleOutOfCoreOp op = { sampling_extents, region_world, false };
+    return processTypedGrid(grid, op) && op.result;
+}
+
+namespace detail {
+
+// Type erased row sampler of one channel, so that the channels sampled by
+// sampleGrids can use different kinds of samplers.
+class ChannelRowSampler {
+public:
+    virtual ~ChannelRowSampler() {}
+    // Writes the samples of the cells [x_begin, x_end] of the lattice row (y, z)
+    // to out_values.
+    virtual void sampleRow(int x_begin, int x_end, int y, int z, float* out_values) const = 0;
+};
+
+template <typename SamplingFunc>
+class ChannelRowSamplerImpl : public ChannelRowSampler {
+public:
+    explicit ChannelRowSamplerImpl(const SamplingFunc& sampling_func) : m_sampling_func(sampling_func) {}
+
+    void sampleRow(int x_begin, int x_end, int y, int z, float* out_values) const override
+    {
+        auto consume = [out_values](int i, float value) { out_values[i] = value; };
+        m_sampling_func.sampleRow(x_begin, x_end, y, z, consume);
+    }
+
+private:
+    SamplingFunc m_sampling_func;
+};
+
+// Multi-channel sampling function for sampleChannels. Rows are at most a lattice
+// block long, so the samples of a row fit into a small buffer on the stack.
+class MultiChannelSampler {
+public:
+    template <typename SamplingFunc>
+    void addChannel(const SamplingFunc& sampling_func)
+    {
+        m_channels.emplace_back(new ChannelRowSamplerImpl<SamplingFunc>(sampling_func));
+    }
+
+    template <typename Consumer>
+    void sampleRow(size_t channel, int x_begin, int x_end, int y, int z, Consumer& consume) const
+    {
+        assert(x_end - x_begin < LATTICE_BLOCK_DIM);
+        float values[LATTICE_BLOCK_DIM];
+        m_channels[channel]->sampleRow(x_begin, x_end, y, z, values);
+        for (int i = 0; i <= x_end - x_begin; ++i)
+            consume(i, values[i]);
+    }
+
+private:
+    std::vector<std::unique_ptr<ChannelRowSampler>> m_channels;
+};
+
+// A channel of sampleGridsImpl. The sampling functions of the channels are
+// created through type erased functions, so that the grids can be of
+// different types; these are only called once per task, not per sample.
+struct GridChannel {
+    // Adds the sampling function of the channel to a MultiChannelSampler.
+    std::function<void(MultiChannelSampler&)> add_sampling_func;
+    // Rasterizes the topology of the grid into a BlockMask, see rasterizeTopology.
+    std::function<void(BlockMask&)> rasterize_topology;
+    // The value range of the samples, see computeValueRange.
+    FloatRange value_range;
+    bool is_multires;
+    bool is_linear;
+};
+
+// Grid operation for processTypedGrid, picking the filtering of a channel based
+// on the size of the lattice cells compared to the voxels of the grid.
+template <typename MultiResProvider>
+struct GridChannelSetupOp {
+    const openvdb::BBoxd& bbox_world;
+    const openvdb::Coord& sampling_extents;
+    FilterMode filter_mode;
+    MultiResProvider& multires_provider;
+    ScalarReduction reduction;
+    const openvdb::BBoxd* region_world;
+    GridChannel channel;
+
+    template <typename GridType>
+    void operator()(const GridType& grid)
+    {
+        typedef typename GridType::TreeType TreeType;
+
+        const auto* grid_ptr = &grid;
+        const auto& bbox_world_ = bbox_world;
+        const auto& sampling_extents_ = sampling_extents;
+        const auto reduce = makeScalarReducer(grid, reduction);
+
+        channel.is_linear = grid.transform().isLinear();
+        channel.rasterize_topology = [grid_ptr, reduce, &bbox_world_, &sampling_extents_](BlockMask& mask) {
+            rasterizeTopology(*grid_ptr, bbox_world_, sampling_extents_, reduce, mask);
+        };
+
+        // The value range only covers the leaves the samples can read, see
+        // sampleGridImpl.
+        double lod_level = 0;
+        channel.is_multires = setupMultiRes(SupportsMultiRes<TreeType>(), grid, reduce, lod_level);
+        const auto read_bbox_is = getReadBoundingBox(
+            grid.transform(), bbox_world, channel.is_multires ? FilterMode::MULTIRES : FilterMode::BOX, lod_level);
+        const auto voxel_value_range = computeValueRange(grid, reduce, read_bbox_is);
+        if (channel.is_multires) {
+            channel.value_range = voxel_value_range;
+            return;
+        }
+
+        channel.value_range = reduce.boundInterpolated(voxel_value_range);
+        channel.add_sampling_func = [grid_ptr, reduce, &bbox_world_, &sampling_extents_](MultiChannelSampler& sampler) {
+            sampler.addChannel(makeLatticeSampler(
+                makeReducingSampler(TreeBoxSampler<TreeType>(grid_ptr->tree()), reduce),
+                grid_ptr->transform(), bbox_world_, sampling_extents_));
+        };
+    }
+
+private:
+    // Returns true if the channel uses MULTIRES filtering, and the sampled level
+    // in out_lod_level.
+    template <typename GridType>
+    bool setupMultiRes(
+            std::true_type /* supports_multires */,
+            const GridType& grid,
+            const ScalarReducer<typename GridType::ValueType>& reduce,
+            double& out_lod_level)
+    {
+        typedef typename GridType::TreeType TreeType;
+
+        const auto grid_bbox_is = getSamplingBoundingBox(grid, region_world);
+        if (grid_bbox_is.empty() || filter_mode == FilterMode::BOX || filter_mode == FilterMode::SPARSE_BOX)
+            return false;
+
+        const auto max_lod = getLOD(grid_bbox_is.extents().asVec3d());
+        const auto num_levels = int(openvdb::math::Ceil(max_lod));
+        // The voxels of the grid along the union are counted like those of
+        // its own bbox in setupFilter, so that a grid spanning the whole union
+        // is sampled at the level sampleGrid picks.
+        const auto union_voxels = bbox_world.extents() / grid.voxelSize() + openvdb::Vec3d(1.0);
+        const auto coarse_voxel_size = union_voxels / sampling_extents.asVec3d();
+        const double lod_level = clamp(getLOD(coarse_voxel_size), 0, num_levels);
+        const bool use_multires = filter_mode == FilterMode::MULTIRES ?
+            num_levels > 0 : num_levels > 1 && lod_level > 0;
+        if (!use_multires)
+            return false;
+
+        out_lod_level = lod_level;
+        const auto multires = getMultiResGrid(multires_provider, grid, size_t(num_levels));
+        assert(multires);
+        const auto& bbox_world_ = bbox_world;
+        const auto& sampling_extents_ = sampling_extents;
+        channel.add_sampling_func = [multires, lod_level, reduce, &bbox_world_, &sampling_extents_](MultiChannelSampler& sampler) {
+            sampler.addChannel(makeLatticeSampler(
+                makeReducingSampler(MultiResSampler<TreeType>(*multires, lod_level), reduce),
+                multires->transform(), bbox_world_, sampling_extents_));
+        };
+        return true;
+    }
+
+    template <typename GridType>
+    bool setupMultiRes(
+            std::false_type /* supports_multires */,
+            const GridType&,
+            const ScalarReducer<typename GridType::ValueType>&,
+            double& /* out_lod_level */)
+    {
+        return false;
+    }
+};
+
+// Samples the grids; see sampleGrids.
+template <typename RealType, typename ProgressCallback, typename MultiResProvider>
+Result sampleGridsImpl(
+        const std::vector<const openvdb::GridBase*>& grids,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>* out_headers,
+        RealType* out_data,
+        const ChannelLayout& layout,
+        FilterMode filter_mode,
+        ProgressCallback pcb,
+        MultiResProvider& multires_provider,
+        ScalarReduction reduction,
+        const openvdb::BBoxd* region_world)
+{
+    assert(out_data);
+
+    const auto num_channels = grids.size();
+    const auto bbox_world = getWorldBoundingBox(grids, region_world);
+
+    // Return if all the grids are empty.
+    if (bbox_world.empty()) {
+        for (size_t channel = 0; channel < num_channels; ++channel)
+            setHeader({0, 0}, bbox_world, out_headers[channel]);
+        return Result::EMPTY_VOLUME;
+    }
+
+    // Pick the filtering of each channel.
+    std::vector<GridChannel> channels;
+    channels.reserve(num_channels);
+    bool is_sparse = filter_mode != FilterMode::BOX && filter_mode != FilterMode::MULTIRES;
+    for (const openvdb::GridBase* grid : grids) {
+        GridChannelSetupOp<MultiResProvider> op = {
+            bbox_world, sampling_extents, filter_mode, multires_provider, reduction, region_world, GridChannel() };
+        if (!processTypedGrid(*grid, op))
+            return Result::UNSUPPORTED_GRID_TYPE;
+        // The topology can only be rasterized conservatively for box filtering
+        // and linear transforms.
+        is_sparse = is_sparse && !op.channel.is_multires && op.channel.is_linear;
+        channels.push_back(std::move(op.channel));
+    }
+
+    // Find the parts of the lattice which overlap the topology of any grid.
+    BlockMask active_blocks;
+    if (is_sparse) {
+        for (const GridChannel& channel : channels)
+            channel.rasterize_topology(active_blocks);
+    }
+
+    // Set up sampling func.
+    const auto make_sampling_func = [&channels]() -> MultiChannelSampler
+    {
+        MultiChannelSampler sampler;
+        for (const GridChannel& channel : channels)
+            channel.add_sampling_func(sampler);
+        return sampler;
+    };
+
+    // Sample the grids and fill the output variables.
+    std::vector<FloatRange> value_ranges;
+    value_ranges.reserve(num_channels);
+    for (size_t channel = 0; channel < num_channels; ++channel) {
+        value_ranges.push_back(channels[channel].value_range);
+        setHeader(value_ranges[channel], bbox_world, out_headers[channel]);
+    }
+    return sampleChannels(
+            sampling_extents,
+            layout,
+            num_channels,
+            make_sampling_func,
+            out_data,
+            value_ranges.data(),
+            pcb,
+            is_sparse ? &active_blocks : nullptr);
+}
+
+} // namespace detail
+
+template <typename RealType, typename ProgressCallback, typename MultiResProvider>
+Result sampleGrids(
+        const std::vector<const openvdb::GridBase*>& grids,
+        const openvdb::Coord& sampling_extents,
+        SampleBufferHeader<typename SampleTraits<RealType>::HeaderType>* out_headers,
+        RealType* out_data,
+        const ChannelLayout& layout,
+        FilterMode filter_mode,
+        ProgressCallback pcb,
+        MultiResProvider multires_provider,
+        ScalarReduction reduction,
+        const openvdb::BBoxd* region_world)
+{
+    return detail::sampleGridsImpl(
+        grids, sampling_extents, out_headers, out_data, layout, filter_mode, pcb, multires_provider, reduction,
+        region_world);
 }
 
 } // namespace volume_sampling
@@ -0,0 +1,494 @@
+// Copyright 2019 Luma Pictures
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the throughput of volume_sampling::sampleGrid with BOX, MULTIRES and
+// AUTO filtering on synthetic grids, across lattice extents and thread counts.
+// Every configuration is sampled once to warm up (and to build the MultiResGrid
+// pyramid, which is cached as in the plugin), then the best of the timed runs
+// is reported in lattice cells (voxels) per second.
+// Then BOX and MULTIRES bakes of the noise cloud are sampled both through
+// samplers shared by all tasks, as the bakes used to, and through the per-task
+// ValueAccessors of the bakes, and the speedup of the latter is reported.
+// Then frames of slowly changing versions of the grids are sampled one after
+// the other, both from scratch and with volume_sampling::sampleGridDelta from
+// the samples of the previous frame, as the plugin does with -deltaRebake.
+
+#include "volume_sampling.hpp"
+#include "synthetic_grids.hpp"
+
+#include <openvdb/openvdb.h>
+#include <openvdb/tools/Interpolation.h>
+
+#include <tbb/task_scheduler_init.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Options {
+    float grid_size;
+    std::vector<int> extents;
+    std::vector<int> threads;
+    std::vector<int> accessor_extents;
+    int repeats;
+    int delta_frames;
+
+    Options()
+        : grid_size(192.0f), extents({ 64, 128, 256, 512 }), accessor_extents({ 256, 512 }), repeats(3), delta_frames(8)
+    {
+        const int max_threads = std::max(1, int(std::thread::hardware_concurrency()));
+        for (int num_threads = 1; num_threads < max_threads; num_threads *= 2)
+            threads.push_back(num_threads);
+        threads.push_back(max_threads);
+    }
+};
+
+void printUsage()
+{
+    std::cout << "Usage: bench_volume_sampling [--grid-size <voxels>] [--extents <n,n,...>] "
+                 "[--threads <n,n,...>] [--accessor-extents <n,n,...>] [--repeats <n>] "
+                 "[--delta-frames <n>]" << std::endl;
+}
+
+bool parseList(const char* arg, std::vector<int>& out_values)
+{
+    out_values.clear();
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        const int value = std::atoi(item.c_str());
+        if (value <= 0)
+            return false;
+        out_values.push_back(value);
+    }
+    return !out_values.empty();
+}
+
+bool parseOptions(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        const bool has_value = i + 1 < argc;
+        if (!std::strcmp(argv[i], "--grid-size") && has_value) {
+            options.grid_size = float(std::atof(argv[++i]));
+            if (options.grid_size <= 0.0f)
+                return false;
+        } else if (!std::strcmp(argv[i], "--extents") && has_value) {
+            if (!parseList(argv[++i], options.extents))
+                return false;
+        } else if (!std::strcmp(argv[i], "--threads") && has_value) {
+            if (!parseList(argv[++i], options.threads))
+                return false;
+        } else if (!std::strcmp(argv[i], "--accessor-extents") && has_value) {
+            if (!parseList(argv[++i], options.accessor_extents))
+                return false;
+        } else if (!std::strcmp(argv[i], "--repeats") && has_value) {
+            options.repeats = std::atoi(argv[++i]);
+            if (options.repeats <= 0)
+                return false;
+        } else if (!std::strcmp(argv[i], "--delta-frames") && has_value) {
+            options.delta_frames = std::atoi(argv[++i]);
+            if (options.delta_frames <= 0)
+                return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Keeps the MultiResGrid pyramids across calls, like the pyramid cache of the
+// plugin, so that MULTIRES timings don't include building them.
+class MultiResCache {
+public:
+    volume_sampling::FloatMultiResGrid::ConstPtr get(const openvdb::FloatGrid& grid, size_t num_levels)
+    {
+        auto& multires = m_pyramids[&grid];
+        if (!multires || multires->numLevels() < num_levels)
+            multires.reset(new volume_sampling::FloatMultiResGrid(num_levels, grid));
+        return multires;
+    }
+
+private:
+    std::map<const openvdb::FloatGrid*, volume_sampling::FloatMultiResGrid::ConstPtr> m_pyramids;
+};
+
+struct CachedMultiResProvider {
+    MultiResCache* cache;
+
+    volume_sampling::FloatMultiResGrid::ConstPtr operator()(const openvdb::FloatGrid& grid, size_t num_levels)
+    {
+        return cache->get(grid, num_levels);
+    }
+};
+
+const char* filterModeName(volume_sampling::FilterMode filter_mode)
+{
+    switch (filter_mode) {
+    case volume_sampling::FilterMode::BOX: return "BOX";
+    case volume_sampling::FilterMode::MULTIRES: return "MULTIRES";
+    case volume_sampling::FilterMode::AUTO: return "AUTO";
+    case volume_sampling::FilterMode::SPARSE_BOX: return "SPARSE_BOX";
+    case volume_sampling::FilterMode::REDUCE: return "REDUCE";
+    }
+    return "?";
+}
+
+// Returns the best time of the runs in seconds, or a negative value if the
+// sampling failed.
+double timeSampling(
+        const openvdb::FloatGrid& grid,
+        const openvdb::Coord& extents,
+        volume_sampling::FilterMode filter_mode,
+        int num_threads,
+        int repeats,
+        MultiResCache& multires_cache,
+        std::vector<float>& buffer)
+{
+    tbb::task_scheduler_init task_init(num_threads);
+    const CachedMultiResProvider multires_provider = { &multires_cache };
+    volume_sampling::SampleBufferHeader<float> header;
+    double best_seconds = -1.0;
+    for (int run = 0; run <= repeats; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto result = volume_sampling::sampleGrid<float>(
+            grid, extents, header, buffer.data(), filter_mode,
+            volume_sampling::ProgressCallbackNoOp(), multires_provider);
+        const auto end = std::chrono::steady_clock::now();
+        if (result != volume_sampling::Result::SUCCESS)
+            return -1.0;
+        // The first run is the warm-up.
+        const double seconds = std::chrono::duration<double>(end - start).count();
+        if (run > 0 && (best_seconds < 0.0 || seconds < best_seconds))
+            best_seconds = seconds;
+    }
+    return best_seconds;
+}
+
+// Samples the tree without an accessor, like the GridSampler BOX bakes used to
+// share between all tasks: every lookup starts from the root of the tree.
+class SharedBoxSampler {
+public:
+    typedef float ValueType;
+
+    explicit SharedBoxSampler(const openvdb::FloatTree& tree) : m_tree(&tree) {}
+
+    float isSample(const openvdb::Vec3d& pos_is) const
+    {
+        return openvdb::tools::BoxSampler::sample(*m_tree, pos_is);
+    }
+
+private:
+    const openvdb::FloatTree* m_tree;
+};
+
+// Samples the pyramid through MultiResGrid::sampleValue, like MULTIRES bakes
+// used to, which creates new accessors for every sample.
+class SharedMultiResSampler {
+public:
+    typedef float ValueType;
+
+    SharedMultiResSampler(const volume_sampling::FloatMultiResGrid& multires, double level)
+        : m_multires(&multires)
+        , m_level(level)
+    {}
+
+    float isSample(const openvdb::Vec3d& pos_is) const
+    {
+        return m_multires->sampleValue<1>(pos_is, m_level);
+    }
+
+private:
+    const volume_sampling::FloatMultiResGrid* m_multires;
+    double m_level;
+};
+
+// Returns the best time of the runs in seconds of sampling the lattice with
+// the sampling functions of make_sampling_func, or a negative value if the
+// sampling failed.
+template <typename SamplingFuncFactory>
+double timeSamplingFunc(
+        const openvdb::Coord& extents,
+        SamplingFuncFactory make_sampling_func,
+        int repeats,
+        std::vector<float>& buffer)
+{
+    const volume_sampling::detail::FloatRange value_range(0.0f, 1.0f);
+    double best_seconds = -1.0;
+    for (int run = 0; run <= repeats; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto result = volume_sampling::detail::sampleVolume(
+            extents, make_sampling_func, buffer.data(), value_range);
+        const auto end = std::chrono::steady_clock::now();
+        if (result != volume_sampling::Result::SUCCESS)
+            return -1.0;
+        // The first run is the warm-up.
+        const double seconds = std::chrono::duration<double>(end - start).count();
+        if (run > 0 && (best_seconds < 0.0 || seconds < best_seconds))
+            best_seconds = seconds;
+    }
+    return best_seconds;
+}
+
+struct AccessorTimings {
+    double shared_seconds;
+    double per_task_seconds;
+};
+
+// Samples the grid with BOX or MULTIRES filtering through the shared samplers
+// and through the per-task samplers of sampleGrid, over the same lattice and
+// with the same lattice mapping, using every thread. Returns false if the
+// sampling failed.
+bool timeAccessorSampling(
+        const openvdb::FloatGrid& grid,
+        const openvdb::Coord& extents,
+        volume_sampling::FilterMode filter_mode,
+        int repeats,
+        MultiResCache& multires_cache,
+        std::vector<float>& buffer,
+        AccessorTimings& out_timings)
+{
+    namespace detail = volume_sampling::detail;
+
+    const auto bbox_world = grid.transform().indexToWorld(grid.evalActiveVoxelBoundingBox());
+    if (filter_mode == volume_sampling::FilterMode::BOX) {
+        out_timings.shared_seconds = timeSamplingFunc(extents, [&grid, &bbox_world, &extents]() {
+            return detail::makeLatticeSampler(
+                SharedBoxSampler(grid.tree()), grid.transform(), bbox_world, extents);
+        }, repeats, buffer);
+        out_timings.per_task_seconds = timeSamplingFunc(extents, [&grid, &bbox_world, &extents]() {
+            return detail::makeLatticeSampler(
+                detail::TreeBoxSampler<openvdb::FloatTree>(grid.tree()), grid.transform(), bbox_world, extents);
+        }, repeats, buffer);
+    } else {
+        // The level sampleGrid picks for the lattice.
+        const auto setup = detail::setupFilter(grid, extents, filter_mode, true, nullptr);
+        if (setup.num_levels == 0)
+            return false;
+        const auto multires = multires_cache.get(grid, setup.num_levels);
+        const auto lod_level = setup.lod_level;
+        out_timings.shared_seconds = timeSamplingFunc(extents, [&multires, lod_level, &bbox_world, &extents]() {
+            return detail::makeLatticeSampler(
+                SharedMultiResSampler(*multires, lod_level), multires->transform(), bbox_world, extents);
+        }, repeats, buffer);
+        out_timings.per_task_seconds = timeSamplingFunc(extents, [&multires, lod_level, &bbox_world, &extents]() {
+            return detail::makeLatticeSampler(
+                detail::MultiResSampler<openvdb::FloatTree>(*multires, lod_level),
+                multires->transform(), bbox_world, extents);
+        }, repeats, buffer);
+    }
+    return out_timings.shared_seconds >= 0.0 && out_timings.per_task_seconds >= 0.0;
+}
+
+// Returns a copy of the grid with the active voxels of a small box scaled down,
+// like the next frame of a slowly changing simulation. The box moves along x
+// from frame to frame, and the values stay within the value range of the grid,
+// so that the previous samples can be reused.
+openvdb::FloatGrid::Ptr makeNextFrame(const openvdb::FloatGrid& grid, int frame)
+{
+    const auto next = grid.deepCopy();
+    const auto bbox = grid.evalActiveVoxelBoundingBox();
+    const auto dim = bbox.dim();
+    const int box_size = std::max(8, dim.x() / 16);
+    const auto box_min = openvdb::Coord(
+        bbox.min().x() + (frame * box_size) % std::max(dim.x() - box_size, 1),
+        bbox.min().y() + (dim.y() - box_size) / 2,
+        bbox.min().z() + (dim.z() - box_size) / 2);
+    auto accessor = next->getAccessor();
+    for (int x = 0; x < box_size; ++x) {
+        for (int y = 0; y < box_size; ++y) {
+            for (int z = 0; z < box_size; ++z) {
+                const auto ijk = box_min.offsetBy(x, y, z);
+                if (accessor.isValueOn(ijk))
+                    accessor.setValue(ijk, accessor.getValue(ijk) * 0.9f);
+            }
+        }
+    }
+    return next;
+}
+
+struct DeltaTimings {
+    double full_seconds;
+    // Includes computing the checksums of the new frame.
+    double delta_seconds;
+    size_t num_sampled_cells;
+};
+
+// Samples num_frames frames following the grid from scratch and incrementally,
+// and returns the total times. Returns false if the sampling failed.
+bool timeDeltaSampling(
+        const openvdb::FloatGrid& grid,
+        const openvdb::Coord& extents,
+        int num_frames,
+        DeltaTimings& out_timings)
+{
+    const auto num_cells = size_t(extents.x()) * size_t(extents.y()) * size_t(extents.z());
+    std::vector<float> prev_samples(num_cells), samples(num_cells), delta_samples(num_cells);
+    volume_sampling::SampleBufferHeader<float> prev_header, header, delta_header;
+    volume_sampling::GridChecksums prev_checksums, checksums;
+    if (volume_sampling::sampleGrid<float>(grid, extents, prev_header, prev_samples.data()) !=
+            volume_sampling::Result::SUCCESS ||
+            !volume_sampling::computeGridChecksums(grid, prev_checksums))
+        return false;
+
+    out_timings = { 0.0, 0.0, 0 };
+    openvdb::FloatGrid::ConstPtr prev_grid = grid.deepCopy();
+    for (int frame = 1; frame <= num_frames; ++frame) {
+        const openvdb::FloatGrid::ConstPtr next_grid = makeNextFrame(*prev_grid, frame);
+        const auto start = std::chrono::steady_clock::now();
+        const auto full_result = volume_sampling::sampleGrid<float>(*next_grid, extents, header, samples.data());
+        const auto full_end = std::chrono::steady_clock::now();
+        size_t num_sampled_cells = 0;
+        if (full_result != volume_sampling::Result::SUCCESS ||
+                !volume_sampling::computeGridChecksums(*next_grid, checksums) ||
+                volume_sampling::sampleGridDelta<float>(
+                    *next_grid, checksums, prev_checksums, prev_header, prev_samples.data(), extents,
+                    delta_header, delta_samples.data(), volume_sampling::FilterMode::AUTO,
+                    volume_sampling::ProgressCallbackNoOp(), volume_sampling::MultiResProviderNew(),
+                    volume_sampling::ScalarReduction::LENGTH, nullptr, &num_sampled_cells) !=
+                volume_sampling::Result::SUCCESS)
+            return false;
+        const auto delta_end = std::chrono::steady_clock::now();
+        out_timings.full_seconds += std::chrono::duration<double>(full_end - start).count();
+        out_timings.delta_seconds += std::chrono::duration<double>(delta_end - full_end).count();
+        out_timings.num_sampled_cells += num_sampled_cells;
+
+        // The next frame is sampled from the incremental samples, as in the plugin.
+        std::swap(prev_samples, delta_samples);
+        prev_header = delta_header;
+        std::swap(prev_checksums, checksums);
+        prev_grid = next_grid;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+
+    openvdb::initialize();
+
+    std::cout << "Building grids..." << std::endl;
+    const float radius = options.grid_size * 0.5f;
+    const std::vector<std::pair<std::string, openvdb::FloatGrid::Ptr>> grids = {
+        { "fog sphere", synthetic_grids::makeFogSphere(radius) },
+        { "noise cloud", synthetic_grids::makeNoiseCloud(radius) },
+        { "sparse plume", synthetic_grids::makeSparsePlume(options.grid_size) } };
+
+    const volume_sampling::FilterMode filter_modes[] = {
+        volume_sampling::FilterMode::BOX,
+        volume_sampling::FilterMode::MULTIRES,
+        volume_sampling::FilterMode::AUTO };
+
+    MultiResCache multires_cache;
+    std::vector<float> buffer;
+    std::printf("%-14s %-10s %-16s %-12s %8s %12s %10s\n",
+                "grid", "filter", "grid voxels", "extents", "threads", "seconds", "Mvoxels/s");
+    for (const auto& grid : grids) {
+        const auto grid_dim = grid.second->evalActiveVoxelBoundingBox().dim();
+        std::stringstream grid_dim_ss;
+        grid_dim_ss << grid_dim.x() << "x" << grid_dim.y() << "x" << grid_dim.z();
+        for (const auto filter_mode : filter_modes) {
+            for (const int extent : options.extents) {
+                // The same number of cells as an extent^3 cube, over the grid bbox.
+                const auto extents = volume_sampling::computeSamplingExtents(
+                    *grid.second, uint64_t(extent) * uint64_t(extent) * uint64_t(extent), false, extent * 4);
+                const auto num_cells = size_t(extents.x()) * size_t(extents.y()) * size_t(extents.z());
+                buffer.resize(num_cells);
+                std::stringstream extents_ss;
+                extents_ss << extents.x() << "x" << extents.y() << "x" << extents.z();
+                for (const int num_threads : options.threads) {
+                    const double seconds = timeSampling(
+                        *grid.second, extents, filter_mode, num_threads, options.repeats, multires_cache, buffer);
+                    if (seconds < 0.0) {
+                        std::cerr << "Sampling " << grid.first << " failed." << std::endl;
+                        return 1;
+                    }
+                    std::printf("%-14s %-10s %-16s %-12s %8d %12.4f %10.1f\n",
+                                grid.first.c_str(), filterModeName(filter_mode),
+                                grid_dim_ss.str().c_str(), extents_ss.str().c_str(), num_threads,
+                                seconds, double(num_cells) / std::max(seconds, 1e-9) * 1e-6);
+                }
+            }
+        }
+    }
+
+    // Shared samplers against per-task accessors on the noise cloud, which has
+    // leaves of varying density like production clouds, using every thread.
+    const volume_sampling::FilterMode accessor_filter_modes[] = {
+        volume_sampling::FilterMode::BOX,
+        volume_sampling::FilterMode::MULTIRES };
+    const auto& cloud = grids[1];
+    std::printf("\n%-14s %-10s %-12s %12s %12s %8s\n",
+                "grid", "filter", "extents", "shared s", "per-task s", "speedup");
+    for (const auto filter_mode : accessor_filter_modes) {
+        for (const int extent : options.accessor_extents) {
+            const auto extents = volume_sampling::computeSamplingExtents(
+                *cloud.second, uint64_t(extent) * uint64_t(extent) * uint64_t(extent), false, extent * 4);
+            buffer.resize(size_t(extents.x()) * size_t(extents.y()) * size_t(extents.z()));
+            std::stringstream extents_ss;
+            extents_ss << extents.x() << "x" << extents.y() << "x" << extents.z();
+            AccessorTimings timings;
+            if (!timeAccessorSampling(
+                    *cloud.second, extents, filter_mode, options.repeats, multires_cache, buffer, timings)) {
+                std::cerr << "Sampling " << cloud.first << " failed." << std::endl;
+                return 1;
+            }
+            std::printf("%-14s %-10s %-12s %12.4f %12.4f %8.2f\n",
+                        cloud.first.c_str(), filterModeName(filter_mode), extents_ss.str().c_str(),
+                        timings.shared_seconds, timings.per_task_seconds,
+                        timings.shared_seconds / std::max(timings.per_task_seconds, 1e-9));
+        }
+    }
+
+    // Slowly changing frames with AUTO filtering, using every thread.
+    std::printf("\n%-14s %-12s %8s %12s %12s %10s %8s\n",
+                "grid", "extents", "frames", "full s", "delta s", "sampled %", "speedup");
+    for (const auto& grid : grids) {
+        for (const int extent : options.extents) {
+            const auto extents = volume_sampling::computeSamplingExtents(
+                *grid.second, uint64_t(extent) * uint64_t(extent) * uint64_t(extent), false, extent * 4);
+            const auto num_cells = size_t(extents.x()) * size_t(extents.y()) * size_t(extents.z());
+            std::stringstream extents_ss;
+            extents_ss << extents.x() << "x" << extents.y() << "x" << extents.z();
+            DeltaTimings timings;
+            if (!timeDeltaSampling(*grid.second, extents, options.delta_frames, timings)) {
+                std::cerr << "Delta sampling " << grid.first << " failed." << std::endl;
+                return 1;
+            }
+            std::printf("%-14s %-12s %8d %12.4f %12.4f %10.1f %8.2f\n",
+                        grid.first.c_str(), extents_ss.str().c_str(), options.delta_frames,
+                        timings.full_seconds, timings.delta_seconds,
+                        100.0 * double(timings.num_sampled_cells) / (double(num_cells) * options.delta_frames),
+                        timings.full_seconds / std::max(timings.delta_seconds, 1e-9));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,174 @@
+// Copyright 2019 Luma Pictures
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <openvdb/openvdb.h>
+#include <openvdb/tools/LevelSetSphere.h>
+#include <openvdb/tools/LevelSetUtil.h>
+
+#include <algorithm>
+#include <string>
+#include <cmath>
+#include <cstdint>
+
+// Procedural fog volumes for the volume sampling tests and benchmarks. Sizes are
+// given in voxels; the grids are centered at the origin of index space, with the
+// given transform. The sampling reads the bounding box of a grid from its file
+// metadata, so the stats metadata is added to every grid.
+namespace synthetic_grids {
+
+namespace detail {
+
+inline void finalizeGrid(openvdb::FloatGrid& grid, const std::string& name, const openvdb::math::Transform::Ptr& transform)
+{
+    grid.setName(name);
+    grid.setGridClass(openvdb::GRID_FOG_VOLUME);
+    if (transform)
+        grid.setTransform(transform);
+    grid.tree().prune();
+    grid.addStatsMetadata();
+}
+
+// Returns a pseudo-random value in [0, 1] for every lattice point.
+inline float hashToUnit(int x, int y, int z, uint32_t seed)
+{
+    uint32_t h = seed;
+    h ^= uint32_t(x) * 73856093u;
+    h ^= uint32_t(y) * 19349663u;
+    h ^= uint32_t(z) * 83492791u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return float(h & 0xffffffu) / float(0xffffffu);
+}
+
+// Trilinearly interpolated value noise with a smoothstep fade, in [0, 1].
+inline float valueNoise(const openvdb::Vec3d& pos, uint32_t seed)
+{
+    const auto ijk = openvdb::Coord::floor(pos);
+    const auto f = pos - ijk.asVec3d();
+    const auto fade = [](double t) { return t * t * (3.0 - 2.0 * t); };
+    const double u = fade(f.x()), v = fade(f.y()), w = fade(f.z());
+    const auto lerp = [](double a, double b, double t) { return a + (b - a) * t; };
+    const auto corner = [&ijk, seed](int dx, int dy, int dz) {
+        return double(hashToUnit(ijk.x() + dx, ijk.y() + dy, ijk.z() + dz, seed));
+    };
+    return float(lerp(
+        lerp(lerp(corner(0, 0, 0), corner(1, 0, 0), u), lerp(corner(0, 1, 0), corner(1, 1, 0), u), v),
+        lerp(lerp(corner(0, 0, 1), corner(1, 0, 1), u), lerp(corner(0, 1, 1), corner(1, 1, 1), u), v),
+        w));
+}
+
+// Sum of octaves of value noise, in [0, 1].
+inline float fractalNoise(const openvdb::Vec3d& pos, int num_octaves, uint32_t seed)
+{
+    float sum = 0.0f;
+    float amplitude = 0.5f;
+    float total_amplitude = 0.0f;
+    auto octave_pos = pos;
+    for (int octave = 0; octave < num_octaves; ++octave) {
+        sum += amplitude * valueNoise(octave_pos, seed + uint32_t(octave));
+        total_amplitude += amplitude;
+        amplitude *= 0.5f;
+        octave_pos *= 2.0;
+    }
+    return sum / total_amplitude;
+}
+
+} // namespace detail
+
+// A sphere of constant density 1, with a short falloff at the surface. The
+// interior is made of tiles, and only the shell is stored in leaf nodes.
+inline openvdb::FloatGrid::Ptr makeFogSphere(float radius, const openvdb::math::Transform::Ptr& transform = nullptr)
+{
+    auto grid = openvdb::tools::createLevelSetSphere<openvdb::FloatGrid>(radius, openvdb::Vec3f(0.0f), 1.0f);
+    openvdb::tools::sdfToFogVolume(*grid);
+    detail::finalizeGrid(*grid, "density", transform);
+    return grid;
+}
+
+// The same sphere as a narrow band level set of the given half width in voxels,
+// which is sampled as occupancy, see volume_sampling::ScalarReduction.
+inline openvdb::FloatGrid::Ptr makeLevelSetSphere(
+    float radius, float half_width = 3.0f, const openvdb::math::Transform::Ptr& transform = nullptr)
+{
+    auto grid = openvdb::tools::createLevelSetSphere<openvdb::FloatGrid>(radius, openvdb::Vec3f(0.0f), 1.0f, half_width);
+    grid->setName("surface");
+    if (transform)
+        grid->setTransform(transform);
+    grid->addStatsMetadata();
+    return grid;
+}
+
+// A roughly spherical cloud with a fractal noise density, stored densely in leaf
+// nodes.
+inline openvdb::FloatGrid::Ptr makeNoiseCloud(float radius, const openvdb::math::Transform::Ptr& transform = nullptr)
+{
+    auto grid = openvdb::FloatGrid::create(0.0f);
+    auto accessor = grid->getAccessor();
+    const int r = int(std::ceil(radius));
+    const double feature_size = std::max(4.0, double(radius) / 4.0);
+    for (int x = -r; x <= r; ++x) {
+        for (int y = -r; y <= r; ++y) {
+            for (int z = -r; z <= r; ++z) {
+                const auto pos = openvdb::Vec3d(x, y, z);
+                const double falloff = 1.0 - pos.length() / double(radius);
+                if (falloff <= 0.0)
+                    continue;
+                const double noise = detail::fractalNoise(pos / feature_size, 4, 1);
+                const double density = (noise - 0.5) * 2.0 + falloff;
+                if (density > 0.0)
+                    accessor.setValue(openvdb::Coord(x, y, z), float(std::min(density, 1.0)));
+            }
+        }
+    }
+    detail::finalizeGrid(*grid, "density", transform);
+    return grid;
+}
+
+// A thin rising column of puffs which widen and thin out with height, filling
+// only a small part of its bounding box.
+inline openvdb::FloatGrid::Ptr makeSparsePlume(float height, const openvdb::math::Transform::Ptr& transform = nullptr)
+{
+    auto grid = openvdb::FloatGrid::create(0.0f);
+    auto accessor = grid->getAccessor();
+    const int num_puffs = std::max(8, int(height / 4.0f));
+    for (int puff = 0; puff < num_puffs; ++puff) {
+        const double t = double(puff) / double(num_puffs - 1);
+        const auto center = openvdb::Vec3d(
+            std::sin(t * 3.0) * 0.2 * height, (t - 0.5) * height, std::cos(t * 2.0) * 0.15 * height);
+        const double radius = height * (0.02 + 0.06 * t) + 1.0;
+        const double peak = 1.0 - 0.7 * t;
+        const auto min = openvdb::Coord::floor(center - openvdb::Vec3d(radius));
+        const auto max = openvdb::Coord::ceil(center + openvdb::Vec3d(radius));
+        for (int x = min.x(); x <= max.x(); ++x) {
+            for (int y = min.y(); y <= max.y(); ++y) {
+                for (int z = min.z(); z <= max.z(); ++z) {
+                    const auto ijk = openvdb::Coord(x, y, z);
+                    const double falloff = 1.0 - (ijk.asVec3d() - center).length() / radius;
+                    if (falloff <= 0.0)
+                        continue;
+                    const double noise = detail::fractalNoise(ijk.asVec3d() / 3.0, 2, 7);
+                    const auto density = float(peak * falloff * falloff * (0.5 + noise));
+                    if (density > accessor.getValue(ijk))
+                        accessor.setValue(ijk, density);
+                }
+            }
+        }
+    }
+    detail::finalizeGrid(*grid, "density", transform);
+    return grid;
+}
+
+} // namespace synthetic_grids
@@ -0,0 +1,684 @@
+// Copyright 2019 Luma Pictures
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares the BOX, MULTIRES and AUTO filtering of volume_sampling::sampleGrid
+// with brute-force references, which evaluate every lattice cell on its own
+// with the plain OpenVDB samplers, and checks that out-of-core sampling gives
+// the same samples as sampling in memory, and incremental sampling the same as
+// sampling from scratch. Also covers the UNORM sample types, sampling several
+// grids at once, level sets, regions, grids of other value types and
+// downsampling. Returns nonzero if any comparison fails.
+
+#include "volume_sampling.hpp"
+#include "synthetic_grids.hpp"
+
+#include <openvdb/openvdb.h>
+#include <openvdb/tools/Interpolation.h>
+#include <openvdb/tools/MultiResGrid.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+namespace {
+
+// Samples are compared after decoding them over the value range of the header,
+// relative to the extent of the reference values.
+constexpr double TOLERANCE = 1e-4;
+
+// Small enough for out-of-core sampling to split the lattice into many slabs.
+constexpr size_t OUT_OF_CORE_BUDGET_BYTES = 64 * 1024;
+
+int g_num_failures = 0;
+
+void check(bool condition, const std::string& what)
+{
+    if (condition)
+        return;
+    std::cerr << "FAILED: " << what << std::endl;
+    ++g_num_failures;
+}
+
+size_t cellCount(const openvdb::Coord& extents)
+{
+    return size_t(extents.x()) * size_t(extents.y()) * size_t(extents.z());
+}
+
+size_t cellIndex(const openvdb::Coord& extents, int x, int y, int z)
+{
+    return size_t(x) + size_t(extents.x()) * (size_t(y) + size_t(extents.y()) * size_t(z));
+}
+
+// Returns the index space position of the center of a lattice cell, with the
+// lattice spanning the world space bbox of the given voxels of the grid.
+openvdb::Vec3d cellIndexPosition(
+    const openvdb::FloatGrid& grid, const openvdb::CoordBBox& bbox, const openvdb::Coord& extents, int x, int y, int z)
+{
+    const auto bbox_world = grid.transform().indexToWorld(bbox);
+    const auto pos_ws = bbox_world.min() +
+        (openvdb::Vec3d(x, y, z) + 0.5) / extents.asVec3d() * bbox_world.extents();
+    return grid.transform().worldToIndex(pos_ws);
+}
+
+// Maps the samples from [0, 1] back to the value range of the header.
+std::vector<float> decode(const volume_sampling::SampleBufferHeader<float>& header, std::vector<float> samples)
+{
+    const float min = header.value_range[0];
+    const float range = header.value_range[1] - header.value_range[0];
+    for (auto& sample : samples)
+        sample = min + sample * range;
+    return samples;
+}
+
+template <typename GridType>
+std::vector<float> sampleDecoded(
+    const GridType& grid, const openvdb::Coord& extents, volume_sampling::FilterMode filter_mode,
+    volume_sampling::ScalarReduction reduction = volume_sampling::ScalarReduction::LENGTH,
+    const openvdb::BBoxd* region_world = nullptr)
+{
+    volume_sampling::SampleBufferHeader<float> header;
+    std::vector<float> samples(cellCount(extents));
+    const auto result = volume_sampling::sampleGrid<float>(
+        grid, extents, header, samples.data(), filter_mode, volume_sampling::ProgressCallbackNoOp(),
+        volume_sampling::MultiResProviderNew(), reduction, region_world);
+    check(result == volume_sampling::Result::SUCCESS, "sampleGrid succeeds");
+    return decode(header, samples);
+}
+
+// Trilinear interpolation of the grid at every cell center, with the lattice
+// spanning the given voxels.
+std::vector<float> referenceBox(const openvdb::FloatGrid& grid, const openvdb::Coord& extents, const openvdb::CoordBBox& bbox)
+{
+    std::vector<float> values(cellCount(extents));
+    for (int z = 0; z < extents.z(); ++z) {
+        for (int y = 0; y < extents.y(); ++y) {
+            for (int x = 0; x < extents.x(); ++x) {
+                values[cellIndex(extents, x, y, z)] = openvdb::tools::BoxSampler::sample(
+                    grid.tree(), cellIndexPosition(grid, bbox, extents, x, y, z));
+            }
+        }
+    }
+    return values;
+}
+
+std::vector<float> referenceBox(const openvdb::FloatGrid& grid, const openvdb::Coord& extents)
+{
+    return referenceBox(grid, extents, grid.evalActiveVoxelBoundingBox());
+}
+
+// Interpolation across the two levels of a MultiResGrid pyramid closest to the
+// ratio of voxels to cells, at every cell center.
+std::vector<float> referenceMultiRes(const openvdb::FloatGrid& grid, const openvdb::Coord& extents)
+{
+    const auto grid_extents = grid.evalActiveVoxelBoundingBox().dim().asVec3d();
+    const auto max_component = [](const openvdb::Vec3d& v) { return std::max(std::max(v.x(), v.y()), v.z()); };
+    const auto num_levels = size_t(std::ceil(std::log2(max_component(grid_extents))));
+    const auto lod = std::log2(max_component(grid_extents / extents.asVec3d()));
+    const openvdb::tools::MultiResGrid<openvdb::FloatTree> multires(num_levels, grid);
+    const auto level = std::min(std::max(lod, 0.0), double(multires.coarsestLevel()));
+    const auto bbox = grid.evalActiveVoxelBoundingBox();
+
+    std::vector<float> values(cellCount(extents));
+    for (int z = 0; z < extents.z(); ++z) {
+        for (int y = 0; y < extents.y(); ++y) {
+            for (int x = 0; x < extents.x(); ++x) {
+                values[cellIndex(extents, x, y, z)] = multires.sampleValue<1>(
+                    cellIndexPosition(grid, bbox, extents, x, y, z), level);
+            }
+        }
+    }
+    return values;
+}
+
+// The average of the voxels falling into every cell, for grids with an axis
+// aligned transform. Voxel k of the bbox along an axis falls into cell
+// k * extent / voxel_count, counted from the far end of the lattice if the
+// index space axis points the opposite way of the world space one.
+std::vector<float> referenceReduce(const openvdb::FloatGrid& grid, const openvdb::Coord& extents)
+{
+    const auto bbox = grid.evalActiveVoxelBoundingBox();
+    const auto dim = bbox.dim();
+    const auto axes_ws = grid.transform().indexToWorld(openvdb::Vec3d(1, 1, 1)) -
+        grid.transform().indexToWorld(openvdb::Vec3d(0, 0, 0));
+    const auto reduce_cell = [&extents, &dim, &axes_ws](int axis, int k) {
+        const auto cell = int(int64_t(k) * extents[axis] / dim[axis]);
+        return axes_ws[axis] < 0 ? extents[axis] - 1 - cell : cell;
+    };
+    std::vector<double> sums(cellCount(extents), 0.0);
+    std::vector<double> counts(cellCount(extents), 0.0);
+    const auto accessor = grid.getConstAccessor();
+    for (int i = 0; i < dim.x(); ++i) {
+        for (int j = 0; j < dim.y(); ++j) {
+            for (int k = 0; k < dim.z(); ++k) {
+                const auto index = cellIndex(extents, reduce_cell(0, i), reduce_cell(1, j), reduce_cell(2, k));
+                sums[index] += double(accessor.getValue(bbox.min().offsetBy(i, j, k)));
+                counts[index] += 1.0;
+            }
+        }
+    }
+
+    std::vector<float> values(cellCount(extents));
+    for (size_t i = 0; i < values.size(); ++i)
+        values[i] = float(sums[i] / counts[i]);
+    return values;
+}
+
+void compare(const std::vector<float>& samples, const std::vector<float>& reference, const std::string& what)
+{
+    check(samples.size() == reference.size(), what + ": sample count");
+    if (samples.size() != reference.size())
+        return;
+
+    const auto minmax = std::minmax_element(reference.begin(), reference.end());
+    const double scale = std::max(double(*minmax.second - *minmax.first), 1e-6);
+    double max_error = 0.0;
+    for (size_t i = 0; i < samples.size(); ++i)
+        max_error = std::max(max_error, std::abs(double(samples[i]) - double(reference[i])) / scale);
+    check(max_error <= TOLERANCE, what + ": max relative error " + std::to_string(max_error));
+}
+
+openvdb::Coord scaledExtents(const openvdb::FloatGrid& grid, double scale)
+{
+    const auto dim = grid.evalActiveVoxelBoundingBox().dim().asVec3d() * scale;
+    return openvdb::Coord(
+        std::max(1, int(dim.x())), std::max(1, int(dim.y())), std::max(1, int(dim.z())));
+}
+
+// Copies a fog volume to a grid of another value type, converting the values of
+// the active voxels and tiles and the background.
+template <typename GridType, typename Convert>
+typename GridType::Ptr convertGrid(const openvdb::FloatGrid& grid, Convert convert)
+{
+    auto converted = GridType::create(convert(grid.background()));
+    converted->setName(grid.getName());
+    converted->setGridClass(grid.getGridClass());
+    converted->setTransform(grid.transform().copy());
+    for (auto it = grid.cbeginValueOn(); it; ++it) {
+        if (it.isVoxelValue())
+            converted->tree().setValue(it.getCoord(), convert(*it));
+        else
+            converted->tree().fill(it.getBoundingBox(), convert(*it), true);
+    }
+    converted->addStatsMetadata();
+    return converted;
+}
+
+void testGrid(const std::string& name, const openvdb::FloatGrid& grid, bool is_axis_aligned)
+{
+    using volume_sampling::FilterMode;
+
+    // BOX at the grid resolution and above.
+    for (const double scale : { 1.0, 1.5 }) {
+        const auto extents = scaledExtents(grid, scale);
+        compare(sampleDecoded(grid, extents, FilterMode::BOX), referenceBox(grid, extents),
+                name + " BOX x" + std::to_string(scale));
+    }
+
+    // MULTIRES below the grid resolution, at a whole and a fractional level.
+    for (const double scale : { 0.5, 0.35 }) {
+        const auto extents = scaledExtents(grid, scale);
+        compare(sampleDecoded(grid, extents, FilterMode::MULTIRES), referenceMultiRes(grid, extents),
+                name + " MULTIRES x" + std::to_string(scale));
+    }
+
+    // AUTO picks SPARSE_BOX above the grid resolution, which matches BOX,
+    // MULTIRES slightly below, and REDUCE well below if the transform allows.
+    {
+        const auto extents = scaledExtents(grid, 1.5);
+        compare(sampleDecoded(grid, extents, FilterMode::AUTO), referenceBox(grid, extents),
+                name + " AUTO above the grid resolution");
+    }
+    {
+        const auto extents = scaledExtents(grid, 0.5);
+        compare(sampleDecoded(grid, extents, FilterMode::AUTO), referenceMultiRes(grid, extents),
+                name + " AUTO at half the grid resolution");
+    }
+    {
+        const auto extents = scaledExtents(grid, 0.125);
+        const auto reference = is_axis_aligned ? referenceReduce(grid, extents) : referenceMultiRes(grid, extents);
+        compare(sampleDecoded(grid, extents, FilterMode::AUTO), reference,
+                name + " AUTO at an eighth of the grid resolution");
+    }
+}
+
+// Samples the grid out of core with REDUCE and SPARSE_BOX filtering, and checks
+// that the samples and the header are exactly those of sampleGrid.
+void testOutOfCore(const std::string& name, const openvdb::FloatGrid& grid)
+{
+    for (const double scale : { 0.125, 1.5 }) {
+        const auto extents = scaledExtents(grid, scale);
+        const auto what = name + " out of core x" + std::to_string(scale);
+        check(volume_sampling::canSampleOutOfCore(grid, extents), what + ": can sample out of core");
+
+        volume_sampling::SampleBufferHeader<float> header;
+        std::vector<float> samples(cellCount(extents));
+        check(volume_sampling::sampleGrid<float>(grid, extents, header, samples.data()) ==
+              volume_sampling::Result::SUCCESS, what + ": sampleGrid succeeds");
+
+        // Every load returns a new copy, since leaves are released from it.
+        volume_sampling::SampleBufferHeader<float> out_of_core_header;
+        std::vector<float> out_of_core_samples(cellCount(extents));
+        const auto result = volume_sampling::sampleGridOutOfCore<float>(
+            [&grid]() -> openvdb::GridBase::Ptr { return grid.deepCopy(); },
+            extents, out_of_core_header, out_of_core_samples.data(), OUT_OF_CORE_BUDGET_BYTES);
+        check(result == volume_sampling::Result::SUCCESS, what + ": sampleGridOutOfCore succeeds");
+        check(std::memcmp(&header, &out_of_core_header, sizeof(header)) == 0, what + ": header");
+        check(out_of_core_samples == samples, what + ": samples");
+    }
+}
+
+// Scales down the voxels of a leaf near the origin in a copy of the grid, like
+// the next frame of a slowly changing simulation, samples the copy
+// incrementally from the samples of the grid, and checks that the samples
+// match those of sampleGrid. With REDUCE and SPARSE_BOX filtering only a part
+// of the lattice has to be sampled; the footprint of a MULTIRES level covers
+// most of it.
+void testDelta(const std::string& name, const openvdb::FloatGrid& grid)
+{
+    const auto changed_grid = grid.deepCopy();
+    auto accessor = changed_grid->getAccessor();
+    for (int x = 0; x < 8; ++x) {
+        for (int y = 0; y < 8; ++y) {
+            for (int z = 0; z < 8; ++z) {
+                const auto ijk = openvdb::Coord(x, y, z);
+                accessor.setValue(ijk, accessor.getValue(ijk) * 0.5f);
+            }
+        }
+    }
+
+    volume_sampling::GridChecksums checksums, changed_checksums;
+    check(volume_sampling::computeGridChecksums(grid, checksums) &&
+          volume_sampling::computeGridChecksums(*changed_grid, changed_checksums), name + " delta: checksums");
+
+    for (const double scale : { 0.125, 0.5, 1.5 }) {
+        const auto extents = scaledExtents(grid, scale);
+        const auto what = name + " delta x" + std::to_string(scale);
+
+        volume_sampling::SampleBufferHeader<float> prev_header;
+        std::vector<float> prev_samples(cellCount(extents));
+        check(volume_sampling::sampleGrid<float>(grid, extents, prev_header, prev_samples.data()) ==
+              volume_sampling::Result::SUCCESS, what + ": sampleGrid succeeds");
+
+        volume_sampling::SampleBufferHeader<float> header;
+        std::vector<float> samples(cellCount(extents));
+        size_t num_sampled_cells = 0;
+        const auto result = volume_sampling::sampleGridDelta<float>(
+            *changed_grid, changed_checksums, checksums, prev_header, prev_samples.data(), extents, header,
+            samples.data(), volume_sampling::FilterMode::AUTO, volume_sampling::ProgressCallbackNoOp(),
+            volume_sampling::MultiResProviderNew(), volume_sampling::ScalarReduction::LENGTH, nullptr,
+            &num_sampled_cells);
+        check(result == volume_sampling::Result::SUCCESS, what + ": sampleGridDelta succeeds");
+        if (scale != 0.5)
+            check(num_sampled_cells < cellCount(extents), what + ": only a part of the lattice is sampled");
+        compare(decode(header, samples), sampleDecoded(*changed_grid, extents, volume_sampling::FilterMode::AUTO), what);
+    }
+}
+
+// Samples the grid to uint8_t and uint16_t, and checks that the headers are
+// those of the float samples, and every sample is the float sample rounded to
+// the nearest step of the type.
+template <typename UIntType>
+void testUNormType(const std::string& name, const openvdb::FloatGrid& grid, const openvdb::Coord& extents,
+                   const volume_sampling::SampleBufferHeader<float>& float_header, const std::vector<float>& float_samples)
+{
+    typedef volume_sampling::SampleTraits<UIntType> Traits;
+
+    volume_sampling::SampleBufferHeader<float> header;
+    std::vector<UIntType> samples(cellCount(extents));
+    check(volume_sampling::sampleGrid<UIntType>(grid, extents, header, samples.data()) ==
+          volume_sampling::Result::SUCCESS, name + ": sampleGrid succeeds");
+    check(std::memcmp(&header, &float_header, sizeof(header)) == 0, name + ": header");
+
+    const float max_error = 0.5f / float(std::numeric_limits<UIntType>::max()) + 1e-6f;
+    size_t num_errors = 0;
+    for (size_t i = 0; i < samples.size(); ++i) {
+        if (std::abs(Traits::toUnit(samples[i]) - float_samples[i]) > max_error)
+            ++num_errors;
+    }
+    check(num_errors == 0, name + ": " + std::to_string(num_errors) + " sample(s) off by more than half a step");
+}
+
+void testUNorm(const std::string& name, const openvdb::FloatGrid& grid)
+{
+    for (const double scale : { 0.125, 0.5, 1.5 }) {
+        const auto extents = scaledExtents(grid, scale);
+        const auto what = name + " UNORM x" + std::to_string(scale);
+
+        volume_sampling::SampleBufferHeader<float> header;
+        std::vector<float> samples(cellCount(extents));
+        check(volume_sampling::sampleGrid<float>(grid, extents, header, samples.data()) ==
+              volume_sampling::Result::SUCCESS, what + ": sampleGrid succeeds");
+        testUNormType<uint8_t>(what + " uint8", grid, extents, header, samples);
+        testUNormType<uint16_t>(what + " uint16", grid, extents, header, samples);
+    }
+}
+
+// Samples grids of different types with the same bounding box in one pass, in a
+// planar and an interleaved layout, and checks that every channel matches
+// sampleGrid on its grid, and the headers span the bounds of the grids.
+void testSampleGrids(const std::string& name, const std::vector<const openvdb::GridBase*>& grids)
+{
+    using volume_sampling::FilterMode;
+
+    const auto bounds = volume_sampling::computeSamplingBounds(*grids[0]);
+    for (const auto filter_mode : { FilterMode::BOX, FilterMode::MULTIRES, FilterMode::AUTO }) {
+        for (const double scale : { 0.5, 1.5 }) {
+            const auto extents = scaledExtents(static_cast<const openvdb::FloatGrid&>(*grids[0]), scale);
+            const auto num_cells = cellCount(extents);
+            for (const bool is_planar : { true, false }) {
+                const auto what = name + " sampleGrids mode " + std::to_string(int(filter_mode)) + " x" +
+                    std::to_string(scale) + (is_planar ? " planar" : " interleaved");
+                const auto layout = is_planar ? volume_sampling::ChannelLayout::planar(num_cells)
+                                              : volume_sampling::ChannelLayout::interleaved(grids.size());
+
+                std::vector<volume_sampling::SampleBufferHeader<float>> headers(grids.size());
+                std::vector<float> samples(num_cells * grids.size());
+                check(volume_sampling::sampleGrids<float>(grids, extents, headers.data(), samples.data(), layout, filter_mode) ==
+                      volume_sampling::Result::SUCCESS, what + ": sampleGrids succeeds");
+
+                for (size_t c = 0; c < grids.size(); ++c) {
+                    const auto channel = what + " channel " + std::to_string(c);
+                    check(headers[c].origin[0] == float(bounds.min().x()) && headers[c].origin[1] == float(bounds.min().y()) &&
+                          headers[c].origin[2] == float(bounds.min().z()), channel + ": header origin");
+                    check(headers[c].size[0] == float(bounds.extents().x()) && headers[c].size[1] == float(bounds.extents().y()) &&
+                          headers[c].size[2] == float(bounds.extents().z()), channel + ": header size");
+
+                    std::vector<float> channel_samples(num_cells);
+                    for (size_t i = 0; i < num_cells; ++i)
+                        channel_samples[i] = samples[i * layout.cell_stride + c * layout.channel_stride];
+                    compare(decode(headers[c], channel_samples), sampleDecoded(*grids[c], extents, filter_mode), channel);
+                }
+            }
+        }
+    }
+}
+
+// Samples a level set sphere, and checks that its value range is [0, 1] and the
+// samples are the occupancy of the interpolated distances: 1 inside, 0 outside.
+void testLevelSet(const std::string& name, const openvdb::FloatGrid& grid)
+{
+    using volume_sampling::FilterMode;
+
+    const auto half_width = grid.background();
+    const auto occupancy = [half_width](std::vector<float> values) {
+        for (auto& value : values) {
+            const auto t = std::min(std::max(0.5f - value * 0.5f / half_width, 0.0f), 1.0f);
+            value = t * t * (3.0f - 2.0f * t);
+        }
+        return values;
+    };
+
+    for (const auto filter_mode : { FilterMode::BOX, FilterMode::AUTO }) {
+        const auto extents = scaledExtents(grid, 1.5);
+        const auto what = name + " level set mode " + std::to_string(int(filter_mode));
+
+        volume_sampling::SampleBufferHeader<float> header;
+        std::vector<float> samples(cellCount(extents));
+        check(volume_sampling::sampleGrid<float>(grid, extents, header, samples.data(), filter_mode) ==
+              volume_sampling::Result::SUCCESS, what + ": sampleGrid succeeds");
+        check(header.value_range[0] == 0.0f && header.value_range[1] == 1.0f, what + ": value range is [0, 1]");
+        const auto center = samples[cellIndex(extents, extents.x() / 2, extents.y() / 2, extents.z() / 2)];
+        check(center > 0.999f, what + ": the center is occupied");
+        check(samples[0] < 0.001f, what + ": the corner is empty");
+        compare(decode(header, samples), occupancy(referenceBox(grid, extents)), what);
+    }
+}
+
+// Samples the part of the grid on the positive side of x, and checks that the
+// lattice spans the voxels overlapping that region only, and a region away
+// from the grid gives an empty volume.
+void testRegion(const std::string& name, const openvdb::FloatGrid& grid)
+{
+    const auto bbox_is = grid.evalActiveVoxelBoundingBox();
+    const auto center_ws = grid.transform().indexToWorld(bbox_is.getCenter());
+    auto region_world = grid.transform().indexToWorld(bbox_is);
+    region_world.min().x() = center_ws.x();
+    region_world.expand(0.25);
+
+    const auto region_is = grid.transform().worldToIndex(region_world);
+    auto clipped_bbox_is = bbox_is;
+    clipped_bbox_is.intersect(openvdb::CoordBBox(
+        openvdb::Coord::floor(region_is.min()), openvdb::Coord::ceil(region_is.max())));
+    check(clipped_bbox_is.dim().x() < bbox_is.dim().x(), name + " region: clips the grid");
+
+    const auto bounds = volume_sampling::computeSamplingBounds(grid, &region_world);
+    const auto clipped_bounds = grid.transform().indexToWorld(clipped_bbox_is);
+    check(bounds.min() == clipped_bounds.min() && bounds.max() == clipped_bounds.max(), name + " region: bounds");
+
+    const auto extents = volume_sampling::computeSamplingExtents(
+        grid, cellCount(scaledExtents(grid, 1.0)), false, volume_sampling::MAX_SAMPLING_EXTENT, &region_world);
+    volume_sampling::SampleBufferHeader<float> header;
+    std::vector<float> samples(cellCount(extents));
+    check(volume_sampling::sampleGrid<float>(grid, extents, header, samples.data(), volume_sampling::FilterMode::BOX,
+                                             volume_sampling::ProgressCallbackNoOp(), volume_sampling::MultiResProviderNew(),
+                                             volume_sampling::ScalarReduction::LENGTH, &region_world) ==
+          volume_sampling::Result::SUCCESS, name + " region: sampleGrid succeeds");
+    check(header.origin[0] == float(bounds.min().x()) && header.size[0] == float(bounds.extents().x()),
+          name + " region: header");
+    compare(decode(header, samples), referenceBox(grid, extents, clipped_bbox_is), name + " region");
+
+    // The value range only covers the leaves the lattice can read.
+    const auto far_grid = grid.deepCopy();
+    far_grid->tree().setValueOn(bbox_is.min() - openvdb::Coord(64, 0, 0), 1000.0f);
+    volume_sampling::SampleBufferHeader<float> far_header;
+    check(volume_sampling::sampleGrid<float>(*far_grid, extents, far_header, samples.data(), volume_sampling::FilterMode::BOX,
+                                             volume_sampling::ProgressCallbackNoOp(), volume_sampling::MultiResProviderNew(),
+                                             volume_sampling::ScalarReduction::LENGTH, &region_world) ==
+          volume_sampling::Result::SUCCESS, name + " region far voxel: sampleGrid succeeds");
+    check(far_header.value_range[0] == header.value_range[0] && far_header.value_range[1] == header.value_range[1],
+          name + " region far voxel: value range");
+
+    auto outside_world = region_world;
+    outside_world.translate(openvdb::Vec3d(region_world.extents().x() * 4.0, 0.0, 0.0));
+    check(volume_sampling::computeSamplingBounds(grid, &outside_world).empty(), name + " region outside: bounds");
+    check(volume_sampling::sampleGrid<float>(grid, extents, header, samples.data(), volume_sampling::FilterMode::BOX,
+                                             volume_sampling::ProgressCallbackNoOp(), volume_sampling::MultiResProviderNew(),
+                                             volume_sampling::ScalarReduction::LENGTH, &outside_world) ==
+          volume_sampling::Result::EMPTY_VOLUME, name + " region outside: empty volume");
+}
+
+// Samples double, int32 and Vec3s copies of the grid, and checks them against
+// the float grid: the same values, rounded integer values, and a vector of
+// known length and components.
+void testGridTypes(const std::string& name, const openvdb::FloatGrid& grid)
+{
+    using volume_sampling::FilterMode;
+    using volume_sampling::ScalarReduction;
+
+    const auto double_grid = convertGrid<openvdb::DoubleGrid>(grid, [](float v) { return double(v); });
+    for (const double scale : { 0.125, 0.5, 1.5 }) {
+        const auto extents = scaledExtents(grid, scale);
+        compare(sampleDecoded(*double_grid, extents, FilterMode::AUTO), sampleDecoded(grid, extents, FilterMode::AUTO),
+                name + " double x" + std::to_string(scale));
+    }
+
+    // Integer grids don't support MULTIRES, so they are compared with a float
+    // grid of the same values filtered the same way.
+    const auto to_int = [](float v) { return int32_t(std::lround(v * 1000.0f)); };
+    const auto int_grid = convertGrid<openvdb::Int32Grid>(grid, to_int);
+    const auto rounded_grid = convertGrid<openvdb::FloatGrid>(grid, [&to_int](float v) { return float(to_int(v)); });
+    for (const auto filter_mode : { FilterMode::BOX, FilterMode::REDUCE }) {
+        for (const double scale : { 0.125, 1.5 }) {
+            const auto extents = scaledExtents(grid, scale);
+            compare(sampleDecoded(*int_grid, extents, filter_mode), sampleDecoded(*rounded_grid, extents, filter_mode),
+                    name + " int32 mode " + std::to_string(int(filter_mode)) + " x" + std::to_string(scale));
+        }
+    }
+    {
+        const auto extents = scaledExtents(grid, 0.5);
+        compare(sampleDecoded(*int_grid, extents, FilterMode::MULTIRES), sampleDecoded(*rounded_grid, extents, FilterMode::BOX),
+                name + " int32 MULTIRES falls back to BOX");
+    }
+
+    // The interpolated vector is (v, -2v, 0) for the interpolated, non-negative
+    // density v.
+    const auto vector_grid = convertGrid<openvdb::Vec3SGrid>(grid, [](float v) { return openvdb::Vec3s(v, -2.0f * v, 0.0f); });
+    const auto extents = scaledExtents(grid, 1.5);
+    const auto reference = referenceBox(grid, extents);
+    const auto scaled = [&reference](float factor) {
+        auto values = reference;
+        for (auto& value : values)
+            value *= factor;
+        return values;
+    };
+    compare(sampleDecoded(*vector_grid, extents, FilterMode::BOX, ScalarReduction::LENGTH), scaled(std::sqrt(5.0f)),
+            name + " Vec3s length");
+    compare(sampleDecoded(*vector_grid, extents, FilterMode::BOX, ScalarReduction::AVERAGE), scaled(-1.0f / 3.0f),
+            name + " Vec3s average");
+    compare(sampleDecoded(*vector_grid, extents, FilterMode::BOX, ScalarReduction::COMPONENT_Y), scaled(-2.0f),
+            name + " Vec3s y component");
+}
+
+// The average of the input cells overlapping every output cell, weighted by
+// the overlap, computed one output cell at a time.
+std::vector<float> referenceDownsample(
+    const openvdb::Coord& extents, const std::vector<float>& samples, const openvdb::Coord& out_extents)
+{
+    const auto overlap = [&extents, &out_extents](int axis, int i, int o) {
+        const auto min = std::max(double(i) / extents[axis], double(o) / out_extents[axis]);
+        const auto max = std::min(double(i + 1) / extents[axis], double(o + 1) / out_extents[axis]);
+        return std::max(max - min, 0.0) * out_extents[axis];
+    };
+
+    std::vector<float> values(cellCount(out_extents));
+    for (int oz = 0; oz < out_extents.z(); ++oz) {
+        for (int oy = 0; oy < out_extents.y(); ++oy) {
+            for (int ox = 0; ox < out_extents.x(); ++ox) {
+                double sum = 0.0;
+                for (int z = 0; z < extents.z(); ++z) {
+                    const auto weight_z = overlap(2, z, oz);
+                    if (weight_z <= 0)
+                        continue;
+                    for (int y = 0; y < extents.y(); ++y) {
+                        const auto weight_yz = overlap(1, y, oy) * weight_z;
+                        if (weight_yz <= 0)
+                            continue;
+                        for (int x = 0; x < extents.x(); ++x)
+                            sum += overlap(0, x, ox) * weight_yz * samples[cellIndex(extents, x, y, z)];
+                    }
+                }
+                values[cellIndex(out_extents, ox, oy, oz)] = float(sum);
+            }
+        }
+    }
+    return values;
+}
+
+// Downsamples the samples of the grid by exactly two and by fractional ratios,
+// as float and uint8_t samples.
+void testDownsample(const std::string& name, const openvdb::FloatGrid& grid)
+{
+    const auto extents = scaledExtents(grid, 0.5);
+    std::vector<float> samples(cellCount(extents));
+    std::vector<uint8_t> unorm_samples(cellCount(extents));
+    volume_sampling::SampleBufferHeader<float> header;
+    check(volume_sampling::sampleGrid<float>(grid, extents, header, samples.data()) == volume_sampling::Result::SUCCESS &&
+          volume_sampling::sampleGrid<uint8_t>(grid, extents, header, unorm_samples.data()) == volume_sampling::Result::SUCCESS,
+          name + " downsample: sampleGrid succeeds");
+
+    const openvdb::Coord half_extents(std::max(1, extents.x() / 2), std::max(1, extents.y() / 2), std::max(1, extents.z() / 2));
+    const openvdb::Coord fractional_extents(
+        std::max(1, extents.x() * 2 / 3), std::max(1, extents.y() * 3 / 5), std::max(1, extents.z() - 1));
+    for (const auto& out_extents : { extents, half_extents, fractional_extents }) {
+        const auto what = name + " downsample to " + std::to_string(out_extents.x()) + "x" +
+            std::to_string(out_extents.y()) + "x" + std::to_string(out_extents.z());
+
+        std::vector<float> out_samples(cellCount(out_extents));
+        volume_sampling::downsampleSamples<float>(extents, samples.data(), out_extents, out_samples.data());
+        compare(out_samples, referenceDownsample(extents, samples, out_extents), what);
+
+        // The uint8_t samples are averaged as unit values, then rounded again.
+        std::vector<float> unit_samples(unorm_samples.size());
+        for (size_t i = 0; i < unorm_samples.size(); ++i)
+            unit_samples[i] = volume_sampling::SampleTraits<uint8_t>::toUnit(unorm_samples[i]);
+        const auto reference = referenceDownsample(extents, unit_samples, out_extents);
+        std::vector<uint8_t> out_unorm_samples(cellCount(out_extents));
+        volume_sampling::downsampleSamples<uint8_t>(extents, unorm_samples.data(), out_extents, out_unorm_samples.data());
+        size_t num_errors = 0;
+        for (size_t i = 0; i < out_unorm_samples.size(); ++i) {
+            if (std::abs(volume_sampling::SampleTraits<uint8_t>::toUnit(out_unorm_samples[i]) - reference[i]) > 0.5f / 255.0f + 1e-5f)
+                ++num_errors;
+        }
+        check(num_errors == 0, what + " uint8: " + std::to_string(num_errors) + " sample(s) off by more than half a step");
+    }
+}
+
+} // namespace
+
+int main()
+{
+    openvdb::initialize();
+
+    // A scaled and translated transform, which is still axis aligned.
+    auto scaled = openvdb::math::Transform::createLinearTransform(0.5);
+    scaled->postTranslate(openvdb::Vec3d(3.0, -2.0, 1.0));
+    // A rotated transform, which rules out REDUCE filtering.
+    auto rotated = openvdb::math::Transform::createLinearTransform(1.0);
+    rotated->postRotate(0.5, openvdb::math::Y_AXIS);
+    // A negative scale along x and z, which mirrors the index space axes but
+    // keeps the transform axis aligned.
+    auto mirrored = openvdb::math::Transform::createLinearTransform(1.0);
+    mirrored->postScale(openvdb::Vec3d(-1.0, 1.0, -1.0));
+    mirrored->postTranslate(openvdb::Vec3d(2.0, 1.0, -3.0));
+
+    testGrid("fog sphere", *synthetic_grids::makeFogSphere(20.0f), true);
+    testGrid("scaled fog sphere", *synthetic_grids::makeFogSphere(20.0f, scaled), true);
+    testGrid("noise cloud", *synthetic_grids::makeNoiseCloud(20.0f), true);
+    testGrid("rotated noise cloud", *synthetic_grids::makeNoiseCloud(20.0f, rotated), false);
+    testGrid("sparse plume", *synthetic_grids::makeSparsePlume(48.0f), true);
+    testGrid("mirrored noise cloud", *synthetic_grids::makeNoiseCloud(20.0f, mirrored), true);
+    testGrid("mirrored sparse plume", *synthetic_grids::makeSparsePlume(48.0f, mirrored), true);
+
+    testOutOfCore("noise cloud", *synthetic_grids::makeNoiseCloud(20.0f));
+    testOutOfCore("sparse plume", *synthetic_grids::makeSparsePlume(48.0f));
+    testOutOfCore("mirrored sparse plume", *synthetic_grids::makeSparsePlume(48.0f, mirrored));
+
+    testDelta("noise cloud", *synthetic_grids::makeNoiseCloud(40.0f));
+    testDelta("mirrored noise cloud", *synthetic_grids::makeNoiseCloud(40.0f, mirrored));
+
+    testUNorm("noise cloud", *synthetic_grids::makeNoiseCloud(20.0f));
+    testUNorm("sparse plume", *synthetic_grids::makeSparsePlume(48.0f));
+
+    {
+        // A float, a double and a vector grid with the same topology.
+        const auto cloud = synthetic_grids::makeNoiseCloud(20.0f, scaled);
+        const auto bright_cloud = convertGrid<openvdb::FloatGrid>(*cloud, [](float v) { return v * 4.0f; });
+        const auto double_cloud = convertGrid<openvdb::DoubleGrid>(*cloud, [](float v) { return 1.0 - double(v); });
+        const auto vector_cloud = convertGrid<openvdb::Vec3SGrid>(*cloud, [](float v) { return openvdb::Vec3s(v, 0.5f, -v); });
+        testSampleGrids("noise cloud", { cloud.get(), bright_cloud.get(), double_cloud.get(), vector_cloud.get() });
+    }
+
+    testLevelSet("level set sphere", *synthetic_grids::makeLevelSetSphere(20.0f));
+    testLevelSet("scaled level set sphere", *synthetic_grids::makeLevelSetSphere(20.0f, 3.0f, scaled));
+
+    testRegion("noise cloud", *synthetic_grids::makeNoiseCloud(20.0f));
+    testRegion("mirrored noise cloud", *synthetic_grids::makeNoiseCloud(20.0f, mirrored));
+
+    testGridTypes("noise cloud", *synthetic_grids::makeNoiseCloud(20.0f));
+    testGridTypes("rotated noise cloud", *synthetic_grids::makeNoiseCloud(20.0f, rotated));
+
+    testDownsample("noise cloud", *synthetic_grids::makeNoiseCloud(20.0f));
+
+    if (g_num_failures > 0) {
+        std::cerr << g_num_failures << " check(s) failed." << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed." << std::endl;
+    return 0;
+}